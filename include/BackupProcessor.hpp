@@ -0,0 +1,36 @@
+#ifndef BACKUPPROCESSOR_HPP
+#define BACKUPPROCESSOR_HPP
+
+#include <memory>
+#include <vector>
+#include <functional>
+
+#include "adapters/Adapter.hpp"
+
+namespace FenixBackup {
+
+/**
+ * Gets and processes files of a backup (list from FileTree::FinishTree) by a pool
+ * of threads. Files are split into batches in the order of the list and each free
+ * thread takes the next batch, so files with higher priority are still done first.
+ */
+class BackupProcessor {
+  public:
+    /// Number of threads, 0 = number of CPUs
+    BackupProcessor(std::shared_ptr<Adapter> adapter, unsigned int jobs);
+    virtual ~BackupProcessor();
+
+    /// Process all files, observer gets each file before it is processed (called by one thread at a time)
+    void Process(const std::vector<std::shared_ptr<FileInfo>>& files,
+        const std::function<void(std::shared_ptr<FileInfo>)>& observer = nullptr);
+
+    unsigned int GetJobs();
+
+  private:
+    class BackupProcessorData;
+    std::unique_ptr<BackupProcessorData> data;
+};
+
+}
+
+#endif // BACKUPPROCESSOR_HPP
@@ -0,0 +1,41 @@
+#ifndef CHUNKCACHE_HPP
+#define CHUNKCACHE_HPP
+
+#include <string>
+#include <list>
+#include <unordered_map>
+
+namespace FenixBackup {
+
+/// Process-wide LRU cache of decoded FileChunk contents with limited size (in bytes)
+class ChunkCache {
+  public:
+    ChunkCache() = delete;
+
+    /// Copy cached content of the chunk into content, return false when it is not cached
+    static bool Get(const std::string& name, std::string& content);
+    /// Copy part of the cached content (chunk in a container), return false when it is not cached
+    static bool GetPart(const std::string& name, size_t offset, size_t length, std::string& content);
+    static void Put(const std::string& name, const std::string& content);
+    static void Remove(const std::string& name);
+    static void Clear();
+
+    static size_t GetHits();
+    static size_t GetMisses();
+    static size_t GetUsedSize();
+
+  private:
+    typedef std::list<std::pair<std::string, std::string>> item_list;
+
+    static void Shrink(size_t limit);
+
+    static item_list items; // Most recently used first
+    static std::unordered_map<std::string, item_list::iterator> index;
+    static size_t used_size;
+    static size_t hits;
+    static size_t misses;
+};
+
+}
+
+#endif // CHUNKCACHE_HPP
@@ -6,15 +6,33 @@
 
 #include "Global.hpp"
 #include "adapters/Adapter.hpp"
+#include "adapters/SourceReader.hpp"
+#include "storage/ChunkStorage.hpp"
+#include "storage/ChunkCatalog.hpp"
+#include "TreeCatalog.hpp"
 
 namespace FenixBackup {
 
 struct ConfigData {
+    std::string configFilename; // Loaded config file
     std::string baseDir;
     std::string adapterType;
     std::string adapterPath;
 
     std::shared_ptr<Adapter> adapter = nullptr;
+    source_read_mode adapterReadMode = READ_PREAD; // How backed up files are read (see SourceReader)
+    unsigned int adapterReadBuffer = 1024*1024; // Buffer (mmap window) of one read
+    bool adapterDropCache = true; // Drop read files from the page cache (pages cached before reading are kept)
+    unsigned int adapterBatchSize = 64; // Files processed together (small ones are read at once, see BatchReader)
+    unsigned long long adapterBatchFileSize = 64*1024; // Bigger files are read alone (by SourceReader)
+    bool adapterIoUring = true; // Read batches by io_uring when the kernel allows it
+    unsigned int adapterScanThreads = 8; // Threads reading directories (see DirectoryScanner), 0 = number of CPUs
+    bool adapterJournal = true; // Read only changed directories when the watcher is running (see ChangeJournal)
+
+    std::string chunkStorageType = "files";
+    std::shared_ptr<ChunkStorage> chunkStorage = nullptr;
+    std::shared_ptr<ChunkCatalog> chunkCatalog = nullptr;
+    std::shared_ptr<TreeCatalog> treeCatalog = nullptr;
 
     std::string treeSubdir = "trees";
     std::string dataSubdir = "data";
@@ -22,11 +40,41 @@ struct ConfigData {
 
     std::string treeFileExtension = ".fenixtree";
     std::string treeFilePattern = "%Y-%m-%d_%H%M%S";
+    std::string journalFilename = "changes.journal";
+    std::string journalStateFilename = "changes.state";
 
     std::string chunkMetaExtension = ".meta";
     std::string chunkDataExtension = ".data";
+    std::string packExtension = ".pack";
+    std::string packIndexFilename = "packs.index";
+    std::string catalogFilename = "chunks.catalog";
+    std::string catalogJournalFilename = "chunks.journal";
+    std::string similarityIndexFilename = "similarity.index";
+    std::string treeCatalogFilename = "trees.catalog";
+    std::string repositoryFilename = "repository.defaults"; // Version of the defaults the repository was created with
+    unsigned long long packSize = 1024*1024*1024; // Start new pack file when the last one reaches this size
 
     int maxChunkDepth = 10;
+    unsigned int treeKeyframeInterval = 8; // Every n-th tree is saved whole, the others as deltas of their previous trees (1 = all whole)
+    unsigned long long treeCacheSize = 512*1024*1024; // Memory budget for loaded trees (trees in use are kept anyway)
+    unsigned int streamWindowSize = 8*1024*1024; // Size of one VCDIFF window when encoding streams
+    unsigned long long mappedSourceSize = 64*1024*1024; // Bigger delta bases are restored into a temporary file and mapped
+    unsigned long long maxDeltaSourceSize = 1024*1024*1024; // Files are saved whole instead of as deltas of bigger bases
+    bool mergeDeltas = true; // Merge VCDIFFs when skipping ancestor instead of encoding content again
+    bool reverseDeltas = false; // Store the newest version whole and older versions as deltas against newer ones
+    unsigned long long chunkCacheSize = 256*1024*1024; // Memory budget for decoded chunks (ChunkCache)
+    unsigned long long containerFileSize = 16*1024; // Smaller new files are saved together in container chunks, 0 = never
+    unsigned int cdcAverageSize = 16*1024; // Average block size for files with content-defined chunking (power of two)
+    chunk_codec compression = ZSTD; // Codec of new chunks, unless rules of their path set another one
+    int compressionLevel = 0; // Level for zstd and LZ4, 0 = default level of the codec
+    unsigned int loadedChunksLimit = 100000; // Unused chunks are released from the memory above this count
+    bool similarityIndex = true; // Encode new files as deltas against similar stored files
+    double similarityThreshold = 0.25; // Minimal estimated similarity (Jaccard index of blocks) of the delta base
+    unsigned int similarityBlockSize = 1024; // Average block size for sketches (power of two)
+    unsigned long long similarityMinSize = 16*1024; // Smaller files are not indexed
+    hash_algorithm hashAlgorithm = SHA256_HASH; // Content hash of new trees and chunks (older ones keep their own)
+    unsigned int hashThreads = 0; // Threads hashing one big file (BLAKE3 only), 0 = number of CPUs
+    unsigned int jobs = 1; // Threads processing files of one backup (see BackupProcessor), 0 = number of CPUs
 };
 
 class Config {
@@ -36,19 +84,34 @@ class Config {
     static const ConfigData& GetConfig();
 
     static std::shared_ptr<Adapter> GetAdapter();
+    static std::shared_ptr<ChunkStorage> GetChunkStorage();
+    static std::shared_ptr<ChunkStorage> CreateChunkStorage(const std::string& type);
+    static std::shared_ptr<ChunkCatalog> GetChunkCatalog();
+    static std::shared_ptr<TreeCatalog> GetTreeCatalog();
 
 	static const std::string GetTreeDir();
 	static const std::string GetDataDir();
 	static const std::string GetTempDir();
 
 	static const std::string GetTreeFilename(const std::string& name);
+	static const std::string GetJournalFilename();
+	static const std::string GetJournalStateFilename();
 	static const std::string GetChunkFilename(const std::string& name, bool is_data = false);
+	static const std::string GetPackFilename(unsigned int pack);
+	static const std::string GetPackIndexFilename();
+	static const std::string GetCatalogFilename();
+	static const std::string GetCatalogJournalFilename();
+	static const std::string GetSimilarityIndexFilename();
+	static const std::string GetTreeCatalogFilename();
+	static const std::string GetRepositoryFilename();
 
     struct Rules {
         bool scan = true;
         bool backup = true;
         int priority = 1;
         int history = 1;
+        bool cdc = false; // Split files into content-defined blocks shared across all files
+        chunk_codec compression = ZSTD;
     };
 
     static const Rules GetRules(const std::string& path, const file_params& params);
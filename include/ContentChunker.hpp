@@ -0,0 +1,32 @@
+#ifndef CONTENTCHUNKER_HPP
+#define CONTENTCHUNKER_HPP
+
+#include <istream>
+#include <string>
+#include <memory>
+
+namespace FenixBackup {
+
+/// Content-defined chunking (FastCDC with gear hash) of a stream into blocks
+class ContentChunker {
+  public:
+    /**
+     * Average size must be a power of two (at least 256 bytes), blocks are
+     * between 1/4 and 8 times of the average size. Block boundaries depend
+     * only on the content, so the same data split in the same blocks even
+     * when shifted inside the file or stored in another file.
+     */
+    ContentChunker(std::istream& stream, size_t average_size);
+    virtual ~ContentChunker();
+
+    /// Read the next block, return false at the end of the stream
+    bool Next(std::string& block);
+
+  private:
+    class ContentChunkerData;
+    std::unique_ptr<ContentChunkerData> data;
+};
+
+}
+
+#endif // CONTENTCHUNKER_HPP
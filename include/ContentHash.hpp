@@ -0,0 +1,38 @@
+#ifndef CONTENTHASH_HPP
+#define CONTENTHASH_HPP
+
+#include <string>
+#include <memory>
+
+#include "Global.hpp"
+
+namespace FenixBackup {
+
+/**
+ * Incremental hash of file and chunk content with the algorithm of the
+ * repository. BLAKE3 hashes big pieces of data by hashThreads threads
+ * (independent subtrees of its hash tree), SHA-256 is always sequential.
+ */
+class ContentHash {
+  public:
+    ContentHash(hash_algorithm algorithm);
+    virtual ~ContentHash();
+
+    void Add(const char* buffer, size_t length);
+    /// Return hash of the data added so far as hex string
+    std::string GetHash();
+
+    /// Algorithm by the name used in config ("sha256", "blake3")
+    static hash_algorithm GetAlgorithm(const std::string& name);
+    static std::string GetName(hash_algorithm algorithm);
+    /// Size of pieces passed to Add which lets all threads work
+    static size_t GetPreferredBufferSize(hash_algorithm algorithm);
+
+  private:
+    class ContentHashData;
+    std::unique_ptr<ContentHashData> data;
+};
+
+}
+
+#endif // CONTENTHASH_HPP
@@ -30,6 +30,11 @@ class FileChunkException : public FenixException {
 	FileChunkException(std::string message): FenixException("FileChunk error: "+message) {}
 };
 
+class ChunkStorageException : public FenixException {
+  public:
+	ChunkStorageException(std::string message): FenixException("ChunkStorage error: "+message) {}
+};
+
 class AdapterException : public FenixException {
   public:
 	AdapterException(std::string message): FenixException("Adapter error: "+message) {}
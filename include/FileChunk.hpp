@@ -4,7 +4,14 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <map>
 #include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+
+#include "storage/ChunkStorage.hpp"
 
 namespace FenixBackup {
 
@@ -13,13 +20,39 @@ class FileChunk {
     FileChunk(std::string chunk_name, bool load = false);
     virtual ~FileChunk();
 
-    /// Compute VCDIFF of the file against given ancestor and save it
+    /// Compute VCDIFF of the file against given ancestor and save it (observer gets each read window of the stream)
     void ProcessStringAndSave(const std::string& ancestor_name, const std::string& content);
-    void ProcessStreamAndSave(const std::string& ancestor_name, std::istream& stream);
+    void ProcessStreamAndSave(const std::string& ancestor_name, std::istream& stream,
+        const std::function<void(const char*, size_t)>& observer = nullptr);
     void ProcessFileAndSave(const std::string& ancestor_name, const std::string& source_path);
-    /// Return file content
+    /// Split the stream into content-defined blocks, save new blocks and the list of blocks
+    void ProcessBlocksAndSave(std::istream& stream);
+    /// Save the stream whole and re-encode the previous version as a delta against it (reverse deltas)
+    void ProcessStreamAndRebase(const std::string& previous_name, std::istream& stream,
+        const std::function<void(const char*, size_t)>& observer = nullptr);
+    /// Re-encode the previous version as a delta against this chunk, unless its chain gets too long
+    void RebasePrevious(const std::string& previous_name);
+
+    /**
+     * Encode the stream into temporary data and compute its hash in the same
+     * pass, so the stream is read only once. Observer gets each read piece of
+     * the stream. Return the hash (by the algorithm of the chunk), the chunk has to be saved by Commit
+     * (usually under the hash) or dropped by Discard.
+     */
+    std::string ProcessStreamToTemp(const std::string& ancestor_name, std::istream& stream,
+        const std::function<void(const char*, size_t)>& observer = nullptr);
+    void Commit(const std::string& name);
+    void Discard();
+    /// Return file content (must not be called with the lock held, the data are read and decoded without it)
     std::string LoadAndReturn();
     void LoadAndExtract(std::string target_path);
+    /// Decode content directly into the given file descriptor, return number of written bytes
+    size_t LoadAndWrite(int fd);
+
+    /// Set compression of the data saved by this chunk (used unless the data are incompressible)
+    void SetCompression(chunk_codec codec);
+    /// Set algorithm of the name of this chunk (and of its blocks), new chunks use hashAlgorithm from config
+    void SetHashAlgorithm(hash_algorithm algorithm);
 
     int GetDepth();
     const std::string& GetAncestorName();
@@ -29,18 +62,77 @@ class FileChunk {
     int SkipAncestor();
     /// Delete this chunk and call SkipAncestor on all its childs, return size change
     int DeleteChunk();
+    /// Re-encode this chunk as a delta against the given chunk (derived chunks move with it), return size change
+    int Rebase(const std::string& ancestor_name);
 
     void AddDerivedChunk(std::string);
     void RemoveDerivedChunk(std::string);
 
     // Static functions
 	static std::shared_ptr<FileChunk> GetChunk(std::string name);
+	/// Ancestor for a new forward delta after the given chunk (root of its branch when the branch is too deep)
+	static std::string GetDeltaBase(const std::string& previous_name);
+	static size_t GetRestoredBytes();
+	/// Unique name for a temporary chunk
+	static std::string GetTempName();
+	/**
+	 * Lock of loaded chunks and everything they update (ChunkCatalog, ChunkCache, SimilarityIndex).
+	 * Methods of FileChunk take it themselves and hold it only around changes of the chunk graph,
+	 * content is read, hashed, encoded and written to the storage without it.
+	 */
+	static std::recursive_mutex& GetLock();
+
+	/// Name of a chunk saved by this thread, another thread saving the same name waits until the reservation ends
+	class Reservation {
+	  public:
+	    Reservation(const std::string& name);
+	    ~Reservation();
+	  private:
+	    std::string name;
+	};
+
+	/**
+	 * Small new chunks collected and saved together as one container chunk (their concatenation).
+	 * Each of them is saved as CONTAINED chunk, addressed by the container, offset and length, so
+	 * it keeps its own name (content hash) for deduplication. Chunks not saved are dropped.
+	 */
+	class Container {
+	  public:
+	    Container();
+	    ~Container();
+	    /// Add content of a new chunk, return false when another container already has it
+	    bool Add(const std::string& name, const std::string& content, chunk_codec codec, hash_algorithm algorithm);
+	    /// Save containers (one for each compression and hash algorithm) and their chunks
+	    void Save();
+	  private:
+	    std::map<std::pair<chunk_codec, hash_algorithm>, std::vector<std::pair<std::string, std::string>>> chunks;
+	};
 
     class FileChunkData;
+    /// Content of a delta base, in the memory or in a mapped temporary file
+    class Source;
   private:
     std::unique_ptr<FileChunkData> data;
 
 	static std::unordered_map<std::string, std::shared_ptr<FileChunk>> loaded_chunks;
+	static size_t restored_bytes;
+	static std::recursive_mutex lock;
+	static std::unordered_set<std::string> reserved;
+	static std::condition_variable_any reserved_changed;
+	static std::unordered_set<std::string> contained; // Chunks added to a container, not saved yet
+
+	/// Remove chunks which are not used outside of loaded_chunks
+	static void ReleaseChunks();
+	/**
+	 * Return content, the data are read and decoded without the lock and one thread
+	 * decodes the chunk at a time (Reservation), others find the content in the cache.
+	 * When the caller holds the lock (locked), nothing is reserved.
+	 */
+	std::string Load(bool locked);
+	/// Write content in pieces (whole multiples of 1 MB except the last one), return false when the data were rewritten meanwhile
+	bool WriteContent(const std::function<void(const char*, size_t)>& write);
+	/// Load content used as a delta base, data rewritten meanwhile are loaded again
+	void LoadSource(Source& source);
 };
 
 }
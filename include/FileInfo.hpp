@@ -2,6 +2,8 @@
 #define FILEINFO_HPP
 
 #include <memory>
+#include <string>
+#include <vector>
 #include <ctime>
 #include <sys/stat.h>
 
@@ -10,61 +12,64 @@ namespace FenixBackup {
 }
 
 #include "Global.hpp"
+#include "NodeStore.hpp"
 #include "FileTree.hpp"
+#include "storage/ChunkStorage.hpp"
+#include "FileChunk.hpp"
 
 namespace FenixBackup {
 
+/// Handle of a node of the FileTree, its data are in the NodeStore of the tree (handles are created on demand)
 class FileInfo {
   public:
-	FileInfo();
-	FileInfo(std::shared_ptr<FileTree> tree, file_type type, std::shared_ptr<FileInfo> parent, std::string const& name);
-	virtual ~FileInfo();
-	/*FileInfo(const FileInfo& other);
-	FileInfo& operator=(const FileInfo& other);*/
+	FileInfo(std::shared_ptr<FileTree> tree, unsigned int index);
+	~FileInfo();
 
-    const std::string& GetName();
+	std::string GetName();
 	const file_params& GetParams();
 	version_file_status GetStatus();
 	file_type GetType();
 	unsigned int GetId();
-	const std::string& GetPath();
+	/// Path from the root of the tree, computed from the parents
+	std::string GetPath();
 	unsigned int GetPrevVersionId();
-	const std::string& GetHash();
+	/// Id of the first file of this tree with the same inode (hard link), 0 = none
+	unsigned int GetHardLinkId();
+	std::string GetHash();
 	std::shared_ptr<FileTree> GetTree();
 
 	void SetParams(const file_params& params);
 	void SetStatus(version_file_status status);
-	void SetId(unsigned int index);
 	void SetPrevVersionId(unsigned int index);
+	void SetHardLinkId(unsigned int index);
 	void SetHash(const std::string& file_hash);
-	void SetTree(std::shared_ptr<FileTree> tree);
 
-	std::shared_ptr<FileInfo> GetPrevVersion();
 	std::shared_ptr<FileInfo> GetParent();
 
-	void AddChild(std::string const& name, std::shared_ptr<FileInfo> child);
 	std::shared_ptr<FileInfo> GetChild(std::string const& name);
-	const std::unordered_map<std::string, std::shared_ptr<FileInfo>>& GetChilds();
+	/// Children sorted by name
+	std::vector<std::shared_ptr<FileInfo>> GetChilds();
 
 	// In the packing process
-	void ProcessFileContent(std::istream& file, std::shared_ptr<FileTree> tree = nullptr);
+	void ProcessFileContent(std::istream& file, std::shared_ptr<FileTree> tree = nullptr, FileChunk::Container* container = nullptr);
 	std::ostream& GetFileContent(std::ostream& out);
+	/// Write file content directly into the file descriptor, return number of written bytes
+	size_t GetFileContent(int fd);
 
-    class FileInfoData;
   private:
-	std::unique_ptr<FileInfoData> data;
-
-    void serialize_internal(cereal::JSONOutputArchive & archive);
-    void serialize_internal(cereal::JSONInputArchive & archive);
-    void serialize_internal(cereal::BinaryOutputArchive & archive);
-    void serialize_internal(cereal::BinaryInputArchive & archive);
-
-    template<class Archive>
-    void serialize(Archive & archive) {
-        serialize_internal(archive);
-    }
-
-    friend class cereal::access;
+	std::shared_ptr<FileTree> tree;
+	unsigned int index;
+
+	const NodeStore::node_record& Record();
+	NodeStore::node_record& EditRecord();
+
+	/**
+	 * Hash and encode changed or new file in one pass against the previous version (new file against nothing).
+	 * New file found by its hash in prev_tree (moved or copied file) and new file similar to a stored one
+	 * drop the encoded data, the latter is read again and encoded against the similar file.
+	 */
+	void ProcessChangedContent(std::istream& file, const std::string& prev_hash, chunk_codec compression, hash_algorithm algorithm,
+	    std::shared_ptr<FileTree> prev_tree = nullptr);
 };
 
 
@@ -5,15 +5,21 @@ namespace FenixBackup {
     class FileTree;
 }
 
+#include "TreeCatalog.hpp"
 #include "Config.hpp"
+#include "NodeStore.hpp"
 #include "FileInfo.hpp"
 
+#include <memory>
 #include <unordered_map>
 #include <vector>
+#include <list>
+#include <mutex>
 
 namespace FenixBackup {
 
-class FileTree {
+/// Tree of files of one backup, nodes are kept in a NodeStore and accessed by FileInfo handles
+class FileTree: public std::enable_shared_from_this<FileTree> {
   public:
 	FileTree(); // Construct new one
 	FileTree(std::string name); // Try to load from tree of given name
@@ -27,16 +33,23 @@ class FileTree {
 	std::shared_ptr<FileInfo> AddSymlink(std::shared_ptr<FileInfo> parent, std::string const& name, const file_params& params);
 
 	std::shared_ptr<FileInfo> GetFileByPath(std::string const& file_path);
+	/// File at the path and all its descendants, in the path order (empty when there is no such file)
+	std::vector<std::shared_ptr<FileInfo>> GetSubtreeFiles(std::string const& path);
+	/// Files with paths matching the pattern ("*" and "?" within a name, "**" any number of directories), in the path order
+	std::vector<std::shared_ptr<FileInfo>> GetFilesByPattern(std::string const& pattern);
 	std::shared_ptr<FileInfo> GetFileByHash(std::string const& file_hash);
 	std::shared_ptr<FileInfo> GetFileById(unsigned int file_id);
 
-    const std::vector<std::shared_ptr<FileInfo>>& GetAllFiles();
+	/// Files have ids 1 .. GetLastId(), GetFileById returns nullptr for unused ids
+	unsigned int GetLastId();
+	NodeStore& GetNodes();
 
 	std::vector<std::shared_ptr<FileInfo>> FinishTree(); // End construction of the file tree and return the files which it wants to download them (TODO: ordered by priority)
 
 	// Saving functions
 	const std::string& GetTreeName();
 	const time_t GetConstructTime();
+	hash_algorithm GetHashAlgorithm();
 	void SaveTree();
 	std::shared_ptr<FileTree> GetNextTree();
 	std::shared_ptr<FileTree> GetPrevTree();
@@ -45,14 +58,22 @@ class FileTree {
     static const std::vector<std::string>& GetHistoryTreeList();
     static const std::string GetNewestTreeName();
 	static std::shared_ptr<FileTree> CreateNewTree();
+	/// Loaded tree of the name (the same one while it is used), nullptr when there is no such tree
 	static std::shared_ptr<FileTree> GetHistoryTree(std::string name);
+	/// Read info of the saved tree from its file (its nodes are not mapped), return false when there is no such file
+	static bool ReadTreeInfo(const std::string& name, tree_info& info);
 
     class FileTreeData;
   private:
 	std::unique_ptr<FileTreeData> data;
 
-    static std::vector<std::string> history_trees_list;
-	static std::unordered_map<std::string, std::shared_ptr<FileTree>> history_trees;
+	static std::unordered_map<std::string, std::weak_ptr<FileTree>> history_trees; // Loaded trees, they are freed when nobody uses them
+	static std::list<std::shared_ptr<FileTree>> cached_trees; // Most recently used first, they are kept within treeCacheSize
+	static size_t cached_size;
+	static std::recursive_mutex history_lock; // Files of the new tree are processed by more threads
+
+	/// Move the tree to the front of the cache, release the least recently used trees over the budget
+	static void CacheTree(const std::shared_ptr<FileTree>& tree);
 };
 
 }
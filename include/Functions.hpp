@@ -1,4 +1,8 @@
 #include <string>
+#include <vector>
+#include <functional>
+
+#include "Global.hpp"
 
 #ifndef FUNCTIONS_HPP
 #define FUNCTIONS_HPP
@@ -9,7 +13,16 @@ class Functions {
   public:
     Functions() = delete;
 
-    static std::string ComputeFileHash(std::istream& file);
+    /// Hash the whole stream (position in the stream is kept), observer gets each read piece of the stream
+    static std::string ComputeFileHash(std::istream& file, hash_algorithm algorithm,
+        const std::function<void(const char*, size_t)>& observer = nullptr);
+    static std::string ComputeHash(const std::string& content, hash_algorithm algorithm);
+    /// Hashes of several contents at once (small SHA-256 ones are hashed in parallel SIMD lanes)
+    static std::vector<std::string> ComputeHashes(const std::vector<std::string>& contents, hash_algorithm algorithm);
+    /// Return peak resident memory of this process in bytes
+    static size_t GetPeakMemoryUsage();
+    /// Return current resident memory of this process in bytes
+    static size_t GetMemoryUsage();
 };
 
 }
@@ -1,4 +1,5 @@
 #include <time.h>
+#include <cstdint>
 
 #include <cereal/archives/binary.hpp>
 #include <cereal/archives/json.hpp>
@@ -10,6 +11,10 @@ namespace FenixBackup {
 
 enum file_type { DIR, FILE, SYMLINK };
 
+enum hash_algorithm : uint8_t { SHA256_HASH, BLAKE3_HASH };
+// Hash identifying content of files and chunks, it is recorded in each FileTree and chunk_info
+// (data saved before it was recorded use SHA256_HASH)
+
 enum version_file_status { UNKNOWN, NEW, UNCHANGED, UPDATED_PARAMS, UPDATED_FILE, NOT_UPDATED, DELETED };
 // UNKNOWN - new file, which is not yet saved (there isn't any older file)
 // NEW - new file, which is saved
@@ -28,6 +33,7 @@ struct file_params {
 	uid_t	uid;				// user ID of owner
 	gid_t	gid;				// group ID of owner
 	size_t	file_size;			// total size, in bytes
+	nlink_t	link_count;			// number of hard links (serialized by FileInfo, not compared)
 	// timespec access_time;    // time of last access (nanoseconds)
 	// time_t	access_time;	// time of last access
 	timespec modification_time; // time of last modification (nanoseconds)
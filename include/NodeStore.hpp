@@ -0,0 +1,318 @@
+#ifndef NODESTORE_HPP
+#define NODESTORE_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include "Global.hpp"
+#include "FenixExceptions.hpp"
+
+namespace FenixBackup {
+
+/**
+ * Nodes of one FileTree in a flat arena of fixed-size records indexed by the file id
+ * (id 0 is unused, 1 is the root). Names are interned in a string pool, hashes are in another one,
+ * children of each directory are a range of the children index sorted by name (it is
+ * sorted again after nodes were added). Paths are not stored, they are computed from
+ * the parents.
+ *
+ * Saved trees keep the sections (records, children index and both pools) after their
+ * archive, a loaded tree maps them from the file (privately, so records can be changed
+ * in place) and only the touched pages are read. Records are copied into the memory
+ * when nodes are added, new strings are appended after the mapped ones.
+ *
+ * Nodes of a new tree keep ids of their previous versions (see SetPrevious), so a tree can
+ * be saved as a delta: only records and children lists which differ from the previous tree
+ * (its base) are saved, its pools continue the pools of the base. Loaded delta finds the
+ * other nodes in its base (it can be a delta too).
+ *
+ * Path index lists the nodes in the path order (preorder of the sorted children) with the end of
+ * the subtree of each one, so a path is found by a binary search and a subtree is a range of it.
+ * Whole trees save it, deltas and older trees build it when it is needed.
+ *
+ * Records are not moved while no node is added, so more threads can read them and
+ * change their own records (hashes are guarded by the lock of the store).
+ */
+class NodeStore {
+  public:
+    struct node_record {
+        file_params params = {};
+        uint32_t name = 0; // Offset in the name pool
+        uint32_t parent = 0; // 0 = root (or unused record)
+        uint32_t prev_version_id = 0;
+        uint32_t hard_link_id = 0;
+        uint32_t hash = 0; // Offset in the hash pool, 0 = no hash
+        uint32_t first_child = 0; // Range of the children index (directory, not used by deltas)
+        uint32_t child_count = 0;
+        uint8_t type = DIR;
+        uint8_t status = UNKNOWN;
+    };
+
+    NodeStore();
+    ~NodeStore();
+
+    /// Add node into the directory, return its id (the given one when it is free, see SetPrevious)
+    uint32_t Add(file_type type, uint32_t parent, const std::string& name, const file_params& params, uint32_t id = 0);
+    /// Set number of records, new ones are unused until they are filled (used when loading nodes in any order)
+    void Resize(size_t count);
+    /// Number of records (known before the sections of the loaded tree are mapped)
+    size_t Size() const { return sections.pending ? sections.record_count : record_count; }
+    /// Memory of the store, its mapped file included
+    size_t GetMemoryUsage() const;
+    bool Exists(uint32_t id) const { return id > 0 && id < record_count && (id == 1 || Get(id).parent != 0); }
+    const node_record& Get(uint32_t id) const { return (records != nullptr ? records[id] : GetDelta(id)); }
+    /// Record to change (loaded trees keep the original values for the trees saved as their deltas)
+    node_record& Edit(uint32_t id);
+
+    std::string GetName(uint32_t id) const;
+    void SetName(uint32_t id, const std::string& name);
+    /// Path from the root ("." is the root, "./dir/file" its descendant)
+    std::string GetPath(uint32_t id) const;
+    std::string GetHash(uint32_t id);
+    void SetHash(uint32_t id, const std::string& hash);
+    /// Set hash of the node from another store (its pool offset is used when this store is its delta)
+    void CopyHash(uint32_t id, NodeStore& from, uint32_t from_id);
+    /// First file with the hash, 0 = none
+    uint32_t FindHash(const std::string& hash);
+
+    /// Child of the directory with the name, 0 = none
+    uint32_t FindChild(uint32_t directory, const std::string& name);
+    /// Node at the path ("./dir/file", "dir/file" and "/dir/file" are the same path), 0 = none
+    uint32_t FindPath(const std::string& path);
+    /// Node at the path and all its descendants in the path order, empty when there is no such node
+    std::vector<uint32_t> FindPrefix(const std::string& path);
+    /// Nodes with paths matching the pattern in the path order. Components are matched by fnmatch,
+    /// "**" matches any number of components (e.g. "./var/**/*.log")
+    std::vector<uint32_t> FindGlob(const std::string& pattern);
+    /// Children of the directory sorted by name
+    std::vector<uint32_t> GetChildren(uint32_t directory);
+    /// Sort the children index, if nodes were added since the last sort
+    void SortChildren();
+
+    /// Nodes found in the store of the previous tree keep their ids (Add with the id), new ones fill its unused
+    /// ids first. When delta, this store is saved as a delta of the previous one (its pools are continued)
+    void SetPrevious(NodeStore& previous, bool delta);
+    /// Original values of the records changed since the tree was loaded (they are forgotten)
+    std::unordered_map<uint32_t, node_record> TakeOriginals();
+    /// Base of this delta was changed, its records not saved in the delta keep the original values
+    void KeepRecords(const std::unordered_map<uint32_t, node_record>& originals);
+
+    /// Sizes of the sections, the sections are written after the archive by WriteSections. Records are saved
+    /// as they are in the memory, so trees are readable only on the same architecture
+    template <class Archive>
+    void SaveSizes(Archive& ar) const {
+        if (!children_sorted) throw FileTreeException("Children of the tree must be sorted before saving\n");
+        ar(
+            cereal::make_nvp("record_size", (uint32_t)sizeof(node_record)),
+            cereal::make_nvp("record_count", (uint64_t)record_count),
+            cereal::make_nvp("delta", base != nullptr),
+            cereal::make_nvp("delta_count", (uint64_t)saved.ids.size()),
+            cereal::make_nvp("directory_count", (uint64_t)saved.directories.size()),
+            cereal::make_nvp("children_count", (uint64_t)(base != nullptr ? saved.children.size() : children_count)),
+            cereal::make_nvp("names_base", (uint64_t)names.Inherited()),
+            cereal::make_nvp("names_size", (uint64_t)(names.Size() - names.Inherited())),
+            cereal::make_nvp("hashes_base", (uint64_t)hashes.Inherited()),
+            cereal::make_nvp("hashes_size", (uint64_t)(hashes.Size() - hashes.Inherited())),
+            cereal::make_nvp("path_count", (uint64_t)(base != nullptr ? 0 : path_count))
+        );
+    }
+
+    /// Sizes of the sections saved by FileTree version 4 (whole trees only), 5 or 6 (with the path index)
+    template <class Archive>
+    void LoadSizes(Archive& ar, uint32_t version) {
+        uint32_t record_size;
+        ar(record_size, sections.record_count);
+        if (version >= 5) ar(sections.delta, sections.delta_count, sections.directory_count);
+        ar(sections.children_count);
+        if (version >= 5) ar(sections.names_base);
+        ar(sections.names_size);
+        if (version >= 5) ar(sections.hashes_base);
+        ar(sections.hashes_size);
+        if (version >= 6) ar(sections.path_count);
+        if (record_size != sizeof(node_record)) throw FileTreeException("Tree was saved on another architecture\n");
+        sections.pending = true;
+    }
+
+    /// Sections of trees saved by version 3 (inside the archive)
+    template <class Archive>
+    void LoadInline(Archive& ar) {
+        uint32_t record_size;
+        uint64_t count;
+        ar(record_size, count);
+        if (record_size != sizeof(node_record)) throw FileTreeException("Tree was saved on another architecture\n");
+        owned_records.resize(count);
+        ar(cereal::binary_data(owned_records.data(), count * sizeof(node_record)));
+        ar(owned_children, names.owned, hashes.owned);
+        records = owned_records.data();
+        record_count = owned_records.size();
+        children = owned_children.data();
+        children_count = owned_children.size();
+        names.Sync();
+        hashes.Sync();
+        children_sorted = true;
+    }
+
+    /// Compute the delta against the base before saving (the loaded delta is merged with its changes)
+    void PrepareSections();
+    /// Write the sections after the archive (aligned, so they can be mapped)
+    void WriteSections(std::ostream& os);
+    /// Map the sections of the loaded tree, its archive ended at the offset of the file (nothing to do when
+    /// the archive had the nodes). Delta needs the store of its base
+    void MapSections(const std::string& filename, size_t offset, NodeStore* base);
+
+  private:
+    /// Strings in one offset space (each one ends by '\0'), found by an open addressing table of offsets.
+    /// Segments are never changed (mapped, or shared with the pools continuing this one), new strings are
+    /// appended to the owned tail
+    class StringPool {
+      public:
+        std::string owned = std::string(1, '\0'); // Tail, offset 0 is the empty string
+
+        StringPool() = default;
+        StringPool(const StringPool&) = delete;
+
+        /// Return offset of the text, it is added when it is not in the pool yet
+        uint32_t Intern(const std::string& text);
+        /// Add the text without looking for it (it can be more times in the pool), the table is built again when it is needed
+        uint32_t Append(const std::string& text);
+        /// Return false when the text is not in the pool
+        bool Find(const std::string& text, uint32_t& offset, uint32_t& value);
+        const char* Get(uint32_t offset) const {
+            if (offset >= tail_start) return owned.data() + (offset - tail_start);
+            for (auto& segment: segments) if (offset < segment.start + segment.size) return segment.data + (offset - segment.start);
+            return owned.data(); // Not reached, offsets are from the pool
+        }
+        size_t Size() const { return tail_start + owned.size(); }
+        /// Size of the pool this one continues (0 = none)
+        size_t Inherited() const { return inherited; }
+        /// Value of the text at the offset (after Find)
+        uint32_t& Value(uint32_t offset);
+        /// Use the strings of the mapped file
+        void Map(const char* mapped, size_t mapped_size);
+        /// Continue the pool (its tail becomes a segment shared by both)
+        void Inherit(StringPool& base);
+        /// Strings of the mapped file continue the pool
+        void Extend(const char* mapped, size_t mapped_size);
+        /// Owned tail was replaced, the table is built again when it is needed
+        void Sync();
+        /// Write strings from the offset to the end
+        void Write(std::ostream& os, size_t from) const;
+        /// Memory of the owned tail and the table
+        size_t GetMemoryUsage() const { return owned.capacity() + table.capacity() * sizeof(table[0]); }
+
+      private:
+        struct segment {
+            size_t start;
+            const char* data;
+            size_t size;
+        };
+        std::vector<segment> segments;
+        std::vector<std::shared_ptr<const std::string>> shared; // Former tails in the segments
+        size_t tail_start = 0;
+        size_t inherited = 0;
+        std::vector<std::pair<uint32_t, uint32_t>> table; // Offset + 1 (0 = empty slot) and value
+        size_t count = 0;
+
+        size_t FindSlot(const char* text, size_t length);
+        void Rebuild(size_t size);
+        void Reset();
+        /// Call the function with offset and length of each string (but the empty one)
+        template <class Function>
+        void ForEach(Function function) const;
+    };
+
+    struct section_sizes {
+        uint64_t record_count = 0;
+        bool delta = false;
+        uint64_t delta_count = 0;
+        uint64_t directory_count = 0;
+        uint64_t children_count = 0;
+        uint64_t names_base = 0;
+        uint64_t names_size = 0;
+        uint64_t hashes_base = 0;
+        uint64_t hashes_size = 0;
+        uint64_t path_count = 0; // 0 = no path index
+        bool pending = false; // Loaded from the archive, the sections are not mapped yet
+    };
+
+    /// Changed records and children lists of a delta (saved or prepared for saving)
+    struct delta_sections {
+        std::vector<uint32_t> ids; // Sorted
+        std::vector<node_record> records;
+        std::vector<uint32_t> directories; // Sorted, with ranges of their children (count + 1 items)
+        std::vector<uint32_t> ranges;
+        std::vector<uint32_t> children;
+    };
+
+    node_record* records; // Owned records or the mapped section, nullptr = loaded delta
+    size_t record_count;
+    std::vector<node_record> owned_records;
+    const uint32_t* children; // Children of each directory as one range
+    size_t children_count = 0;
+    std::vector<uint32_t> owned_children;
+    std::atomic<bool> children_sorted{true};
+    StringPool names;
+    StringPool hashes; // Value is the first file with the hash (hashes are appended, they are searched only in finished trees)
+    std::mutex lock; // Hashes and sorting of children
+
+    // Previous tree (new trees) and the base of the delta
+    NodeStore* previous = nullptr;
+    NodeStore* base = nullptr;
+    std::vector<uint32_t> free_ids; // Unused ids of the previous tree, the last one is used first
+    bool free_ids_found = false;
+
+    // Loaded delta, mapped sections
+    const uint32_t* delta_ids = nullptr;
+    const node_record* delta_records = nullptr;
+    size_t delta_count = 0;
+    const uint32_t* delta_directories = nullptr;
+    const uint32_t* delta_ranges = nullptr;
+    size_t delta_directory_count = 0;
+    std::unordered_map<uint32_t, node_record> edited; // Changed records of the loaded delta
+
+    bool keep_originals = false; // Loaded tree, its records can be base of other trees
+    std::unordered_map<uint32_t, node_record> originals;
+    delta_sections saved; // Prepared for SaveSizes and WriteSections
+
+    // Path index, nodes in the path order and the end of the subtree of each one (owned or mapped)
+    const uint32_t* path_order = nullptr;
+    const uint32_t* path_ends = nullptr;
+    size_t path_count = 0;
+    std::vector<uint32_t> owned_path_order;
+    std::vector<uint32_t> owned_path_ends;
+    std::atomic<bool> path_index_ready{false}; // Cleared when the children are sorted again
+
+    section_sizes sections;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+
+    /// Copy the mapped records before nodes are added
+    void OwnRecords();
+    const node_record& GetDelta(uint32_t id) const;
+    /// Children of the directory (the base has them, when the delta has not)
+    void ChildRange(uint32_t directory, const uint32_t*& begin, const uint32_t*& end);
+    uint32_t FindChild(uint32_t directory, const char* name, size_t length);
+
+    typedef std::vector<std::pair<const char*, size_t>> path_components; // Text and length of each component
+    /// Components of the path, empty ones and "." are skipped
+    static path_components SplitPath(const std::string& path);
+    /// Build the path index, if it is not built or mapped yet
+    void BuildPathIndex();
+    /// Compare the path of the node with the components in the path order (<0, 0 or >0)
+    int ComparePath(uint32_t id, const path_components& components, std::vector<uint32_t>& ancestors) const;
+    /// Position of the node in the path index, path_count = none
+    size_t FindPosition(const path_components& components) const;
+};
+
+}
+
+#endif // NODESTORE_HPP
@@ -0,0 +1,59 @@
+#ifndef SIMILARITYINDEX_HPP
+#define SIMILARITYINDEX_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+namespace FenixBackup {
+
+/**
+ * Process-wide index of chunk sketches used to find a delta base for files
+ * without a previous version (new, renamed or copied files). Sketch is the
+ * bottom-k (the smallest k) set of hashes of small content-defined blocks,
+ * similar files share a big part of their sketches. Sketches are computed
+ * without any lock, the index itself is guarded by FileChunk::GetLock().
+ */
+class SimilarityIndex {
+  public:
+    SimilarityIndex() = delete;
+
+    typedef std::vector<uint64_t> sketch;
+
+    /// Add next piece of a stream to the sketch (the stream is read by hashing or encoding, not again for the sketch)
+    static void UpdateSketch(sketch& file_sketch, const char* buffer, size_t length);
+    /// Return the most similar chunk (empty when none reaches similarityThreshold)
+    static std::string FindSimilar(const sketch& file_sketch);
+    static void Add(const std::string& chunk_name, const sketch& chunk_sketch);
+
+    /// Count a file encoded against a similar chunk
+    static void CountMatch(size_t file_size, size_t stored_size);
+    static size_t GetMatches();
+    /// Size of files encoded against similar chunks and size of their stored data
+    static size_t GetMatchedBytes();
+    static size_t GetStoredBytes();
+
+    /// Append new sketches to the index file
+    static void Flush();
+    /// Rewrite the index file without sketches of deleted chunks
+    static void Compact();
+
+  private:
+    static void Load();
+    static void AddHash(sketch& file_sketch, uint64_t hash);
+    static void Insert(const std::string& chunk_name, const sketch& chunk_sketch);
+    static void Erase(const std::string& chunk_name);
+
+    static bool loaded;
+    static std::unordered_map<std::string, sketch> sketches;
+    static std::unordered_map<uint64_t, std::vector<std::string>> features; // Inverted index: hash -> chunks
+    static std::string buffer; // Records not written yet
+    static size_t matches;
+    static size_t matched_bytes;
+    static size_t stored_bytes;
+};
+
+}
+
+#endif // SIMILARITYINDEX_HPP
@@ -0,0 +1,51 @@
+#ifndef TREECATALOG_HPP
+#define TREECATALOG_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <ctime>
+#include <cstdint>
+
+namespace FenixBackup {
+
+struct tree_info {
+    std::string tree_name;
+    time_t construct_time = 0;
+    std::string prev_tree_name; // Empty for the first tree
+    std::string next_tree_name; // Empty for the newest tree
+    uint64_t node_count = 0; // Ids of the nodes (FileTree::GetLastId)
+    uint64_t stored_bytes = 0; // Size of the tree file
+};
+
+/**
+ * List of the trees of the repository with their links, so trees are listed and their
+ * successors are found without reading the tree directory or the trees. The catalog
+ * file is rewritten when a tree is saved, trees saved or removed by others (e.g. older
+ * versions) are found when the tree directory was changed since the catalog was written.
+ */
+class TreeCatalog {
+  public:
+    TreeCatalog();
+    virtual ~TreeCatalog();
+
+    /// Read the catalog file, it is updated from the tree directory when the directory was changed
+    void Open();
+
+    /// Names of the trees, oldest first
+    const std::vector<std::string>& GetTreeList();
+    /// Load info of the tree with info.tree_name, return false when there is no such tree
+    bool Load(tree_info& info);
+    /// Add or update the saved tree, it becomes the successor of its previous tree
+    void Save(const tree_info& info);
+    /// Forget the removed tree
+    void Remove(const std::string& name);
+
+  private:
+    class TreeCatalogData;
+    std::unique_ptr<TreeCatalogData> data;
+};
+
+}
+
+#endif // TREECATALOG_HPP
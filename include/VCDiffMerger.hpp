@@ -0,0 +1,30 @@
+#ifndef VCDIFFMERGER_HPP
+#define VCDIFFMERGER_HPP
+
+#include <string>
+
+namespace FenixBackup {
+
+/// Composition of VCDIFF deltas (RFC 3284) without decoding the files
+class VCDiffMerger {
+  public:
+    VCDiffMerger() = delete;
+
+    /**
+     * Merge delta A->B (first) and delta B->C (second) into delta A->C by
+     * rewriting COPY instructions of the second delta into COPY/ADD/RUN
+     * instructions referencing A. Return false when any of the deltas uses
+     * VCDIFF features which are not supported here (secondary compression,
+     * custom code tables, VCD_TARGET windows, open-vcdiff extensions) or is
+     * malformed, the caller has to decode and encode the content then.
+     */
+    static bool Merge(const std::string& first, const std::string& second, std::string& output);
+
+  private:
+    class DeltaParser;
+    class Composer;
+};
+
+}
+
+#endif // VCDIFFMERGER_HPP
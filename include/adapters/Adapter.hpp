@@ -26,8 +26,10 @@ class Adapter {
     virtual std::shared_ptr<FileTree> GetTree() = 0;
     virtual void SetTree(std::shared_ptr<FileTree> tree) = 0;
 
-    /// Get and process each given file
+    /// Get and process each given file (both may be called from more threads at once, see BackupProcessor)
     virtual void GetAndProcess(std::shared_ptr<FileInfo> file) = 0;
+    /// Get and process more files at once (adapters can fetch them together), default calls GetAndProcess
+    virtual void GetAndProcessBatch(const std::vector<std::shared_ptr<FileInfo>>& files);
 
     /// Restore file to the original machine
     virtual void RestoreFile(std::shared_ptr<FileInfo> file, restore_mode mode = ALL, restore_tactic tactic = NEWEST_KNOWN_VERSION) = 0;
@@ -43,6 +45,11 @@ class Adapter {
     virtual void RestoreSubtreeToLocalPath(std::shared_ptr<FileInfo> file, const std::string& path,
                                            restore_mode mode = ALL,restore_tactic tactic = NEWEST_KNOWN_VERSION,
                                            bool preserve_inbackup_path = true);
+
+    /// Restoring listed files (in the path order, e.g. FileTree::GetFilesByPattern), each one to its path in the backup
+    virtual void RestoreFiles(const std::vector<std::shared_ptr<FileInfo>>& files, restore_mode mode = ALL, restore_tactic tactic = NEWEST_KNOWN_VERSION);
+    virtual void RestoreFilesToLocalPath(const std::vector<std::shared_ptr<FileInfo>>& files, const std::string& path,
+                                         restore_mode mode = ALL, restore_tactic tactic = NEWEST_KNOWN_VERSION);
 };
 
 }
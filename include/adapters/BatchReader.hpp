@@ -0,0 +1,40 @@
+#ifndef ADAPTERS_BATCHREADER_HPP
+#define ADAPTERS_BATCHREADER_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace FenixBackup {
+
+/**
+ * Reader of whole small files in batches. With io_uring, opens, reads and
+ * closes of the whole batch are submitted at once (a few system calls per
+ * batch instead of three per file). When io_uring is not available (old
+ * kernel, seccomp), files are read one by one.
+ */
+class BatchReader {
+  public:
+    struct item {
+        std::string filename;
+        size_t size; // Expected size (from the scan)
+        std::string content;
+        int error = 0; // errno of the failed operation
+        bool complete = true; // False when the file is bigger than expected (content has only the expected size)
+    };
+
+    /// Depth is the number of files submitted at once
+    BatchReader(unsigned int depth, bool use_io_uring = true);
+    virtual ~BatchReader();
+
+    void Read(std::vector<item>& items);
+    bool UsesIoUring();
+
+  private:
+    class BatchReaderData;
+    std::unique_ptr<BatchReaderData> data;
+};
+
+}
+
+#endif // ADAPTERS_BATCHREADER_HPP
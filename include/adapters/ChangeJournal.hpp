@@ -0,0 +1,51 @@
+#ifndef ADAPTERS_CHANGEJOURNAL_HPP
+#define ADAPTERS_CHANGEJOURNAL_HPP
+
+#include <string>
+#include <memory>
+#include <functional>
+#include <unordered_set>
+
+#include "FileTree.hpp"
+
+namespace FenixBackup {
+
+/**
+ * Persistent journal of changed directories of the local filesystem. The watcher (inotify,
+ * "fenix <config> watch") runs between backups and appends tree paths of directories whose
+ * entries changed. Scan then reads only these directories and copies the others from the
+ * previous tree.
+ *
+ * The journal is used only when it covers all the time since the previous scan: the watcher
+ * is running (it holds a lock on the journal), it was ready (watching everything) before the
+ * previous scan started, no events were lost (queue overflow) and the config did not change.
+ * Otherwise Begin returns false and the whole tree is scanned.
+ *
+ * Begin writes a token into the state file and waits until the watcher records it. Events are
+ * read in order, so changes made before the Begin are in the journal before the token. When the
+ * state changes, the watcher drops the records older than its offset (once they are most of the
+ * journal), offsets of the other records stay the same.
+ */
+class ChangeJournal {
+  public:
+    ChangeJournal();
+    virtual ~ChangeJournal();
+
+    /// Watch the directory tree and record its changed directories, until stopped returns true
+    void Watch(const std::string& path, const std::function<bool()>& stopped);
+
+    /// Start of a scan, return true when the journal has all changes since the previous tree (waits for the watcher)
+    bool Begin(std::shared_ptr<FileTree> prev_tree);
+    /// Tree paths of directories changed since the previous tree (valid after Begin returned true)
+    const std::unordered_set<std::string>& GetDirty();
+    /// The scanned tree was saved, next scan reads the journal from the Begin of this one
+    void End(std::shared_ptr<FileTree> tree);
+
+  private:
+    class ChangeJournalData;
+    std::unique_ptr<ChangeJournalData> data;
+};
+
+}
+
+#endif // ADAPTERS_CHANGEJOURNAL_HPP
@@ -0,0 +1,57 @@
+#ifndef ADAPTERS_DIRECTORYSCANNER_HPP
+#define ADAPTERS_DIRECTORYSCANNER_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <sys/stat.h>
+
+#include "Global.hpp"
+
+namespace FenixBackup {
+
+/**
+ * Parallel scan of a directory tree. Directories are listed by getdents64 with
+ * a big buffer and each entry is stat'ed once, relative to the directory fd.
+ * Each thread takes directories from its own queue (newest first, so the scan
+ * goes roughly in depth-first order) and steals the oldest ones from other
+ * threads when its queue is empty. Entries keep the order of the directory,
+ * so a tree built from them is the same as from a serial scan.
+ */
+class DirectoryScanner {
+  public:
+    struct directory;
+    struct entry {
+        std::string name;
+        file_params params; // Of the entry itself (lstat)
+        file_type type; // Symlink to a directory or a regular file has type of its target
+        std::unique_ptr<directory> subdir; // Nullptr when the directory is not scanned
+    };
+    struct directory {
+        std::string path; // Filesystem path
+        std::string tree_path; // Path in the FileTree
+        std::vector<entry> entries; // Valid after Wait
+        bool complete = false;
+    };
+
+    /// Filter gets tree path and params of each directory and decides if it is scanned (called by more threads)
+    DirectoryScanner(unsigned int threads, const std::function<bool(const std::string&, const file_params&)>& filter);
+    virtual ~DirectoryScanner();
+
+    /// Start the scan of the directory (the root of the tree or a subtree), more scans can run at once
+    directory& Scan(const std::string& path, const std::string& tree_path = ".");
+    /// Wait until entries of the directory are read (rethrow error of the scan)
+    void Wait(directory& dir);
+
+    /// Params from the stat info (same fields as the scan)
+    static file_params GetParams(const struct stat& info);
+
+  private:
+    class DirectoryScannerData;
+    std::unique_ptr<DirectoryScannerData> data;
+};
+
+}
+
+#endif // ADAPTERS_DIRECTORYSCANNER_HPP
@@ -17,6 +17,8 @@ class LocalFilesystemAdapter: public Adapter {
     virtual std::shared_ptr<FileTree> GetTree();
     virtual void SetTree(std::shared_ptr<FileTree> tree);
     virtual void GetAndProcess(std::shared_ptr<FileInfo> file);
+    /// Small files are read together (by io_uring when available), bigger ones one by one
+    virtual void GetAndProcessBatch(const std::vector<std::shared_ptr<FileInfo>>& files);
 
     virtual void RestoreFile(std::shared_ptr<FileInfo> file, restore_mode mode = ALL, restore_tactic tactic = NEWEST_KNOWN_VERSION);
     virtual void RestoreFileToLocalPath(std::shared_ptr<FileInfo> file, const std::string& path,
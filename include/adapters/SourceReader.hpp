@@ -0,0 +1,58 @@
+#ifndef ADAPTERS_SOURCEREADER_HPP
+#define ADAPTERS_SOURCEREADER_HPP
+
+#include <streambuf>
+#include <string>
+#include <memory>
+
+namespace FenixBackup {
+
+enum source_read_mode { READ_STREAM, READ_MMAP, READ_PREAD, READ_DIRECT };
+// READ_STREAM - std::ifstream (not a SourceReader)
+// READ_MMAP - whole file mapped with MADV_SEQUENTIAL (file truncated while reading raises SIGBUS)
+// READ_PREAD - pread into a reusable buffer, reads bigger than the buffer go directly into the caller's memory
+// READ_DIRECT - O_DIRECT reads into an aligned buffer, page cache is not used at all (falls back to pread
+//               on filesystems without O_DIRECT)
+
+/**
+ * Stream buffer for reading backed up files with low page cache footprint.
+ * With dropCache, pages of the file are dropped from the page cache (posix_fadvise
+ * DONTNEED) when the reader is destroyed, except pages which were cached before
+ * the file was opened, so the working set of other processes stays in the memory.
+ * Pages are kept while the reader is open, the file may be read again after seeking
+ * back (e.g. hashed and then encoded) without reading the disk again.
+ */
+class SourceReader: public std::streambuf {
+  public:
+    SourceReader(const std::string& filename, source_read_mode mode, size_t buffer_size, bool drop_cache);
+    virtual ~SourceReader();
+
+    /// Mode by the name used in config ("stream", "mmap", "pread", "direct")
+    static source_read_mode GetMode(const std::string& name);
+    static std::string GetModeName(source_read_mode mode);
+    /// Size of the file cached in the page cache
+    static size_t GetCachedBytes(const std::string& filename);
+    /// Drop (clean) pages of the file from the page cache
+    static void DropCache(const std::string& filename);
+
+  protected:
+    virtual int_type underflow();
+    virtual std::streamsize xsgetn(char* buffer, std::streamsize count);
+    virtual pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which = std::ios_base::in);
+    virtual pos_type seekpos(pos_type position, std::ios_base::openmode which = std::ios_base::in);
+
+  private:
+    class SourceReaderData;
+    std::unique_ptr<SourceReaderData> data;
+
+    /// Current position in the file
+    size_t GetPosition();
+    /// Forget the loaded window and continue from the offset with empty buffer
+    void Reset(size_t offset);
+    /// Load window starting at the offset, return false at the end of the file
+    bool Fill(size_t offset);
+};
+
+}
+
+#endif // ADAPTERS_SOURCEREADER_HPP
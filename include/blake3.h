@@ -0,0 +1,95 @@
+// //////////////////////////////////////////////////////////
+// blake3.h
+// Portable BLAKE3 (hash mode, 32 byte output) following the reference design,
+// with optional multi-threaded hashing of big inputs (tree mode)
+//
+
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+
+/// compute BLAKE3 hash
+/** Usage (same as SHA256):
+    BLAKE3 blake3;
+    std::string myHash = blake3("Hello World");
+
+    // or in a streaming fashion:
+
+    BLAKE3 blake3(4); // up to 4 threads for big pieces of data
+    while (more data available)
+      blake3.add(pointer to fresh data, number of new bytes);
+    std::string myHash2 = blake3.getHash();
+
+    Big pieces passed to add() are split into subtrees which are hashed in
+    parallel, the result does not depend on the number of threads or on the
+    way the data are split into add() calls.
+  */
+class BLAKE3
+{
+public:
+  /// 1 KB chunks of 64 byte blocks, hash is 32 bytes long
+  enum { BlockSize = 64, ChunkSize = 1024, HashBytes = 32 };
+
+  /// same as reset()
+  explicit BLAKE3(unsigned int threads = 1);
+
+  /// compute BLAKE3 of a memory block
+  std::string operator()(const void* data, size_t numBytes);
+  /// compute BLAKE3 of a string, excluding final zero
+  std::string operator()(const std::string& text);
+
+  /// add arbitrary number of bytes
+  void add(const void* data, size_t numBytes);
+
+  /// return latest hash as 64 hex characters
+  std::string getHash();
+  /// return latest hash as bytes
+  void        getHash(unsigned char buffer[HashBytes]);
+
+  /// restart
+  void reset();
+
+private:
+  /// input of the last compression of a node (chunk or parent), it gives chaining value or root hash
+  struct Output
+  {
+    uint32_t cv[8];
+    uint8_t  block[BlockSize];
+    uint64_t counter;
+    uint32_t blockLen;
+    uint32_t flags;
+
+    void chainingValue(uint32_t result[8]) const;
+    void rootBytes(unsigned char result[HashBytes]) const;
+  };
+
+  /// state of the chunk being filled
+  struct ChunkState
+  {
+    uint32_t cv[8];
+    uint64_t counter;
+    uint8_t  block[BlockSize];
+    size_t   blockLen;
+    size_t   blocksCompressed;
+
+    void   init(uint64_t chunkCounter);
+    size_t length() const;
+    void   update(const uint8_t* data, size_t numBytes);
+    Output output() const;
+  };
+
+  static Output parentOutput(const uint32_t left[8], const uint32_t right[8]);
+  /// chaining values of both halves of a power-of-2 subtree of whole chunks (halves are hashed in parallel when big enough)
+  static void subtreeChildren(const uint8_t* data, size_t numBytes, uint64_t chunkCounter, uint32_t left[8], uint32_t right[8], unsigned int threads);
+  static void subtreeChainingValue(const uint8_t* data, size_t numBytes, uint64_t chunkCounter, uint32_t cv[8], unsigned int threads);
+  void pushChainingValue(const uint32_t cv[8], uint64_t chunkCounter);
+  void mergeStack(uint64_t totalChunks);
+
+  unsigned int m_threads;
+  ChunkState   m_chunk;
+  /// chaining values of completed subtrees (one per level at most)
+  uint32_t     m_stack[54][8];
+  size_t       m_stackLen;
+};
@@ -8,6 +8,7 @@
 
 //#include "hash.h"
 #include <string>
+#include <vector>
 
 // define fixed size integer types
 #ifdef _MSC_VER
@@ -59,9 +60,22 @@ public:
   /// restart
   void reset();
 
+  /// compute SHA256 of several independent messages, short messages are hashed in parallel SIMD lanes
+  static std::vector<std::string> hashMany(const std::vector<std::string>& texts);
+
+  /// name of the block function chosen for this CPU ("sha-ni", "avx2" or "scalar")
+  static const char* implementation();
+  /// use only the portable code (for benchmarks)
+  static void forceScalar(bool scalar);
+
+  /// number of messages hashed at once by the multi-buffer kernel
+  enum { Lanes = 8 };
+
 private:
   /// process 64 bytes
   void processBlock(const void* data);
+  /// process numBlocks * 64 bytes with the fastest available function
+  void processBlocks(const void* data, size_t numBlocks);
   /// process everything left in the internal buffer
   void processBuffer();
 
@@ -0,0 +1,49 @@
+#ifndef STORAGE_CHUNKCATALOG_HPP
+#define STORAGE_CHUNKCATALOG_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "storage/ChunkStorage.hpp"
+
+namespace FenixBackup {
+
+/**
+ * Meta info of all chunks in the repository (the chunk graph). It consists
+ * of a memory-mapped snapshot with a hash index and an append-only journal
+ * of changes made after the snapshot. Journal records are buffered, so
+ * lookups and updates do not touch the filesystem. The journal has to be
+ * flushed before data of an existing chunk are rewritten or removed.
+ */
+class ChunkCatalog {
+  public:
+    ChunkCatalog();
+    /// Buffered changes are written
+    virtual ~ChunkCatalog();
+
+    /// Open catalog files, import meta info of older versions from the storage when there is no catalog yet
+    void Open(ChunkStorage& storage);
+
+    bool Exists(const std::string& name);
+    /// Load info of the chunk with info.chunk_name, return false when there is no such chunk
+    bool Load(chunk_info& info);
+    void Save(const chunk_info& info);
+    void Remove(const std::string& name);
+    std::vector<std::string> GetChunkList();
+
+    /// Write buffered journal records and sync them to the disk
+    void Flush();
+    /// Write a new snapshot with all changes and empty the journal
+    void Compact();
+    /// Move meta info stored by older versions in the storage into the catalog
+    void ImportLegacy(ChunkStorage& storage);
+
+  private:
+    class ChunkCatalogData;
+    std::unique_ptr<ChunkCatalogData> data;
+};
+
+}
+
+#endif // STORAGE_CHUNKCATALOG_HPP
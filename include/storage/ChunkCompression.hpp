@@ -0,0 +1,56 @@
+#ifndef STORAGE_CHUNKCOMPRESSION_HPP
+#define STORAGE_CHUNKCOMPRESSION_HPP
+
+#include <string>
+#include <memory>
+
+#include "storage/ChunkStorage.hpp"
+
+namespace FenixBackup {
+
+/// Compression of chunk data (after delta encoding) as decorators of storage readers and writers
+class ChunkCompression {
+  public:
+    ChunkCompression() = delete;
+
+    /// Writer which compresses data, unless the beginning of the data looks incompressible
+    class Writer: public ChunkStorage::Writer {
+      public:
+        Writer(std::unique_ptr<ChunkStorage::Writer> target, chunk_codec codec);
+        virtual ~Writer();
+
+        virtual void Write(const char* buffer, size_t length);
+        /// Return size of compressed data
+        virtual size_t Close();
+        /// Codec really used for the data (known after the probe or Close)
+        chunk_codec GetCodec();
+
+      private:
+        class WriterData;
+        std::unique_ptr<WriterData> data;
+    };
+
+    static std::unique_ptr<Writer> CreateWriter(std::unique_ptr<ChunkStorage::Writer> target, chunk_codec codec);
+    static std::unique_ptr<ChunkStorage::Reader> CreateReader(std::unique_ptr<ChunkStorage::Reader> source, chunk_codec codec);
+
+    /// Codec by the name used in config ("none", "zstd", "lz4")
+    static chunk_codec GetCodec(const std::string& name);
+    /// Test if compression of the sample saves enough space
+    static bool IsCompressible(const char* sample, size_t length, chunk_codec codec);
+
+  private:
+    class Encoder;
+    class Decoder;
+    class ZstdEncoder;
+    class ZstdDecoder;
+    class LZ4Encoder;
+    class LZ4Decoder;
+    class Reader;
+
+    static std::unique_ptr<Encoder> CreateEncoder(chunk_codec codec);
+    static std::unique_ptr<Decoder> CreateDecoder(chunk_codec codec);
+};
+
+}
+
+#endif // STORAGE_CHUNKCOMPRESSION_HPP
@@ -0,0 +1,118 @@
+#ifndef STORAGE_CHUNKSTORAGE_HPP
+#define STORAGE_CHUNKSTORAGE_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include <cereal/cereal.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include "Global.hpp"
+
+namespace FenixBackup {
+
+enum chunk_type : uint8_t { DELTA, BLOCK_LIST, CONTAINED };
+// DELTA - VCDIFF against the ancestor (or against empty file), also used for blocks and containers
+// BLOCK_LIST - names of blocks (content-defined chunks), the content is their concatenation
+// CONTAINED - small chunk without own data, the content is a part of the container chunk
+
+enum chunk_codec : uint8_t { RAW, ZSTD, LZ4 };
+// Compression of the stored data (applied after delta encoding)
+
+/// Meta info of one FileChunk
+struct chunk_info {
+    std::string chunk_name;
+    std::string ancestor_chunk_name;
+    int depth = 0;
+    std::vector<std::string> derived_chunks;
+    size_t chunk_size = 0;
+    chunk_type type = DELTA;
+    unsigned int references = 0; // Number of block lists using this block (or of chunks in this container)
+    chunk_codec codec = RAW;
+    hash_algorithm hash = SHA256_HASH; // Algorithm of the chunk name (for BLOCK_LIST also of the block names)
+    std::string container_name; // Container of the CONTAINED chunk
+    uint64_t offset = 0; // Content of the CONTAINED chunk in the container
+    uint64_t length = 0;
+
+    template <class Archive>
+    void serialize(Archive & ar, std::uint32_t const version) {
+        ar(
+            cereal::make_nvp("chunk_name", chunk_name),
+            cereal::make_nvp("ancestor_chunk_name", ancestor_chunk_name),
+            cereal::make_nvp("depth", depth),
+            cereal::make_nvp("chunk_size", chunk_size),
+            cereal::make_nvp("derived_chunks", derived_chunks)
+        );
+        if (version >= 2) ar(
+            cereal::make_nvp("type", type),
+            cereal::make_nvp("references", references)
+        );
+        if (version >= 3) ar(cereal::make_nvp("codec", codec));
+        if (version >= 4) ar(cereal::make_nvp("hash", hash));
+        if (version >= 5) ar(
+            cereal::make_nvp("container_name", container_name),
+            cereal::make_nvp("offset", offset),
+            cereal::make_nvp("length", length)
+        );
+    }
+};
+
+/// Place where FileChunk data (VCDIFF) are stored, meta info is kept in the ChunkCatalog.
+/// Data of different chunks may be read and written from more threads at once.
+class ChunkStorage {
+  public:
+    class Reader {
+      public:
+        virtual ~Reader() {}
+        /// Read at most length bytes into buffer, return number of read bytes (0 at the end of data)
+        virtual size_t Read(char* buffer, size_t length) = 0;
+    };
+
+    class Writer {
+      public:
+        virtual ~Writer() {}
+        virtual void Write(const char* buffer, size_t length) = 0;
+        /// Finish writing, return total size of written data
+        virtual size_t Close() = 0;
+    };
+
+    ChunkStorage();
+    virtual ~ChunkStorage();
+
+    virtual std::unique_ptr<Reader> OpenData(const std::string& name) = 0;
+    /// Data are replaced after the writer is closed
+    virtual std::unique_ptr<Writer> CreateData(const std::string& name) = 0;
+
+    /// Data without the final name yet, they are saved by CommitData or dropped by DiscardData
+    virtual std::unique_ptr<Writer> CreateTempData(const std::string& temp_name) = 0;
+    /// Atomically give the temporary data their name (replacing data with that name)
+    virtual void CommitData(const std::string& temp_name, const std::string& name) = 0;
+    virtual void DiscardData(const std::string& temp_name) = 0;
+
+    /// Remove data of the chunk
+    virtual void Remove(const std::string& name) = 0;
+
+    /// Free space occupied by removed or rewritten chunks
+    virtual void Compact();
+
+    /// Meta info stored next to the data by older versions (before ChunkCatalog)
+    virtual std::vector<chunk_info> LoadLegacyInfo();
+    /// Delete legacy meta info, after it is imported into the catalog
+    virtual void DropLegacyInfo();
+
+    // Helpers for whole data
+    std::string LoadData(const std::string& name);
+    size_t SaveData(const std::string& name, const std::string& content);
+
+    /// Move (or copy) data of given chunks from the other storage into this storage
+    void Import(ChunkStorage& source, const std::vector<std::string>& chunks, bool remove_source = true);
+};
+
+}
+
+CEREAL_CLASS_VERSION(FenixBackup::chunk_info, 5);
+
+#endif // STORAGE_CHUNKSTORAGE_HPP
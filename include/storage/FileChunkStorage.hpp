@@ -0,0 +1,36 @@
+#ifndef STORAGE_FILECHUNKSTORAGE_HPP
+#define STORAGE_FILECHUNKSTORAGE_HPP
+
+#include "storage/ChunkStorage.hpp"
+
+namespace FenixBackup {
+
+/// Each chunk is stored as one data file in the data directory
+class FileChunkStorage: public ChunkStorage {
+  public:
+    FileChunkStorage();
+    virtual ~FileChunkStorage();
+
+    virtual std::unique_ptr<Reader> OpenData(const std::string& name);
+    virtual std::unique_ptr<Writer> CreateData(const std::string& name);
+    virtual std::unique_ptr<Writer> CreateTempData(const std::string& temp_name);
+    virtual void CommitData(const std::string& temp_name, const std::string& name);
+    virtual void DiscardData(const std::string& temp_name);
+
+    virtual void Remove(const std::string& name);
+
+    /// Meta files of older versions
+    virtual std::vector<chunk_info> LoadLegacyInfo();
+    virtual void DropLegacyInfo();
+
+  private:
+    class FileReader;
+    class FileWriter;
+
+    std::vector<std::string> GetLegacyMetaFiles();
+    std::string GetTempFilename(const std::string& temp_name);
+};
+
+}
+
+#endif // STORAGE_FILECHUNKSTORAGE_HPP
@@ -0,0 +1,36 @@
+#ifndef STORAGE_PACKCHUNKSTORAGE_HPP
+#define STORAGE_PACKCHUNKSTORAGE_HPP
+
+#include "storage/ChunkStorage.hpp"
+
+namespace FenixBackup {
+
+/// Chunk data are appended into big pack files, their locations are kept in one append-only index
+class PackChunkStorage: public ChunkStorage {
+  public:
+    PackChunkStorage();
+    virtual ~PackChunkStorage();
+
+    virtual std::unique_ptr<Reader> OpenData(const std::string& name);
+    virtual std::unique_ptr<Writer> CreateData(const std::string& name);
+    virtual std::unique_ptr<Writer> CreateTempData(const std::string& temp_name);
+    virtual void CommitData(const std::string& temp_name, const std::string& name);
+    virtual void DiscardData(const std::string& temp_name);
+
+    virtual void Remove(const std::string& name);
+
+    /// Meta info from the pack index of older versions
+    virtual std::vector<chunk_info> LoadLegacyInfo();
+    virtual void DropLegacyInfo();
+
+    /// Rewrite packs with too much unused space
+    virtual void Compact();
+
+  private:
+    class PackChunkStorageData;
+    std::unique_ptr<PackChunkStorageData> data;
+};
+
+}
+
+#endif // STORAGE_PACKCHUNKSTORAGE_HPP
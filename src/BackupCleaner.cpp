@@ -1,4 +1,5 @@
 #include <vector>
+#include <algorithm>
 #include <queue>
 #include <unordered_map>
 #include <unordered_set>
@@ -39,7 +40,7 @@ class BackupCleaner::BackupCleanerData {
     std::unordered_map<std::string, chunk_info> chunks;
     std::priority_queue<heap_item, std::vector<heap_item>, heap_comparator> chunk_heap;
     std::vector<std::vector<std::shared_ptr<FileInfo>>> files;
-    std::unordered_set<std::shared_ptr<FileInfo>> files_used;
+    std::unordered_map<std::string, std::vector<bool>> files_used; // By tree name (trees can be evicted from the cache), by file ids
 
     void AddFile(int index, std::shared_ptr<FileTree> tree, std::shared_ptr<FileInfo> file);
 
@@ -65,7 +66,9 @@ void BackupCleaner::BackupCleanerData::AddFile(int index, std::shared_ptr<FileTr
         if (prev_tree != nullptr) AddFile(index, prev_tree, prev_tree->GetFileById(file->GetPrevVersionId()));
     }
 
-    files_used.insert(file);
+    auto& used = files_used[file->GetTree()->GetTreeName()];
+    if (used.size() <= file->GetId()) used.resize(std::max<size_t>(file->GetTree()->GetLastId(), file->GetId()) + 1);
+    used[file->GetId()] = true;
 }
 
 void BackupCleaner::BackupCleanerData::CountBadness(unsigned int index, unsigned int subindex) {
@@ -103,10 +106,11 @@ void BackupCleaner::LoadData() {
         // XXX: Newest tree has badness always = 0
         auto tree = FileTree::GetHistoryTree(trees.back());
         trees.pop_back();
-        auto& files = tree->GetAllFiles();
-        for (auto& file: files) {
+        auto& used = data->files_used[tree->GetTreeName()];
+        for (unsigned int id = 1; id <= tree->GetLastId(); id++) {
+            auto file = tree->GetFileById(id);
             if (file == nullptr) continue;
-            if (file->GetType() != DIR && data->files_used.find(file) == data->files_used.end()) {
+            if (file->GetType() != DIR && (id >= used.size() || !used[id])) {
                 int index = data->files.size();
                 data->files.push_back(std::vector<std::shared_ptr<FileInfo>>());
                 data->AddFile(index, tree, file);
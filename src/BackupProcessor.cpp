@@ -0,0 +1,100 @@
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <system_error>
+#include <algorithm>
+
+#include "Config.hpp"
+#include "BackupProcessor.hpp"
+
+namespace FenixBackup {
+
+class BackupProcessor::BackupProcessorData {
+  public:
+    std::shared_ptr<Adapter> adapter;
+    unsigned int jobs;
+
+    std::vector<std::vector<std::shared_ptr<FileInfo>>> batches;
+    std::atomic<size_t> next_batch;
+    std::atomic<bool> failed;
+    std::exception_ptr error; // First error, other threads stop after their current batch
+    std::mutex lock; // Observer and error
+
+    /// Small files are joined (the adapter reads them together), big file is a batch on its own
+    void SplitBatches(const std::vector<std::shared_ptr<FileInfo>>& files);
+    /// Process batches until there is none left
+    void Work(const std::function<void(std::shared_ptr<FileInfo>)>& observer);
+};
+
+void BackupProcessor::BackupProcessorData::SplitBatches(const std::vector<std::shared_ptr<FileInfo>>& files) {
+    auto& config = Config::GetConfig();
+    batches.clear();
+    std::vector<std::shared_ptr<FileInfo>> batch;
+    for (auto& file: files) {
+        bool big = (file->GetType() == FILE && file->GetParams().file_size > config.adapterBatchFileSize);
+        if (!batch.empty() && (big || batch.size() >= config.adapterBatchSize)) {
+            batches.push_back(std::move(batch));
+            batch.clear();
+        }
+        if (big) batches.push_back(std::vector<std::shared_ptr<FileInfo>>(1, file));
+        else batch.push_back(file);
+    }
+    if (!batch.empty()) batches.push_back(std::move(batch));
+}
+
+void BackupProcessor::BackupProcessorData::Work(const std::function<void(std::shared_ptr<FileInfo>)>& observer) {
+    while (!failed) {
+        size_t index = next_batch++;
+        if (index >= batches.size()) return;
+        auto& batch = batches[index];
+        if (observer) {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto& file: batch) observer(file);
+        }
+        try {
+            adapter->GetAndProcessBatch(batch);
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!error) error = std::current_exception();
+            failed = true;
+        }
+        // Processed files are not needed by the processor anymore
+        std::vector<std::shared_ptr<FileInfo>>().swap(batch);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+BackupProcessor::BackupProcessor(std::shared_ptr<Adapter> adapter, unsigned int jobs): data{new BackupProcessorData()} {
+    data->adapter = adapter;
+    data->jobs = (jobs == 0 ? std::max(1u, std::thread::hardware_concurrency()) : jobs);
+}
+BackupProcessor::~BackupProcessor() {}
+
+unsigned int BackupProcessor::GetJobs() { return data->jobs; }
+
+void BackupProcessor::Process(const std::vector<std::shared_ptr<FileInfo>>& files,
+    const std::function<void(std::shared_ptr<FileInfo>)>& observer) {
+    // 1. Everything created lazily and shared by the threads is prepared before they start
+    Config::GetChunkStorage();
+    auto tree = data->adapter->GetTree();
+    if (tree != nullptr) tree->GetPrevTree();
+
+    // 2. Process batches, this thread is one of the workers
+    data->SplitBatches(files);
+    data->next_batch = 0;
+    data->failed = false;
+    data->error = nullptr;
+    size_t threads = std::min<size_t>(data->jobs, data->batches.size());
+    std::vector<std::thread> workers;
+    try {
+        for (size_t i = 1; i < threads; i++) workers.emplace_back(&BackupProcessorData::Work, data.get(), std::cref(observer));
+    } catch (const std::system_error& ex) {} // Less threads than requested, the started ones do all work
+    data->Work(observer);
+    for (auto& worker: workers) worker.join();
+
+    if (data->error) std::rethrow_exception(data->error);
+}
+
+}
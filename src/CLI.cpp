@@ -1,29 +1,645 @@
 #include <iostream>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <csignal>
+#include <thread>
+#include <atomic>
+#include <unordered_set>
+#include <boost/filesystem.hpp>
 
 #include "CLI.hpp"
 #include "Config.hpp"
 #include "FenixExceptions.hpp"
 #include "adapters/LocalFilesystemAdapter.hpp"
 #include "BackupCleaner.hpp"
+#include "BackupProcessor.hpp"
+#include "Functions.hpp"
+#include "FileChunk.hpp"
+#include "ChunkCache.hpp"
+#include "SimilarityIndex.hpp"
+#include "adapters/BatchReader.hpp"
+#include "adapters/DirectoryScanner.hpp"
+#include "adapters/ChangeJournal.hpp"
+#include "VCDiffMerger.hpp"
+#include "sha256.h"
+#include "blake3.h"
+
+#include <google/vcencoder.h>
+#include <google/vcdecoder.h>
+
+// Checks in fenix_tester.cpp, return number of failed checks
+int merger_tester(int runs);
 
 namespace FenixBackup {
 
 const char * file_type_names[] = { "DIR", "FILE", "SYMLINK" };
 const char * version_file_status_names[] = { "UNKNOWN ", "NEW     ", "UNCHANGED", "UPDATED_PARAMS", "UPDATED_FILE", "NOT_UPDATED", "DELETED" };
 
+void print_cache_stats() {
+    std::cout << "Chunk cache: " << ChunkCache::GetHits() << " hits, " << ChunkCache::GetMisses() << " misses" << std::endl;
+}
+
+void print_similarity_stats() {
+    size_t matched = SimilarityIndex::GetMatchedBytes(), stored = SimilarityIndex::GetStoredBytes();
+    std::cout << "Similarity index: " << SimilarityIndex::GetMatches() << " new files encoded against similar files, "
+        << matched/1024 << " kB stored as " << stored/1024 << " kB (saved " << (matched > stored ? matched - stored : 0)/1024 << " kB)" << std::endl;
+}
+
+/// Time in milliseconds of decoding the chunk with empty cache
+double measure_restore(const std::string& chunk_name) {
+    ChunkCache::Clear();
+    int fd = open("/dev/null", O_WRONLY);
+    auto start = std::chrono::steady_clock::now();
+    FileChunk::GetChunk(chunk_name)->LoadAndWrite(fd);
+    std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+    close(fd);
+    return duration.count();
+}
+
+/// Store versions of the file with forward and reverse deltas and compare backup and restore costs
+int benchmark_chain(const std::string& path, int versions) {
+    // Benchmark chunks are saved into the repository, an interrupted run would leave them among backed up chunks
+    if (!FileTree::GetHistoryTreeList().empty() || !Config::GetChunkCatalog()->GetChunkList().empty()) {
+        std::cerr << "Chain benchmark needs a repository without backups and chunks" << std::endl;
+        return(EXIT_FAILURE);
+    }
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.good()) {
+        std::cerr << "Cannot read file '" << path << "'" << std::endl;
+        return(EXIT_FAILURE);
+    }
+    std::string original((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if (original.empty()) original.assign(1024*1024, 'x');
+
+    std::cout << "Layout	Backup [s]	Stored [kB]	Restore newest [ms]	Restore oldest [ms]" << std::endl;
+    for (bool reverse: {false, true}) {
+        // Same versions for both layouts, each one rewrites a few small parts of the previous one
+        std::minstd_rand random(1);
+        std::string content = original;
+        std::vector<std::string> names;
+        std::chrono::duration<double> backup_time(0);
+
+        for (int i = 0; i < versions; i++) {
+            for (int j = 0; j < 16; j++) {
+                size_t position = random() % content.size();
+                for (size_t k = position; k < std::min(content.size(), position + 64); k++) content[k] = (char)random();
+            }
+            std::string name = std::string("benchmark_") + (reverse ? "reverse_" : "forward_") + std::to_string(i);
+            std::string previous = names.empty() ? "" : names.back();
+            std::istringstream stream(content);
+
+            auto start = std::chrono::steady_clock::now();
+            FileChunk chunk(name);
+            if (reverse) chunk.ProcessStreamAndRebase(previous, stream);
+            else chunk.ProcessStreamAndSave(FileChunk::GetDeltaBase(previous), stream);
+            backup_time += std::chrono::steady_clock::now() - start;
+            names.push_back(name);
+        }
+
+        size_t stored = 0;
+        for (auto& name: names) stored += FileChunk::GetChunk(name)->GetSize();
+        std::cout << (reverse ? "reverse" : "forward") << "\t" << backup_time.count() << "\t\t" << stored/1024
+            << "\t\t" << measure_restore(names.back()) << "\t\t\t" << measure_restore(names.front()) << std::endl;
+
+        // Delete chunks without derived chunks first, so no delta has to be recomputed
+        if (!reverse) std::reverse(names.begin(), names.end());
+        for (auto& name: names) FileChunk::GetChunk(name)->DeleteChunk();
+    }
+    ChunkCache::Clear();
+    return(EXIT_SUCCESS);
+}
+
+/// Peak resident memory (VmHWM) in kB since the last reset, reset starts a new measurement
+size_t peak_resident_memory(bool reset) {
+    if (reset) std::ofstream("/proc/self/clear_refs") << "5";
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) if (line.compare(0, 6, "VmHWM:") == 0) return std::stoul(line.substr(6));
+    return 0;
+}
+
+/// Write a version of synthetic content (each MB from its own seed, the second version changes 64 bytes of each MB)
+void write_restore_version(const std::string& path, size_t megabytes, int version) {
+    std::ofstream os(path, std::ios::binary);
+    std::vector<uint64_t> block(1024*1024 / sizeof(uint64_t));
+    for (size_t i = 0; i < megabytes; i++) {
+        std::mt19937_64 random(i);
+        for (auto& value: block) value = random();
+        if (version > 0) std::fill_n((char*)block.data() + random() % (1024*1024 - 64), 64, 'x');
+        os.write((const char*)block.data(), block.size() * sizeof(uint64_t));
+    }
+}
+
+/// Restore of a delta against a base of 1 MB to <max_megabytes> MB (4x each step), memory should not grow with the base
+int benchmark_restore(size_t max_megabytes) {
+    // Benchmark chunks are saved into the repository, an interrupted run would leave them among backed up chunks
+    if (!FileTree::GetHistoryTreeList().empty() || !Config::GetChunkCatalog()->GetChunkList().empty()) {
+        std::cerr << "Restore benchmark needs a repository without backups and chunks" << std::endl;
+        return(EXIT_FAILURE);
+    }
+    boost::filesystem::create_directories(Config::GetTempDir());
+    std::string path = (boost::filesystem::path(Config::GetTempDir()) / "benchmark_restore").string();
+    const std::string names[2] = {"benchmark_restore_base", "benchmark_restore_delta"};
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    std::cout << "Size [MB]\tBackup [s]\tRestore [s]\tRestore [MB/s]\tPeak memory [kB]" << std::endl;
+    for (size_t megabytes = 1; megabytes <= max_megabytes; megabytes *= 4) {
+        std::chrono::duration<double> backup_time(0);
+        for (int version = 0; version < 2; version++) {
+            write_restore_version(path, megabytes, version);
+            std::ifstream stream(path, std::ios::binary);
+            auto start = std::chrono::steady_clock::now();
+            FileChunk chunk(names[version]);
+            chunk.ProcessStreamAndSave(version > 0 ? names[0] : "", stream);
+            backup_time += std::chrono::steady_clock::now() - start;
+        }
+        boost::filesystem::remove(path);
+
+        ChunkCache::Clear();
+        peak_resident_memory(true);
+        auto start = std::chrono::steady_clock::now();
+        FileChunk::GetChunk(names[1])->LoadAndWrite(null_fd);
+        std::chrono::duration<double> restore = std::chrono::steady_clock::now() - start;
+        std::cout << megabytes << "\t\t" << backup_time.count() << "\t\t" << restore.count() << "\t\t"
+            << megabytes / restore.count() << "\t\t" << peak_resident_memory(false) << std::endl;
+
+        // Delta first, so the base has no derived chunk to re-encode
+        for (auto& name: {names[1], names[0]}) FileChunk::GetChunk(name)->DeleteChunk();
+        ChunkCache::Clear();
+    }
+    close(null_fd);
+    return(EXIT_SUCCESS);
+}
+
+/// Next version of the content, 16 parts of 64 bytes are rewritten (as in benchmark_chain)
+std::string rewrite_parts(std::string content, std::minstd_rand& random) {
+    for (int j = 0; j < 16; j++) {
+        size_t position = random() % content.size();
+        for (size_t k = position; k < std::min(content.size(), position + 64); k++) content[k] = (char)random();
+    }
+    return content;
+}
+
+/// Skipping of a deleted ancestor (SkipAncestor) by merging the deltas and by decoding and encoding the content again
+int benchmark_merge(size_t max_megabytes) {
+    std::cout << "Size [MB]\tMerge [ms]\tMerged [kB]\tRe-encode [ms]\tRe-encoded [kB]" << std::endl;
+    for (size_t megabytes = 1; megabytes <= max_megabytes; megabytes *= 4) {
+        // A -> B -> C, deltas are saved by the streaming encoder as new files are
+        std::minstd_rand random(1);
+        std::string a(megabytes*1024*1024, 0);
+        for (auto& c: a) c = (char)random();
+        std::string b = rewrite_parts(a, random), c = rewrite_parts(b, random);
+        std::string deltas[2];
+        const std::string* versions[3] = {&a, &b, &c};
+        for (int i = 0; i < 2; i++) {
+            open_vcdiff::HashedDictionary dictionary(versions[i]->data(), versions[i]->size());
+            dictionary.Init();
+            open_vcdiff::VCDiffStreamingEncoder encoder(&dictionary, open_vcdiff::VCD_STANDARD_FORMAT, true);
+            encoder.StartEncoding(&deltas[i]);
+            for (size_t position = 0; position < versions[i + 1]->size(); position += Config::GetConfig().streamWindowSize)
+                encoder.EncodeChunk(versions[i + 1]->data() + position, std::min<size_t>(Config::GetConfig().streamWindowSize, versions[i + 1]->size() - position), &deltas[i]);
+            encoder.FinishEncoding(&deltas[i]);
+        }
+
+        // 1. Merge (no decoding), each path is timed 3 times and the fastest run is reported
+        std::string merged;
+        bool ok = true;
+        std::chrono::duration<double, std::milli> merge_time = std::chrono::duration<double, std::milli>::max();
+        for (int run = 0; run < 3; run++) {
+            auto start = std::chrono::steady_clock::now();
+            ok = VCDiffMerger::Merge(deltas[0], deltas[1], merged) && ok;
+            merge_time = std::min<std::chrono::duration<double, std::milli>>(merge_time, std::chrono::steady_clock::now() - start);
+        }
+
+        // 2. Fallback of SkipAncestor, decode C (through B) and encode it against A
+        std::string decoded_b, decoded_c, encoded;
+        open_vcdiff::VCDiffDecoder decoder;
+        std::chrono::duration<double, std::milli> encode_time = std::chrono::duration<double, std::milli>::max();
+        for (int run = 0; run < 3; run++) {
+            decoded_b.clear();
+            decoded_c.clear();
+            encoded.clear();
+            auto start = std::chrono::steady_clock::now();
+            decoder.Decode(a.data(), a.size(), deltas[0], &decoded_b);
+            decoder.Decode(decoded_b.data(), decoded_b.size(), deltas[1], &decoded_c);
+            open_vcdiff::VCDiffEncoder encoder(a.data(), a.size());
+            encoder.Encode(decoded_c.data(), decoded_c.size(), &encoded);
+            encode_time = std::min<std::chrono::duration<double, std::milli>>(encode_time, std::chrono::steady_clock::now() - start);
+        }
+
+        std::string check;
+        if (!ok || decoded_c != c || !decoder.Decode(a.data(), a.size(), merged, &check) || check != c) {
+            std::cerr << "Merged delta of " << megabytes << " MB does not decode to the content" << std::endl;
+            return(EXIT_FAILURE);
+        }
+        std::cout << megabytes << "\t\t" << merge_time.count() << "\t\t" << merged.size()/1024 << "\t\t"
+            << encode_time.count() << "\t\t" << encoded.size()/1024 << std::endl;
+    }
+    return(EXIT_SUCCESS);
+}
+
+/// Throughput of SHA-256 (scalar and CPU-specific code) and BLAKE3 (one and hashThreads threads), one big buffer and many small blocks
+int benchmark_hash(size_t megabytes) {
+    std::string buffer(megabytes*1024*1024, 0);
+    std::minstd_rand random(1);
+    for (auto& c: buffer) c = (char)random();
+    std::vector<std::string> blocks;
+    for (size_t position = 0; position < buffer.size(); position += 16*1024) blocks.push_back(buffer.substr(position, 16*1024));
+
+    std::cout << "Implementation\tBuffer [GB/s]\tBlocks 16 kB [GB/s]" << std::endl;
+    for (bool scalar: {true, false}) {
+        SHA256::forceScalar(scalar);
+        SHA256 sha256;
+        auto start = std::chrono::steady_clock::now();
+        std::string hash = sha256(buffer);
+        std::chrono::duration<double> buffer_time = std::chrono::steady_clock::now() - start;
+        start = std::chrono::steady_clock::now();
+        auto hashes = SHA256::hashMany(blocks);
+        std::chrono::duration<double> blocks_time = std::chrono::steady_clock::now() - start;
+        std::cout << SHA256::implementation() << "\t\t" << buffer.size() / buffer_time.count() / 1e9
+            << "\t\t" << buffer.size() / blocks_time.count() / 1e9 << std::endl;
+    }
+    SHA256::forceScalar(false);
+
+    unsigned int threads = Config::GetConfig().hashThreads;
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int count: {1u, threads}) {
+        BLAKE3 blake3(count);
+        auto start = std::chrono::steady_clock::now();
+        std::string hash = blake3(buffer);
+        std::chrono::duration<double> buffer_time = std::chrono::steady_clock::now() - start;
+        start = std::chrono::steady_clock::now();
+        for (auto& block: blocks) blake3(block);
+        std::chrono::duration<double> blocks_time = std::chrono::steady_clock::now() - start;
+        std::cout << "blake3 x" << count << "\t" << buffer.size() / buffer_time.count() / 1e9
+            << "\t\t" << buffer.size() / blocks_time.count() / 1e9 << std::endl;
+        if (count == threads) break;
+    }
+    return(EXIT_SUCCESS);
+}
+
+/// Bytes this process has read from the storage (not from the page cache)
+static size_t get_storage_read_bytes() {
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    size_t value;
+    while (io >> key >> value) if (key == "read_bytes:") return value;
+    return 0;
+}
+
+/// Throughput in MB/s of reading the rest of the stream
+static double measure_pass(std::istream& is, std::vector<char>& buffer) {
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (is.read(buffer.data(), buffer.size()) || is.gcount() > 0) total += is.gcount();
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    return total / duration.count() / (1024*1024);
+}
+
+/// Throughput and page cache footprint of reading the file in each read mode (from cold page cache),
+/// the file is read twice like a hashed and then encoded file
+int benchmark_read(const std::string& path) {
+    auto& config = Config::GetConfig();
+    std::vector<char> buffer(256*1024);
+    std::cout << "Mode\tPass 1 [MB/s]\tPass 2 [MB/s]\tDisk read [MB]\tCached open [kB]\tCached after [kB]" << std::endl;
+    for (auto mode: {READ_STREAM, READ_MMAP, READ_PREAD, READ_DIRECT}) {
+        SourceReader::DropCache(path);
+        size_t read_bytes = get_storage_read_bytes();
+        std::unique_ptr<SourceReader> reader;
+        std::ifstream file;
+        if (mode == READ_STREAM) file.open(path, std::ios::binary);
+        else reader.reset(new SourceReader(path, mode, config.adapterReadBuffer, config.adapterDropCache));
+        std::istream is(mode == READ_STREAM ? (std::streambuf*)file.rdbuf() : reader.get());
+
+        double first = measure_pass(is, buffer);
+        is.clear();
+        is.seekg(0);
+        double second = measure_pass(is, buffer);
+        size_t cached_open = SourceReader::GetCachedBytes(path);
+        reader.reset();
+        file.close();
+        std::cout << SourceReader::GetModeName(mode) << "\t" << first << "\t\t" << second
+            << "\t\t" << (get_storage_read_bytes() - read_bytes) / (1024*1024)
+            << "\t\t" << cached_open / 1024 << "\t\t\t" << SourceReader::GetCachedBytes(path) / 1024 << std::endl;
+    }
+    return(EXIT_SUCCESS);
+}
+
+/// Reading of a synthetic tree of small files (0-16 kB) one by one and in batches, from cold page cache
+int benchmark_small(size_t count) {
+    auto& config = Config::GetConfig();
+    boost::filesystem::path dir = boost::filesystem::path(Config::GetTempDir()) / "benchmark_small";
+    std::vector<BatchReader::item> items(count);
+    std::minstd_rand random(1);
+    std::string content;
+    for (size_t i = 0; i < count; i++) {
+        // 100 files per directory
+        boost::filesystem::path subdir = dir / std::to_string(i / 100);
+        if (i % 100 == 0) boost::filesystem::create_directories(subdir);
+        items[i].filename = (subdir / std::to_string(i)).string();
+        items[i].size = random() % (16*1024);
+        content.resize(items[i].size);
+        for (auto& c: content) c = (char)random();
+        std::ofstream(items[i].filename, std::ios::binary) << content;
+    }
+    sync();
+
+    std::cout << "Method\t\tFiles/s\t\tMB/s" << std::endl;
+    for (int method = 0; method < 3; method++) {
+        for (auto& item: items) SourceReader::DropCache(item.filename);
+        auto batch = items;
+        size_t total = 0;
+        auto start = std::chrono::steady_clock::now();
+        if (method == 0) {
+            // Same as GetAndProcess with the stream read mode
+            std::vector<char> buffer(16*1024);
+            for (auto& item: batch) {
+                std::ifstream is(item.filename, std::ios::binary);
+                while (is.read(buffer.data(), buffer.size()) || is.gcount() > 0) total += is.gcount();
+            }
+        } else {
+            BatchReader reader(config.adapterBatchSize, method == 2);
+            if (method == 2 && !reader.UsesIoUring()) {
+                std::cout << "io_uring\tnot available" << std::endl;
+                continue;
+            }
+            for (size_t begin = 0; begin < batch.size(); begin += config.adapterBatchSize) {
+                std::vector<BatchReader::item> part(batch.begin() + begin, batch.begin() + std::min(batch.size(), begin + config.adapterBatchSize));
+                reader.Read(part);
+                for (auto& item: part) total += item.content.size();
+            }
+        }
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        std::cout << (method == 0 ? "ifstream" : method == 1 ? "batch plain" : "io_uring") << "\t"
+            << count / duration.count() << "\t\t" << total / duration.count() / (1024*1024) << std::endl;
+    }
+    boost::filesystem::remove_all(dir);
+    return(EXIT_SUCCESS);
+}
+
+/// Processing of a synthetic tree of new files (0-256 kB, random content) by 1 to 32 threads
+int benchmark_jobs(size_t count) {
+    // Benchmark chunks are saved into the repository and deleted after each round, an interrupted run would leave them among backed up chunks
+    if (!FileTree::GetHistoryTreeList().empty() || !Config::GetChunkCatalog()->GetChunkList().empty()) {
+        std::cerr << "Jobs benchmark needs a repository without backups and chunks" << std::endl;
+        return(EXIT_FAILURE);
+    }
+    boost::filesystem::path dir = boost::filesystem::path(Config::GetTempDir()) / "benchmark_jobs";
+    std::vector<std::pair<std::string, size_t>> names;
+    std::minstd_rand random(1);
+    std::string content;
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        // 100 files per directory
+        std::string name = std::to_string(i / 100) + "/" + std::to_string(i);
+        if (i % 100 == 0) boost::filesystem::create_directories(dir / std::to_string(i / 100));
+        content.resize(random() % (256*1024));
+        for (auto& c: content) c = (char)random();
+        std::ofstream((dir / name).string(), std::ios::binary) << content;
+        names.push_back(std::make_pair(name, content.size()));
+        total += content.size();
+    }
+
+    auto adapter = std::make_shared<LocalFilesystemAdapter>();
+    adapter->SetPath(dir.string() + "/");
+    std::cout << "Jobs	Files/s		MB/s		Speedup		Restore MB/s	Speedup" << std::endl;
+    double single = 0, single_restore = 0;
+    int null_fd = open("/dev/null", O_WRONLY);
+    for (unsigned int jobs: {1, 2, 4, 8, 16, 32}) {
+        // New nodes each round (in a tree which is not saved), chunks of the previous round are deleted
+        auto tree = std::make_shared<FileTree>();
+        std::vector<std::shared_ptr<FileInfo>> dirs, files;
+        file_params dir_params = {};
+        dir_params.permissions = S_IFDIR | 0755;
+        for (auto& name: names) {
+            size_t slash = name.first.find('/');
+            if (dirs.size() <= std::stoul(name.first.substr(0, slash)))
+                dirs.push_back(tree->AddDirectory(tree->GetRoot(), name.first.substr(0, slash), dir_params));
+            file_params params = {};
+            params.permissions = S_IFREG | 0644;
+            params.file_size = name.second;
+            files.push_back(tree->AddFile(dirs.back(), name.first.substr(slash + 1), params));
+        }
+
+        BackupProcessor processor(adapter, jobs);
+        auto start = std::chrono::steady_clock::now();
+        processor.Process(files);
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        if (jobs == 1) single = duration.count();
+
+        // Restore of the saved files by the same number of threads, chunks are decoded without the chunk lock
+        ChunkCache::Clear();
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> threads;
+        start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < jobs; i++) threads.emplace_back([&files, &next, null_fd]() {
+            for (size_t j; (j = next++) < files.size();) files[j]->GetFileContent(null_fd);
+        });
+        for (auto& thread: threads) thread.join();
+        std::chrono::duration<double> restore = std::chrono::steady_clock::now() - start;
+        if (jobs == 1) single_restore = restore.count();
+        std::cout << jobs << "\t" << count / duration.count() << "\t\t" << total / duration.count() / (1024*1024)
+            << "\t\t" << single / duration.count() << "\t\t" << total / restore.count() / (1024*1024)
+            << "\t\t" << single_restore / restore.count() << std::endl;
+
+        std::unordered_set<std::string> hashes;
+        for (auto& file: files) hashes.insert(file->GetHash());
+        for (auto& hash: hashes) {
+            auto chunk = FileChunk::GetChunk(hash);
+            if (chunk != nullptr) chunk->DeleteChunk();
+        }
+        ChunkCache::Clear();
+    }
+    close(null_fd);
+    boost::filesystem::remove_all(dir);
+    return(EXIT_SUCCESS);
+}
+
+/// Count entries of the scanned subtree (and wait for it the same way as the adapter)
+size_t count_scanned(DirectoryScanner::directory& scanned, DirectoryScanner& scanner) {
+    scanner.Wait(scanned);
+    size_t count = scanned.entries.size();
+    for (auto& item: scanned.entries) if (item.subdir != nullptr) count += count_scanned(*item.subdir, scanner);
+    return count;
+}
+
+/// Scan of the directory tree by one and by configured number of threads, from cold and warm dentry/inode caches
+int benchmark_scan(const std::string& path) {
+    std::vector<unsigned int> thread_counts = {1};
+    if (Config::GetConfig().adapterScanThreads != 1) thread_counts.push_back(Config::GetConfig().adapterScanThreads);
+    std::cout << "Cache	Threads	Entries		Entries/s	Memory MB" << std::endl;
+    for (bool cold: {true, false}) {
+        for (auto threads: thread_counts) {
+            if (cold) {
+                // Drop dentries and inodes (needs root)
+                sync();
+                std::ofstream drop("/proc/sys/vm/drop_caches");
+                if (!(drop << "2" << std::flush)) {
+                    std::cout << "cold	" << threads << "	cannot drop caches" << std::endl;
+                    continue;
+                }
+            }
+            auto start = std::chrono::steady_clock::now();
+            DirectoryScanner scanner(threads, [](const std::string&, const file_params&) { return true; });
+            size_t count = count_scanned(scanner.Scan(path), scanner);
+            std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+            // Scanned tree is still held, so big trees show its size
+            std::cout << (cold ? "cold" : "warm") << "\t" << threads << "\t" << count << "\t\t" << count / duration.count()
+                << "\t" << Functions::GetMemoryUsage() / (1024*1024) << std::endl;
+        }
+    }
+    return(EXIT_SUCCESS);
+}
+
+/// Build a tree of <count> files (100 in each directory), then save, load and search it (paths, subtrees and patterns),
+/// report time and memory of its nodes.
+/// Then save two more backups of the files as deltas
+int benchmark_tree(size_t count) {
+    if (!FileTree::GetHistoryTreeList().empty()) {
+        std::cerr << "Tree benchmark needs a repository without backups" << std::endl;
+        return(EXIT_FAILURE);
+    }
+    file_params dir_params = {}, params = {};
+    dir_params.permissions = S_IFDIR | 0755;
+    params.permissions = S_IFREG | 0644;
+    params.file_size = 4096;
+
+    // 1. Build, every file has its own hash
+    size_t memory = Functions::GetMemoryUsage();
+    auto start = std::chrono::steady_clock::now();
+    auto tree = std::make_shared<FileTree>();
+    std::shared_ptr<FileInfo> dir;
+    std::string hash(64, '0');
+    for (size_t i = 0; i < count; i++) {
+        if (i % 100 == 0) dir = tree->AddDirectory(tree->GetRoot(), "directory_" + std::to_string(i / 100), dir_params);
+        auto file = tree->AddFile(dir, "file_" + std::to_string(i) + ".txt", params);
+        std::string number = std::to_string(i);
+        file->SetHash(hash.replace(hash.size() - number.size(), number.size(), number));
+        file->SetStatus(NEW);
+    }
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    size_t nodes = count + count / 100 + 1;
+    std::cout << "Build	" << nodes << " nodes in " << duration.count() << " s, "
+        << (Functions::GetMemoryUsage() - memory) / nodes << " bytes per node" << std::endl;
+
+    // 2. Save and load
+    start = std::chrono::steady_clock::now();
+    tree->SaveTree();
+    duration = std::chrono::steady_clock::now() - start;
+    std::string name = tree->GetTreeName();
+    std::cout << "Save	" << duration.count() << " s, " << boost::filesystem::file_size(Config::GetTreeFilename(name)) / nodes << " bytes per node" << std::endl;
+    tree.reset();
+    dir.reset();
+
+    memory = Functions::GetMemoryUsage();
+    start = std::chrono::steady_clock::now();
+    tree = std::make_shared<FileTree>(name);
+    duration = std::chrono::steady_clock::now() - start;
+    std::cout << "Load	" << duration.count() << " s, " << (Functions::GetMemoryUsage() - memory) / nodes << " bytes per node" << std::endl;
+
+    // 3. Lookups page in only the touched nodes of the loaded tree
+    start = std::chrono::steady_clock::now();
+    std::minstd_rand random(1);
+    size_t found = 0;
+    for (int i = 0; i < 1000; i++) {
+        size_t file = random() % count;
+        found += (tree->GetFileByPath("./directory_" + std::to_string(file / 100) + "/file_" + std::to_string(file) + ".txt") != nullptr);
+    }
+    duration = std::chrono::steady_clock::now() - start;
+    std::cout << "Find	" << found << " paths in " << duration.count() << " s" << std::endl;
+
+    // Subtrees and patterns are ranges of the saved path index
+    start = std::chrono::steady_clock::now();
+    found = 0;
+    for (int i = 0; i < 1000; i++) found += tree->GetSubtreeFiles("./directory_" + std::to_string(random() % (count / 100 + 1))).size();
+    duration = std::chrono::steady_clock::now() - start;
+    std::cout << "Subtree	1000 directories with " << found << " files in " << duration.count() << " s" << std::endl;
+    start = std::chrono::steady_clock::now();
+    found = tree->GetFilesByPattern("./directory_1*/file_*7.txt").size();
+    duration = std::chrono::steady_clock::now() - start;
+    std::cout << "Pattern	" << found << " files in " << duration.count() << " s" << std::endl;
+
+    // 4. Two more backups of the same files, every 100th file is changed in the last one (they are saved as deltas,
+    // unless the treeKeyframeInterval is 1)
+    std::vector<std::string> names{name};
+    size_t changed = 0;
+    for (int backup = 1; backup <= 2; backup++) {
+        auto next = std::make_shared<FileTree>();
+        for (size_t i = 0; i < count; i++) {
+            if (i % 100 == 0) dir = next->AddDirectory(next->GetRoot(), "directory_" + std::to_string(i / 100), dir_params);
+            file_params current = params;
+            if (backup == 2 && i % 100 == 0) current.modification_time.tv_sec = backup;
+            auto file = next->AddFile(dir, "file_" + std::to_string(i) + ".txt", current);
+            if (file->GetStatus() == UNCHANGED) continue;
+            std::string number = std::to_string(i);
+            file->SetHash(std::string(64 - number.size(), '0' + backup) + number);
+            file->SetStatus(UPDATED_FILE);
+            if (backup == 2) changed++;
+        }
+        dir.reset();
+        start = std::chrono::steady_clock::now();
+        next->SaveTree();
+        duration = std::chrono::steady_clock::now() - start;
+        names.push_back(next->GetTreeName());
+    }
+    size_t size = boost::filesystem::file_size(Config::GetTreeFilename(names.back()));
+    start = std::chrono::steady_clock::now();
+    tree = std::make_shared<FileTree>(names.back());
+    std::chrono::duration<double> load_duration = std::chrono::steady_clock::now() - start;
+    std::cout << "Delta	" << changed << " changed files, save " << duration.count() << " s, " << size << " bytes ("
+        << (double)size / nodes << " bytes per node), load " << load_duration.count() << " s" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    found = 0;
+    for (int i = 0; i < 1000; i++) {
+        size_t file = random() % count;
+        found += (tree->GetFileByPath("./directory_" + std::to_string(file / 100) + "/file_" + std::to_string(file) + ".txt") != nullptr);
+    }
+    duration = std::chrono::steady_clock::now() - start;
+    std::cout << "Find	" << found << " paths in " << duration.count() << " s (through the deltas)" << std::endl;
+    for (auto& name: names) {
+        boost::filesystem::remove(Config::GetTreeFilename(name));
+        Config::GetTreeCatalog()->Remove(name);
+    }
+    return(EXIT_SUCCESS);
+}
+
+/// Set by SIGINT and SIGTERM, the watcher ends
+static volatile sig_atomic_t watch_stopped = 0;
+static void stop_watch(int) { watch_stopped = 1; }
+
 int usage(char* argv[]) {
     std::cout << "Usage: " << argv[0] << " <config_file>" << std::endl << "And one of these commands:" << std::endl;
     std::cout << "  show backups\t\t\t(displays list of all backups)" << std::endl;
     std::cout << "  show files [<backup>]\t\t(displays list of all files in given backup)" << std::endl;
+    std::cout << "  show files <backup> <path>\t(displays files under the path or matching the pattern, e.g. './var/**/*.log')" << std::endl;
     std::cout << "  show history <backup> <path>\t(displays known history of given file)" << std::endl;
-    std::cout << "  backup\t\t\t(run backup)" << std::endl;
+    std::cout << "  backup [--jobs <x>]\t\t(run backup by <x> threads, default from the config file)" << std::endl;
     std::cout << "  restore full <backup>\t\t(run full restore to original path)" << std::endl;
     std::cout << "  restore full <backup> <path>\t(run full restore to given path)" << std::endl;
     std::cout << "  restore subtree <backup> <subtree_path>" << std::endl << "\t\t\t\t(restore subtree to original path)" << std::endl;
     std::cout << "  restore subtree <backup> <subtree_path> <path>" << std::endl << "\t\t\t\t(restore subtree to given path)" << std::endl;
     std::cout << "  restore file <backup> <file_path>" << std::endl << "\t\t\t\t(restore one file to original path)" << std::endl;
     std::cout << "  restore file <backup> <file_path> <path>" << std::endl << "\t\t\t\t(restore one file to given path)" << std::endl;
+    std::cout << "  restore matching <backup> <pattern> [<path>]" << std::endl << "\t\t\t\t(restore files matching the pattern to original or given path)" << std::endl;
+    std::cout << "  watch\t\t\t\t(record changed directories for the next backups, until interrupted)" << std::endl;
     std::cout << "  cleanup [<x>]\t\t\t(run <x> rounds of cleanup, default 1)" << std::endl;
+    std::cout << "  migrate <files|packs>\t\t(move all chunks into given chunk storage)" << std::endl;
+    std::cout << "  benchmark chain <file> [<x>]\t(compare forward and reverse deltas on <x> versions, default 20)" << std::endl;
+    std::cout << "  benchmark hash [<x>]\t\t(SHA-256 and BLAKE3 throughput on <x> MB of data, default 256)" << std::endl;
+    std::cout << "  benchmark merge [<x>]\t\t(skipping an ancestor by merging deltas and by encoding again, 1 MB to <x> MB, default 64)" << std::endl;
+    std::cout << "  benchmark restore [<x>]\t(restoring a delta against a base of 1 MB to <x> MB, default 1024)" << std::endl;
+    std::cout << "  benchmark read <file>\t\t(throughput and page cache footprint of read modes, two passes over the file)" << std::endl;
+    std::cout << "  benchmark small [<x>]\t\t(reading <x> small files one by one and in batches, default 20000)" << std::endl;
+    std::cout << "  benchmark jobs [<x>]\t\t(processing and restoring <x> new files by 1 to 32 threads, default 1000)" << std::endl;
+    std::cout << "  benchmark scan <path>\t\t(scanning the directory tree by 1 and adapter.scanThreads threads)" << std::endl;
+    std::cout << "  benchmark tree [<x>]\t\t(building, saving, loading and searching a tree of <x> files and its deltas, default 1000000)" << std::endl;
+    std::cout << "  test merger [<x>]\t\t(check merged VCDIFF deltas on <x> random deltas, default 1000)" << std::endl;
     return(EXIT_FAILURE);
 }
 
@@ -47,9 +663,23 @@ int CLI::Run(int argc, char* argv[]) {
                     std::cerr << "No backup name " << backup_name << std::endl;
                     return(EXIT_FAILURE);
                 }
-                for (auto& file: backup->GetAllFiles())
+                for (unsigned int id = 1; id <= backup->GetLastId(); id++) {
+                    auto file = backup->GetFileById(id);
                     if (file != nullptr)
                         std::cout << version_file_status_names[file->GetStatus()] << "\t" << file->GetPath() << std::endl;
+                }
+            } else if (subcommand == "files" && argc == 6) {
+                std::string backup_name = argv[4];
+                std::string path = argv[5];
+                auto backup = FileTree::GetHistoryTree(backup_name);
+                if (backup == nullptr) {
+                    std::cerr << "No backup name " << backup_name << std::endl;
+                    return(EXIT_FAILURE);
+                }
+                // Path without wildcards lists its whole subtree
+                auto files = (path.find_first_of("*?[") == std::string::npos ? backup->GetSubtreeFiles(path) : backup->GetFilesByPattern(path));
+                for (auto& file: files)
+                    std::cout << version_file_status_names[file->GetStatus()] << "\t" << file->GetPath() << std::endl;
             } else if (subcommand == "history" && argc == 6) {
                 std::string backup_name = argv[4];
                 std::string backup_path = argv[5];
@@ -77,18 +707,43 @@ int CLI::Run(int argc, char* argv[]) {
                 }
             } else return usage(argv);
         //////////////////////////////////////////////
-        } else if (command == "backup" && argc == 3) {
+        } else if (command == "watch" && argc == 3) {
+            if (Config::GetConfig().adapterType != "local_filesystem") {
+                std::cerr << "Watching is supported only by the local_filesystem adapter" << std::endl;
+                return(EXIT_FAILURE);
+            }
+            signal(SIGINT, stop_watch);
+            signal(SIGTERM, stop_watch);
+            ChangeJournal journal;
+            std::cout << "Watching '" << Config::GetConfig().adapterPath << "'" << std::endl;
+            journal.Watch(Config::GetConfig().adapterPath, []() { return watch_stopped != 0; });
+        } else if (command == "backup" && (argc == 3 || (argc == 5 && subcommand == "--jobs"))) {
+            int jobs = (argc == 5 ? atoi(argv[4]) : Config::GetConfig().jobs);
+            if (jobs < 0) return usage(argv);
             auto adapter = FenixBackup::Config::GetAdapter();
             auto tree = adapter->Scan();
             // Get files list
             auto files = tree->FinishTree();
-            // 3. Foreach file in the file list, get file content and process it
-            for (auto& file: files) {
+            // 3. Foreach file in the file list, get file content and process it (by more threads, in order of the list)
+            BackupProcessor processor(adapter, jobs);
+            size_t total = 0;
+            for (auto& file: files) total += file->GetParams().file_size;
+            auto start = std::chrono::steady_clock::now();
+            processor.Process(files, [](std::shared_ptr<FileInfo> file) {
                 std::cout << "Processing file " << file->GetPath() << std::endl;
-                adapter->GetAndProcess(file);
-            }
+            });
+            std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+            double megabytes = total / (1024.0*1024.0);
+            std::cout << "Processed " << files.size() << " files (" << megabytes << " MB) in " << duration.count() << " s ("
+                << (duration.count() > 0 ? megabytes / duration.count() : 0) << " MB/s) by " << processor.GetJobs() << " threads" << std::endl;
             std::cout << "Saving new backup '" << tree->GetTreeName() << "'" << std::endl;
+            // Chunks must be in the catalog before the tree refers to them
+            Config::GetChunkCatalog()->Flush();
+            SimilarityIndex::Flush();
             tree->SaveTree();
+            std::cout << "Peak memory usage: " << Functions::GetPeakMemoryUsage()/1024 << " kB" << std::endl;
+            print_cache_stats();
+            print_similarity_stats();
         ///////////////////////////////////////////////
         } else if (command == "restore" && argc >= 5) {
             auto adapter = FenixBackup::Config::GetAdapter();
@@ -99,6 +754,7 @@ int CLI::Run(int argc, char* argv[]) {
                 return(EXIT_FAILURE);
             }
             adapter->SetTree(tree);
+            auto start = std::chrono::steady_clock::now();
             if (subcommand == "full" && argc <= 6) {
                 if (argc == 6) {
                     std::string path = argv[5];
@@ -126,7 +782,22 @@ int CLI::Run(int argc, char* argv[]) {
                     std::string path = argv[6];
                     adapter->RestoreFileToLocalPath(file, path, ALL, NEWEST_KNOWN_VERSION, false);
                 } else adapter->RestoreFile(file);
+            } else if (subcommand == "matching" && argc >= 6 && argc <= 7) {
+                std::string pattern = argv[5];
+                auto files = tree->GetFilesByPattern(pattern);
+                if (files.empty()) {
+                    std::cerr << "No file matching '" << pattern << "'" << std::endl;
+                    return(EXIT_FAILURE);
+                }
+                if (argc == 7) adapter->RestoreFilesToLocalPath(files, argv[6]);
+                else adapter->RestoreFiles(files);
             } else return usage(argv);
+            std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+            double megabytes = FileChunk::GetRestoredBytes() / (1024.0*1024.0);
+            std::cout << "Restored " << megabytes << " MB in " << duration.count() << " s ("
+                << (duration.count() > 0 ? megabytes / duration.count() : 0) << " MB/s), peak memory usage: "
+                << Functions::GetPeakMemoryUsage()/1024 << " kB" << std::endl;
+            print_cache_stats();
         ///////////////////////////////////////////////
         } else if (command == "cleanup" && argc <= 4) {
             int runs = (argc == 4 ? atoi(argv[3]) : 1);
@@ -135,8 +806,71 @@ int CLI::Run(int argc, char* argv[]) {
             cleaner.LoadData();
             std::cout << "Cleaning (" << runs << " runs)..." << std::endl;
             int cleaned = 0;
+            auto start = std::chrono::steady_clock::now();
             for (int i = 0; i < runs; i++) cleaned += cleaner.Clean();
-            std::cout << "Cleaned " << -cleaned << " bytes of data" << std::endl;
+            // Removed chunks must be out of the catalog before their space is reclaimed
+            Config::GetChunkCatalog()->Flush();
+            Config::GetChunkStorage()->Compact();
+            Config::GetChunkCatalog()->Compact();
+            SimilarityIndex::Compact();
+            std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+            std::cout << "Cleaned " << -cleaned << " bytes of data in " << duration.count() << " s" << std::endl;
+            print_cache_stats();
+        ///////////////////////////////////////////////
+        } else if (command == "migrate" && argc == 4 && (subcommand == "files" || subcommand == "packs")) {
+            auto target = Config::CreateChunkStorage(subcommand);
+            auto source = Config::CreateChunkStorage(subcommand == "files" ? "packs" : "files");
+            std::cout << "Migrating chunks into '" << subcommand << "' storage..." << std::endl;
+            auto catalog = Config::GetChunkCatalog();
+            // Source may still have meta info of an older version
+            catalog->ImportLegacy(*source);
+            // Chunks in containers have no data of their own
+            std::vector<std::string> chunks;
+            for (auto& name: catalog->GetChunkList()) {
+                chunk_info info;
+                info.chunk_name = name;
+                if (catalog->Load(info) && info.type != CONTAINED) chunks.push_back(name);
+            }
+            target->Import(*source, chunks);
+            target->Compact();
+            std::cout << "Done, set 'chunkStorage = \"" << subcommand << "\"' in the config file" << std::endl;
+        ///////////////////////////////////////////////
+        } else if (command == "benchmark" && subcommand == "chain" && (argc == 5 || argc == 6)) {
+            int versions = (argc == 6 ? atoi(argv[5]) : 20);
+            if (versions < 1) return usage(argv);
+            return benchmark_chain(argv[4], versions);
+        } else if (command == "benchmark" && subcommand == "hash" && argc <= 5) {
+            int megabytes = (argc == 5 ? atoi(argv[4]) : 256);
+            if (megabytes < 1) return usage(argv);
+            return benchmark_hash(megabytes);
+        } else if (command == "benchmark" && subcommand == "small" && argc <= 5) {
+            int count = (argc == 5 ? atoi(argv[4]) : 20000);
+            if (count < 1) return usage(argv);
+            return benchmark_small(count);
+        } else if (command == "benchmark" && subcommand == "jobs" && argc <= 5) {
+            int count = (argc == 5 ? atoi(argv[4]) : 1000);
+            if (count < 1) return usage(argv);
+            return benchmark_jobs(count);
+        } else if (command == "benchmark" && subcommand == "merge" && argc <= 5) {
+            int megabytes = (argc == 5 ? atoi(argv[4]) : 64);
+            if (megabytes < 1) return usage(argv);
+            return benchmark_merge(megabytes);
+        } else if (command == "benchmark" && subcommand == "restore" && argc <= 5) {
+            int megabytes = (argc == 5 ? atoi(argv[4]) : 1024);
+            if (megabytes < 1) return usage(argv);
+            return benchmark_restore(megabytes);
+        } else if (command == "benchmark" && subcommand == "read" && argc == 5) {
+            return benchmark_read(argv[4]);
+        } else if (command == "benchmark" && subcommand == "scan" && argc == 5) {
+            return benchmark_scan(argv[4]);
+        } else if (command == "benchmark" && subcommand == "tree" && argc <= 5) {
+            int count = (argc == 5 ? atoi(argv[4]) : 1000000);
+            if (count < 1) return usage(argv);
+            return benchmark_tree(count);
+        } else if (command == "test" && subcommand == "merger" && argc <= 5) {
+            int runs = (argc == 5 ? atoi(argv[4]) : 1000);
+            if (runs < 0) return usage(argv);
+            return merger_tester(runs) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
         } else return usage(argv);
 	} catch(FenixBackup::FenixException &ex) {
 		std::cerr << ex.what();
@@ -0,0 +1,71 @@
+#include "ChunkCache.hpp"
+#include "Config.hpp"
+
+namespace FenixBackup {
+
+ChunkCache::item_list ChunkCache::items;
+std::unordered_map<std::string, ChunkCache::item_list::iterator> ChunkCache::index;
+size_t ChunkCache::used_size = 0;
+size_t ChunkCache::hits = 0;
+size_t ChunkCache::misses = 0;
+
+bool ChunkCache::Get(const std::string& name, std::string& content) {
+    auto it = index.find(name);
+    if (it == index.end()) {
+        misses++;
+        return false;
+    }
+    hits++;
+    // Move to the front of the LRU list
+    items.splice(items.begin(), items, it->second);
+    content = it->second->second;
+    return true;
+}
+
+bool ChunkCache::GetPart(const std::string& name, size_t offset, size_t length, std::string& content) {
+    auto it = index.find(name);
+    if (it == index.end() || offset + length > it->second->second.size()) {
+        misses++;
+        return false;
+    }
+    hits++;
+    items.splice(items.begin(), items, it->second);
+    content = it->second->second.substr(offset, length);
+    return true;
+}
+
+void ChunkCache::Put(const std::string& name, const std::string& content) {
+    size_t limit = Config::GetConfig().chunkCacheSize;
+    Remove(name);
+    if (content.size() > limit) return; // Would evict everything and still wouldn't fit
+
+    Shrink(limit - content.size());
+    items.emplace_front(name, content);
+    index.insert(std::make_pair(name, items.begin()));
+    used_size += content.size();
+}
+
+void ChunkCache::Remove(const std::string& name) {
+    auto it = index.find(name);
+    if (it == index.end()) return;
+    used_size -= it->second->second.size();
+    items.erase(it->second);
+    index.erase(it);
+}
+
+void ChunkCache::Clear() { Shrink(0); }
+
+void ChunkCache::Shrink(size_t limit) {
+    // Evict least recently used items until the cache fits into the limit
+    while (used_size > limit && !items.empty()) {
+        used_size -= items.back().second.size();
+        index.erase(items.back().first);
+        items.pop_back();
+    }
+}
+
+size_t ChunkCache::GetHits() { return hits; }
+size_t ChunkCache::GetMisses() { return misses; }
+size_t ChunkCache::GetUsedSize() { return used_size; }
+
+}
@@ -2,14 +2,23 @@
 #include <sstream>
 #include <regex>
 #include <iostream>
+#include <fstream>
+#include <boost/filesystem.hpp>
 
 #include "Config.hpp"
 #include "FenixExceptions.hpp"
 
 #include "adapters/LocalFilesystemAdapter.hpp"
+#include "storage/FileChunkStorage.hpp"
+#include "storage/PackChunkStorage.hpp"
+#include "storage/ChunkCompression.hpp"
+#include "ContentHash.hpp"
 
 namespace FenixBackup {
 
+/// Version of the defaults of new repositories: 1 = no compression, similarity index and containers, 2 = all of them on
+static const unsigned int REPOSITORY_DEFAULTS = 2;
+
 bool Config::loaded = false;
 struct ConfigData Config::data;
 std::shared_ptr<Config::Dir> Config::root_rules = nullptr;
@@ -21,6 +30,8 @@ class Config::Dir {
         bool backup; bool backup_set = false;
         int priority; bool priority_set = false;
         int history; bool history_set = false;
+        bool cdc; bool cdc_set = false;
+        chunk_codec compression; bool compression_set = false;
     };
 
     struct RulesFilter {
@@ -97,11 +108,45 @@ std::shared_ptr<Adapter> Config::GetAdapter() {
     return data.adapter;
 }
 
+std::shared_ptr<ChunkStorage> Config::CreateChunkStorage(const std::string& type) {
+    if (type == "files") return std::make_shared<FileChunkStorage>();
+    else if (type == "packs") return std::make_shared<PackChunkStorage>();
+    throw ConfigException("Unknown chunk storage type '"+type+"'\n");
+}
+
+std::shared_ptr<ChunkStorage> Config::GetChunkStorage() {
+    if (data.chunkStorage == nullptr) {
+        data.chunkStorage = CreateChunkStorage(data.chunkStorageType);
+        // Catalog imports meta info of older versions from the storage, it has to be done before anything is changed
+        GetChunkCatalog();
+    }
+    return data.chunkStorage;
+}
+
+std::shared_ptr<ChunkCatalog> Config::GetChunkCatalog() {
+    if (data.chunkCatalog == nullptr) {
+        data.chunkCatalog = std::make_shared<ChunkCatalog>();
+        data.chunkCatalog->Open(*GetChunkStorage());
+    }
+    return data.chunkCatalog;
+}
+
+std::shared_ptr<TreeCatalog> Config::GetTreeCatalog() {
+    if (data.treeCatalog == nullptr) data.treeCatalog = std::make_shared<TreeCatalog>();
+    return data.treeCatalog;
+}
+
 void Config::Dir::ParseRules(const libconfig::Setting& source, Config::Dir::RulesInternal& target) {
     if (source.lookupValue("scan", target.scan)) target.scan_set = true;
     if (source.lookupValue("backup", target.backup)) target.backup_set = true;
     if (source.lookupValue("priority", target.priority)) target.priority_set = true;
     if (source.lookupValue("history", target.history)) target.history_set = true;
+    if (source.lookupValue("cdc", target.cdc)) target.cdc_set = true;
+    std::string compression;
+    if (source.lookupValue("compression", compression)) {
+        target.compression = ChunkCompression::GetCodec(compression);
+        target.compression_set = true;
+    }
 }
 
 void Config::Dir::ParseRulesFilter(const libconfig::Setting& source, Config::Dir::RulesFilter& target) {
@@ -116,6 +161,8 @@ void Config::Dir::ApplyRules(const Config::Dir::RulesInternal& internal, Config:
     if (internal.backup_set) rules.backup = internal.backup;
     if (internal.priority_set) rules.priority = internal.priority;
     if (internal.history_set) rules.history = internal.history;
+    if (internal.cdc_set) rules.cdc = internal.cdc;
+    if (internal.compression_set) rules.compression = internal.compression;
 }
 
 bool Config::Dir::RulesFilterTest(const Config::Dir::RulesFilter& filter, const std::string& path, const file_params& params) {
@@ -171,6 +218,22 @@ void Config::Dir::Apply(const std::string& path, const file_params& params, Conf
     }
 }
 
+/// Return version of the defaults the repository was created with, a repository without the file is new when it is empty
+static unsigned int LoadRepositoryDefaults() {
+    std::string filename = Config::GetRepositoryFilename();
+    unsigned int defaults = 0;
+    std::ifstream is(filename);
+    if (is >> defaults) return defaults;
+
+    boost::system::error_code error;
+    bool empty = (!boost::filesystem::exists(Config::GetTreeDir(), error) || boost::filesystem::is_empty(Config::GetTreeDir(), error))
+        && (!boost::filesystem::exists(Config::GetDataDir(), error) || boost::filesystem::is_empty(Config::GetDataDir(), error));
+    defaults = (empty ? REPOSITORY_DEFAULTS : 1);
+    // Saved once the repository exists, so it keeps these defaults when it gets the first chunks (read-only ones are detected again)
+    if (boost::filesystem::is_directory(Config::GetDataDir(), error)) std::ofstream(filename) << defaults << "\n";
+    return defaults;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void Config::Load(std::string filename) {
@@ -190,16 +253,58 @@ void Config::Load(std::string filename) {
 	}
 
     // Get config from config file
+    data.configFilename = filename;
     // 1. Required fields
 	if (!config_file.lookupValue("baseDir", data.baseDir)) throw ConfigException("Missing 'baseDir' in the config file '"+filename+"'\n");
 	if (!config_file.lookupValue("adapter.type", data.adapterType)) throw ConfigException("Missing 'adapter.type' in the config file '"+filename+"'\n");
 	if (!config_file.lookupValue("adapter.path", data.adapterPath)) throw ConfigException("Missing 'adapter.path' in the config file '"+filename+"'\n");
 
     // 2. Optional fields
+    std::string read_mode;
+    if (config_file.lookupValue("adapter.readMode", read_mode)) data.adapterReadMode = SourceReader::GetMode(read_mode);
+    config_file.lookupValue("adapter.readBuffer", data.adapterReadBuffer);
+    config_file.lookupValue("adapter.dropCache", data.adapterDropCache);
+    config_file.lookupValue("adapter.batchSize", data.adapterBatchSize);
+    config_file.lookupValue("adapter.batchFileSize", data.adapterBatchFileSize);
+    config_file.lookupValue("adapter.ioUring", data.adapterIoUring);
+    config_file.lookupValue("adapter.scanThreads", data.adapterScanThreads);
+    config_file.lookupValue("adapter.journal", data.adapterJournal);
     config_file.lookupValue("treeSubdir", data.treeSubdir);
     config_file.lookupValue("dataSubdir", data.dataSubdir);
     config_file.lookupValue("tempSubdir", data.tempSubdir);
     config_file.lookupValue("maxChunkDepth", data.maxChunkDepth);
+    config_file.lookupValue("treeKeyframeInterval", data.treeKeyframeInterval);
+    config_file.lookupValue("treeCacheSize", data.treeCacheSize);
+    config_file.lookupValue("chunkStorage", data.chunkStorageType);
+    config_file.lookupValue("packSize", data.packSize);
+    config_file.lookupValue("streamWindowSize", data.streamWindowSize);
+    config_file.lookupValue("mappedSourceSize", data.mappedSourceSize);
+    config_file.lookupValue("maxDeltaSourceSize", data.maxDeltaSourceSize);
+    config_file.lookupValue("chunkCacheSize", data.chunkCacheSize);
+    config_file.lookupValue("mergeDeltas", data.mergeDeltas);
+    config_file.lookupValue("reverseDeltas", data.reverseDeltas);
+    bool containers_set = config_file.lookupValue("containerFileSize", data.containerFileSize);
+    config_file.lookupValue("cdcAverageSize", data.cdcAverageSize);
+    std::string compression;
+    bool compression_set = config_file.lookupValue("compression", compression);
+    if (compression_set) data.compression = ChunkCompression::GetCodec(compression);
+    config_file.lookupValue("compressionLevel", data.compressionLevel);
+    config_file.lookupValue("loadedChunksLimit", data.loadedChunksLimit);
+    bool similarity_set = config_file.lookupValue("similarityIndex", data.similarityIndex);
+    config_file.lookupValue("similarityThreshold", data.similarityThreshold);
+    config_file.lookupValue("similarityBlockSize", data.similarityBlockSize);
+    config_file.lookupValue("similarityMinSize", data.similarityMinSize);
+    std::string hash_algorithm_name;
+    if (config_file.lookupValue("hashAlgorithm", hash_algorithm_name)) data.hashAlgorithm = ContentHash::GetAlgorithm(hash_algorithm_name);
+    config_file.lookupValue("hashThreads", data.hashThreads);
+    config_file.lookupValue("jobs", data.jobs);
+    if (data.adapterReadBuffer == 0) throw ConfigException("'adapter.readBuffer' must be greater than zero\n");
+    if (data.adapterBatchSize == 0) throw ConfigException("'adapter.batchSize' must be greater than zero\n");
+    if (data.streamWindowSize == 0) throw ConfigException("'streamWindowSize' must be greater than zero\n");
+    if (data.cdcAverageSize < 256 || (data.cdcAverageSize & (data.cdcAverageSize - 1)))
+        throw ConfigException("'cdcAverageSize' must be a power of two and at least 256\n");
+    if (data.similarityBlockSize < 256 || (data.similarityBlockSize & (data.similarityBlockSize - 1)))
+        throw ConfigException("'similarityBlockSize' must be a power of two and at least 256\n");
 
     // 3. Create root_rules
     root_rules = std::make_shared<Dir>();
@@ -237,12 +342,20 @@ void Config::Load(std::string filename) {
     }
 
     loaded = true;
+
+    // 5. Repositories created with older defaults keep compression, similarity index and containers off, unless they are set
+    if (LoadRepositoryDefaults() < REPOSITORY_DEFAULTS) {
+        if (!compression_set) data.compression = RAW;
+        if (!similarity_set) data.similarityIndex = false;
+        if (!containers_set) data.containerFileSize = 0;
+    }
 }
 
 const Config::Rules Config::GetRules(const std::string& path, const file_params& params) {
     // Let all dirs on the path modify the rules
     // Start asking the root dir
     Rules rules;
+    rules.compression = data.compression;
     root_rules->Apply(path, params, rules);
     return rules;
 }
@@ -268,8 +381,46 @@ const std::string Config::GetTreeFilename(const std::string& filename) {
     return GetTreeDir() + "/" + filename + data.treeFileExtension;
 }
 
+const std::string Config::GetJournalFilename() {
+    return GetDataDir() + "/" + data.journalFilename;
+}
+
+const std::string Config::GetJournalStateFilename() {
+    return GetDataDir() + "/" + data.journalStateFilename;
+}
+
 const std::string Config::GetChunkFilename(const std::string& name, bool is_data) {
     return GetDataDir() + "/" + name + (is_data ? data.chunkDataExtension : data.chunkMetaExtension);
 }
 
+const std::string Config::GetPackFilename(unsigned int pack) {
+    char name[16];
+    snprintf(name, sizeof(name), "%06u", pack);
+    return GetDataDir() + "/" + name + data.packExtension;
+}
+
+const std::string Config::GetPackIndexFilename() {
+    return GetDataDir() + "/" + data.packIndexFilename;
+}
+
+const std::string Config::GetCatalogFilename() {
+    return GetDataDir() + "/" + data.catalogFilename;
+}
+
+const std::string Config::GetCatalogJournalFilename() {
+    return GetDataDir() + "/" + data.catalogJournalFilename;
+}
+
+const std::string Config::GetSimilarityIndexFilename() {
+    return GetDataDir() + "/" + data.similarityIndexFilename;
+}
+
+const std::string Config::GetTreeCatalogFilename() {
+    return GetDataDir() + "/" + data.treeCatalogFilename;
+}
+
+const std::string Config::GetRepositoryFilename() {
+    return GetDataDir() + "/" + data.repositoryFilename;
+}
+
 }
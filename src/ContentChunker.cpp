@@ -0,0 +1,203 @@
+#include <deque>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONTENTCHUNKER_AVX2
+#endif
+
+#include "FenixExceptions.hpp"
+#include "ContentChunker.hpp"
+
+namespace FenixBackup {
+
+/// Stream is read in pieces of this size (or max block size, if bigger)
+static const size_t READ_SIZE = 1024*1024;
+/// Gear hash depends only on the last 64 bytes
+static const size_t HASH_WINDOW = 64;
+
+/// Random value for each byte (splitmix64 with fixed seed, must never change)
+struct GearTable {
+    uint64_t values[256];
+    GearTable() {
+        uint64_t state = 0x46656e6978424355ULL;
+        for (auto& value: values) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+    }
+};
+
+static const uint64_t* GetGearTable() {
+    // Initialization of a local static is thread-safe (chunkers run in more threads)
+    static const GearTable table;
+    return table.values;
+}
+
+class ContentChunker::ContentChunkerData {
+  public:
+    /// Possible block end (position after the last byte of the block)
+    struct candidate {
+        size_t end;
+        bool strong; // Matches also the harder mask used before the average size
+    };
+
+    std::istream& stream;
+    size_t min_size, normal_size, max_size;
+    uint64_t mask_s, mask_l;
+    const uint64_t* gear;
+
+    std::vector<char> buffer;
+    size_t begin = 0;   // Start of the current block in the buffer
+    size_t scanned = 0; // All positions before this one are tested for boundary
+    bool eof = false;
+    std::deque<candidate> candidates;
+
+    ContentChunkerData(std::istream& stream, size_t average_size);
+
+    /// Return end of the current block, 0 if more data are needed to decide
+    size_t FindCut();
+    /// Drop processed data and read next part of the stream
+    void Fill();
+
+    /// Find candidates in bytes[from, to), bytes before from are used as the hash history
+    void Scan(const unsigned char* bytes, size_t from, size_t to);
+    void ScanScalar(const unsigned char* bytes, size_t from, size_t to, std::vector<candidate>& output);
+#ifdef CONTENTCHUNKER_AVX2
+    /// Hash four parts of the range at once, each lane starts with its own 64 bytes of history
+    __attribute__((target("avx2")))
+    void ScanAVX2(const unsigned char* bytes, size_t from, size_t to);
+#endif
+};
+
+ContentChunker::ContentChunkerData::ContentChunkerData(std::istream& stream, size_t average_size): stream(stream), gear{GetGearTable()} {
+    int bits = 0;
+    while (((size_t)1 << bits) < average_size) bits++;
+    if (((size_t)1 << bits) != average_size || average_size < 256) throw FileChunkException("Average block size must be a power of two and at least 256 bytes\n");
+
+    // Normalized chunking (level 2) -- harder mask before the average size, easier after.
+    // High bits are used, because they depend on the whole hash window
+    normal_size = average_size;
+    min_size = average_size / 4;
+    max_size = average_size * 8;
+    mask_s = ~0ULL << (64 - (bits + 2));
+    mask_l = ~0ULL << (64 - (bits - 2));
+}
+
+void ContentChunker::ContentChunkerData::ScanScalar(const unsigned char* bytes, size_t from, size_t to, std::vector<candidate>& output) {
+    uint64_t hash = 0;
+    for (size_t i = (from > HASH_WINDOW ? from - HASH_WINDOW : 0); i < from; i++) hash = (hash << 1) + gear[bytes[i]];
+    for (size_t i = from; i < to; i++) {
+        hash = (hash << 1) + gear[bytes[i]];
+        if (!(hash & mask_l)) output.push_back({i + 1, !(hash & mask_s)});
+    }
+}
+
+#ifdef CONTENTCHUNKER_AVX2
+void ContentChunker::ContentChunkerData::ScanAVX2(const unsigned char* bytes, size_t from, size_t to) {
+    const size_t LANES = 4;
+    size_t length = (to - from) / LANES;
+    size_t start[LANES];
+    alignas(32) uint64_t hashes[LANES];
+    for (size_t lane = 0; lane < LANES; lane++) {
+        start[lane] = from + lane * length;
+        hashes[lane] = 0;
+        for (size_t i = (start[lane] > HASH_WINDOW ? start[lane] - HASH_WINDOW : 0); i < start[lane]; i++)
+            hashes[lane] = (hashes[lane] << 1) + gear[bytes[i]];
+    }
+
+    std::vector<candidate> found[LANES];
+    __m256i hash = _mm256_load_si256((const __m256i*)hashes);
+    const __m256i mask = _mm256_set1_epi64x(mask_l);
+    const __m256i zero = _mm256_setzero_si256();
+    for (size_t i = 0; i < length; i++) {
+        __m256i values = _mm256_set_epi64x(gear[bytes[start[3] + i]], gear[bytes[start[2] + i]],
+                                           gear[bytes[start[1] + i]], gear[bytes[start[0] + i]]);
+        hash = _mm256_add_epi64(_mm256_slli_epi64(hash, 1), values);
+        int hits = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(hash, mask), zero)));
+        if (hits) {
+            _mm256_store_si256((__m256i*)hashes, hash);
+            for (size_t lane = 0; lane < LANES; lane++)
+                if (hits & (1 << lane)) found[lane].push_back({start[lane] + i + 1, !(hashes[lane] & mask_s)});
+        }
+    }
+
+    // Lanes are in the order of positions, the rest is done by the scalar version
+    for (auto& lane: found) candidates.insert(candidates.end(), lane.begin(), lane.end());
+    std::vector<candidate> rest;
+    ScanScalar(bytes, from + LANES * length, to, rest);
+    candidates.insert(candidates.end(), rest.begin(), rest.end());
+}
+#endif
+
+void ContentChunker::ContentChunkerData::Scan(const unsigned char* bytes, size_t from, size_t to) {
+#ifdef CONTENTCHUNKER_AVX2
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2 && to - from >= 4096) return ScanAVX2(bytes, from, to);
+#endif
+    std::vector<candidate> found;
+    ScanScalar(bytes, from, to, found);
+    candidates.insert(candidates.end(), found.begin(), found.end());
+}
+
+size_t ContentChunker::ContentChunkerData::FindCut() {
+    while (!candidates.empty()) {
+        auto& next = candidates.front();
+        size_t size = next.end - begin;
+        if (size > max_size) return begin + max_size;
+        if (size > normal_size || (size > min_size && next.strong)) return next.end;
+        candidates.pop_front();
+    }
+    if (scanned - begin >= max_size) return begin + max_size;
+    return 0;
+}
+
+void ContentChunker::ContentChunkerData::Fill() {
+    // 1. Keep the current block and history of the hash
+    size_t keep = std::min(begin, scanned > HASH_WINDOW ? scanned - HASH_WINDOW : 0);
+    if (keep > 0) {
+        buffer.erase(buffer.begin(), buffer.begin() + keep);
+        begin -= keep;
+        scanned -= keep;
+        for (auto& item: candidates) item.end -= keep;
+    }
+
+    // 2. Read new data and find boundaries in them
+    size_t old_size = buffer.size();
+    size_t read_size = std::max(READ_SIZE, max_size);
+    buffer.resize(old_size + read_size);
+    stream.read(buffer.data() + old_size, read_size);
+    buffer.resize(old_size + stream.gcount());
+    if (!stream.good()) eof = true;
+
+    Scan((const unsigned char*)buffer.data(), scanned, buffer.size());
+    scanned = buffer.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ContentChunker::ContentChunker(std::istream& stream, size_t average_size): data{new ContentChunkerData(stream, average_size)} {}
+ContentChunker::~ContentChunker() {}
+
+bool ContentChunker::Next(std::string& block) {
+    size_t cut;
+    while ((cut = data->FindCut()) == 0) {
+        if (data->eof) {
+            if (data->begin == data->buffer.size()) return false;
+            cut = data->buffer.size();
+            break;
+        }
+        data->Fill();
+    }
+
+    block.assign(data->buffer.data() + data->begin, cut - data->begin);
+    data->begin = cut;
+    while (!data->candidates.empty() && data->candidates.front().end <= cut) data->candidates.pop_front();
+    return true;
+}
+
+}
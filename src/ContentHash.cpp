@@ -0,0 +1,65 @@
+#include <thread>
+
+#include "FenixExceptions.hpp"
+#include "Config.hpp"
+#include "ContentHash.hpp"
+#include "sha256.h"
+#include "blake3.h"
+
+namespace FenixBackup {
+
+/// Read buffer for SHA-256 (big reads let it process many blocks at once)
+static const size_t SHA256_BUFFER_SIZE = 256*1024;
+/// Read buffer per BLAKE3 thread
+static const size_t BLAKE3_THREAD_BUFFER_SIZE = 1024*1024;
+
+static unsigned int GetThreads() {
+    unsigned int threads = Config::GetConfig().hashThreads;
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    return threads == 0 ? 1 : threads;
+}
+
+// Hide data from .hpp file using PIMP idiom
+class ContentHash::ContentHashData {
+  public:
+    ContentHashData(hash_algorithm algorithm): algorithm{algorithm}, blake3(algorithm == BLAKE3_HASH ? GetThreads() : 1) {}
+
+    hash_algorithm algorithm;
+    SHA256 sha256;
+    BLAKE3 blake3;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+ContentHash::ContentHash(hash_algorithm algorithm): data{new ContentHashData(algorithm)} {
+    if (algorithm != SHA256_HASH && algorithm != BLAKE3_HASH) throw FileChunkException("Unknown hash algorithm "+std::to_string((int)algorithm)+"\n");
+}
+
+ContentHash::~ContentHash() {}
+
+void ContentHash::Add(const char* buffer, size_t length) {
+    if (data->algorithm == BLAKE3_HASH) data->blake3.add(buffer, length);
+    else data->sha256.add(buffer, length);
+}
+
+std::string ContentHash::GetHash() {
+    if (data->algorithm == BLAKE3_HASH) return data->blake3.getHash();
+    return data->sha256.getHash();
+}
+
+hash_algorithm ContentHash::GetAlgorithm(const std::string& name) {
+    if (name == "sha256") return SHA256_HASH;
+    if (name == "blake3") return BLAKE3_HASH;
+    throw ConfigException("Unknown hash algorithm '"+name+"'\n");
+}
+
+std::string ContentHash::GetName(hash_algorithm algorithm) {
+    return algorithm == BLAKE3_HASH ? "blake3" : "sha256";
+}
+
+size_t ContentHash::GetPreferredBufferSize(hash_algorithm algorithm) {
+    if (algorithm == BLAKE3_HASH) return BLAKE3_THREAD_BUFFER_SIZE * GetThreads();
+    return SHA256_BUFFER_SIZE;
+}
+
+}
@@ -1,16 +1,26 @@
 #include <vector>
 #include <fstream>
+#include <sstream>
+#include <unordered_set>
 #include <algorithm>
+#include <limits>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <boost/filesystem.hpp>
 
 #include "FenixExceptions.hpp"
 #include "Config.hpp"
 #include "FileChunk.hpp"
-
-#include <cereal/archives/binary.hpp>
-#include <cereal/archives/json.hpp>
-#include <cereal/types/memory.hpp>
-#include <cereal/types/polymorphic.hpp>
-#include <cereal/types/vector.hpp>
+#include "ChunkCache.hpp"
+#include "VCDiffMerger.hpp"
+#include "ContentChunker.hpp"
+#include "Functions.hpp"
+#include "ContentHash.hpp"
+#include "storage/ChunkCompression.hpp"
 
 #include <google/vcencoder.h>
 #include <google/vcdecoder.h>
@@ -18,104 +28,550 @@
 namespace FenixBackup {
 
 std::unordered_map<std::string, std::shared_ptr<FileChunk>> FileChunk::loaded_chunks;
+size_t FileChunk::restored_bytes = 0;
+std::recursive_mutex FileChunk::lock;
+std::unordered_set<std::string> FileChunk::reserved;
+std::condition_variable_any FileChunk::reserved_changed;
+std::unordered_set<std::string> FileChunk::contained;
+
+/// Decoded data are written in multiples of this size (except the last write)
+static const size_t WRITE_ALIGNMENT = 1024*1024;
+/// Blocks are chunks too, prefix separates them from whole file chunks with the same hash
+static const std::string BLOCK_PREFIX = "b_";
+/// Containers of small chunks, prefix separates them from whole file chunks with the same hash
+static const std::string CONTAINER_PREFIX = "c_";
+/// Number of blocks hashed at once
+static const size_t BLOCK_BATCH = 8;
+
+static void WriteAll(int fd, const char* buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw FileChunkException("Cannot write decoded data: "+std::string(strerror(errno))+"\n");
+        }
+        buffer += written;
+        length -= written;
+    }
+}
 
-class FileChunk::FileChunkData {
+/**
+ * Content of a delta base. Content up to mappedSourceSize is kept in the memory, bigger content
+ * is written into an unlinked temporary file and mapped, so its pages are only in the page cache
+ * (dropped and read again under memory pressure) and memory use does not grow with the file size.
+ */
+class FileChunk::Source {
   public:
-    std::string chunk_name;
-    std::string ancestor_chunk_name;
-    int depth = 0;
-    std::vector<std::string> derived_chunks;
-    size_t chunk_size = 0;
+    ~Source() { Clear(); }
+
+    void Clear() {
+        if (mapped != nullptr) munmap(mapped, file_size);
+        if (fd >= 0) close(fd);
+        mapped = nullptr;
+        fd = -1;
+        file_size = 0;
+        content.clear();
+    }
+    void Assign(std::string&& new_content) {
+        Clear();
+        content = std::move(new_content);
+    }
+    void Append(const char* buffer, size_t length) {
+        if (fd < 0 && content.size() + length > Config::GetConfig().mappedSourceSize) {
+            OpenFile();
+            WriteAll(fd, content.data(), content.size());
+            file_size = content.size();
+            std::string().swap(content);
+        }
+        if (fd < 0) content.append(buffer, length);
+        else {
+            WriteAll(fd, buffer, length);
+            file_size += length;
+        }
+    }
+    /// Map the temporary file (when it is used), data() and size() are valid after it
+    void Finish() {
+        if (fd < 0 || file_size == 0) return;
+        void* address = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) throw FileChunkException("Cannot map delta base: "+std::string(strerror(errno))+"\n");
+        mapped = (char*)address;
+    }
+
+    const char* data() { return (fd >= 0 ? mapped : content.data()); }
+    size_t size() { return (fd >= 0 ? file_size : content.size()); }
+    bool IsMapped() { return fd >= 0; }
+    /// Content kept in the memory (empty when mapped)
+    const std::string& GetContent() { return content; }
+
+  private:
+    std::string content;
+    int fd = -1;
+    size_t file_size = 0;
+    char* mapped = nullptr;
+
+    void OpenFile() {
+        boost::system::error_code error;
+        boost::filesystem::create_directories(Config::GetTempDir(), error);
+        // File without a name is removed by the kernel when closed (even after a crash)
+        fd = open(Config::GetTempDir().c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            // File system without O_TMPFILE
+            std::string name = Config::GetTempDir() + "/source_XXXXXX";
+            fd = mkostemp(&name[0], O_CLOEXEC);
+            if (fd >= 0) unlink(name.c_str());
+        }
+        if (fd < 0) throw FileChunkException("Cannot create temporary file for delta base in '"+Config::GetTempDir()+"'\n");
+    }
+};
 
-    FileChunkData(std::string chunk_name): chunk_name{chunk_name} {}
+class FileChunk::FileChunkData: public chunk_info {
+  public:
+    chunk_codec compression = RAW; // Requested codec for saved data (not serialized)
+    bool temporary = false; // Data are written as temporary, until the chunk is committed under its final name
+    bool rewritten = false; // Data of the stored chunk were rewritten, its info is synced by FinishSave
+    unsigned int version = 0; // Changed when the data are rewritten or removed (not serialized)
+
+    FileChunkData(std::string chunk_name) {
+        this->chunk_name = chunk_name;
+        hash = Config::GetConfig().hashAlgorithm;
+    }
 
     void SaveChunkInfo();
     void LoadChunkInfo();
+    /// Copy of what is needed to read the data (name, type, codec, size, ancestor, container), used without the lock
+    FileChunkData CopyForLoad();
+
+    /// Set ancestor of this chunk (and depth), ancestor is nullptr when the name is empty
+    void SetAncestor(const std::string& ancestor_name, std::shared_ptr<FileChunk>& ancestor);
+    /// Open data for reading (decompressed)
+    std::unique_ptr<ChunkStorage::Reader> OpenData();
+    /// Create data with requested compression, codec and chunk_size are set by FinishData
+    std::unique_ptr<ChunkCompression::Writer> CreateData();
+    void FinishData(ChunkCompression::Writer& writer);
+    /// Load whole VCDIFF from the storage
+    std::string LoadDelta();
+    /// Decode VCDIFF data against the source window by window into output, flush gets output after each window
+    void DecodeData(const char* source, size_t source_size, std::string& output, const std::function<void(std::string&)>& flush);
+    /// Save VCDIFF into the storage
+    void SaveDelta(const std::string& delta);
+    /// Save chunk info and register this chunk in its ancestor
+    void FinishSave(std::shared_ptr<FileChunk>& ancestor);
+    /// Encode the stream against the ancestor window by window, observer gets each read window
+    void EncodeStream(const std::string& ancestor_name, std::istream& stream, std::shared_ptr<FileChunk>& ancestor,
+        const std::function<void(const char*, size_t)>& observer);
+
+    /// Names of blocks of the BLOCK_LIST chunk
+    std::vector<std::string> LoadBlockList();
+    /// Drop references of this BLOCK_LIST chunk to its blocks and delete unused blocks, return size change
+    int ReleaseBlocks();
+    /// Drop references of CONTAINED chunks to their container and delete it when unused, return size change
+    static int ReleaseContainer(const std::string& container_name, unsigned int count = 1);
+
+    /// Add change to the depth of this chunk and all derived chunks
+    void ChangeDepth(int change);
+    /// Return the biggest depth of this chunk and all derived chunks
+    int GetDeepestDepth();
+};
+
+void FileChunk::FileChunkData::SaveChunkInfo() { Config::GetChunkCatalog()->Save(*this); }
+void FileChunk::FileChunkData::LoadChunkInfo() {
+    if (!Config::GetChunkCatalog()->Load(*this)) throw FileChunkException("Couldn't load FileChunk '"+chunk_name+"' meta info\n");
+    // Rewritten data keep the same compression
+    compression = codec;
+}
 
-    template <class Archive>
-    void serialize(Archive & ar, std::uint32_t const version) {
-        ar(
-            cereal::make_nvp("chunk_name", chunk_name),
-            cereal::make_nvp("ancestor_chunk_name", ancestor_chunk_name),
-            cereal::make_nvp("depth", depth),
-            cereal::make_nvp("chunk_size", chunk_size),
-            cereal::make_nvp("derived_chunks", derived_chunks)
-        );
+FileChunk::FileChunkData FileChunk::FileChunkData::CopyForLoad() {
+    FileChunkData copy(chunk_name);
+    copy.ancestor_chunk_name = ancestor_chunk_name;
+    copy.type = type;
+    copy.codec = codec;
+    copy.chunk_size = chunk_size;
+    copy.container_name = container_name;
+    copy.offset = offset;
+    copy.length = length;
+    copy.version = version;
+    return copy;
+}
+
+void FileChunk::FileChunkData::SetAncestor(const std::string& ancestor_name, std::shared_ptr<FileChunk>& ancestor) {
+    ancestor_chunk_name = ancestor_name;
+    depth = 0;
+    ancestor = nullptr;
+    if (ancestor_name.empty()) return;
+
+    ancestor = GetChunk(ancestor_chunk_name);
+    if (ancestor == nullptr) throw FileChunkException("Cannot load ancestor '"+ancestor_chunk_name+"' of the FileChunk '"+chunk_name+"'\n");
+    depth = ancestor->GetDepth() + 1;
+}
+
+std::unique_ptr<ChunkStorage::Reader> FileChunk::FileChunkData::OpenData() {
+    return ChunkCompression::CreateReader(Config::GetChunkStorage()->OpenData(chunk_name), codec);
+}
+
+std::unique_ptr<ChunkCompression::Writer> FileChunk::FileChunkData::CreateData() {
+    auto storage = Config::GetChunkStorage();
+    return ChunkCompression::CreateWriter(temporary ? storage->CreateTempData(chunk_name) : storage->CreateData(chunk_name), compression);
+}
+
+void FileChunk::FileChunkData::FinishData(ChunkCompression::Writer& writer) {
+    chunk_size = writer.Close();
+    codec = writer.GetCodec();
+    // Data of stored chunks are rewritten only under the lock (new chunks are not seen by others)
+    version++;
+}
+
+std::string FileChunk::FileChunkData::LoadDelta() {
+    auto reader = OpenData();
+    std::string delta;
+    char buffer[64*1024];
+    size_t count;
+    while ((count = reader->Read(buffer, sizeof(buffer))) > 0) delta.append(buffer, count);
+    return delta;
+}
+
+void FileChunk::FileChunkData::DecodeData(const char* source, size_t source_size, std::string& output, const std::function<void(std::string&)>& flush) {
+    auto storage = OpenData();
+    open_vcdiff::VCDiffStreamingDecoder decoder;
+    // Chunks encoded at once have only one window as big as the whole file
+    decoder.SetMaximumTargetFileSize(std::numeric_limits<size_t>::max());
+    decoder.SetMaximumTargetWindowSize(std::numeric_limits<size_t>::max());
+    decoder.StartDecoding(source, source_size);
+
+    // Small chunks don't need a buffer of the whole window (restoring threads allocate it for each chunk)
+    std::vector<char> delta(std::min<size_t>(Config::GetConfig().streamWindowSize, std::max<size_t>(chunk_size, 64*1024)));
+    size_t count;
+    while ((count = storage->Read(delta.data(), delta.size())) > 0) {
+        if (!decoder.DecodeChunk(delta.data(), count, &output))
+            throw FileChunkException("VCDIFF decoding of the FileChunk '"+chunk_name+"' failed\n");
+        if (flush) flush(output);
     }
-};
+    if (!decoder.FinishDecoding()) throw FileChunkException("Incomplete VCDIFF data of the FileChunk '"+chunk_name+"'\n");
+}
+
+void FileChunk::FileChunkData::SaveDelta(const std::string& delta) {
+    // Data of a stored chunk are rewritten (rebase, skipped ancestor), the catalog on the disk must not be older
+    rewritten = Config::GetChunkCatalog()->Exists(chunk_name);
+    if (rewritten) Config::GetChunkCatalog()->Flush();
+    auto writer = CreateData();
+    writer->Write(delta.data(), delta.size());
+    FinishData(*writer);
+}
 
-void FileChunk::FileChunkData::SaveChunkInfo() {
-    std::ofstream os(Config::GetChunkFilename(chunk_name));
-    //cereal::JSONOutputArchive archive(os);
-    cereal::BinaryOutputArchive archive(os);
+void FileChunk::FileChunkData::FinishSave(std::shared_ptr<FileChunk>& ancestor) {
+    // TODO: Count size of chunk metadata to the final size?
+    SaveChunkInfo();
+    // New ancestor of the rewritten data is on the disk right after them
+    if (rewritten) Config::GetChunkCatalog()->Flush();
+    rewritten = false;
+    // Update ancestor in this moment, when derived chunk is saved
+    if (ancestor != nullptr) ancestor->AddDerivedChunk(chunk_name);
+}
 
-    archive(*this);
-    //serialize(archive);
+std::vector<std::string> FileChunk::FileChunkData::LoadBlockList() {
+    std::istringstream list(LoadDelta());
+    std::vector<std::string> blocks;
+    std::string name;
+    while (std::getline(list, name)) blocks.push_back(name);
+    return blocks;
 }
 
-void FileChunk::FileChunkData::LoadChunkInfo() {
-	// Load data from given FileChunk meta file name
-    std::ifstream is(Config::GetChunkFilename(chunk_name));
-    if (!is.good()) throw FileChunkException("Couldn't load FileChunk '"+chunk_name+"' meta info (from filename '"+Config::GetChunkFilename(chunk_name)+"')\n");
-    //cereal::JSONInputArchive archive(is);
-    cereal::BinaryInputArchive archive(is);
+int FileChunk::FileChunkData::ReleaseBlocks() {
+    int size_change = 0;
+    std::unordered_set<std::string> released;
+    for (auto& name: LoadBlockList()) {
+        if (!released.insert(name).second) continue;
+        auto block = GetChunk(name);
+        if (block == nullptr) continue;
+        if (block->data->references <= 1) size_change += block->DeleteChunk();
+        else {
+            block->data->references--;
+            block->data->SaveChunkInfo();
+        }
+    }
+    return size_change;
+}
 
-    archive(*this);
+int FileChunk::FileChunkData::ReleaseContainer(const std::string& container_name, unsigned int count) {
+    auto container = GetChunk(container_name);
+    if (container == nullptr) return 0;
+    if (container->data->references <= count) return container->DeleteChunk();
+    container->data->references -= count;
+    container->data->SaveChunkInfo();
+    return 0;
+}
+
+void FileChunk::FileChunkData::ChangeDepth(int change) {
+    depth += change;
+    SaveChunkInfo();
+    for (auto& name: derived_chunks) {
+        auto chunk = GetChunk(name);
+        if (chunk != nullptr) chunk->data->ChangeDepth(change);
+    }
+}
+
+int FileChunk::FileChunkData::GetDeepestDepth() {
+    int deepest = depth;
+    for (auto& name: derived_chunks) {
+        auto chunk = GetChunk(name);
+        if (chunk != nullptr) deepest = std::max(deepest, chunk->data->GetDeepestDepth());
+    }
+    return deepest;
 }
 
 ////////
 
+std::string FileChunk::GetDeltaBase(const std::string& previous_name) {
+    if (previous_name.empty()) return "";
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    auto current_chunk = GetChunk(previous_name);
+    if (current_chunk == nullptr) return "";
+
+    // If the depth of chunks is too big, use the root of this chunk "branch"
+    std::string base = previous_name;
+    if (current_chunk->GetDepth() >= Config::GetConfig().maxChunkDepth) {
+        while (current_chunk != nullptr && current_chunk->GetDepth() != 0) {
+            base = current_chunk->GetAncestorName();
+            current_chunk = GetChunk(base);
+        }
+    }
+    return base;
+}
+
 std::shared_ptr<FileChunk> FileChunk::GetChunk(std::string chunk_name) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
 	if (loaded_chunks.find(chunk_name) == loaded_chunks.end()) {
-        if(!std::ifstream(Config::GetChunkFilename(chunk_name)).good()) return nullptr;
+        if(!Config::GetChunkCatalog()->Exists(chunk_name)) return nullptr;
+        if (loaded_chunks.size() >= Config::GetConfig().loadedChunksLimit) ReleaseChunks();
 		loaded_chunks.insert(std::make_pair(chunk_name, std::make_shared<FileChunk>(chunk_name, true)));
     }
 
 	return loaded_chunks[chunk_name];
 }
 
+void FileChunk::ReleaseChunks() {
+    // Info of all chunks is saved in the catalog, so chunks used only by this map can be loaded again later
+    for (auto it = loaded_chunks.begin(); it != loaded_chunks.end();) {
+        if (it->second.use_count() == 1) it = loaded_chunks.erase(it);
+        else ++it;
+    }
+}
+
 FileChunk::FileChunk(std::string chunk_name, bool load): data{new FileChunkData(chunk_name)} {
     if (load) data->LoadChunkInfo();
 }
 
-FileChunk::~FileChunk() {}
+FileChunk::~FileChunk() {
+    // Temporary data left by an interrupted save
+    if (data->temporary) {
+        try {
+            Config::GetChunkStorage()->DiscardData(data->chunk_name);
+        } catch (const FenixException& ex) {}
+    }
+}
+
+std::string FileChunk::GetTempName() {
+    static std::atomic<unsigned int> counter(0);
+    return "t_" + std::to_string(getpid()) + "_" + std::to_string(counter++);
+}
+
+std::recursive_mutex& FileChunk::GetLock() { return lock; }
+
+FileChunk::Reservation::Reservation(const std::string& name): name{name} {
+    // Must not be called with the lock held, waiting releases only one level of it
+    std::unique_lock<std::recursive_mutex> guard(lock);
+    reserved_changed.wait(guard, [&name]() { return reserved.find(name) == reserved.end(); });
+    reserved.insert(name);
+}
+
+FileChunk::Reservation::~Reservation() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    reserved.erase(name);
+    reserved_changed.notify_all();
+}
+
+FileChunk::Container::Container() {}
+
+FileChunk::Container::~Container() {
+    // Chunks of an unsaved container can be saved by others
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    for (auto& group: chunks)
+        for (auto& item: group.second) contained.erase(item.first);
+}
+
+bool FileChunk::Container::Add(const std::string& name, const std::string& content, chunk_codec codec, hash_algorithm algorithm) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!contained.insert(name).second) return false;
+    chunks[std::make_pair(codec, algorithm)].emplace_back(name, content);
+    return true;
+}
+
+void FileChunk::Container::Save() {
+    for (auto& group: chunks) {
+        auto& items = group.second;
+        // 1. Content of the container is the concatenation of its chunks, it is named by its hash
+        std::string content;
+        for (auto& item: items) content += item.second;
+        ContentHash hash(group.first.second);
+        hash.Add(content.data(), content.size());
+        std::string name = CONTAINER_PREFIX + hash.GetHash();
+
+        // 2. Save the container (each chunk references it), encoding is done without the lock
+        {
+            Reservation reservation(name);
+            std::unique_lock<std::recursive_mutex> guard(lock);
+            auto existing = GetChunk(name);
+            if (existing != nullptr) {
+                existing->data->references += items.size();
+                existing->data->SaveChunkInfo();
+            } else {
+                guard.unlock();
+                FileChunk container(name);
+                container.data->references = items.size();
+                container.data->compression = group.first.first;
+                container.data->hash = group.first.second;
+                std::istringstream stream(content);
+                container.ProcessStreamAndSave("", stream);
+            }
+        }
+
+        // 3. Save the chunks as parts of the container, unless saved meanwhile without a container
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        uint64_t offset = 0;
+        unsigned int unused = 0;
+        for (auto& item: items) {
+            if (GetChunk(item.first) != nullptr) unused++;
+            else {
+                FileChunk chunk(item.first);
+                chunk.data->type = CONTAINED;
+                chunk.data->hash = group.first.second;
+                chunk.data->container_name = name;
+                chunk.data->offset = offset;
+                chunk.data->length = item.second.size();
+                chunk.data->SaveChunkInfo();
+            }
+            offset += item.second.size();
+            contained.erase(item.first);
+        }
+        if (unused > 0) FileChunkData::ReleaseContainer(name, unused);
+    }
+    chunks.clear();
+}
 
 // Saving and loading
 void FileChunk::ProcessStringAndSave(const std::string& ancestor_name, const std::string& content) {
-    data->ancestor_chunk_name = ancestor_name;
+    std::lock_guard<std::recursive_mutex> guard(lock);
     // 1. Get source to diff against
-    std::string source;
-
     std::shared_ptr<FileChunk> ancestor;
-    if (!ancestor_name.empty()) {
-        ancestor = GetChunk(data->ancestor_chunk_name);
-        if (ancestor == nullptr) throw FileChunkException("Cannot load ancestor '"+data->ancestor_chunk_name+"' of the FileChunk '"+data->chunk_name+"'\n");
-        source = ancestor->LoadAndReturn();
-        data->depth = ancestor->GetDepth() + 1;
-    }
+    data->SetAncestor(ancestor_name, ancestor);
+    std::string source = (ancestor != nullptr ? ancestor->Load(true) : "");
 
     // 2. Encode new content using VCDIFF against source
     std::string output_string;
     open_vcdiff::VCDiffEncoder encoder(source.data(), source.size());
-    encoder.Encode(content.data(), content.size(), &output_string);
+    if (!encoder.Encode(content.data(), content.size(), &output_string))
+        throw FileChunkException("VCDIFF encoding of the FileChunk '"+data->chunk_name+"' failed\n");
 
     // 3. Save new content
-    std::ofstream storage(Config::GetChunkFilename(data->chunk_name, true), std::ios::binary);
-    storage.write(output_string.data(), output_string.size());
-    storage.close();
-    data->chunk_size = output_string.size();
-    // TODO: Count size of chunk metadata to the final size?
+    data->SaveDelta(output_string);
 
     // 4. Save chunk info
-    data->SaveChunkInfo();
-    // Update ancestor in this moment, when derived chunk is saved
-    if (!ancestor_name.empty()) ancestor->AddDerivedChunk(data->chunk_name);
+    data->FinishSave(ancestor);
+    // Content is probably used as the source for the next version of the file
+    ChunkCache::Put(data->chunk_name, content);
 }
 
-void FileChunk::ProcessStreamAndSave(const std::string& ancestor_name, std::istream& stream) {
-    std::string content((std::istreambuf_iterator<char>(stream)),
-                        (std::istreambuf_iterator<char>()   ));
-    ProcessStringAndSave(ancestor_name, content);
+void FileChunk::FileChunkData::EncodeStream(const std::string& ancestor_name, std::istream& stream, std::shared_ptr<FileChunk>& ancestor,
+    const std::function<void(const char*, size_t)>& observer) {
+    // 1. Get source to diff against, only the ancestor is set under the lock
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        SetAncestor(ancestor_name, ancestor);
+    }
+    Source source;
+    if (ancestor != nullptr) ancestor->LoadSource(source);
+    // Dictionary hash takes more memory than the base itself, bigger bases are not used
+    if (source.size() > Config::GetConfig().maxDeltaSourceSize) {
+        source.Clear();
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        SetAncestor("", ancestor);
+    }
+
+    open_vcdiff::HashedDictionary dictionary(source.data(), source.size());
+    if (!dictionary.Init()) throw FileChunkException("Cannot initialize VCDIFF dictionary for the FileChunk '"+chunk_name+"'\n");
+    open_vcdiff::VCDiffStreamingEncoder encoder(&dictionary, open_vcdiff::VCD_STANDARD_FORMAT, true);
+
+    // 2. Encode the stream window by window and write each encoded window
+    // directly to the storage, so memory usage does not depend on file size
+    auto storage = CreateData();
+    std::vector<char> window(Config::GetConfig().streamWindowSize);
+    std::string output_string;
+
+    bool ok = encoder.StartEncoding(&output_string);
+    while (ok && stream.good()) {
+        stream.read(window.data(), window.size());
+        if (stream.gcount() == 0) break;
+        if (observer) observer(window.data(), stream.gcount());
+        ok = encoder.EncodeChunk(window.data(), stream.gcount(), &output_string);
+        storage->Write(output_string.data(), output_string.size());
+        output_string.clear();
+    }
+    ok = ok && encoder.FinishEncoding(&output_string);
+    if (!ok) throw FileChunkException("VCDIFF encoding of the FileChunk '"+chunk_name+"' failed\n");
+    storage->Write(output_string.data(), output_string.size());
+    FinishData(*storage);
+}
+
+void FileChunk::ProcessStreamAndSave(const std::string& ancestor_name, std::istream& stream,
+    const std::function<void(const char*, size_t)>& observer) {
+    std::shared_ptr<FileChunk> ancestor;
+    data->EncodeStream(ancestor_name, stream, ancestor, observer);
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    data->FinishSave(ancestor);
+}
+
+std::string FileChunk::ProcessStreamToTemp(const std::string& ancestor_name, std::istream& stream,
+    const std::function<void(const char*, size_t)>& observer) {
+    ContentHash hash(data->hash);
+    std::shared_ptr<FileChunk> ancestor;
+    data->temporary = true;
+    data->EncodeStream(ancestor_name, stream, ancestor, [&hash, &observer](const char* buffer, size_t length) {
+        hash.Add(buffer, length);
+        if (observer) observer(buffer, length);
+    });
+    return hash.GetHash();
+}
+
+void FileChunk::Commit(const std::string& name) {
+    if (!data->temporary) throw FileChunkException("FileChunk '"+data->chunk_name+"' is not temporary\n");
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    Config::GetChunkStorage()->CommitData(data->chunk_name, name);
+    data->chunk_name = name;
+    data->temporary = false;
+    std::shared_ptr<FileChunk> ancestor = (data->ancestor_chunk_name.empty() ? nullptr : GetChunk(data->ancestor_chunk_name));
+    data->FinishSave(ancestor);
+}
+
+void FileChunk::Discard() {
+    if (!data->temporary) throw FileChunkException("FileChunk '"+data->chunk_name+"' is not temporary\n");
+    Config::GetChunkStorage()->DiscardData(data->chunk_name);
+    data->temporary = false;
+}
+
+void FileChunk::ProcessStreamAndRebase(const std::string& previous_name, std::istream& stream,
+    const std::function<void(const char*, size_t)>& observer) {
+    // The newest version is stored whole, so it is restored without decoding any ancestor
+    ProcessStreamAndSave("", stream, observer);
+    RebasePrevious(previous_name);
+}
+
+void FileChunk::RebasePrevious(const std::string& previous_name) {
+    if (previous_name.empty()) return;
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    // Previous version becomes a delta against this one, unless its chain gets too long
+    auto previous = GetChunk(previous_name);
+    if (previous == nullptr || previous->data->type != DELTA) return;
+    if (previous->data->GetDeepestDepth() - previous->data->depth + 1 > Config::GetConfig().maxChunkDepth) return;
+    previous->Rebase(data->chunk_name);
 }
 
 void FileChunk::ProcessFileAndSave(const std::string& ancestor_name, const std::string& source_path) {
@@ -124,25 +580,118 @@ void FileChunk::ProcessFileAndSave(const std::string& ancestor_name, const std::
     ProcessStreamAndSave(ancestor_name, ifs);
 }
 
-std::string FileChunk::LoadAndReturn() {
-    // 1. Get dictionary (source file) from ancestors
-    std::string source;
-    if (!data->ancestor_chunk_name.empty()) {
-        auto ancestor = GetChunk(data->ancestor_chunk_name);
-        if (ancestor == nullptr) throw FileChunkException("Cannot load ancestor '"+data->ancestor_chunk_name+"' of the FileChunk '"+data->chunk_name+"'\n");
-        source = ancestor->LoadAndReturn();
+void FileChunk::ProcessBlocksAndSave(std::istream& stream) {
+    data->ancestor_chunk_name = "";
+    data->depth = 0;
+    data->type = BLOCK_LIST;
+
+    // 1. Save blocks which are not stored yet, count one reference from this list to each block
+    ContentChunker chunker(stream, Config::GetConfig().cdcAverageSize);
+    std::unordered_set<std::string> referenced;
+    std::string list;
+    std::vector<std::string> blocks(BLOCK_BATCH);
+    while (true) {
+        // Blocks are hashed in batches (in parallel lanes when the CPU allows it)
+        size_t count = 0;
+        while (count < BLOCK_BATCH && chunker.Next(blocks[count])) count++;
+        if (count == 0) break;
+        blocks.resize(count);
+        auto hashes = Functions::ComputeHashes(blocks, data->hash);
+
+        // Blocks are small, new ones are saved under the lock, so no other thread saves the same block
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        for (size_t i = 0; i < count; i++) {
+            std::string name = BLOCK_PREFIX + hashes[i];
+            list += name + "\n";
+            if (!referenced.insert(name).second) continue;
+
+            auto existing = GetChunk(name);
+            if (existing != nullptr) {
+                existing->data->references++;
+                existing->data->SaveChunkInfo();
+            } else {
+                FileChunk new_block(name);
+                new_block.data->references = 1;
+                new_block.data->compression = data->compression;
+                new_block.data->hash = data->hash;
+                new_block.ProcessStringAndSave("", blocks[i]);
+            }
+        }
+        if (count < BLOCK_BATCH) break;
     }
 
-    // 2. Open data file with VCDIFF
-    std::ifstream storage(Config::GetChunkFilename(data->chunk_name, true), std::ios::binary);
-    std::string delta(  (std::istreambuf_iterator<char>(storage)),
-                        (std::istreambuf_iterator<char>()       ));
+    // 2. Save list of blocks as the data of this chunk
+    std::shared_ptr<FileChunk> no_ancestor;
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    data->SaveDelta(list);
+    data->FinishSave(no_ancestor);
+}
+
+std::string FileChunk::LoadAndReturn() { return Load(false); }
 
-    // 3. Compute original file
-    open_vcdiff::VCDiffDecoder decoder;
+std::string FileChunk::Load(bool locked) {
     std::string output;
-    decoder.Decode(source.data(), source.size(), delta, &output);
-    return output;
+    std::unique_lock<std::recursive_mutex> guard(lock);
+    if (data->type == CONTAINED) {
+        // The whole container is decoded once and stays in the cache for other chunks in it
+        if (ChunkCache::GetPart(data->container_name, data->offset, data->length, output)) return output;
+        auto container = GetChunk(data->container_name);
+        if (container == nullptr) throw FileChunkException("Cannot load container '"+data->container_name+"' of the FileChunk '"+data->chunk_name+"'\n");
+        // Contained chunks are never changed
+        std::string chunk_name = data->chunk_name;
+        uint64_t offset = data->offset, length = data->length;
+        guard.unlock();
+        std::string content = container->Load(locked);
+        if (offset + length > content.size()) throw FileChunkException("FileChunk '"+chunk_name+"' is out of its container\n");
+        return content.substr(offset, length);
+    }
+    if (ChunkCache::Get(data->chunk_name, output)) return output;
+    std::string chunk_name = data->chunk_name;
+    guard.unlock();
+
+    // Another thread decoding this chunk is waited for, then the content is in the cache
+    std::unique_ptr<Reservation> reservation;
+    if (!locked) reservation.reset(new Reservation(chunk_name));
+    while (true) {
+        // 1. Copy what is needed to read the data, reading and decoding is done without the lock
+        guard.lock();
+        if (ChunkCache::Get(chunk_name, output)) return output;
+        FileChunkData info = data->CopyForLoad();
+        std::shared_ptr<FileChunk> ancestor;
+        if (!info.ancestor_chunk_name.empty()) {
+            ancestor = GetChunk(info.ancestor_chunk_name);
+            if (ancestor == nullptr) throw FileChunkException("Cannot load ancestor '"+info.ancestor_chunk_name+"' of the FileChunk '"+chunk_name+"'\n");
+        }
+        guard.unlock();
+
+        // 2. Join blocks, or compute original file from VCDIFF against the ancestor (with the same limits as LoadAndWrite)
+        try {
+            if (info.type == BLOCK_LIST) {
+                for (auto& name: info.LoadBlockList()) {
+                    auto block = GetChunk(name);
+                    if (block == nullptr) throw FileChunkException("Cannot load block '"+name+"' of the FileChunk '"+chunk_name+"'\n");
+                    output += block->Load(locked);
+                }
+            } else {
+                std::string source = (ancestor != nullptr ? ancestor->Load(locked) : "");
+                info.DecodeData(source.data(), source.size(), output, nullptr);
+            }
+        } catch (const FenixException& ex) {
+            guard.lock();
+            if (data->version == info.version) throw;
+            guard.unlock();
+        }
+
+        // 3. Data rewritten meanwhile (e.g. rebased) are loaded again, failed decoding throws,
+        // so only complete content gets into the cache
+        guard.lock();
+        if (data->version == info.version) {
+            ChunkCache::Put(chunk_name, output);
+            return output;
+        }
+        guard.unlock();
+        output.clear();
+    }
 }
 
 void FileChunk::LoadAndExtract(std::string target_path) {
@@ -152,11 +701,101 @@ void FileChunk::LoadAndExtract(std::string target_path) {
     output.close();
 }
 
+size_t FileChunk::LoadAndWrite(int fd) {
+    size_t written = 0;
+    bool complete = WriteContent([fd, &written](const char* buffer, size_t length) {
+        WriteAll(fd, buffer, length);
+        written += length;
+    });
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    // Written data cannot be loaded again
+    if (!complete) throw FileChunkException("FileChunk '"+data->chunk_name+"' was rewritten while it was restored\n");
+    restored_bytes += written;
+    return written;
+}
+
+bool FileChunk::WriteContent(const std::function<void(const char*, size_t)>& write) {
+    // 1. Copy what is needed to read the data, reading, decoding and writing is done without the lock
+    std::unique_lock<std::recursive_mutex> guard(lock);
+    FileChunkData info = data->CopyForLoad();
+    std::shared_ptr<FileChunk> ancestor;
+    if (info.type == DELTA && !info.ancestor_chunk_name.empty()) {
+        ancestor = GetChunk(info.ancestor_chunk_name);
+        if (ancestor == nullptr) throw FileChunkException("Cannot load ancestor '"+info.ancestor_chunk_name+"' of the FileChunk '"+info.chunk_name+"'\n");
+    }
+    guard.unlock();
+
+    std::string output;
+    if (info.type == CONTAINED) {
+        output = LoadAndReturn();
+    } else if (info.type == BLOCK_LIST) {
+        // Blocks are small, join them to write whole multiples of WRITE_ALIGNMENT
+        for (auto& name: info.LoadBlockList()) {
+            auto block = GetChunk(name);
+            if (block == nullptr) throw FileChunkException("Cannot load block '"+name+"' of the FileChunk '"+info.chunk_name+"'\n");
+            output += block->LoadAndReturn();
+            if (output.size() >= WRITE_ALIGNMENT) {
+                size_t aligned = output.size() - output.size() % WRITE_ALIGNMENT;
+                write(output.data(), aligned);
+                output.erase(0, aligned);
+            }
+        }
+    } else {
+        // 2. Decode VCDIFF window by window, only whole multiples of WRITE_ALIGNMENT
+        // are written, the rest is kept for the next round
+        // Big base is mapped from a temporary file, not loaded into the memory
+        Source source;
+        if (ancestor != nullptr) ancestor->LoadSource(source);
+        try {
+            info.DecodeData(source.data(), source.size(), output, [&write](std::string& output) {
+                size_t aligned = output.size() - output.size() % WRITE_ALIGNMENT;
+                if (aligned > 0) {
+                    write(output.data(), aligned);
+                    output.erase(0, aligned);
+                }
+            });
+        } catch (const FenixException& ex) {
+            guard.lock();
+            if (data->version == info.version) throw;
+            guard.unlock();
+        }
+        guard.lock();
+        if (data->version != info.version) return false;
+        guard.unlock();
+    }
+    write(output.data(), output.size());
+    return true;
+}
+
+void FileChunk::LoadSource(Source& source) {
+    std::unique_lock<std::recursive_mutex> guard(lock);
+    std::string chunk_name = data->chunk_name, content;
+    bool contained = (data->type == CONTAINED);
+    if (!contained && ChunkCache::Get(chunk_name, content)) {
+        source.Assign(std::move(content));
+        return;
+    }
+    guard.unlock();
+
+    // Content written before the data were rewritten (e.g. rebased) is not complete, it is loaded again
+    do source.Clear(); while (!WriteContent([&source](const char* buffer, size_t length) { source.Append(buffer, length); }));
+    source.Finish();
+
+    // Content kept in the memory is probably the base of the next version too
+    guard.lock();
+    if (!contained && !source.IsMapped()) ChunkCache::Put(chunk_name, source.GetContent());
+}
+
+size_t FileChunk::GetRestoredBytes() { return restored_bytes; }
+
 const std::string& FileChunk::GetAncestorName() { return data->ancestor_chunk_name; }
 int FileChunk::GetDepth() { return data->depth; }
 size_t FileChunk::GetSize() { return data->chunk_size; }
+void FileChunk::SetCompression(chunk_codec codec) { data->compression = codec; }
+void FileChunk::SetHashAlgorithm(hash_algorithm algorithm) { data->hash = algorithm; }
 
 int FileChunk::SkipAncestor() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     size_t old_size = data->chunk_size;
     // 1. Get new ancestor
     if (data->ancestor_chunk_name.empty()) throw FileChunkException("FileChunk '"+data->chunk_name+"' has no ancestor, cannot skip ancestor\n");
@@ -164,37 +803,78 @@ int FileChunk::SkipAncestor() {
     if (ancestor == nullptr) throw FileChunkException("Cannot load ancestor '"+data->ancestor_chunk_name+"' of the FileChunk '"+data->chunk_name+"'\n");
     std::string new_ancestor_name = ancestor->GetAncestorName();
 
-    // TODO: Maybe some way to merge VCDIFFs instead of counting new?
-    // 2. Get this chunk content, and compute new VCDIFF
-    auto content = LoadAndReturn();
-
-    ProcessStringAndSave(new_ancestor_name, content);
+    // 2. Merge VCDIFF of the ancestor with this VCDIFF (no decoding needed)
+    std::string merged;
+    if (Config::GetConfig().mergeDeltas && ancestor->data->type == DELTA && VCDiffMerger::Merge(ancestor->data->LoadDelta(), data->LoadDelta(), merged)) {
+        std::shared_ptr<FileChunk> new_ancestor;
+        data->SetAncestor(new_ancestor_name, new_ancestor);
+        data->SaveDelta(merged);
+        data->FinishSave(new_ancestor);
+    } else {
+        // 3. Fallback, get this chunk content, and compute new VCDIFF
+        auto content = Load(true);
+        ProcessStringAndSave(new_ancestor_name, content);
+    }
     size_t new_size = data->chunk_size;
     return new_size - old_size;
 }
 
 int FileChunk::DeleteChunk() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     int size_change = -data->chunk_size;
     for (auto& chunk_name: data->derived_chunks) {
         size_change += GetChunk(chunk_name)->SkipAncestor();
     }
-    remove(Config::GetChunkFilename(data->chunk_name).c_str());
-    remove(Config::GetChunkFilename(data->chunk_name, true).c_str());
+    if (data->type == BLOCK_LIST) size_change += data->ReleaseBlocks();
+    // Chunk is out of the catalog on the disk before its data are removed (crash leaves only unused data)
+    Config::GetChunkCatalog()->Remove(data->chunk_name);
+    Config::GetChunkCatalog()->Flush();
+    // Contained chunk has no data of its own
+    if (data->type == CONTAINED) size_change += FileChunkData::ReleaseContainer(data->container_name);
+    else Config::GetChunkStorage()->Remove(data->chunk_name);
+    data->version++;
+    ChunkCache::Remove(data->chunk_name);
     if (!data->ancestor_chunk_name.empty()) GetChunk(data->ancestor_chunk_name)->RemoveDerivedChunk(data->chunk_name);
     loaded_chunks.erase(data->chunk_name);
     return size_change;
 }
 
+int FileChunk::Rebase(const std::string& ancestor_name) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    size_t old_size = data->chunk_size;
+    int old_depth = data->depth;
+    std::string old_ancestor_name = data->ancestor_chunk_name;
+
+    // 1. Encode the content against the new ancestor
+    auto content = Load(true);
+    ProcessStringAndSave(ancestor_name, content);
+
+    // 2. Unregister from the old ancestor and move the whole subtree
+    if (!old_ancestor_name.empty() && old_ancestor_name != ancestor_name) {
+        auto old_ancestor = GetChunk(old_ancestor_name);
+        if (old_ancestor != nullptr) old_ancestor->RemoveDerivedChunk(data->chunk_name);
+    }
+    if (data->depth != old_depth) {
+        for (auto& name: data->derived_chunks) {
+            auto chunk = GetChunk(name);
+            if (chunk != nullptr) chunk->data->ChangeDepth(data->depth - old_depth);
+        }
+    }
+    size_t new_size = data->chunk_size;
+    return new_size - old_size;
+}
+
 void FileChunk::AddDerivedChunk(std::string name) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     data->derived_chunks.push_back(name);
     data->SaveChunkInfo();
 }
 
 void FileChunk::RemoveDerivedChunk(std::string name) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     auto it = std::find(data->derived_chunks.begin(), data->derived_chunks.end(), name);
     if(it != data->derived_chunks.end()) data->derived_chunks.erase(it);
     data->SaveChunkInfo();
 }
 
 }
-CEREAL_CLASS_VERSION(FenixBackup::FileChunk::FileChunkData, 1);
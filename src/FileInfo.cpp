@@ -1,195 +1,210 @@
-#include <unordered_map>
 #include <string>
-
-#include <cereal/types/memory.hpp>
-#include <cereal/types/polymorphic.hpp>
-#include <cereal/types/string.hpp>
-#include <cereal/types/unordered_map.hpp>
+#include <vector>
+#include <iterator>
 
 #include "FenixExceptions.hpp"
 #include "FileInfo.hpp"
 #include "FileChunk.hpp"
 #include "Functions.hpp"
+#include "SimilarityIndex.hpp"
 
 namespace FenixBackup {
 
-// Hide data from .hpp file using PIMPL idiom
-class FileInfo::FileInfoData {
-  public:
-	file_type type;
-	version_file_status version_status = UNKNOWN;
-	file_params params = {};
-
-	// Versioning
-    unsigned int file_index;
-    unsigned int prev_version_id = 0;  // index of the file in the last version, 0 = no previous version
-
-    std::shared_ptr<FileInfo> parent;
-    std::string name;
-
-	// For directory
-	std::unordered_map<std::string, std::shared_ptr<FileInfo>> files;
-	// For ordinal file
-	std::string file_hash;
-
-    // Cache (not serialize)
-    std::string path;
-    std::shared_ptr<FileTree> tree;
-
-	FileInfoData(std::shared_ptr<FileTree> tree, file_type type, std::shared_ptr<FileInfo> parent, std::string const& name):
-		type{type}, parent{parent}, name{name}, tree{tree} {}
-
-    FileInfoData() : FileInfoData(nullptr, DIR, nullptr, "") {}
-
-    template <class Archive>
-    void serialize(Archive & ar, std::uint32_t const version) {
-        if (version == 1) ar(
-            cereal::make_nvp("name", name),
-            cereal::make_nvp("type", type),
-            cereal::make_nvp("version_status", version_status),
-            cereal::make_nvp("params", params),
-            cereal::make_nvp("file_index", file_index),
-            cereal::make_nvp("prev_version_id", prev_version_id),
-            cereal::make_nvp("parent", parent),
-            cereal::make_nvp("file_hash", file_hash),
-            cereal::make_nvp("files", files)
-        );
-        else throw FileInfoException("Unknown version "+std::to_string(version)+" of FileInfo serialized data\n");
-    }
-};
-
-// Constructors
-FileInfo::FileInfo(std::shared_ptr<FileTree> tree, file_type type, std::shared_ptr<FileInfo> parent, std::string const& name):
-	data{new FileInfoData(tree, type, parent, name)} {}
-FileInfo::FileInfo(): FileInfo(nullptr, DIR, nullptr, "") {}
+FileInfo::FileInfo(std::shared_ptr<FileTree> tree, unsigned int index): tree{tree}, index{index} {}
 
 FileInfo::~FileInfo() {}
 
-/*
-FileInfo::FileInfo(const FileInfo& other) {
-	//copy ctor
-}
-
-FileInfo& FileInfo::operator=(const FileInfo& rhs) {
-	if (this == &rhs) return *this; // handle self assignment
-	//assignment operator
-	return *this;
-}
-*/
-
-// Serialization -- must explicitly specify each archive type because of Cereal checks
-void FileInfo::serialize_internal(cereal::JSONOutputArchive & archive) {
-  archive(cereal::make_nvp("FileInfoData", data));
-}
-void FileInfo::serialize_internal(cereal::JSONInputArchive & archive) {
-  archive(cereal::make_nvp("FileInfoData", data));
-}
-void FileInfo::serialize_internal(cereal::BinaryOutputArchive & archive) {
-  archive(cereal::make_nvp("FileInfoData", data));
-}
-void FileInfo::serialize_internal(cereal::BinaryInputArchive & archive) {
-  archive(cereal::make_nvp("FileInfoData", data));
-}
+const NodeStore::node_record& FileInfo::Record() { return tree->GetNodes().Get(index); }
+NodeStore::node_record& FileInfo::EditRecord() { return tree->GetNodes().Edit(index); }
 
-void FileInfo::AddChild(std::string const& name, std::shared_ptr<FileInfo> child) {
-	if (data->type != DIR) throw std::runtime_error("Cannot add child to not-dir FileInfo");
-	data->files.insert(std::make_pair(name, child));
-}
 std::shared_ptr<FileInfo> FileInfo::GetChild(std::string const& name) {
-	if (data->type != DIR) throw std::runtime_error("Cannot get child from not-dir FileInfo");
-	auto i = data->files.find(name);
-	if (i == data->files.end()) return nullptr;
-	else return i->second;
+	if (GetType() != DIR) throw std::runtime_error("Cannot get child from not-dir FileInfo");
+	return tree->GetFileById(tree->GetNodes().FindChild(index, name));
 }
 
-const std::unordered_map<std::string, std::shared_ptr<FileInfo>>& FileInfo::GetChilds() { return data->files; }
+std::vector<std::shared_ptr<FileInfo>> FileInfo::GetChilds() {
+	std::vector<std::shared_ptr<FileInfo>> childs;
+	if (GetType() != DIR) return childs;
+	for (auto id: tree->GetNodes().GetChildren(index)) childs.push_back(tree->GetFileById(id));
+	return childs;
+}
 
 std::ostream& FileInfo::GetFileContent(std::ostream& out) {
-    if (data->type == DIR) throw FileInfoException("Cannot get content of directory\n");
-    if (data->version_status == DELETED) throw FileInfoException("Cannot get file content of deleted file\n");
-    if (data->file_hash.empty()) throw FileInfoException("Cannot get file content of unsaved file\n");
+    std::string file_hash = GetHash();
+    if (GetType() == DIR) throw FileInfoException("Cannot get content of directory\n");
+    if (GetStatus() == DELETED) throw FileInfoException("Cannot get file content of deleted file\n");
+    if (file_hash.empty()) throw FileInfoException("Cannot get file content of unsaved file\n");
 
-    auto chunk = FileChunk::GetChunk(data->file_hash);
+    auto chunk = FileChunk::GetChunk(file_hash);
     if (chunk != nullptr) out << chunk->LoadAndReturn();
     return out;
 }
 
-void FileInfo::ProcessFileContent(std::istream& file, std::shared_ptr<FileTree> tree) {
-    if (data->type == DIR) throw FileInfoException("Cannot process content for directory\n");
+size_t FileInfo::GetFileContent(int fd) {
+    std::string file_hash = GetHash();
+    if (GetType() == DIR) throw FileInfoException("Cannot get content of directory\n");
+    if (GetStatus() == DELETED) throw FileInfoException("Cannot get file content of deleted file\n");
+    if (file_hash.empty()) throw FileInfoException("Cannot get file content of unsaved file\n");
 
-    // 1. Count SHA256 hash of the given file
-    data->file_hash = Functions::ComputeFileHash(file);
+    auto chunk = FileChunk::GetChunk(file_hash);
+    if (chunk == nullptr) return 0;
+    return chunk->LoadAndWrite(fd);
+}
+
+void FileInfo::ProcessFileContent(std::istream& file, std::shared_ptr<FileTree> tree, FileChunk::Container* container) {
+    if (GetType() == DIR) throw FileInfoException("Cannot process content for directory\n");
+    auto& params = GetParams();
+    auto rules = Config::GetRules(GetPath(), params);
+    // Small new content goes into the container, whole (not as a delta)
+    auto& config = Config::GetConfig();
+    bool contained = (container != nullptr && !rules.cdc && config.containerFileSize > 0 && params.file_size <= config.containerFileSize);
+    // Hashes are comparable only with a previous tree hashed by the same algorithm
+    hash_algorithm algorithm = (tree != nullptr ? tree->GetHashAlgorithm() : Config::GetConfig().hashAlgorithm);
+    bool same_algorithm = (tree != nullptr && tree->GetPrevTree() != nullptr && tree->GetPrevTree()->GetHashAlgorithm() == algorithm);
+
+    // 0. File with different size than its previous version surely changed and a new file has to be
+    // saved too (unless it is found by its hash), they are hashed while they are encoded into
+    // a temporary chunk, so they are read only once
+    auto prev_version_node = (tree != nullptr && tree->GetPrevTree() != nullptr && GetPrevVersionId() != 0
+        ? tree->GetPrevTree()->GetFileById(GetPrevVersionId()) : nullptr);
+    if (prev_version_node != nullptr && !rules.cdc && !contained && params.file_size != prev_version_node->GetParams().file_size) {
+        ProcessChangedContent(file, prev_version_node->GetHash(), rules.compression, algorithm);
+        return;
+    }
+    if (GetPrevVersionId() == 0 && !rules.cdc && !contained) {
+        ProcessChangedContent(file, "", rules.compression, algorithm, same_algorithm ? tree->GetPrevTree() : nullptr);
+        return;
+    }
+
+    // 1. Count hash of the given file, small content for the container is read into memory and hashed there
+    std::string content, file_hash;
+    if (contained) {
+        content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        file_hash = Functions::ComputeHash(content, algorithm);
+    } else file_hash = Functions::ComputeFileHash(file, algorithm);
+    SetHash(file_hash);
 
     // 2. If UNKNOWN ancestor try to localize it using file_hash
-    if (data->version_status == UNKNOWN && tree != nullptr  && tree->GetPrevTree() != nullptr) {
-        auto prev_version_node = tree->GetPrevTree()->GetFileByHash(data->file_hash);
+    if (GetStatus() == UNKNOWN && same_algorithm) {
+        auto prev_version_node = tree->GetPrevTree()->GetFileByHash(file_hash);
         if (prev_version_node != nullptr) {
-            data->prev_version_id = prev_version_node->GetId();
+            SetPrevVersionId(prev_version_node->GetId());
             // file_node->SetChunkName(prev_version_node->GetChunkName());
-            data->version_status = (data->params == prev_version_node->GetParams() ? UNCHANGED : UPDATED_PARAMS);
+            SetStatus(params == prev_version_node->GetParams() ? UNCHANGED : UPDATED_PARAMS);
             return;
         }
     }
     // If file has the same size and same hash as older file, there were only params updated
-    if (tree != nullptr && tree->GetPrevTree() != nullptr && data->prev_version_id != 0) {
-            auto prev_version_node = tree->GetPrevTree()->GetFileById(data->prev_version_id);
+    if (same_algorithm && GetPrevVersionId() != 0) {
+            auto prev_version_node = tree->GetPrevTree()->GetFileById(GetPrevVersionId());
             if (prev_version_node != nullptr
-                && data->params.file_size == prev_version_node->GetParams().file_size
-                && data->file_hash == prev_version_node->GetHash()
+                && params.file_size == prev_version_node->GetParams().file_size
+                && file_hash == prev_version_node->GetHash()
             ) {
-                data->version_status = UPDATED_PARAMS;
+                SetStatus(UPDATED_PARAMS);
                 return;
             }
     }
 
-    // 3. Test if exists chunk for this file_hash and eventually save it
-    if (FileChunk::GetChunk(data->file_hash) == nullptr) {
-        FileChunk chunk(data->file_hash);
-        std::string prev_hash = (data->prev_version_id != 0 ? tree->GetPrevTree()->GetFileById(data->prev_version_id)->GetHash() : "" );
-        if (!prev_hash.empty()) {
-            auto current_chunk = FileChunk::GetChunk(prev_hash);
-            // If the depth of chunks is too big, set the root of this chunk "branch" as prev_chunk
-            if (current_chunk == nullptr) prev_hash = "";
-            else if (current_chunk->GetDepth() >= Config::GetConfig().maxChunkDepth) {
-                while (current_chunk != nullptr && current_chunk->GetDepth() != 0) {
-                    prev_hash = current_chunk->GetAncestorName();
-                    current_chunk = FileChunk::GetChunk(prev_hash);
-                }
-            }
-        }
-        chunk.ProcessStreamAndSave(prev_hash, file);
+    // 3. Test if exists chunk for this file_hash and eventually save it (another thread with the same content waits)
+    FileChunk::Reservation reservation(file_hash);
+    if (FileChunk::GetChunk(file_hash) == nullptr && rules.cdc) {
+        FileChunk chunk(file_hash);
+        chunk.SetCompression(rules.compression);
+        chunk.SetHashAlgorithm(algorithm);
+        chunk.ProcessBlocksAndSave(file);
+    } else if (FileChunk::GetChunk(file_hash) == nullptr && contained) {
+        // False when another container has it already
+        container->Add(file_hash, content, rules.compression, algorithm);
+    } else if (FileChunk::GetChunk(file_hash) == nullptr) {
+        FileChunk chunk(file_hash);
+        chunk.SetCompression(rules.compression);
+        chunk.SetHashAlgorithm(algorithm);
+        std::string prev_hash = (GetPrevVersionId() != 0 ? tree->GetPrevTree()->GetFileById(GetPrevVersionId())->GetHash() : "" );
+        // Sketch for future lookups of similar files is computed while encoding
+        SimilarityIndex::sketch file_sketch;
+        std::function<void(const char*, size_t)> update_sketch;
+        if (config.similarityIndex && params.file_size >= config.similarityMinSize)
+            update_sketch = [&file_sketch](const char* buffer, size_t length) { SimilarityIndex::UpdateSketch(file_sketch, buffer, length); };
+
+        if (Config::GetConfig().reverseDeltas) chunk.ProcessStreamAndRebase(prev_hash, file, update_sketch);
+        else chunk.ProcessStreamAndSave(FileChunk::GetDeltaBase(prev_hash), file, update_sketch);
+        SimilarityIndex::Add(file_hash, file_sketch);
     }
 
     // 4. Update info for this file
-    data->version_status = (data->version_status == UNKNOWN ? NEW : UPDATED_FILE);
+    SetStatus(GetStatus() == UNKNOWN ? NEW : UPDATED_FILE);
 }
 
-// Setters
-void FileInfo::SetParams(const file_params& params) { data->params = params; }
-void FileInfo::SetStatus(version_file_status status) { data->version_status = status; }
-void FileInfo::SetId(unsigned int index) { data->file_index = index; }
-void FileInfo::SetPrevVersionId(unsigned int index) { data->prev_version_id = index; }
-void FileInfo::SetHash(const std::string& file_hash) { data->file_hash = file_hash; }
-void FileInfo::SetTree(std::shared_ptr<FileTree> tree) { data->tree = tree; }
+void FileInfo::ProcessChangedContent(std::istream& file, const std::string& prev_hash, chunk_codec compression, hash_algorithm algorithm,
+    std::shared_ptr<FileTree> prev_tree) {
+    bool reverse = Config::GetConfig().reverseDeltas;
+    bool sketch = (Config::GetConfig().similarityIndex && GetParams().file_size >= Config::GetConfig().similarityMinSize);
+    SimilarityIndex::sketch file_sketch;
+
+    FileChunk chunk(FileChunk::GetTempName());
+    chunk.SetCompression(compression);
+    chunk.SetHashAlgorithm(algorithm);
+    std::string file_hash = chunk.ProcessStreamToTemp(reverse ? "" : FileChunk::GetDeltaBase(prev_hash), file,
+        [sketch, &file_sketch](const char* buffer, size_t length) {
+            if (sketch) SimilarityIndex::UpdateSketch(file_sketch, buffer, length);
+        });
+    SetHash(file_hash);
+
+    // 1. New file can be a moved or copied file of the previous tree
+    if (GetStatus() == UNKNOWN && prev_tree != nullptr) {
+        auto prev_version_node = prev_tree->GetFileByHash(file_hash);
+        if (prev_version_node != nullptr) {
+            chunk.Discard();
+            SetPrevVersionId(prev_version_node->GetId());
+            SetStatus(GetParams() == prev_version_node->GetParams() ? UNCHANGED : UPDATED_PARAMS);
+            return;
+        }
+    }
 
-// Getters
-const file_params& FileInfo::GetParams() { return data->params; }
-const std::string& FileInfo::GetName() { return data->name; }
-version_file_status FileInfo::GetStatus() { return data->version_status; }
-unsigned int FileInfo::GetId() { return data->file_index; }
-file_type FileInfo::GetType() { return data->type; }
-const std::string& FileInfo::GetPath() {
-    if (data->path.empty()) {
-        auto parent = GetParent();
-        if (parent != nullptr) data->path = parent->GetPath() + "/" + GetName();
-        else data->path = ".";
+    // 2. Content may be already stored (e.g. file returned to an older version or saved by another thread)
+    FileChunk::Reservation reservation(file_hash);
+    if (FileChunk::GetChunk(file_hash) != nullptr) chunk.Discard();
+    else {
+        // 3. New file similar to a stored one is read again and encoded against it
+        std::string similar_hash = (prev_hash.empty() && !file_sketch.empty() ? SimilarityIndex::FindSimilar(file_sketch) : "");
+        if (similar_hash.empty()) {
+            chunk.Commit(file_hash);
+            if (reverse) chunk.RebasePrevious(prev_hash);
+        } else {
+            // Forward delta even with reverseDeltas, the similar chunk belongs to another file
+            chunk.Discard();
+            FileChunk similar_chunk(file_hash);
+            similar_chunk.SetCompression(compression);
+            similar_chunk.SetHashAlgorithm(algorithm);
+            file.clear();
+            file.seekg(0);
+            similar_chunk.ProcessStreamAndSave(FileChunk::GetDeltaBase(similar_hash), file);
+            SimilarityIndex::CountMatch(GetParams().file_size, similar_chunk.GetSize());
+        }
+        SimilarityIndex::Add(file_hash, file_sketch);
     }
-    return data->path;
+    SetStatus(GetStatus() == UNKNOWN ? NEW : UPDATED_FILE);
 }
-std::shared_ptr<FileInfo> FileInfo::GetParent() { return data->parent; }
-unsigned int FileInfo::GetPrevVersionId() { return data->prev_version_id; }
-const std::string& FileInfo::GetHash() { return data->file_hash; }
-std::shared_ptr<FileTree> FileInfo::GetTree() { return data->tree; }
+
+// Setters
+void FileInfo::SetParams(const file_params& params) { EditRecord().params = params; }
+void FileInfo::SetStatus(version_file_status status) { EditRecord().status = status; }
+void FileInfo::SetPrevVersionId(unsigned int index) { EditRecord().prev_version_id = index; }
+void FileInfo::SetHardLinkId(unsigned int index) { EditRecord().hard_link_id = index; }
+void FileInfo::SetHash(const std::string& file_hash) { tree->GetNodes().SetHash(index, file_hash); }
+
+// Getters
+const file_params& FileInfo::GetParams() { return Record().params; }
+std::string FileInfo::GetName() { return tree->GetNodes().GetName(index); }
+version_file_status FileInfo::GetStatus() { return (version_file_status)Record().status; }
+unsigned int FileInfo::GetId() { return index; }
+file_type FileInfo::GetType() { return (file_type)Record().type; }
+std::string FileInfo::GetPath() { return tree->GetNodes().GetPath(index); }
+std::shared_ptr<FileInfo> FileInfo::GetParent() { return (index == 1 ? nullptr : tree->GetFileById(Record().parent)); }
+unsigned int FileInfo::GetPrevVersionId() { return Record().prev_version_id; }
+unsigned int FileInfo::GetHardLinkId() { return Record().hard_link_id; }
+std::string FileInfo::GetHash() { return tree->GetNodes().GetHash(index); }
+std::shared_ptr<FileTree> FileInfo::GetTree() { return tree; }
 
 }
-CEREAL_CLASS_VERSION(FenixBackup::FileInfo::FileInfoData, 1);
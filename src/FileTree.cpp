@@ -1,4 +1,5 @@
 #include <vector>
+#include <map>
 #include <fstream>
 #include <ctime>
 #include <boost/filesystem.hpp>
@@ -14,48 +15,115 @@
 
 namespace FenixBackup {
 
-std::unordered_map<std::string, std::shared_ptr<FileTree>> FileTree::history_trees;
-std::vector<std::string> FileTree::history_trees_list;
+std::unordered_map<std::string, std::weak_ptr<FileTree>> FileTree::history_trees;
+std::list<std::shared_ptr<FileTree>> FileTree::cached_trees;
+size_t FileTree::cached_size = 0;
+std::recursive_mutex FileTree::history_lock;
+
+/**
+ * Node of trees saved by versions 1 and 2 (a FileInfo and its data serialized by pointers),
+ * they are loaded only to be converted into the NodeStore
+ */
+class LegacyNode {
+  public:
+    virtual ~LegacyNode() {} // FileInfo was polymorphic, so its pointers were saved with polymorphic ids
+
+    class LegacyNodeData {
+      public:
+        file_type type = DIR;
+        version_file_status version_status = UNKNOWN;
+        file_params params = {};
+        unsigned int file_index = 0;
+        unsigned int prev_version_id = 0;
+        unsigned int hard_link_id = 0;
+        std::shared_ptr<LegacyNode> parent;
+        std::string name;
+        std::string file_hash;
+        std::unordered_map<std::string, std::shared_ptr<LegacyNode>> files;
+
+        template <class Archive>
+        void serialize(Archive & ar, std::uint32_t const version) {
+            if (version != 1 && version != 2) throw FileInfoException("Unknown version "+std::to_string(version)+" of FileInfo serialized data\n");
+            ar(
+                cereal::make_nvp("name", name),
+                cereal::make_nvp("type", type),
+                cereal::make_nvp("version_status", version_status),
+                cereal::make_nvp("params", params),
+                cereal::make_nvp("file_index", file_index),
+                cereal::make_nvp("prev_version_id", prev_version_id),
+                cereal::make_nvp("parent", parent),
+                cereal::make_nvp("file_hash", file_hash),
+                cereal::make_nvp("files", files)
+            );
+            // Version 1 files have no hard links
+            if (version >= 2) ar(
+                cereal::make_nvp("link_count", params.link_count),
+                cereal::make_nvp("hard_link_id", hard_link_id)
+            );
+        }
+    };
+    std::unique_ptr<LegacyNodeData> data;
+
+    template <class Archive>
+    void serialize(Archive & ar) {
+        ar(cereal::make_nvp("FileInfoData", data));
+    }
+};
 
 // Hide data from .hpp file using PIMP idiom
 class FileTree::FileTreeData {
   public:
     FileTreeData(bool not_initialize = false);
 
-	std::shared_ptr<FileInfo> root;
+	NodeStore nodes;
 	std::string tree_name;
 	time_t construct_time;
+	hash_algorithm hash = SHA256_HASH; // Algorithm of file hashes (and of prev_version_hash)
 
 	// Versioning
 	std::string prev_version_tree_name;
 	std::string prev_version_hash;
+	unsigned int delta_depth = 0; // Saved as a delta of the previous tree (depth of the chain), 0 = whole
 
-    // Cache - not serialized
-	std::vector<std::shared_ptr<FileInfo>> files;
-	std::unordered_map<std::string, std::shared_ptr<FileInfo>> file_hashes;
-	bool loaded_arrays = false;
-	std::shared_ptr<FileTree> this_tree;
-	bool in_tree_list = true;
-
-    std::vector<std::pair<std::shared_ptr<FileInfo>, int>> files_to_process;
+    // Previous tree (new tree), or base of the delta (loaded tree)
+    std::shared_ptr<FileTree> prev_tree;
 
-	std::shared_ptr<FileInfo> AddNode(file_type type, std::shared_ptr<FileInfo> parent, const std::string& name, const file_params& params);
-	void CountScore(std::shared_ptr<FileInfo> file, const Config::Rules& rules);
+    // Cache - not serialized
+    bool cached = false; // In FileTree::cached_trees
+    std::list<std::shared_ptr<FileTree>>::iterator cache_position;
+    size_t cache_size = 0; // Memory of the nodes when the tree was used the last time
+
+    std::vector<std::pair<unsigned int, int>> files_to_process;
+    std::map<std::pair<dev_t, ino_t>, unsigned int> inodes; // Files with more hard links -> id of the first one
+    std::vector<unsigned int> hard_links; // Other links, they are not processed
+
+	/// Return id of the new node, 0 when it is not backed up
+	unsigned int AddNode(file_type type, unsigned int parent, const std::string& name, const file_params& params);
+	void CountScore(unsigned int file, const Config::Rules& rules);
+	/// Hard links get hash of their first link (when it was processed) and status against their previous version
+	void UpdateHardLinks();
+	/// Move nodes of the tree saved by version 1 or 2 into the NodeStore (ids are kept)
+	void LoadLegacy(std::shared_ptr<LegacyNode> root);
 
     template <class Archive>
     void save(Archive & ar, std::uint32_t const version) const {
-        if (version == 1) ar(
+        // Sections of the nodes follow the archive (NodeStore::WriteSections)
+        if (version == 6) ar(
             cereal::make_nvp("tree_name", tree_name),
             cereal::make_nvp("construct_time", construct_time),
+            cereal::make_nvp("hash", hash),
             cereal::make_nvp("prev_version_tree_name", prev_version_tree_name),
             cereal::make_nvp("prev_version_hash", prev_version_hash),
-            cereal::make_nvp("root", root)
+            cereal::make_nvp("delta_depth", delta_depth)
         );
         else throw FileTreeException("Unknown version "+std::to_string(version)+" of FileTree serialized data\n");
+        nodes.SaveSizes(ar);
     }
 
     template <class Archive>
     void load(Archive & ar, std::uint32_t const version) {
+        std::shared_ptr<LegacyNode> root;
+        // Version 1 trees were always hashed by SHA-256
         if (version == 1) ar(
             cereal::make_nvp("tree_name", tree_name),
             cereal::make_nvp("construct_time", construct_time),
@@ -63,39 +131,37 @@ class FileTree::FileTreeData {
             cereal::make_nvp("prev_version_hash", prev_version_hash),
             cereal::make_nvp("root", root)
         );
+        else if (version == 2) ar(
+            cereal::make_nvp("tree_name", tree_name),
+            cereal::make_nvp("construct_time", construct_time),
+            cereal::make_nvp("hash", hash),
+            cereal::make_nvp("prev_version_tree_name", prev_version_tree_name),
+            cereal::make_nvp("prev_version_hash", prev_version_hash),
+            cereal::make_nvp("root", root)
+        );
+        else if (version >= 3 && version <= 6) ar(
+            cereal::make_nvp("tree_name", tree_name),
+            cereal::make_nvp("construct_time", construct_time),
+            cereal::make_nvp("hash", hash),
+            cereal::make_nvp("prev_version_tree_name", prev_version_tree_name),
+            cereal::make_nvp("prev_version_hash", prev_version_hash)
+        );
         else throw FileTreeException("Unknown version "+std::to_string(version)+" of FileTree serialized data\n");
+        // Version 4 trees are always whole
+        if (version >= 5) ar(cereal::make_nvp("delta_depth", delta_depth));
 
-        // Construct arrays files and file_hashes
-        files.push_back(nullptr);
-        files.push_back(root);
-        LoadArrays(root);
-        loaded_arrays = true;
-    }
-
-    void LoadArrays(std::shared_ptr<FileInfo> node) {
-        if(node->GetId() >= files.size()) files.resize(node->GetId() + 1);
-        files[node->GetId()] = node;
-
-        if (node->GetType() == DIR) {
-            for(auto file: node->GetChilds()) LoadArrays(file.second);
-        } else {
-            file_hashes.insert(std::make_pair(node->GetHash(), node));
-        }
-    }
-
-    void UpdateTreeLinks() {
-         // Register this_tree as tree in each FileInfo
-        for(auto& file: files) if (file != nullptr) file->SetTree(this_tree);
+        // Version 3 trees have the nodes inside the archive, newer ones only sizes of the sections (they are mapped later)
+        if (version == 3) nodes.LoadInline(ar);
+        if (version >= 4) nodes.LoadSizes(ar, version);
+        if (root != nullptr) LoadLegacy(root);
     }
 };
 
 FileTree::FileTreeData::FileTreeData(bool initialize) {
     if (!initialize) return;
-    in_tree_list = false; // It is new tree
-    root = std::make_shared<FileInfo>(this_tree, DIR, nullptr, "");
-    root->SetId(1); root->SetPrevVersionId(1);
-    files.push_back(nullptr);
-    files.push_back(root);
+    hash = Config::GetConfig().hashAlgorithm;
+    unsigned int root = nodes.Add(DIR, 0, "", file_params());
+    nodes.Edit(root).prev_version_id = 1;
 
     // Construct tree name from current datetime
     std::tm* timeinfo;
@@ -112,20 +178,25 @@ FileTree::FileTreeData::FileTreeData(bool initialize) {
             // New name is substring of the previous name -> more FileTrees from the same datetime, add char to the end
             tree_name = tree_name+"x";
         }
-        // Count SHA256 hash of the previous tree and save it
+        // Count hash of the previous tree and save it
         std::ifstream file(Config::GetTreeFilename(prev_version_tree_name));
-        prev_version_hash = Functions::ComputeFileHash(file);
+        prev_version_hash = Functions::ComputeFileHash(file, hash);
+
+        // Nodes keep ids of their previous versions, every treeKeyframeInterval-th tree is saved whole
+        prev_tree = FileTree::GetHistoryTree(prev_version_tree_name);
+        delta_depth = (prev_tree->data->delta_depth + 1) % std::max(1u, Config::GetConfig().treeKeyframeInterval);
+        nodes.SetPrevious(prev_tree->GetNodes(), delta_depth > 0);
     }
 }
 
-void FileTree::FileTreeData::CountScore(std::shared_ptr<FileInfo> file, const Config::Rules& rules) {
+void FileTree::FileTreeData::CountScore(unsigned int file, const Config::Rules& rules) {
     // Score = time_from_last_backup * priority;
     int age;
     if (prev_version_tree_name.empty()) age = 1;
-    else if (file->GetPrevVersionId() == 0) age = construct_time - this_tree->GetPrevTree()->GetConstructTime();
+    else if (nodes.Get(file).prev_version_id == 0) age = construct_time - FileTree::GetHistoryTree(prev_version_tree_name)->GetConstructTime();
     else {
-        auto tree = this_tree->GetPrevTree();
-        auto prev_file = tree->GetFileById(file->GetPrevVersionId());
+        auto tree = FileTree::GetHistoryTree(prev_version_tree_name);
+        auto prev_file = tree->GetFileById(nodes.Get(file).prev_version_id);
         while (tree->GetPrevTree() != nullptr && prev_file->GetPrevVersionId() != 0
             && (prev_file->GetStatus() == UNKNOWN || prev_file->GetStatus() == NOT_UPDATED)
         ) {
@@ -137,6 +208,108 @@ void FileTree::FileTreeData::CountScore(std::shared_ptr<FileInfo> file, const Co
     files_to_process.push_back(std::make_pair(file, age * rules.priority));
 }
 
+void FileTree::FileTreeData::UpdateHardLinks() {
+    for (auto link: hard_links) {
+        std::string first_hash = nodes.GetHash(nodes.Get(link).hard_link_id);
+        if (first_hash.empty() || first_hash == nodes.GetHash(link)) continue;
+        nodes.SetHash(link, first_hash);
+
+        auto& record = nodes.Edit(link);
+        auto prev_version_file = (record.prev_version_id != 0 ? FileTree::GetHistoryTree(prev_version_tree_name)->GetFileById(record.prev_version_id) : nullptr);
+        if (prev_version_file != nullptr && prev_version_file->GetHash() == first_hash)
+            record.status = (record.params == prev_version_file->GetParams() ? UNCHANGED : UPDATED_PARAMS);
+        else record.status = (record.status == UNKNOWN ? NEW : UPDATED_FILE);
+    }
+}
+
+void FileTree::FileTreeData::LoadLegacy(std::shared_ptr<LegacyNode> root) {
+    std::vector<std::shared_ptr<LegacyNode>> stack{root};
+    while (!stack.empty()) {
+        auto node = std::move(stack.back());
+        stack.pop_back();
+        auto& info = *node->data;
+        if (info.file_index >= nodes.Size()) nodes.Resize(info.file_index + 1);
+
+        auto& record = nodes.Edit(info.file_index);
+        record.params = info.params;
+        record.parent = (info.parent != nullptr ? info.parent->data->file_index : 0);
+        record.prev_version_id = info.prev_version_id;
+        record.hard_link_id = info.hard_link_id;
+        record.type = info.type;
+        record.status = info.version_status;
+        nodes.SetName(info.file_index, info.name);
+        if (info.type != DIR) nodes.SetHash(info.file_index, info.file_hash);
+
+        // Children hold their parents, the cycles are broken so the nodes are freed
+        for (auto& file: info.files) stack.push_back(std::move(file.second));
+        info.files.clear();
+        info.parent = nullptr;
+    }
+    nodes.SortChildren();
+}
+
+unsigned int FileTree::FileTreeData::AddNode(file_type type, unsigned int parent, std::string const& name, const file_params& params) {
+	if (nodes.Get(parent).type != DIR) throw std::invalid_argument("Parent must be dir");
+
+    // Test if we want to backup this file
+    auto rules = Config::GetRules(nodes.GetPath(parent) + "/" + name, params);
+    if ((type == DIR && !rules.scan) || (type == FILE && !rules.backup) ) return 0;
+
+	// Find previous known version of file, the node gets its id
+	unsigned int prev_version_file = 0;
+	unsigned int prev_version_parent = nodes.Get(parent).prev_version_id;
+	if (prev_tree != nullptr && prev_version_parent != 0) {
+		auto& prev_nodes = prev_tree->GetNodes();
+		prev_version_file = (prev_nodes.Exists(prev_version_parent) && prev_nodes.Get(prev_version_parent).type == DIR
+			? prev_nodes.FindChild(prev_version_parent, name) : 0);
+		// Match only files to files and dirs to dirs (else UNKNOWN)
+		if (prev_version_file != 0 && prev_nodes.Get(prev_version_file).type != type) prev_version_file = 0;
+	}
+	unsigned int file = nodes.Add(type, parent, name, params, prev_version_file);
+
+	// Content of hard links is processed once, by the first one
+	if (type == FILE && params.link_count > 1) {
+		auto first = inodes.insert(std::make_pair(std::make_pair(params.device, params.inode), file));
+		if (!first.second) {
+			nodes.Edit(file).hard_link_id = first.first->second;
+			hard_links.push_back(file);
+		}
+	}
+
+	// Set status against the previous version
+	version_file_status status = UNKNOWN;
+	if (prev_version_file != 0) {
+		auto& prev_nodes = prev_tree->GetNodes();
+		nodes.Edit(file).prev_version_id = prev_version_file;
+		auto& prev_version_params = prev_nodes.Get(prev_version_file).params;
+		auto prev_version_status = (version_file_status)prev_nodes.Get(prev_version_file).status;
+		if (type == DIR) {
+			// Check only params
+			status = (params == prev_version_params ? UNCHANGED : UPDATED_PARAMS);
+		} else { // FILE or SYMLINK
+			if (prev_version_params.file_size != params.file_size || prev_version_params.modification_time != params.modification_time
+			|| prev_version_status == UNKNOWN || prev_version_status == NOT_UPDATED)
+				// If previous file is UNKNOWN (no known previous version and not processed) -> UNKNOWN
+				// else (if there is at least one known and proccessed previous version) -> NOT_UPDATED
+				// Newest version of each file can't be DELETED
+				status = prev_version_status == UNKNOWN ? UNKNOWN : NOT_UPDATED;
+			else {
+				status = (params == prev_version_params ? UNCHANGED : UPDATED_PARAMS);
+				// No change to the file content -> same hash and chunk name as the previous
+				// (even when the previous tree used another hash algorithm, the chunk is not hashed again)
+				nodes.CopyHash(file, prev_nodes, prev_version_file);
+			}
+		}
+	}
+	if (type == DIR && status == UNKNOWN) status = NEW; // When DIR, there are no data to save -> we have done all work for this file
+	nodes.Edit(file).status = status;
+
+	// Count score and add file to score-heap
+	if ((type == FILE || type == SYMLINK) && status != UNCHANGED && status != UPDATED_PARAMS && nodes.Get(file).hard_link_id == 0) CountScore(file, rules);
+
+	return file;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 FileTree::FileTree(): data{new FileTreeData(true)} {}
@@ -149,6 +322,12 @@ FileTree::FileTree(std::string name) {
     cereal::BinaryInputArchive archive(is);
 
     archive(data);
+    if (data->delta_depth > 0) {
+        data->prev_tree = FileTree::GetHistoryTree(data->prev_version_tree_name);
+        if (data->prev_tree == nullptr)
+            throw FileTreeException("Couldn't load FileTree '"+name+"', it is a delta of the missing tree '"+data->prev_version_tree_name+"'\n");
+    }
+    data->nodes.MapSections(Config::GetTreeFilename(name), is.tellg(), data->prev_tree != nullptr ? &data->prev_tree->GetNodes() : nullptr);
 }
 
 FileTree::~FileTree() { }
@@ -157,37 +336,14 @@ FileTree::~FileTree() { }
 	//copy ctor
 }*/
 
-std::shared_ptr<FileInfo> FileTree::GetRoot() { return data->root; }
+std::shared_ptr<FileInfo> FileTree::GetRoot() { return GetFileById(1); }
 
-const std::vector<std::shared_ptr<FileInfo>>& FileTree::GetAllFiles() {
-    if (!data->loaded_arrays) {
-        data->LoadArrays(GetRoot());
-        data->loaded_arrays = true;
-    }
-    return data->files;
-}
+unsigned int FileTree::GetLastId() { return data->nodes.Size() - 1; }
 
-const std::vector<std::string>& FileTree::GetHistoryTreeList() {
-    if (history_trees_list.empty()) {
-        boost::filesystem::path dir(Config::GetTreeDir());
-        try {
-            if (boost::filesystem::exists(dir) && boost::filesystem::is_directory(dir)) {
-                for (boost::filesystem::directory_iterator file(dir); file != boost::filesystem::directory_iterator(); ++file) {
-                    if (boost::filesystem::is_regular_file(file->path())
-                    && boost::filesystem::extension(file->path()) == Config::GetConfig().treeFileExtension) {
-                        history_trees_list.push_back(boost::filesystem::basename(file->path()));
-                    }
-                }
-            }
-            // TODO: What else? Error, create directory itself or nothing?
-            else throw FileTreeException("Directory '"+Config::GetTreeDir()+"' missing\n");
-        } catch (const boost::filesystem::filesystem_error& ex) {
-            throw FileTreeException("Problem when parsing data directory '"+Config::GetTreeDir()+"'\n");
-        }
-        sort(history_trees_list.begin(), history_trees_list.end());
-    }
+NodeStore& FileTree::GetNodes() { return data->nodes; }
 
-    return history_trees_list;
+const std::vector<std::string>& FileTree::GetHistoryTreeList() {
+    return Config::GetTreeCatalog()->GetTreeList();
 }
 
 const std::string FileTree::GetNewestTreeName() {
@@ -197,124 +353,114 @@ const std::string FileTree::GetNewestTreeName() {
 }
 
 std::shared_ptr<FileTree> FileTree::GetHistoryTree(std::string name) {
-	if (history_trees.find(name) == history_trees.end()) {
-        if(!std::ifstream(Config::GetTreeFilename(name)).good()) return nullptr;
-		history_trees.insert(std::make_pair(name, std::make_shared<FileTree>(name)));
+    std::lock_guard<std::recursive_mutex> guard(history_lock);
+    auto it = history_trees.find(name);
+    auto tree = (it != history_trees.end() ? it->second.lock() : nullptr);
+    if (tree == nullptr) {
+        // Released trees are loaded again
+        tree_info info;
+        info.tree_name = name;
+        if (!Config::GetTreeCatalog()->Load(info) || !std::ifstream(Config::GetTreeFilename(name)).good()) return nullptr;
+        tree = std::make_shared<FileTree>(name);
+        history_trees[name] = tree;
+    }
+    CacheTree(tree);
+    return tree;
+}
+
+bool FileTree::ReadTreeInfo(const std::string& name, tree_info& info) {
+    std::ifstream is(Config::GetTreeFilename(name), std::ios::binary);
+    if (!is.good()) return false;
+    std::unique_ptr<FileTreeData> tree_data;
+    {
+        cereal::BinaryInputArchive archive(is);
+        archive(tree_data);
+    }
+    info.tree_name = name;
+    info.construct_time = tree_data->construct_time;
+    info.prev_tree_name = tree_data->prev_version_tree_name;
+    info.node_count = tree_data->nodes.Size() - 1;
+    info.stored_bytes = boost::filesystem::file_size(Config::GetTreeFilename(name));
+    return true;
+}
+
+void FileTree::CacheTree(const std::shared_ptr<FileTree>& tree) {
+    auto& cached = *tree->data;
+    if (cached.cached && cached.cache_position == cached_trees.begin()) return;
+    if (cached.cached) {
+        cached_trees.splice(cached_trees.begin(), cached_trees, cached.cache_position);
+        cached_size -= cached.cache_size;
+    } else {
+        cached_trees.push_front(tree);
+        cached.cache_position = cached_trees.begin();
+        cached.cached = true;
+    }
+    cached.cache_size = cached.nodes.GetMemoryUsage();
+    cached_size += cached.cache_size;
+
+    // Released trees are freed when nobody uses them (deltas keep their base trees), the last used one is kept
+    bool released = false;
+    while (cached_size > Config::GetConfig().treeCacheSize && cached_trees.size() > 1) {
+        auto& last = *cached_trees.back()->data;
+        cached_size -= last.cache_size;
+        last.cached = false;
+        cached_trees.pop_back();
+        released = true;
+    }
+    if (!released) return;
+    for (auto item = history_trees.begin(); item != history_trees.end();) {
+        if (item->second.expired()) item = history_trees.erase(item);
+        else ++item;
     }
-    history_trees[name]->data->this_tree = history_trees[name];
-    history_trees[name]->data->UpdateTreeLinks();
-	return history_trees[name];
 }
 
 std::shared_ptr<FileTree> FileTree::CreateNewTree() {
+    std::lock_guard<std::recursive_mutex> guard(history_lock);
     auto tree = std::make_shared<FileTree>();
-    history_trees.insert(std::make_pair(tree->GetTreeName(), tree));
-    tree->data->this_tree = tree;
-    tree->data->UpdateTreeLinks();
+    history_trees[tree->GetTreeName()] = tree;
+    CacheTree(tree);
     return tree;
 }
 
 std::shared_ptr<FileInfo> FileTree::AddDirectory(std::shared_ptr<FileInfo> parent, std::string const& name, const file_params& params) {
-	return data->AddNode(DIR, parent, name, params);
+	return GetFileById(data->AddNode(DIR, parent->GetId(), name, params));
 }
 
 std::shared_ptr<FileInfo> FileTree::AddFile(std::shared_ptr<FileInfo> parent, std::string const& name, const file_params& params) {
-	return data->AddNode(FILE, parent, name, params);
+	return GetFileById(data->AddNode(FILE, parent->GetId(), name, params));
 }
 
 std::shared_ptr<FileInfo> FileTree::AddSymlink(std::shared_ptr<FileInfo> parent, std::string const& name, const file_params& params) {
-	return data->AddNode(SYMLINK, parent, name, params);
+	return GetFileById(data->AddNode(SYMLINK, parent->GetId(), name, params));
 }
 
-std::shared_ptr<FileInfo> FileTree::FileTreeData::AddNode(file_type type, std::shared_ptr<FileInfo> parent, std::string const& name, const file_params& params) {
-	if (parent->GetType() != DIR) throw std::invalid_argument("Parent must be dir");
-
-    // Test if we want to backup this file
-    auto rules = Config::GetRules(parent->GetPath() + "/" + name, params);
-    if ((type == DIR && !rules.scan) || (type == FILE && !rules.backup) ) return nullptr;
-
-	auto file = std::make_shared<FileInfo>(this_tree, type, parent, name);
-	file->SetParams(params);
-	parent->AddChild(name, file);
-
-	file->SetId(files.size());
-	files.push_back(file);
-
-	// Check previous known version of file and set status
-	version_file_status status = UNKNOWN;
-	if (!prev_version_tree_name.empty()) {
-		auto prev_version_tree = FileTree::GetHistoryTree(prev_version_tree_name);
-		std::shared_ptr<FileInfo> prev_version_parent;
-
-		if (parent->GetPrevVersionId() != 0) prev_version_parent = prev_version_tree->GetFileById(parent->GetPrevVersionId());
-
-		if (prev_version_parent != nullptr) {
-			std::shared_ptr<FileInfo> prev_version_file = prev_version_parent->GetChild(name);
-			if (prev_version_file != nullptr && prev_version_file->GetType() == type) {
-				// Match only files to files and dirs to dirs (else UNKNOWN)
-				file->SetPrevVersionId(prev_version_file->GetId());
-				auto prev_version_params = prev_version_file->GetParams();
-				auto prev_version_status = prev_version_file->GetStatus();
-				if (type == DIR) {
-					// Check only params
-					status = (params == prev_version_params ? UNCHANGED : UPDATED_PARAMS);
-				} else { // FILE or SYMLINK
-					if (prev_version_params.file_size != params.file_size || prev_version_params.modification_time != params.modification_time
-                    || prev_version_status == UNKNOWN || prev_version_status == NOT_UPDATED)
-                        // If previous file is UNKNOWN (no known previous version and not processed) -> UNKNOWN
-                        // else (if there is at least one known and proccessed previous version) -> NOT_UPDATED
-                        // Newest version of each file can't be DELETED
-                        status = prev_version_status == UNKNOWN ? UNKNOWN : NOT_UPDATED;
-                    else {
-                            status = (params == prev_version_params ? UNCHANGED : UPDATED_PARAMS);
-                            // No change to the file content -> same hash and chunk name as the previous
-                            file->SetHash(prev_version_file->GetHash());
-                            file_hashes.insert(std::make_pair(file->GetHash() ,file));
-                    }
-				}
-			}
-		}
-	}
-	if (type == DIR && status == UNKNOWN) status = NEW; // When DIR, there are no data to save -> we have done all work for this file
-	file->SetStatus(status);
-
-	// Count score and add file to score-heap
-	if ((type == FILE || type == SYMLINK) && status != UNCHANGED && status != UPDATED_PARAMS) CountScore(file, rules);
-
-	return file;
+std::shared_ptr<FileInfo> FileTree::GetFileByPath(std::string const& path) {
+    return GetFileById(data->nodes.FindPath(path));
 }
 
+std::vector<std::shared_ptr<FileInfo>> FileTree::GetSubtreeFiles(std::string const& path) {
+    std::vector<std::shared_ptr<FileInfo>> files;
+    for (auto id: data->nodes.FindPrefix(path)) files.push_back(GetFileById(id));
+    return files;
+}
 
-std::shared_ptr<FileInfo> FileTree::GetFileByPath(std::string const& path) {
-    size_t start = 0; size_t len = path.length();
-    auto node = data->root;
-    auto pos = path.find('/', start);
-
-    // Recursive search
-    while (pos != std::string::npos) {
-        // If directory name is "/" (in cases like "dir//subdir") or "./", move start and ask again
-        if (pos - start > 0 && !(pos - start == 1 && path[start] == '.')) {
-            node = node->GetChild(path.substr(start, pos - start));
-            if (node == nullptr) return nullptr;
-        }
-        start = pos + 1;
-        pos = path.find('/', start);
-    }
-    // If there is rest of the name, try to use it as subdir name, else return this dir
-    if (len - start > 0) return node->GetChild(path.substr(start, len - start));
-    else return node;
+std::vector<std::shared_ptr<FileInfo>> FileTree::GetFilesByPattern(std::string const& pattern) {
+    std::vector<std::shared_ptr<FileInfo>> files;
+    for (auto id: data->nodes.FindGlob(pattern)) files.push_back(GetFileById(id));
+    return files;
 }
 
 std::shared_ptr<FileInfo> FileTree::GetFileById(unsigned int file_id) {
-	if (file_id < 0 || file_id >= data->files.size())
-        throw std::out_of_range("File index "+std::to_string(file_id)+" out of range (range "+std::to_string(data->files.size())+") in the tree "+data->tree_name);
-	return data->files[file_id];
+	if (file_id >= data->nodes.Size())
+        throw std::out_of_range("File index "+std::to_string(file_id)+" out of range (range "+std::to_string(data->nodes.Size())+") in the tree "+data->tree_name);
+	if (!data->nodes.Exists(file_id)) return nullptr;
+	return std::make_shared<FileInfo>(shared_from_this(), file_id);
 }
 
 std::shared_ptr<FileInfo> FileTree::GetFileByHash(std::string const& file_hash) {
-	auto i = data->file_hashes.find(file_hash);
-	if (i == data->file_hashes.end()) return nullptr;
-	else return i->second;
+	unsigned int file_id = data->nodes.FindHash(file_hash);
+	if (file_id == 0) return nullptr;
+	else return GetFileById(file_id);
 }
 
 
@@ -322,19 +468,34 @@ std::vector<std::shared_ptr<FileInfo>> FileTree::FinishTree() {
     SaveTree();
 
     sort(data->files_to_process.begin(), data->files_to_process.end(),
-        [](const std::pair<std::shared_ptr<FileInfo>, int> & a, const std::pair<std::shared_ptr<FileInfo>, int> & b) -> bool
+        [](const std::pair<unsigned int, int> & a, const std::pair<unsigned int, int> & b) -> bool
         { return a.second > b.second; }
     );
 
 	std::vector<std::shared_ptr<FileInfo>> out;
-	for (auto& item: data->files_to_process) out.push_back(item.first);
+	for (auto& item: data->files_to_process) out.push_back(GetFileById(item.first));
 	return out;
 }
 
 const std::string& FileTree::GetTreeName() { return data->tree_name; }
 const time_t FileTree::GetConstructTime() { return data->construct_time; }
+hash_algorithm FileTree::GetHashAlgorithm() { return data->hash; }
 
 void FileTree::SaveTree() {
+    data->UpdateHardLinks();
+    data->nodes.SortChildren();
+
+    // Records changed in the loaded tree keep their original values in the tree saved as its delta
+    auto originals = data->nodes.TakeOriginals();
+    if (!originals.empty()) {
+        auto next = GetNextTree();
+        if (next != nullptr && next->data->delta_depth > 0) {
+            next->data->nodes.KeepRecords(originals);
+            next->SaveTree();
+        }
+    }
+
+    data->nodes.PrepareSections();
     std::string temp_name = Config::GetTreeFilename(data->tree_name)+".tmp";
     std::ofstream os(temp_name, std::ios::binary);
     {
@@ -343,23 +504,27 @@ void FileTree::SaveTree() {
         archive(cereal::make_nvp("FileTreeData", data));
     }
     // Need to unallocate archive (to finish the data) before closing ofstream
+    data->nodes.WriteSections(os);
     os.close();
     rename(temp_name.c_str(), Config::GetTreeFilename(data->tree_name).c_str());
 
-    if (!data->in_tree_list) FileTree::history_trees_list.clear(); // To recache this
+    // Catalog lists the new tree (or the new size of the changed one)
+    tree_info info;
+    info.tree_name = data->tree_name;
+    info.construct_time = data->construct_time;
+    info.prev_tree_name = data->prev_version_tree_name;
+    info.node_count = GetLastId();
+    info.stored_bytes = boost::filesystem::file_size(Config::GetTreeFilename(data->tree_name));
+    Config::GetTreeCatalog()->Save(info);
 }
 
 std::shared_ptr<FileTree> FileTree::GetPrevTree() { return GetHistoryTree(data->prev_version_tree_name); }
 std::shared_ptr<FileTree> FileTree::GetNextTree() {
-    auto trees = GetHistoryTreeList();
-    for (auto i = trees.rbegin(); i != trees.rend(); ++i) {
-        if (GetTreeName().compare(*i) == 0) break;
-        auto tree = GetHistoryTree(*i);
-        if (tree->GetPrevTree()->GetTreeName() == GetTreeName()) return(tree);
-    }
-
-    return nullptr;
+    tree_info info;
+    info.tree_name = GetTreeName();
+    if (!Config::GetTreeCatalog()->Load(info) || info.next_tree_name.empty()) return nullptr;
+    return GetHistoryTree(info.next_tree_name);
 }
 
 }
-CEREAL_CLASS_VERSION(FenixBackup::FileTree::FileTreeData, 1);
+CEREAL_CLASS_VERSION(FenixBackup::FileTree::FileTreeData, 6);
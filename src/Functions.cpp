@@ -1,24 +1,60 @@
 #include "Functions.hpp"
 
 #include <istream>
+#include <fstream>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
 #include <sha256.h>
 
+#include "ContentHash.hpp"
+
 namespace FenixBackup {
 
-std::string Functions::ComputeFileHash(std::istream& file) {
-        SHA256 sha256;
-        auto buffer = new char[1024];
+std::string Functions::ComputeFileHash(std::istream& file, hash_algorithm algorithm, const std::function<void(const char*, size_t)>& observer) {
+        ContentHash hash(algorithm);
+        // Big reads let SHA256 process many blocks at once and BLAKE3 split them between threads
+        std::vector<char> buffer(ContentHash::GetPreferredBufferSize(algorithm));
 
-        int position = file.tellg();
+        std::streampos position = file.tellg();
         file.clear();
         file.seekg(0);
         while (!file.eof()) {
-                file.read(buffer, 1024);
-                sha256.add(buffer, file.gcount());
+                file.read(buffer.data(), buffer.size());
+                hash.Add(buffer.data(), file.gcount());
+                if (observer && file.gcount() > 0) observer(buffer.data(), file.gcount());
         }
         file.clear();
         file.seekg(position); // Reset to original position
-        return sha256.getHash();
+        return hash.GetHash();
+}
+
+std::string Functions::ComputeHash(const std::string& content, hash_algorithm algorithm) {
+        ContentHash hash(algorithm);
+        hash.Add(content.data(), content.size());
+        return hash.GetHash();
+}
+
+std::vector<std::string> Functions::ComputeHashes(const std::vector<std::string>& contents, hash_algorithm algorithm) {
+        if (algorithm == SHA256_HASH) return SHA256::hashMany(contents);
+        std::vector<std::string> hashes;
+        hashes.reserve(contents.size());
+        for (auto& content: contents) hashes.push_back(ComputeHash(content, algorithm));
+        return hashes;
+}
+
+size_t Functions::GetPeakMemoryUsage() {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+        return usage.ru_maxrss * 1024; // ru_maxrss is in kilobytes
+}
+
+size_t Functions::GetMemoryUsage() {
+        // Second value is the number of resident pages
+        std::ifstream statm("/proc/self/statm");
+        size_t size = 0, resident = 0;
+        if (!(statm >> size >> resident)) return 0;
+        return resident * sysconf(_SC_PAGESIZE);
 }
 
 }
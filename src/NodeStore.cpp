@@ -0,0 +1,680 @@
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FenixExceptions.hpp"
+#include "NodeStore.hpp"
+
+namespace FenixBackup {
+
+/// Sections start at aligned offsets of the tree file (the mapping starts at its beginning)
+static size_t AlignSection(size_t offset) { return (offset + 63) / 64 * 64; }
+
+/// FNV-1a with a final mix (slots are taken from the low bits), strings of the pool are hashed without constructing std::string
+static size_t HashText(const char* text, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+    hash ^= hash >> 32;
+    hash *= 0xd6e8feb86659fd93ULL;
+    return hash ^ (hash >> 32);
+}
+
+/// All saved fields are compared (file_params::operator== ignores the inode and the link count), ranges of children are not
+static bool SameRecord(const NodeStore::node_record& a, const NodeStore::node_record& b) {
+    return a.params == b.params && a.params.device == b.params.device && a.params.inode == b.params.inode
+        && a.params.link_count == b.params.link_count && a.name == b.name && a.parent == b.parent
+        && a.prev_version_id == b.prev_version_id && a.hard_link_id == b.hard_link_id && a.hash == b.hash
+        && a.type == b.type && a.status == b.status;
+}
+
+template <class Function>
+void NodeStore::StringPool::ForEach(Function function) const {
+    auto strings = [&function](size_t start, const char* data, size_t size) {
+        for (size_t position = 0; position < size;) {
+            size_t length = strlen(data + position);
+            if (length > 0) function(start + position, data + position, length);
+            position += length + 1;
+        }
+    };
+    for (auto& segment: segments) strings(segment.start, segment.data, segment.size);
+    strings(tail_start, owned.data(), owned.size());
+}
+
+size_t NodeStore::StringPool::FindSlot(const char* text, size_t length) {
+    size_t mask = table.size() - 1;
+    for (size_t slot = HashText(text, length) & mask;; slot = (slot + 1) & mask) {
+        if (table[slot].first == 0) return slot;
+        const char* item = Get(table[slot].first - 1);
+        if (strncmp(item, text, length) == 0 && item[length] == '\0') return slot;
+    }
+}
+
+void NodeStore::StringPool::Rebuild(size_t table_size) {
+    // Values of the old table are kept, after Reset they are unknown (0)
+    std::vector<std::pair<uint32_t, uint32_t>> old_table;
+    old_table.swap(table);
+    if (old_table.empty()) {
+        size_t strings = 0;
+        ForEach([&strings](size_t, const char*, size_t) { strings++; });
+        while (table_size < 2 * (strings + 1)) table_size *= 2;
+    }
+    table.assign(table_size, std::make_pair(0, 0));
+    count = 0;
+    if (!old_table.empty()) {
+        for (auto& item: old_table) if (item.first != 0) {
+            const char* text = Get(item.first - 1);
+            table[FindSlot(text, strlen(text))] = item;
+            count++;
+        }
+        return;
+    }
+    ForEach([this](size_t offset, const char* text, size_t length) {
+        auto& item = table[FindSlot(text, length)];
+        if (item.first != 0) return; // Appended more times
+        item = std::make_pair(offset + 1, 0);
+        count++;
+    });
+}
+
+uint32_t NodeStore::StringPool::Intern(const std::string& text) {
+    if (text.empty()) return 0;
+    if (2 * (count + 1) > table.size()) Rebuild(std::max((size_t)1024, 2 * table.size()));
+    size_t slot = FindSlot(text.data(), text.size());
+    if (table[slot].first != 0) return table[slot].first - 1;
+
+    if (Size() + text.size() + 1 > UINT32_MAX) throw FileTreeException("Too many names or hashes in one tree\n");
+    uint32_t offset = Size();
+    owned.append(text.data(), text.size() + 1);
+    table[slot] = std::make_pair(offset + 1, 0);
+    count++;
+    return offset;
+}
+
+uint32_t NodeStore::StringPool::Append(const std::string& text) {
+    if (text.empty()) return 0;
+    if (Size() + text.size() + 1 > UINT32_MAX) throw FileTreeException("Too many names or hashes in one tree\n");
+    uint32_t offset = Size();
+    owned.append(text.data(), text.size() + 1);
+    Reset();
+    return offset;
+}
+
+bool NodeStore::StringPool::Find(const std::string& text, uint32_t& offset, uint32_t& value) {
+    if (text.empty()) return false;
+    if (table.empty()) Rebuild(1024);
+    auto& item = table[FindSlot(text.data(), text.size())];
+    if (item.first == 0) return false;
+    offset = item.first - 1;
+    value = item.second;
+    return true;
+}
+
+uint32_t& NodeStore::StringPool::Value(uint32_t offset) {
+    const char* text = Get(offset);
+    return table[FindSlot(text, strlen(text))].second;
+}
+
+void NodeStore::StringPool::Map(const char* mapped, size_t mapped_size) {
+    std::string().swap(owned);
+    segments.assign(1, segment{0, mapped, mapped_size});
+    shared.clear();
+    tail_start = mapped_size;
+    inherited = 0;
+    Reset();
+}
+
+void NodeStore::StringPool::Inherit(StringPool& base) {
+    // Tail of the base is not changed anymore, its new strings start a new tail (offsets of both pools continue the segments)
+    if (!base.owned.empty()) {
+        auto tail = std::make_shared<const std::string>(std::move(base.owned));
+        base.owned.clear();
+        base.segments.push_back(segment{base.tail_start, tail->data(), tail->size()});
+        base.shared.push_back(tail);
+        base.tail_start += tail->size();
+    }
+    segments = base.segments;
+    shared = base.shared;
+    std::string().swap(owned);
+    tail_start = inherited = base.tail_start;
+    Reset();
+}
+
+void NodeStore::StringPool::Extend(const char* mapped, size_t mapped_size) {
+    if (!owned.empty()) throw FileTreeException("Only the inherited pool can be extended\n");
+    segments.push_back(segment{tail_start, mapped, mapped_size});
+    tail_start += mapped_size;
+    Reset();
+}
+
+void NodeStore::StringPool::Sync() {
+    segments.clear();
+    shared.clear();
+    tail_start = inherited = 0;
+    Reset();
+}
+
+void NodeStore::StringPool::Write(std::ostream& os, size_t from) const {
+    for (auto& segment: segments) if (segment.start + segment.size > from) {
+        size_t skip = (from > segment.start ? from - segment.start : 0);
+        os.write(segment.data + skip, segment.size - skip);
+    }
+    size_t skip = (from > tail_start ? from - tail_start : 0);
+    os.write(owned.data() + skip, owned.size() - skip);
+}
+
+void NodeStore::StringPool::Reset() {
+    if (!table.empty()) std::vector<std::pair<uint32_t, uint32_t>>().swap(table);
+    count = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+NodeStore::NodeStore(): owned_records(1) {
+    records = owned_records.data();
+    record_count = owned_records.size();
+    children = owned_children.data();
+}
+
+NodeStore::~NodeStore() {
+    if (mapping != nullptr) munmap(mapping, mapping_size);
+}
+
+size_t NodeStore::GetMemoryUsage() const {
+    return mapping_size + owned_records.capacity() * sizeof(node_record) + owned_children.capacity() * sizeof(uint32_t)
+        + names.GetMemoryUsage() + hashes.GetMemoryUsage() + (edited.size() + originals.size()) * sizeof(node_record)
+        + (owned_path_order.capacity() + owned_path_ends.capacity()) * sizeof(uint32_t);
+}
+
+void NodeStore::OwnRecords() {
+    if (records == nullptr) throw FileTreeException("Nodes cannot be added into a tree loaded as a delta\n");
+    if (records == owned_records.data()) return;
+    owned_records.assign(records, records + record_count);
+    records = owned_records.data();
+}
+
+uint32_t NodeStore::Add(file_type type, uint32_t parent, const std::string& name, const file_params& params, uint32_t id) {
+    OwnRecords();
+    node_record record;
+    record.params = params;
+    record.type = type;
+    record.parent = parent;
+    record.name = names.Intern(name);
+
+    if (previous == nullptr) id = 0;
+    else if (id < 2 || id >= record_count || records[id].parent != 0) {
+        // Node without a previous version gets an unused id of the previous tree, the lowest first
+        if (!free_ids_found) {
+            for (size_t free = previous->Size(); free-- > 2;) if (!previous->Exists(free)) free_ids.push_back(free);
+            free_ids_found = true;
+        }
+        id = 0;
+        if (!free_ids.empty()) {
+            id = free_ids.back();
+            free_ids.pop_back();
+        }
+    }
+    if (id == 0) {
+        if (record_count >= UINT32_MAX) throw FileTreeException("Too many files in one tree\n");
+        owned_records.push_back(record);
+        records = owned_records.data();
+        record_count = owned_records.size();
+        id = record_count - 1;
+    } else records[id] = record;
+    children_sorted = false;
+    return id;
+}
+
+void NodeStore::Resize(size_t count) {
+    if (count > UINT32_MAX) throw FileTreeException("Too many files in one tree\n");
+    OwnRecords();
+    owned_records.resize(count);
+    records = owned_records.data();
+    record_count = owned_records.size();
+    children_sorted = false;
+}
+
+NodeStore::node_record& NodeStore::Edit(uint32_t id) {
+    if (keep_originals) originals.emplace(id, Get(id));
+    if (records != nullptr) return records[id];
+    auto item = edited.find(id);
+    if (item == edited.end()) item = edited.emplace(id, GetDelta(id)).first;
+    return item->second;
+}
+
+const NodeStore::node_record& NodeStore::GetDelta(uint32_t id) const {
+    static const node_record unused = node_record();
+    if (!edited.empty()) {
+        auto item = edited.find(id);
+        if (item != edited.end()) return item->second;
+    }
+    auto position = std::lower_bound(delta_ids, delta_ids + delta_count, id);
+    if (position != delta_ids + delta_count && *position == id) return delta_records[position - delta_ids];
+    return (id < base->Size() ? base->Get(id) : unused);
+}
+
+std::string NodeStore::GetName(uint32_t id) const { return names.Get(Get(id).name); }
+
+void NodeStore::SetName(uint32_t id, const std::string& name) {
+    Edit(id).name = names.Intern(name);
+    children_sorted = false;
+}
+
+std::string NodeStore::GetPath(uint32_t id) const {
+    std::vector<uint32_t> ancestors;
+    for (; id > 1; id = Get(id).parent) ancestors.push_back(id);
+    std::string path = ".";
+    for (auto i = ancestors.rbegin(); i != ancestors.rend(); ++i) {
+        path += '/';
+        path += names.Get(Get(*i).name);
+    }
+    return path;
+}
+
+std::string NodeStore::GetHash(uint32_t id) {
+    std::lock_guard<std::mutex> guard(lock);
+    return hashes.Get(Get(id).hash);
+}
+
+void NodeStore::SetHash(uint32_t id, const std::string& hash) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (hash != hashes.Get(Get(id).hash)) Edit(id).hash = hashes.Append(hash);
+}
+
+void NodeStore::CopyHash(uint32_t id, NodeStore& from, uint32_t from_id) {
+    if (&from != base) return SetHash(id, from.GetHash(from_id));
+    // Pool of the base is the beginning of this one
+    std::lock_guard<std::mutex> guard(lock);
+    Edit(id).hash = from.Get(from_id).hash;
+}
+
+uint32_t NodeStore::FindHash(const std::string& hash) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t offset, id;
+    if (!hashes.Find(hash, offset, id)) return 0;
+    if (id != 0) return id;
+
+    // Table was built from the pool, first files of all hashes are found at once
+    for (uint32_t file = 1; file < record_count; file++) {
+        auto& record = Get(file);
+        if (record.hash == 0 || record.type == DIR) continue;
+        uint32_t& first = hashes.Value(record.hash);
+        if (first == 0) first = file;
+    }
+    hashes.Find(hash, offset, id);
+    return id;
+}
+
+void NodeStore::SortChildren() {
+    if (children_sorted) return;
+    std::lock_guard<std::mutex> guard(lock);
+    if (children_sorted) return;
+    path_index_ready = false;
+
+    // Counting sort by the parent, then each range by the name
+    std::vector<uint32_t> filled(record_count, 0);
+    for (size_t id = 0; id < record_count; id++) records[id].child_count = 0;
+    for (uint32_t id = 2; id < record_count; id++) if (records[id].parent != 0) records[records[id].parent].child_count++;
+    uint32_t position = 0;
+    for (size_t id = 0; id < record_count; id++) {
+        records[id].first_child = position;
+        position += records[id].child_count;
+    }
+    owned_children.assign(position, 0);
+    for (uint32_t id = 2; id < record_count; id++) {
+        uint32_t parent = records[id].parent;
+        if (parent != 0) owned_children[records[parent].first_child + filled[parent]++] = id;
+    }
+    for (size_t id = 0; id < record_count; id++) {
+        auto& record = records[id];
+        if (record.child_count < 2) continue;
+        std::sort(owned_children.begin() + record.first_child, owned_children.begin() + record.first_child + record.child_count,
+            [this](uint32_t a, uint32_t b) { return strcmp(names.Get(records[a].name), names.Get(records[b].name)) < 0; });
+    }
+    children = owned_children.data();
+    children_count = owned_children.size();
+    children_sorted = true;
+}
+
+void NodeStore::ChildRange(uint32_t directory, const uint32_t*& begin, const uint32_t*& end) {
+    begin = end = nullptr;
+    if (records != nullptr) {
+        SortChildren();
+        if (directory >= record_count) return;
+        auto& record = records[directory];
+        begin = children + record.first_child;
+        end = begin + record.child_count;
+        return;
+    }
+    auto position = std::lower_bound(delta_directories, delta_directories + delta_directory_count, directory);
+    if (position != delta_directories + delta_directory_count && *position == directory) {
+        begin = children + delta_ranges[position - delta_directories];
+        end = children + delta_ranges[position - delta_directories + 1];
+    } else if (directory < base->Size()) base->ChildRange(directory, begin, end);
+}
+
+/// Compare the name with the text of the length as strcmp does
+static int CompareName(const char* name, const char* text, size_t length) {
+    int result = strncmp(name, text, length);
+    return (result == 0 && name[length] != '\0' ? 1 : result);
+}
+
+/// Match the names from the component with the patterns from the pattern ("**" matches any number of names)
+static bool MatchComponents(const std::vector<std::string>& patterns, size_t pattern, const std::vector<const char*>& path, size_t component) {
+    for (; pattern < patterns.size(); pattern++, component++) {
+        if (patterns[pattern] == "**") {
+            for (size_t skipped = component; skipped <= path.size(); skipped++)
+                if (MatchComponents(patterns, pattern + 1, path, skipped)) return true;
+            return false;
+        }
+        if (component == path.size() || fnmatch(patterns[pattern].c_str(), path[component], 0) != 0) return false;
+    }
+    return component == path.size();
+}
+
+uint32_t NodeStore::FindChild(uint32_t directory, const std::string& name) {
+    return FindChild(directory, name.data(), name.length());
+}
+
+uint32_t NodeStore::FindChild(uint32_t directory, const char* name, size_t length) {
+    const uint32_t *begin, *end;
+    ChildRange(directory, begin, end);
+    auto child = std::lower_bound(begin, end, 0,
+        [this, name, length](uint32_t id, int) { return CompareName(names.Get(Get(id).name), name, length) < 0; });
+    if (child == end || CompareName(names.Get(Get(*child).name), name, length) != 0) return 0;
+    return *child;
+}
+
+std::vector<uint32_t> NodeStore::GetChildren(uint32_t directory) {
+    const uint32_t *begin, *end;
+    ChildRange(directory, begin, end);
+    return std::vector<uint32_t>(begin, end);
+}
+
+NodeStore::path_components NodeStore::SplitPath(const std::string& path) {
+    path_components components;
+    for (size_t start = 0; start < path.length();) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) end = path.length();
+        if (end - start > 0 && !(end - start == 1 && path[start] == '.')) components.emplace_back(path.data() + start, end - start);
+        start = end + 1;
+    }
+    return components;
+}
+
+uint32_t NodeStore::FindPath(const std::string& path) {
+    // Children are searched directly, it touches less records than the binary search of the path index
+    uint32_t node = 1;
+    for (auto& component: SplitPath(path)) {
+        if (Get(node).type != DIR) return 0;
+        node = FindChild(node, component.first, component.second);
+        if (node == 0) return 0;
+    }
+    return node;
+}
+
+std::vector<uint32_t> NodeStore::FindPrefix(const std::string& path) {
+    BuildPathIndex();
+    size_t position = FindPosition(SplitPath(path));
+    if (position == path_count) return std::vector<uint32_t>();
+    return std::vector<uint32_t>(path_order + position, path_order + path_ends[position]);
+}
+
+std::vector<uint32_t> NodeStore::FindGlob(const std::string& pattern) {
+    BuildPathIndex();
+    std::vector<uint32_t> found;
+    // Leading components without wildcards are found in the index, the rest is matched in the subtree of the found node
+    auto components = SplitPath(pattern);
+    size_t literal = 0;
+    while (literal < components.size()
+    && std::string(components[literal].first, components[literal].second).find_first_of("*?[\\") == std::string::npos) literal++;
+    size_t start = FindPosition(path_components(components.begin(), components.begin() + literal));
+    if (start == path_count) return found;
+    std::vector<std::string> patterns;
+    for (size_t i = literal; i < components.size(); i++) patterns.emplace_back(components[i].first, components[i].second);
+    if (patterns.empty()) {
+        found.push_back(path_order[start]);
+        return found;
+    }
+
+    // Nodes below the start with the ends of their subtrees, subtrees which cannot match are skipped
+    bool recursive = std::find(patterns.begin(), patterns.end(), "**") != patterns.end();
+    std::vector<size_t> ends;
+    std::vector<const char*> path;
+    if (recursive && MatchComponents(patterns, 0, path, 0)) found.push_back(path_order[start]);
+    for (size_t position = start + 1; position < path_ends[start];) {
+        while (!ends.empty() && position >= ends.back()) {
+            ends.pop_back();
+            path.pop_back();
+        }
+        uint32_t id = path_order[position];
+        const char* name = names.Get(Get(id).name);
+        if (recursive) {
+            path.push_back(name);
+            if (MatchComponents(patterns, 0, path, 0)) found.push_back(id);
+        } else if (fnmatch(patterns[path.size()].c_str(), name, 0) != 0) {
+            position = path_ends[position];
+            continue;
+        } else if (path.size() + 1 == patterns.size()) {
+            found.push_back(id);
+            position = path_ends[position];
+            continue;
+        } else path.push_back(name);
+        ends.push_back(path_ends[position]);
+        position++;
+    }
+    return found;
+}
+
+void NodeStore::BuildPathIndex() {
+    SortChildren();
+    if (path_index_ready) return;
+    std::lock_guard<std::mutex> guard(lock);
+    if (path_index_ready) return;
+
+    // Preorder, children are visited in their sorted order
+    struct level {
+        const uint32_t* next;
+        const uint32_t* end;
+        size_t position;
+    };
+    std::vector<level> stack;
+    std::vector<uint32_t> order, ends;
+    auto visit = [&](uint32_t id) {
+        const uint32_t *begin, *end;
+        ChildRange(id, begin, end);
+        stack.push_back({begin, end, order.size()});
+        order.push_back(id);
+        ends.push_back(0);
+    };
+    if (record_count > 1) visit(1);
+    while (!stack.empty()) {
+        auto& top = stack.back();
+        if (top.next != top.end) visit(*top.next++);
+        else {
+            ends[top.position] = order.size();
+            stack.pop_back();
+        }
+    }
+    owned_path_order.swap(order);
+    owned_path_ends.swap(ends);
+    path_order = owned_path_order.data();
+    path_ends = owned_path_ends.data();
+    path_count = owned_path_order.size();
+    path_index_ready = true;
+}
+
+int NodeStore::ComparePath(uint32_t id, const path_components& components, std::vector<uint32_t>& ancestors) const {
+    ancestors.clear();
+    for (; id > 1; id = Get(id).parent) ancestors.push_back(id);
+    // Ancestors go first (their paths are prefixes), then the names decide
+    size_t depth = ancestors.size();
+    for (size_t i = 0; i < depth && i < components.size(); i++) {
+        int result = CompareName(names.Get(Get(ancestors[depth - 1 - i]).name), components[i].first, components[i].second);
+        if (result != 0) return result;
+    }
+    return (depth < components.size() ? -1 : depth > components.size() ? 1 : 0);
+}
+
+size_t NodeStore::FindPosition(const path_components& components) const {
+    std::vector<uint32_t> ancestors;
+    auto position = std::lower_bound(path_order, path_order + path_count, 0,
+        [&](uint32_t id, int) { return ComparePath(id, components, ancestors) < 0; });
+    if (position == path_order + path_count || ComparePath(*position, components, ancestors) != 0) return path_count;
+    return position - path_order;
+}
+
+void NodeStore::SetPrevious(NodeStore& previous, bool delta) {
+    this->previous = &previous;
+    if (record_count < previous.Size()) Resize(previous.Size());
+    if (!delta) return;
+    base = &previous;
+    names.Inherit(previous.names);
+    hashes.Inherit(previous.hashes);
+}
+
+std::unordered_map<uint32_t, NodeStore::node_record> NodeStore::TakeOriginals() {
+    std::unordered_map<uint32_t, node_record> taken;
+    taken.swap(originals);
+    return taken;
+}
+
+void NodeStore::KeepRecords(const std::unordered_map<uint32_t, node_record>& kept) {
+    if (records != nullptr) return;
+    for (auto& item: kept) {
+        if (std::binary_search(delta_ids, delta_ids + delta_count, item.first)) continue;
+        edited.insert(item);
+    }
+}
+
+void NodeStore::PrepareSections() {
+    saved = delta_sections();
+    if (base == nullptr) return BuildPathIndex();
+    auto add = [this](uint32_t id, node_record record) {
+        record.first_child = record.child_count = 0;
+        saved.ids.push_back(id);
+        saved.records.push_back(record);
+    };
+
+    if (records == nullptr) {
+        // Loaded delta keeps its records and children, with the changed records
+        std::vector<uint32_t> ids(delta_ids, delta_ids + delta_count);
+        for (auto& item: edited) ids.push_back(item.first);
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        for (auto id: ids) add(id, Get(id));
+        saved.directories.assign(delta_directories, delta_directories + delta_directory_count);
+        saved.ranges.assign(delta_ranges, delta_ranges + delta_directory_count + 1);
+        saved.children.assign(children, children + children_count);
+        return;
+    }
+
+    // New tree, records and children lists which differ from the base
+    for (uint32_t id = 1; id < record_count; id++)
+        if (id >= base->Size() || !SameRecord(records[id], base->Get(id))) add(id, records[id]);
+    for (uint32_t id = 1; id < record_count; id++) {
+        const uint32_t *begin, *end, *base_begin = nullptr, *base_end = nullptr;
+        ChildRange(id, begin, end);
+        if (id < base->Size()) base->ChildRange(id, base_begin, base_end);
+        if (end - begin == base_end - base_begin && std::equal(begin, end, base_begin)) continue;
+        saved.directories.push_back(id);
+        saved.ranges.push_back(saved.children.size());
+        saved.children.insert(saved.children.end(), begin, end);
+    }
+    saved.ranges.push_back(saved.children.size());
+}
+
+void NodeStore::WriteSections(std::ostream& os) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t position = os.tellp();
+    std::string padding(AlignSection(position) - position, '\0');
+    os.write(padding.data(), padding.size());
+    if (base != nullptr) {
+        os.write((const char*)saved.records.data(), saved.records.size() * sizeof(node_record));
+        os.write((const char*)saved.ids.data(), saved.ids.size() * sizeof(uint32_t));
+        os.write((const char*)saved.directories.data(), saved.directories.size() * sizeof(uint32_t));
+        os.write((const char*)saved.ranges.data(), saved.ranges.size() * sizeof(uint32_t));
+        os.write((const char*)saved.children.data(), saved.children.size() * sizeof(uint32_t));
+    } else {
+        os.write((const char*)records, record_count * sizeof(node_record));
+        os.write((const char*)children, children_count * sizeof(uint32_t));
+    }
+    names.Write(os, names.Inherited());
+    hashes.Write(os, hashes.Inherited());
+    if (base == nullptr) {
+        position = os.tellp();
+        padding.assign(AlignSection(position) - position, '\0');
+        os.write(padding.data(), padding.size());
+        os.write((const char*)path_order, path_count * sizeof(uint32_t));
+        os.write((const char*)path_ends, path_count * sizeof(uint32_t));
+    }
+    saved = delta_sections();
+}
+
+void NodeStore::MapSections(const std::string& filename, size_t offset, NodeStore* base) {
+    keep_originals = true;
+    if (!sections.pending) return;
+    sections.pending = false;
+    if (sections.delta && base == nullptr) throw FileTreeException("Tree '"+filename+"' is a delta, its base tree is missing\n");
+    if (sections.delta && (base->names.Size() != sections.names_base || base->hashes.Size() != sections.hashes_base))
+        throw FileTreeException("Tree '"+filename+"' is a delta of another version of its base tree\n");
+
+    offset = AlignSection(offset);
+    size_t records_size = (sections.delta ? sections.delta_count : sections.record_count) * sizeof(node_record);
+    size_t index_size = (sections.delta ? sections.delta_count + 2 * sections.directory_count + 1 : 0) * sizeof(uint32_t);
+    size_t children_size = sections.children_count * sizeof(uint32_t);
+    size_t end = offset + records_size + index_size + children_size + sections.names_size + sections.hashes_size;
+    size_t path_offset = AlignSection(end);
+    if (sections.path_count > 0) end = path_offset + 2 * sections.path_count * sizeof(uint32_t);
+
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw FileTreeException("Cannot open the tree file '"+filename+"': "+strerror(errno)+"\n");
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < end) {
+        close(fd);
+        throw FileTreeException("Tree file '"+filename+"' is truncated\n");
+    }
+    // Private mapping, changed records (e.g. statuses set by the cleanup) are not written into the file
+    void* mapped = mmap(nullptr, end, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) throw FileTreeException("Cannot map the tree file '"+filename+"': "+strerror(errno)+"\n");
+    mapping = mapped;
+    mapping_size = end;
+
+    const char* position = (const char*)mapped + offset;
+    std::vector<node_record>().swap(owned_records);
+    record_count = sections.record_count;
+    if (sections.delta) {
+        this->base = base;
+        records = nullptr;
+        delta_count = sections.delta_count;
+        delta_directory_count = sections.directory_count;
+        delta_records = (const node_record*)position;
+        delta_ids = (const uint32_t*)(position + records_size);
+        delta_directories = delta_ids + delta_count;
+        delta_ranges = delta_directories + delta_directory_count;
+        names.Inherit(base->names);
+        hashes.Inherit(base->hashes);
+    } else records = (node_record*)position;
+    position += records_size + index_size;
+    children = (const uint32_t*)position;
+    children_count = sections.children_count;
+    position += children_size;
+    if (sections.delta) names.Extend(position, sections.names_size);
+    else names.Map(position, sections.names_size);
+    position += sections.names_size;
+    if (sections.delta) hashes.Extend(position, sections.hashes_size);
+    else hashes.Map(position, sections.hashes_size);
+    children_sorted = true;
+    if (sections.path_count > 0) {
+        path_order = (const uint32_t*)((const char*)mapped + path_offset);
+        path_ends = path_order + sections.path_count;
+        path_count = sections.path_count;
+        path_index_ready = true;
+    }
+}
+
+}
@@ -0,0 +1,217 @@
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+
+#include "FenixExceptions.hpp"
+#include "Config.hpp"
+#include "ContentChunker.hpp"
+#include "SimilarityIndex.hpp"
+#include "FileChunk.hpp"
+
+namespace FenixBackup {
+
+/// Number of hashes in one sketch
+static const size_t SKETCH_SIZE = 32;
+/// Chunks remembered for one hash (common blocks like zeros would make lookups slow)
+static const size_t MAX_FEATURE_CHUNKS = 64;
+static const char INDEX_MAGIC[8] = {'F', 'X', 'S', 'I', 'M', 'I', 'D', 'X'};
+static const uint32_t INDEX_VERSION = 1;
+
+bool SimilarityIndex::loaded = false;
+std::unordered_map<std::string, SimilarityIndex::sketch> SimilarityIndex::sketches;
+std::unordered_map<uint64_t, std::vector<std::string>> SimilarityIndex::features;
+std::string SimilarityIndex::buffer;
+size_t SimilarityIndex::matches = 0;
+size_t SimilarityIndex::matched_bytes = 0;
+size_t SimilarityIndex::stored_bytes = 0;
+
+static uint64_t HashBlock(const std::string& block) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c: block) hash = (hash ^ c) * 0x100000001b3ULL;
+    return hash;
+}
+
+/// Estimate of Jaccard similarity of two sorted sketches (shared part of bottom-k of their union)
+static double Similarity(const SimilarityIndex::sketch& a, const SimilarityIndex::sketch& b) {
+    size_t i = 0, j = 0, seen = 0, shared = 0;
+    while (seen < SKETCH_SIZE && (i < a.size() || j < b.size())) {
+        if (j == b.size() || (i < a.size() && a[i] < b[j])) i++;
+        else if (i == a.size() || b[j] < a[i]) j++;
+        else {
+            i++;
+            j++;
+            shared++;
+        }
+        seen++;
+    }
+    return seen == 0 ? 0 : (double)shared / seen;
+}
+
+static void AppendRecord(std::string& output, const std::string& chunk_name, const SimilarityIndex::sketch& chunk_sketch) {
+    uint32_t length = chunk_name.size(), count = chunk_sketch.size();
+    output.append((const char*)&length, sizeof(length));
+    output.append(chunk_name);
+    output.append((const char*)&count, sizeof(count));
+    output.append((const char*)chunk_sketch.data(), count * sizeof(uint64_t));
+}
+
+void SimilarityIndex::UpdateSketch(sketch& file_sketch, const char* buffer, size_t length) {
+    // Piece is split on its own, only blocks at its edges differ from splitting of the whole stream
+    std::istringstream piece(std::string(buffer, length));
+    ContentChunker chunker(piece, Config::GetConfig().similarityBlockSize);
+    std::string block;
+    while (chunker.Next(block)) AddHash(file_sketch, HashBlock(block));
+}
+
+void SimilarityIndex::AddHash(sketch& file_sketch, uint64_t hash) {
+    // Sorted smallest distinct hashes
+    if (file_sketch.size() == SKETCH_SIZE && hash >= file_sketch.back()) return;
+    auto it = std::lower_bound(file_sketch.begin(), file_sketch.end(), hash);
+    if (it != file_sketch.end() && *it == hash) return;
+    file_sketch.insert(it, hash);
+    if (file_sketch.size() > SKETCH_SIZE) file_sketch.pop_back();
+}
+
+std::string SimilarityIndex::FindSimilar(const sketch& file_sketch) {
+    std::lock_guard<std::recursive_mutex> guard(FileChunk::GetLock());
+    Load();
+    std::unordered_map<std::string, size_t> candidates;
+    for (auto hash: file_sketch) {
+        auto it = features.find(hash);
+        if (it == features.end()) continue;
+        for (auto& chunk_name: it->second) candidates[chunk_name]++;
+    }
+
+    std::string best;
+    double best_similarity = Config::GetConfig().similarityThreshold;
+    std::vector<std::string> deleted;
+    for (auto& candidate: candidates) {
+        if (!Config::GetChunkCatalog()->Exists(candidate.first)) {
+            deleted.push_back(candidate.first);
+            continue;
+        }
+        double similarity = Similarity(file_sketch, sketches[candidate.first]);
+        if (similarity >= best_similarity) {
+            best = candidate.first;
+            best_similarity = similarity;
+        }
+    }
+    for (auto& chunk_name: deleted) Erase(chunk_name);
+    return best;
+}
+
+void SimilarityIndex::Add(const std::string& chunk_name, const sketch& chunk_sketch) {
+    if (chunk_sketch.empty()) return;
+    std::lock_guard<std::recursive_mutex> guard(FileChunk::GetLock());
+    Load();
+    Insert(chunk_name, chunk_sketch);
+    AppendRecord(buffer, chunk_name, chunk_sketch);
+}
+
+void SimilarityIndex::Insert(const std::string& chunk_name, const sketch& chunk_sketch) {
+    if (sketches.find(chunk_name) != sketches.end()) return;
+    sketches[chunk_name] = chunk_sketch;
+    for (auto hash: chunk_sketch) {
+        auto& chunks = features[hash];
+        // Prefer newer chunks, they are usually closer to new files
+        if (chunks.size() >= MAX_FEATURE_CHUNKS) chunks.erase(chunks.begin());
+        chunks.push_back(chunk_name);
+    }
+}
+
+void SimilarityIndex::Erase(const std::string& chunk_name) {
+    auto it = sketches.find(chunk_name);
+    if (it == sketches.end()) return;
+    for (auto hash: it->second) {
+        auto& chunks = features[hash];
+        chunks.erase(std::remove(chunks.begin(), chunks.end(), chunk_name), chunks.end());
+        if (chunks.empty()) features.erase(hash);
+    }
+    sketches.erase(it);
+}
+
+void SimilarityIndex::Load() {
+    if (loaded) return;
+    loaded = true;
+    std::ifstream is(Config::GetSimilarityIndexFilename(), std::ios::binary);
+    if (!is.good()) return;
+    std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+
+    uint32_t version;
+    if (content.size() < sizeof(INDEX_MAGIC) + sizeof(version) || memcmp(content.data(), INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+        throw FileChunkException("File '"+Config::GetSimilarityIndexFilename()+"' is not a similarity index\n");
+    memcpy(&version, content.data() + sizeof(INDEX_MAGIC), sizeof(version));
+    if (version != INDEX_VERSION) throw FileChunkException("Unknown version "+std::to_string(version)+" of the similarity index\n");
+
+    // Incomplete record at the end is ignored (it is only a hint for delta encoding)
+    size_t position = sizeof(INDEX_MAGIC) + sizeof(version);
+    while (true) {
+        uint32_t length, count;
+        if (content.size() - position < sizeof(length)) break;
+        memcpy(&length, content.data() + position, sizeof(length));
+        position += sizeof(length);
+        if (content.size() - position < (size_t)length + sizeof(count)) break;
+        std::string chunk_name = content.substr(position, length);
+        position += length;
+        memcpy(&count, content.data() + position, sizeof(count));
+        position += sizeof(count);
+        if ((content.size() - position) / sizeof(uint64_t) < count) break;
+        sketch chunk_sketch(count);
+        memcpy(chunk_sketch.data(), content.data() + position, count * sizeof(uint64_t));
+        position += count * sizeof(uint64_t);
+        if (Config::GetChunkCatalog()->Exists(chunk_name)) Insert(chunk_name, chunk_sketch);
+    }
+}
+
+void SimilarityIndex::Flush() {
+    std::lock_guard<std::recursive_mutex> guard(FileChunk::GetLock());
+    if (buffer.empty()) return;
+    std::string filename = Config::GetSimilarityIndexFilename();
+    struct stat info;
+    bool empty = (stat(filename.c_str(), &info) != 0 || info.st_size == 0);
+    std::ofstream os(filename, std::ios::binary | std::ios::app);
+    if (empty) {
+        os.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        os.write((const char*)&INDEX_VERSION, sizeof(INDEX_VERSION));
+    }
+    os.write(buffer.data(), buffer.size());
+    os.close();
+    if (os.fail()) throw FileChunkException("Cannot write similarity index '"+filename+"'\n");
+    buffer.clear();
+}
+
+void SimilarityIndex::Compact() {
+    std::lock_guard<std::recursive_mutex> guard(FileChunk::GetLock());
+    Load();
+    std::string filename = Config::GetSimilarityIndexFilename();
+    std::string content(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    content.append((const char*)&INDEX_VERSION, sizeof(INDEX_VERSION));
+    std::vector<std::string> deleted;
+    for (auto& item: sketches) {
+        if (Config::GetChunkCatalog()->Exists(item.first)) AppendRecord(content, item.first, item.second);
+        else deleted.push_back(item.first);
+    }
+    for (auto& chunk_name: deleted) Erase(chunk_name);
+
+    std::ofstream os(filename + ".tmp", std::ios::binary);
+    os.write(content.data(), content.size());
+    os.close();
+    if (os.fail() || rename((filename + ".tmp").c_str(), filename.c_str()) != 0) throw FileChunkException("Cannot write similarity index '"+filename+"'\n");
+    buffer.clear();
+}
+
+void SimilarityIndex::CountMatch(size_t file_size, size_t stored_size) {
+    std::lock_guard<std::recursive_mutex> guard(FileChunk::GetLock());
+    matches++;
+    matched_bytes += file_size;
+    stored_bytes += stored_size;
+}
+
+size_t SimilarityIndex::GetMatches() { return matches; }
+size_t SimilarityIndex::GetMatchedBytes() { return matched_bytes; }
+size_t SimilarityIndex::GetStoredBytes() { return stored_bytes; }
+
+}
@@ -0,0 +1,237 @@
+#include <fstream>
+#include <unordered_map>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+
+#include "FenixExceptions.hpp"
+#include "Config.hpp"
+#include "FileTree.hpp"
+#include "TreeCatalog.hpp"
+
+namespace FenixBackup {
+
+static const char CATALOG_MAGIC[8] = {'F', 'X', 'T', 'R', 'E', 'E', 'C', 'T'};
+static const uint32_t CATALOG_VERSION = 1;
+
+template <typename T>
+static void AppendValue(std::string& output, const T& value) { output.append((const char*)&value, sizeof(value)); }
+static void AppendString(std::string& output, const std::string& value) {
+    AppendValue(output, (uint32_t)value.size());
+    output.append(value);
+}
+
+/// Reading of the catalog file with bounds checking
+class CatalogReader {
+  public:
+    CatalogReader(const std::string& content, const std::string& filename): content(content), filename(filename) {}
+
+    template <typename T>
+    T Value() {
+        T value;
+        Check(sizeof(value));
+        memcpy(&value, content.data() + position, sizeof(value));
+        position += sizeof(value);
+        return value;
+    }
+    void Skip(size_t length) {
+        Check(length);
+        position += length;
+    }
+    std::string String() {
+        uint32_t length = Value<uint32_t>();
+        Check(length);
+        position += length;
+        return content.substr(position - length, length);
+    }
+
+  private:
+    const std::string& content;
+    const std::string& filename;
+    size_t position = 0;
+
+    void Check(size_t length) {
+        if (content.size() - position < length) throw FileTreeException("Tree catalog '"+filename+"' is truncated\n");
+    }
+};
+
+/// Modification time of the tree directory in nanoseconds (it changes when a tree file is added, replaced or removed)
+static int64_t GetDirectoryTime() {
+    struct stat info;
+    if (stat(Config::GetTreeDir().c_str(), &info) != 0) throw FileTreeException("Directory '"+Config::GetTreeDir()+"' missing\n");
+    return (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+// Hide data from .hpp file using PIMP idiom
+class TreeCatalog::TreeCatalogData {
+  public:
+    std::mutex lock;
+    bool opened = false;
+    std::vector<std::string> names; // Sorted, so oldest first
+    std::unordered_map<std::string, tree_info> trees;
+    int64_t directory_time = 0; // Of the tree directory when the catalog was written
+
+    void Open();
+    void Read();
+    void Write();
+    /// Add trees of the directory missing in the catalog (or changed), remove trees missing in the directory
+    void Refresh();
+    /// Set successors from the previous trees
+    void Link();
+};
+
+void TreeCatalog::TreeCatalogData::Open() {
+    if (opened) return;
+    Read();
+    opened = true;
+    if (GetDirectoryTime() != directory_time) Refresh();
+}
+
+void TreeCatalog::TreeCatalogData::Read() {
+    std::string filename = Config::GetTreeCatalogFilename();
+    std::ifstream is(filename, std::ios::binary);
+    if (!is.good()) return;
+    std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    if (content.size() < sizeof(CATALOG_MAGIC) || memcmp(content.data(), CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0)
+        throw FileTreeException("File '"+filename+"' is not a tree catalog\n");
+
+    CatalogReader reader(content, filename);
+    reader.Skip(sizeof(CATALOG_MAGIC));
+    uint32_t version = reader.Value<uint32_t>();
+    if (version != CATALOG_VERSION) throw FileTreeException("Unknown version "+std::to_string(version)+" of the tree catalog\n");
+    directory_time = reader.Value<int64_t>();
+    uint32_t count = reader.Value<uint32_t>();
+    for (uint32_t i = 0; i < count; i++) {
+        tree_info info;
+        info.tree_name = reader.String();
+        info.construct_time = reader.Value<int64_t>();
+        info.prev_tree_name = reader.String();
+        info.node_count = reader.Value<uint64_t>();
+        info.stored_bytes = reader.Value<uint64_t>();
+        names.push_back(info.tree_name);
+        trees[info.tree_name] = info;
+    }
+    std::sort(names.begin(), names.end());
+    Link();
+}
+
+void TreeCatalog::TreeCatalogData::Write() {
+    std::string content(CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+    AppendValue(content, CATALOG_VERSION);
+    AppendValue(content, directory_time);
+    AppendValue(content, (uint32_t)names.size());
+    for (auto& name: names) {
+        auto& info = trees[name];
+        AppendString(content, info.tree_name);
+        AppendValue(content, (int64_t)info.construct_time);
+        AppendString(content, info.prev_tree_name);
+        AppendValue(content, info.node_count);
+        AppendValue(content, info.stored_bytes);
+    }
+
+    std::string filename = Config::GetTreeCatalogFilename();
+    std::ofstream os(filename + ".tmp", std::ios::binary);
+    os.write(content.data(), content.size());
+    os.close();
+    if (os.fail() || rename((filename + ".tmp").c_str(), filename.c_str()) != 0) throw FileTreeException("Cannot write tree catalog '"+filename+"'\n");
+}
+
+void TreeCatalog::TreeCatalogData::Refresh() {
+    directory_time = GetDirectoryTime();
+    std::unordered_map<std::string, uint64_t> files;
+    try {
+        for (boost::filesystem::directory_iterator file(Config::GetTreeDir()); file != boost::filesystem::directory_iterator(); ++file) {
+            if (boost::filesystem::is_regular_file(file->path())
+            && boost::filesystem::extension(file->path()) == Config::GetConfig().treeFileExtension) {
+                files[boost::filesystem::basename(file->path())] = boost::filesystem::file_size(file->path());
+            }
+        }
+    } catch (const boost::filesystem::filesystem_error& ex) {
+        throw FileTreeException("Problem when parsing data directory '"+Config::GetTreeDir()+"'\n");
+    }
+
+    // Only headers of the new or changed trees are read
+    std::unordered_map<std::string, tree_info> found;
+    for (auto& file: files) {
+        auto known = trees.find(file.first);
+        if (known != trees.end() && known->second.stored_bytes == file.second) found.insert(*known);
+        else {
+            tree_info info;
+            info.tree_name = file.first;
+            if (FileTree::ReadTreeInfo(file.first, info)) found[file.first] = info;
+        }
+    }
+    trees.swap(found);
+    names.clear();
+    for (auto& tree: trees) names.push_back(tree.first);
+    std::sort(names.begin(), names.end());
+    Link();
+    Write();
+}
+
+void TreeCatalog::TreeCatalogData::Link() {
+    for (auto& tree: trees) tree.second.next_tree_name.clear();
+    for (auto& name: names) {
+        auto prev = trees.find(trees[name].prev_tree_name);
+        if (prev != trees.end()) prev->second.next_tree_name = name;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TreeCatalog::TreeCatalog(): data{new TreeCatalogData()} {}
+TreeCatalog::~TreeCatalog() {}
+
+void TreeCatalog::Open() {
+    std::lock_guard<std::mutex> guard(data->lock);
+    data->Open();
+}
+
+const std::vector<std::string>& TreeCatalog::GetTreeList() {
+    std::lock_guard<std::mutex> guard(data->lock);
+    data->Open();
+    return data->names;
+}
+
+bool TreeCatalog::Load(tree_info& info) {
+    std::lock_guard<std::mutex> guard(data->lock);
+    data->Open();
+    auto tree = data->trees.find(info.tree_name);
+    if (tree == data->trees.end()) return false;
+    info = tree->second;
+    return true;
+}
+
+void TreeCatalog::Save(const tree_info& info) {
+    std::lock_guard<std::mutex> guard(data->lock);
+    data->Open();
+    auto tree = data->trees.find(info.tree_name);
+    if (tree == data->trees.end()) {
+        data->names.insert(std::upper_bound(data->names.begin(), data->names.end(), info.tree_name), info.tree_name);
+        data->trees[info.tree_name] = info;
+    } else {
+        // Successor is kept, it is not known by the saved tree
+        std::string next_tree_name = tree->second.next_tree_name;
+        tree->second = info;
+        tree->second.next_tree_name = next_tree_name;
+    }
+    auto prev = data->trees.find(info.prev_tree_name);
+    if (prev != data->trees.end()) prev->second.next_tree_name = info.tree_name;
+    data->directory_time = GetDirectoryTime();
+    data->Write();
+}
+
+void TreeCatalog::Remove(const std::string& name) {
+    std::lock_guard<std::mutex> guard(data->lock);
+    data->Open();
+    if (data->trees.erase(name) == 0) return;
+    data->names.erase(std::find(data->names.begin(), data->names.end(), name));
+    data->Link();
+    data->directory_time = GetDirectoryTime();
+    data->Write();
+}
+
+}
@@ -0,0 +1,499 @@
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "VCDiffMerger.hpp"
+
+namespace FenixBackup {
+
+// Header of VCDIFF file (without the open-vcdiff extensions)
+static const unsigned char VCDIFF_MAGIC[] = { 0xD6, 0xC3, 0xC4, 0x00 };
+static const unsigned char VCD_SOURCE = 0x01;
+
+// Opcodes of the default code table used for the merged delta (size is always given explicitly)
+static const unsigned char OPCODE_RUN = 0;
+static const unsigned char OPCODE_ADD = 1;
+static const unsigned char OPCODE_COPY_SELF = 19;
+
+/// Stop merging (and let caller encode the content again) when the intermediate file is too fragmented
+static const size_t MAX_PIECES = 4*1024*1024;
+
+class VCDiffMerger::DeltaParser {
+  public:
+    enum inst_type { NOOP = 0, ADD = 1, RUN = 2, COPY = 3 };
+
+    /// Receives windows and instructions from the parser, returning false stops parsing
+    class Handler {
+      public:
+        virtual ~Handler() {}
+        virtual bool StartWindow(uint64_t source_pos, uint64_t source_len, uint64_t target_len) = 0;
+        virtual bool Add(const char* data, uint64_t size) = 0;
+        virtual bool Run(unsigned char byte, uint64_t size) = 0;
+        virtual bool Copy(uint64_t address, uint64_t size) = 0;
+        virtual bool EndWindow() = 0;
+    };
+
+    DeltaParser(const std::string& delta): delta{delta} {}
+
+    bool Parse(Handler& handler);
+
+  private:
+    struct code_entry {
+        unsigned char type[2];
+        unsigned char size[2];
+        unsigned char mode[2];
+    };
+
+    /// Part of the delta file which is read sequentially
+    struct section {
+        const char* pos;
+        const char* end;
+
+        bool Empty() const { return pos == end; }
+        bool ReadByte(unsigned char& byte);
+        bool ReadVarint(uint64_t& value);
+        bool ReadBytes(uint64_t length, const char*& bytes);
+        bool ReadSection(uint64_t length, section& target);
+    };
+
+    /// Address cache of the VCDIFF decoder (RFC 3284, section 5.3)
+    struct address_cache {
+        static const int NEAR_SIZE = 4;
+        static const int SAME_SIZE = 3;
+
+        uint64_t near[NEAR_SIZE] = {};
+        int next_slot = 0;
+        uint64_t same[SAME_SIZE*256] = {};
+
+        bool Decode(unsigned char mode, uint64_t here, section& addresses, uint64_t& address);
+    };
+
+    static const code_entry* DefaultCodeTable();
+
+    const std::string& delta;
+};
+
+const VCDiffMerger::DeltaParser::code_entry* VCDiffMerger::DeltaParser::DefaultCodeTable() {
+    // Constructed by the rules from RFC 3284, section 5.6
+    static code_entry table[256];
+    static bool initialized = false;
+    if (initialized) return table;
+
+    int i = 0;
+    table[i++] = {{RUN, NOOP}, {0, 0}, {0, 0}};
+    for (int size = 0; size <= 17; size++) table[i++] = {{ADD, NOOP}, {(unsigned char)size, 0}, {0, 0}};
+    for (int mode = 0; mode <= 8; mode++) {
+        table[i++] = {{COPY, NOOP}, {0, 0}, {(unsigned char)mode, 0}};
+        for (int size = 4; size <= 18; size++) table[i++] = {{COPY, NOOP}, {(unsigned char)size, 0}, {(unsigned char)mode, 0}};
+    }
+    for (int mode = 0; mode <= 5; mode++)
+        for (int add_size = 1; add_size <= 4; add_size++)
+            for (int copy_size = 4; copy_size <= 6; copy_size++)
+                table[i++] = {{ADD, COPY}, {(unsigned char)add_size, (unsigned char)copy_size}, {0, (unsigned char)mode}};
+    for (int mode = 6; mode <= 8; mode++)
+        for (int add_size = 1; add_size <= 4; add_size++)
+            table[i++] = {{ADD, COPY}, {(unsigned char)add_size, 4}, {0, (unsigned char)mode}};
+    for (int mode = 0; mode <= 8; mode++) table[i++] = {{COPY, ADD}, {4, 1}, {(unsigned char)mode, 0}};
+
+    initialized = true;
+    return table;
+}
+
+bool VCDiffMerger::DeltaParser::section::ReadByte(unsigned char& byte) {
+    if (pos == end) return false;
+    byte = *pos++;
+    return true;
+}
+
+bool VCDiffMerger::DeltaParser::section::ReadVarint(uint64_t& value) {
+    value = 0;
+    for (int i = 0; i < 10; i++) {
+        unsigned char byte;
+        if (!ReadByte(byte)) return false;
+        value = (value << 7) | (byte & 0x7F);
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+bool VCDiffMerger::DeltaParser::section::ReadBytes(uint64_t length, const char*& bytes) {
+    if (length > (uint64_t)(end - pos)) return false;
+    bytes = pos;
+    pos += length;
+    return true;
+}
+
+bool VCDiffMerger::DeltaParser::section::ReadSection(uint64_t length, section& target) {
+    const char* bytes;
+    if (!ReadBytes(length, bytes)) return false;
+    target.pos = bytes;
+    target.end = bytes + length;
+    return true;
+}
+
+bool VCDiffMerger::DeltaParser::address_cache::Decode(unsigned char mode, uint64_t here, section& addresses, uint64_t& address) {
+    uint64_t value;
+    if (mode < 2 + NEAR_SIZE) {
+        if (!addresses.ReadVarint(value)) return false;
+        if (mode == 0) address = value;                 // VCD_SELF
+        else if (mode == 1) {                           // VCD_HERE
+            if (value > here) return false;
+            address = here - value;
+        } else address = near[mode - 2] + value;        // near cache
+    } else {
+        unsigned char byte;
+        if (!addresses.ReadByte(byte)) return false;
+        address = same[(mode - 2 - NEAR_SIZE)*256 + byte]; // same cache
+    }
+    if (address >= here) return false;
+
+    near[next_slot] = address;
+    next_slot = (next_slot + 1) % NEAR_SIZE;
+    same[address % (SAME_SIZE*256)] = address;
+    return true;
+}
+
+bool VCDiffMerger::DeltaParser::Parse(Handler& handler) {
+    section file = {delta.data(), delta.data() + delta.size()};
+    const code_entry* table = DefaultCodeTable();
+
+    // 1. Header, no secondary compressor or custom code table are supported
+    for (auto magic: VCDIFF_MAGIC) {
+        unsigned char byte;
+        if (!file.ReadByte(byte) || byte != magic) return false;
+    }
+    unsigned char header_indicator;
+    if (!file.ReadByte(header_indicator) || header_indicator != 0) return false;
+
+    // 2. Windows
+    while (!file.Empty()) {
+        unsigned char window_indicator;
+        if (!file.ReadByte(window_indicator) || (window_indicator & ~VCD_SOURCE)) return false;
+        uint64_t source_len = 0, source_pos = 0;
+        if (window_indicator & VCD_SOURCE) {
+            if (!file.ReadVarint(source_len) || !file.ReadVarint(source_pos)) return false;
+        }
+
+        uint64_t encoding_len, target_len, data_len, inst_len, addr_len;
+        unsigned char delta_indicator;
+        section window, data, inst, addr;
+        if (!file.ReadVarint(encoding_len) || !file.ReadSection(encoding_len, window)) return false;
+        if (!window.ReadVarint(target_len) || !window.ReadByte(delta_indicator) || delta_indicator != 0) return false;
+        if (!window.ReadVarint(data_len) || !window.ReadVarint(inst_len) || !window.ReadVarint(addr_len)) return false;
+        if (!window.ReadSection(data_len, data) || !window.ReadSection(inst_len, inst) || !window.ReadSection(addr_len, addr)) return false;
+        if (!window.Empty()) return false;
+
+        if (!handler.StartWindow(source_pos, source_len, target_len)) return false;
+
+        address_cache cache;
+        uint64_t target_pos = 0;
+        while (!inst.Empty()) {
+            unsigned char opcode;
+            inst.ReadByte(opcode);
+            const code_entry& entry = table[opcode];
+            for (int i = 0; i < 2; i++) {
+                if (entry.type[i] == NOOP) continue;
+                uint64_t size = entry.size[i];
+                if (size == 0 && !inst.ReadVarint(size)) return false;
+                if (size > target_len - target_pos) return false;
+
+                if (entry.type[i] == ADD) {
+                    const char* bytes;
+                    if (!data.ReadBytes(size, bytes) || !handler.Add(bytes, size)) return false;
+                } else if (entry.type[i] == RUN) {
+                    unsigned char byte;
+                    if (!data.ReadByte(byte) || !handler.Run(byte, size)) return false;
+                } else {
+                    uint64_t address;
+                    if (!cache.Decode(entry.mode[i], source_len + target_pos, addr, address)) return false;
+                    if (!handler.Copy(address, size)) return false;
+                }
+                target_pos += size;
+            }
+        }
+        if (target_pos != target_len || !data.Empty() || !addr.Empty()) return false;
+        if (!handler.EndWindow()) return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+class VCDiffMerger::Composer {
+  public:
+    enum piece_kind { SOURCE, LITERAL, REPEAT, TARGET };
+
+    /// Continuous part of the file: copy from A (or from the current target window) or bytes stored in the delta
+    struct piece {
+        piece_kind kind;
+        uint64_t length;
+        uint64_t value;     // SOURCE: offset in A, REPEAT: repeated byte, TARGET: offset in target window
+        const char* data;   // LITERAL: bytes from the delta file
+    };
+
+    /// Intermediate file B described by pieces referencing A (from the first delta)
+    class Intermediate: public DeltaParser::Handler {
+      public:
+        std::vector<piece> pieces;
+        std::vector<uint64_t> starts;
+        uint64_t size = 0;
+
+        /// Append pieces describing B[position, position + length)
+        bool Resolve(uint64_t position, uint64_t length, std::vector<piece>& out);
+
+        virtual bool StartWindow(uint64_t source_pos, uint64_t source_len, uint64_t target_len);
+        virtual bool Add(const char* data, uint64_t size);
+        virtual bool Run(unsigned char byte, uint64_t size);
+        virtual bool Copy(uint64_t address, uint64_t size);
+        virtual bool EndWindow() { return true; }
+
+      private:
+        uint64_t window_start = 0;
+        uint64_t source_pos = 0;
+        uint64_t source_len = 0;
+        std::vector<piece> resolved;
+
+        void Append(const piece& p);
+    };
+
+    /// Writes delta A->C while parsing delta B->C
+    class Output: public DeltaParser::Handler {
+      public:
+        Output(Intermediate& intermediate, std::string& output): intermediate(intermediate), output(output) {}
+
+        virtual bool StartWindow(uint64_t source_pos, uint64_t source_len, uint64_t target_len);
+        virtual bool Add(const char* data, uint64_t size);
+        virtual bool Run(unsigned char byte, uint64_t size);
+        virtual bool Copy(uint64_t address, uint64_t size);
+        virtual bool EndWindow();
+
+      private:
+        Intermediate& intermediate;
+        std::string& output;
+
+        uint64_t source_pos = 0;
+        uint64_t source_len = 0;
+        uint64_t target_len = 0;
+        std::vector<piece> window;
+        std::vector<piece> resolved;
+
+        void Append(const piece& p);
+    };
+
+    static void AppendPiece(std::vector<piece>& pieces, piece p);
+    static void WriteVarint(std::string& out, uint64_t value);
+};
+
+void VCDiffMerger::Composer::AppendPiece(std::vector<piece>& pieces, piece p) {
+    if (p.length == 0) return;
+    if (p.kind == LITERAL && p.length == 1) {
+        // Single bytes as repeats, so self-overlapping copies stays compact
+        p.kind = REPEAT;
+        p.value = (unsigned char)p.data[0];
+        p.data = nullptr;
+    }
+    if (!pieces.empty()) {
+        piece& last = pieces.back();
+        bool continuous = false;
+        if (last.kind == p.kind) {
+            if (p.kind == LITERAL) continuous = (last.data + last.length == p.data);
+            else if (p.kind == REPEAT) continuous = (last.value == p.value);
+            else continuous = (last.value + last.length == p.value);
+        }
+        if (continuous) {
+            last.length += p.length;
+            return;
+        }
+    }
+    pieces.push_back(p);
+}
+
+void VCDiffMerger::Composer::WriteVarint(std::string& out, uint64_t value) {
+    char buffer[10];
+    int i = sizeof(buffer);
+    buffer[--i] = value & 0x7F;
+    while (value >>= 7) buffer[--i] = (value & 0x7F) | 0x80;
+    out.append(buffer + i, sizeof(buffer) - i);
+}
+
+bool VCDiffMerger::Composer::Intermediate::Resolve(uint64_t position, uint64_t length, std::vector<piece>& out) {
+    if (length == 0) return true;
+    if (position + length > size || position + length < position) return false;
+
+    size_t i = std::upper_bound(starts.begin(), starts.end(), position) - starts.begin() - 1;
+    while (length > 0) {
+        const piece& p = pieces[i];
+        uint64_t offset = position - starts[i];
+        uint64_t n = std::min(length, p.length - offset);
+        piece part = p;
+        part.length = n;
+        if (p.kind == SOURCE) part.value += offset;
+        else if (p.kind == LITERAL) part.data += offset;
+        AppendPiece(out, part);
+        position += n;
+        length -= n;
+        i++;
+    }
+    return true;
+}
+
+void VCDiffMerger::Composer::Intermediate::Append(const piece& p) {
+    size_t count = pieces.size();
+    AppendPiece(pieces, p);
+    if (pieces.size() != count) starts.push_back(size);
+    size += p.length;
+}
+
+bool VCDiffMerger::Composer::Intermediate::StartWindow(uint64_t source_pos, uint64_t source_len, uint64_t target_len) {
+    window_start = size;
+    this->source_pos = source_pos;
+    this->source_len = source_len;
+    return true;
+}
+
+bool VCDiffMerger::Composer::Intermediate::Add(const char* data, uint64_t size) {
+    Append({LITERAL, size, 0, data});
+    return pieces.size() < MAX_PIECES;
+}
+
+bool VCDiffMerger::Composer::Intermediate::Run(unsigned char byte, uint64_t size) {
+    Append({REPEAT, size, byte, nullptr});
+    return pieces.size() < MAX_PIECES;
+}
+
+bool VCDiffMerger::Composer::Intermediate::Copy(uint64_t address, uint64_t size) {
+    // 1. Part of the copy from the source segment (file A)
+    if (address < source_len) {
+        uint64_t n = std::min(size, source_len - address);
+        Append({SOURCE, n, source_pos + address, nullptr});
+        address += n;
+        size -= n;
+    }
+    // 2. Part of the copy from already decoded part of this window, it may
+    // overlap with itself, so copy only already known parts
+    uint64_t position = window_start + (address - source_len);
+    while (size > 0) {
+        uint64_t n = std::min(size, this->size - position);
+        resolved.clear();
+        if (!Resolve(position, n, resolved)) return false;
+        for (auto& p: resolved) Append(p);
+        position += n;
+        size -= n;
+        if (pieces.size() >= MAX_PIECES) return false;
+    }
+    return true;
+}
+
+void VCDiffMerger::Composer::Output::Append(const piece& p) { AppendPiece(window, p); }
+
+bool VCDiffMerger::Composer::Output::StartWindow(uint64_t source_pos, uint64_t source_len, uint64_t target_len) {
+    this->source_pos = source_pos;
+    this->source_len = source_len;
+    this->target_len = target_len;
+    window.clear();
+    return true;
+}
+
+bool VCDiffMerger::Composer::Output::Add(const char* data, uint64_t size) {
+    Append({LITERAL, size, 0, data});
+    return true;
+}
+
+bool VCDiffMerger::Composer::Output::Run(unsigned char byte, uint64_t size) {
+    Append({REPEAT, size, byte, nullptr});
+    return true;
+}
+
+bool VCDiffMerger::Composer::Output::Copy(uint64_t address, uint64_t size) {
+    // 1. Copy from the source segment (file B) is replaced by pieces of B
+    if (address < source_len) {
+        uint64_t n = std::min(size, source_len - address);
+        resolved.clear();
+        if (!intermediate.Resolve(source_pos + address, n, resolved)) return false;
+        for (auto& p: resolved) Append(p);
+        address += n;
+        size -= n;
+    }
+    // 2. Copy from the target window stays, windows of the merged delta are the same
+    if (size > 0) Append({TARGET, size, address - source_len, nullptr});
+    return true;
+}
+
+bool VCDiffMerger::Composer::Output::EndWindow() {
+    // 1. Source segment covering all copies from A
+    uint64_t segment_start = UINT64_MAX, segment_end = 0;
+    for (auto& p: window) if (p.kind == SOURCE) {
+        segment_start = std::min(segment_start, p.value);
+        segment_end = std::max(segment_end, p.value + p.length);
+    }
+    bool has_source = segment_end > 0;
+    uint64_t segment_len = has_source ? segment_end - segment_start : 0;
+
+    // 2. Instructions with explicit sizes and VCD_SELF addresses
+    std::string data, inst, addr;
+    for (auto& p: window) {
+        switch (p.kind) {
+          case LITERAL:
+            inst.push_back(OPCODE_ADD);
+            WriteVarint(inst, p.length);
+            data.append(p.data, p.length);
+            break;
+          case REPEAT:
+            inst.push_back(OPCODE_RUN);
+            WriteVarint(inst, p.length);
+            data.push_back((char)p.value);
+            break;
+          case SOURCE:
+            inst.push_back(OPCODE_COPY_SELF);
+            WriteVarint(inst, p.length);
+            WriteVarint(addr, p.value - segment_start);
+            break;
+          case TARGET:
+            inst.push_back(OPCODE_COPY_SELF);
+            WriteVarint(inst, p.length);
+            WriteVarint(addr, segment_len + p.value);
+            break;
+        }
+    }
+
+    // 3. Window header and delta encoding
+    std::string encoding;
+    WriteVarint(encoding, target_len);
+    encoding.push_back(0); // Delta_Indicator, no compression
+    WriteVarint(encoding, data.size());
+    WriteVarint(encoding, inst.size());
+    WriteVarint(encoding, addr.size());
+    encoding += data;
+    encoding += inst;
+    encoding += addr;
+
+    output.push_back(has_source ? VCD_SOURCE : 0);
+    if (has_source) {
+        WriteVarint(output, segment_len);
+        WriteVarint(output, segment_start);
+    }
+    WriteVarint(output, encoding.size());
+    output += encoding;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool VCDiffMerger::Merge(const std::string& first, const std::string& second, std::string& output) {
+    // 1. Describe intermediate file B using pieces of A and data from the first delta
+    Composer::Intermediate intermediate;
+    DeltaParser first_parser(first);
+    if (!first_parser.Parse(intermediate)) return false;
+
+    // 2. Rewrite the second delta against A
+    std::string merged((const char*)VCDIFF_MAGIC, sizeof(VCDIFF_MAGIC));
+    merged.push_back(0); // Hdr_Indicator
+    Composer::Output composer(intermediate, merged);
+    DeltaParser second_parser(second);
+    if (!second_parser.Parse(composer)) return false;
+
+    output.swap(merged);
+    return true;
+}
+
+}
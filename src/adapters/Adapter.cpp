@@ -5,10 +5,14 @@ namespace FenixBackup {
 Adapter::Adapter() {}
 Adapter::~Adapter() {}
 
+void Adapter::GetAndProcessBatch(const std::vector<std::shared_ptr<FileInfo>>& files) {
+    for (auto& file: files) GetAndProcess(file);
+}
+
 void Adapter::RestoreSubtree(std::shared_ptr<FileInfo> file, restore_mode mode, restore_tactic tactic) {
     if (mode != ONLY_PERMISSIONS) RestoreFile(file, ONLY_DATA, tactic);
     if (file->GetType() == DIR)
-        for(auto& item: file->GetChilds()) RestoreSubtree(item.second, mode, tactic);
+        for(auto& item: file->GetChilds()) RestoreSubtree(item, mode, tactic);
     if (mode != ONLY_DATA) RestoreFile(file, ONLY_PERMISSIONS, tactic);
 }
 void Adapter::RestoreSubtreeToRemotePath(std::shared_ptr<FileInfo> file, const std::string& path,
@@ -18,8 +22,8 @@ void Adapter::RestoreSubtreeToRemotePath(std::shared_ptr<FileInfo> file, const s
     if (mode != ONLY_PERMISSIONS) RestoreFileToRemotePath(file, path, ONLY_DATA, tactic, preserve_inbackup_path);
     if (file->GetType() == DIR)
         for(auto& item: file->GetChilds()) {
-            if (preserve_inbackup_path) RestoreSubtreeToRemotePath(item.second, path, mode, tactic, true);
-            else RestoreSubtreeToRemotePath(item.second, path+"/"+item.second->GetName(), mode, tactic, false);
+            if (preserve_inbackup_path) RestoreSubtreeToRemotePath(item, path, mode, tactic, true);
+            else RestoreSubtreeToRemotePath(item, path+"/"+item->GetName(), mode, tactic, false);
         }
     if (mode != ONLY_DATA) RestoreFileToRemotePath(file, path, ONLY_PERMISSIONS, tactic, preserve_inbackup_path);
 }
@@ -30,10 +34,26 @@ void Adapter::RestoreSubtreeToLocalPath(std::shared_ptr<FileInfo> file, const st
     if (mode != ONLY_PERMISSIONS) RestoreFileToLocalPath(file, path, ONLY_DATA, tactic, preserve_inbackup_path);
     if (file->GetType() == DIR)
         for(auto& item: file->GetChilds()) {
-            if (preserve_inbackup_path) RestoreSubtreeToLocalPath(item.second, path, mode, tactic, true);
-            else RestoreSubtreeToLocalPath(item.second, path+"/"+item.second->GetName(), mode, tactic, false);
+            if (preserve_inbackup_path) RestoreSubtreeToLocalPath(item, path, mode, tactic, true);
+            else RestoreSubtreeToLocalPath(item, path+"/"+item->GetName(), mode, tactic, false);
         }
     if (mode != ONLY_DATA) RestoreFileToLocalPath(file, path, ONLY_PERMISSIONS, tactic, preserve_inbackup_path);
 }
 
+// Data in the path order (directories before their content), permissions in the reverse one (so times of directories are kept)
+void Adapter::RestoreFiles(const std::vector<std::shared_ptr<FileInfo>>& files, restore_mode mode, restore_tactic tactic) {
+    if (mode != ONLY_PERMISSIONS)
+        for (auto& file: files) RestoreFile(file, ONLY_DATA, tactic);
+    if (mode != ONLY_DATA)
+        for (auto file = files.rbegin(); file != files.rend(); ++file) RestoreFile(*file, ONLY_PERMISSIONS, tactic);
+}
+void Adapter::RestoreFilesToLocalPath(const std::vector<std::shared_ptr<FileInfo>>& files, const std::string& path,
+                                      restore_mode mode, restore_tactic tactic)
+{
+    if (mode != ONLY_PERMISSIONS)
+        for (auto& file: files) RestoreFileToLocalPath(file, path, ONLY_DATA, tactic);
+    if (mode != ONLY_DATA)
+        for (auto file = files.rbegin(); file != files.rend(); ++file) RestoreFileToLocalPath(*file, path, ONLY_PERMISSIONS, tactic);
+}
+
 }
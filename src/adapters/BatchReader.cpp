@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "FenixExceptions.hpp"
+#include "adapters/BatchReader.hpp"
+
+namespace FenixBackup {
+
+static const int NO_RESULT = INT_MIN; // Result of an entry that was not submitted (or not completed yet)
+
+/// Read the rest of the file after a short read, return false on error
+static bool ReadRest(int fd, BatchReader::item& item, size_t done) {
+    item.content.resize(item.size + 1);
+    while (done < item.size + 1) {
+        ssize_t count = pread(fd, &item.content[done], item.size + 1 - done, done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) {
+            item.error = errno;
+            return false;
+        }
+        if (count == 0) break;
+        done += count;
+    }
+    item.complete = (done <= item.size);
+    item.content.resize(std::min(done, item.size));
+    return true;
+}
+
+/// Read one file by plain system calls
+static void ReadFile(BatchReader::item& item) {
+    int fd = open(item.filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        item.error = errno;
+        return;
+    }
+    ReadRest(fd, item, 0);
+    close(fd);
+}
+
+// Hide data from .hpp file using PIMP idiom
+class BatchReader::BatchReaderData {
+  public:
+    unsigned int depth;
+    int ring_fd = -1;
+
+    // Mapped rings
+    void* sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void* cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    bool Setup();
+    void Teardown();
+    /// Return the next submission entry (cleared), user_data is the index of the item
+    io_uring_sqe* GetSqe(unsigned int index);
+    /// Submit count prepared entries and wait for all completions, results are stored by user_data.
+    /// On failure, entries not taken by the kernel are withdrawn (their results stay NO_RESULT) and
+    /// the submitted ones are still waited for, so no operation is in flight when it returns false.
+    bool SubmitAndWait(unsigned int count, std::vector<int>& results);
+    /// Read items [begin, end) by io_uring, items it could not read are read by plain system calls,
+    /// return false when io_uring failed (it should not be used any more)
+    bool ReadBatch(std::vector<item>& items, size_t begin, size_t end);
+};
+
+bool BatchReader::BatchReaderData::Setup() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (ring_fd < 0) return false;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        Teardown();
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) cq_ring = sq_ring;
+    else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            Teardown();
+            return false;
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* address = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (address == MAP_FAILED) {
+        Teardown();
+        return false;
+    }
+    sqes = (io_uring_sqe*)address;
+
+    char* sq = (char*)sq_ring;
+    char* cq = (char*)cq_ring;
+    sq_head = (unsigned*)(sq + params.sq_off.head);
+    sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + params.sq_off.array);
+    cq_head = (unsigned*)(cq + params.cq_off.head);
+    cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    // Ring may be bigger than requested, never smaller
+    depth = std::min(depth, params.sq_entries);
+    return true;
+}
+
+void BatchReader::BatchReaderData::Teardown() {
+    if (sqes != nullptr) munmap(sqes, sqes_size);
+    if (cq_ring != nullptr && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != nullptr) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) close(ring_fd);
+    sqes = nullptr;
+    sq_ring = cq_ring = nullptr;
+    ring_fd = -1;
+}
+
+io_uring_sqe* BatchReader::BatchReaderData::GetSqe(unsigned int index) {
+    unsigned tail = *sq_tail;
+    unsigned slot = tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = index;
+    sq_array[slot] = slot;
+    // Kernel sees the entry after the tail is published
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+bool BatchReader::BatchReaderData::SubmitAndWait(unsigned int count, std::vector<int>& results) {
+    unsigned int submitted = 0, completed = 0;
+    bool failed = false;
+    while (completed < (failed ? submitted : count)) {
+        unsigned int to_submit = (failed ? 0 : count - submitted);
+        int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, (failed ? submitted : count) - completed, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0 && errno != EINTR) {
+            if (to_submit > 0) {
+                // Kernel took the entries up to its head -> the rest is withdrawn
+                __atomic_store_n(sq_tail, __atomic_load_n(sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+                failed = true;
+            } else usleep(1000); // Waiting failed, completions are still posted to the ring
+        }
+        if (ret > 0) submitted += ret;
+
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe* cqe = &cqes[head & *cq_mask];
+            results[cqe->user_data] = cqe->res;
+            head++;
+            completed++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+    return !failed;
+}
+
+bool BatchReader::BatchReaderData::ReadBatch(std::vector<item>& items, size_t begin, size_t end) {
+    unsigned int count = end - begin;
+    std::vector<int> fds(count, NO_RESULT), results(count, NO_RESULT);
+
+    // 1. Open all files
+    for (unsigned int i = 0; i < count; i++) {
+        io_uring_sqe* sqe = GetSqe(i);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)items[begin + i].filename.c_str();
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    bool ok = SubmitAndWait(count, fds);
+    // Kernel without OPENAT (older than 5.6) or failed io_uring -> close whatever was opened and use plain reads
+    if (!ok || std::find(fds.begin(), fds.end(), -EINVAL) != fds.end()) {
+        for (int fd: fds) if (fd >= 0) close(fd);
+        for (size_t i = begin; i < end; i++) ReadFile(items[i]);
+        return false;
+    }
+
+    // 2. Read all opened files (one byte more than expected shows that the file grew)
+    unsigned int reads = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        item& file = items[begin + i];
+        if (fds[i] < 0) {
+            file.error = -fds[i];
+            continue;
+        }
+        file.content.resize(file.size + 1);
+        io_uring_sqe* sqe = GetSqe(i);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fds[i];
+        sqe->addr = (uint64_t)&file.content[0];
+        sqe->len = file.size + 1;
+        sqe->off = 0;
+        reads++;
+    }
+    ok = (reads == 0 || SubmitAndWait(reads, results));
+    for (unsigned int i = 0; i < count; i++) {
+        item& file = items[begin + i];
+        if (fds[i] < 0) continue;
+        if (results[i] == NO_RESULT) ReadRest(fds[i], file, 0); // Read was withdrawn -> plain read of the opened file
+        else if (results[i] < 0) file.error = -results[i];
+        else if ((size_t)results[i] < file.size) ReadRest(fds[i], file, results[i]); // Short read (or the file shrank)
+        else {
+            file.complete = ((size_t)results[i] <= file.size);
+            file.content.resize(file.size);
+        }
+    }
+
+    // 3. Close all files
+    unsigned int closes = 0;
+    std::fill(results.begin(), results.end(), NO_RESULT);
+    for (unsigned int i = 0; i < count; i++) {
+        if (fds[i] < 0) continue;
+        io_uring_sqe* sqe = GetSqe(i);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fds[i];
+        closes++;
+    }
+    if (closes > 0 && !SubmitAndWait(closes, results)) ok = false;
+    for (unsigned int i = 0; i < count; i++) if (fds[i] >= 0 && results[i] == NO_RESULT) close(fds[i]);
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+BatchReader::BatchReader(unsigned int depth, bool use_io_uring): data{new BatchReaderData()} {
+    data->depth = std::max(1u, depth);
+    if (use_io_uring) data->Setup();
+}
+
+BatchReader::~BatchReader() { data->Teardown(); }
+
+bool BatchReader::UsesIoUring() { return data->ring_fd >= 0; }
+
+void BatchReader::Read(std::vector<item>& items) {
+    for (size_t begin = 0; begin < items.size(); begin += data->depth) {
+        size_t end = std::min(items.size(), begin + data->depth);
+        if (data->ring_fd < 0) {
+            for (size_t i = begin; i < end; i++) ReadFile(items[i]);
+        } else if (!data->ReadBatch(items, begin, end)) {
+            // io_uring failed -> it is not used any more (nothing of it is in flight)
+            data->Teardown();
+        }
+    }
+}
+
+}
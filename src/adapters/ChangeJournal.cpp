@@ -0,0 +1,378 @@
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "Config.hpp"
+#include "FenixExceptions.hpp"
+#include "adapters/ChangeJournal.hpp"
+
+namespace FenixBackup {
+
+// Records of the journal are a type character, text and '\0' (paths may contain newlines)
+static const char JOURNAL_HEADER = 'H'; // Session of the watcher (journal is truncated by each one)
+static const char JOURNAL_READY = 'R'; // Whole tree is watched
+static const char JOURNAL_CHANGED = 'D'; // Tree path of a directory with changed entries
+static const char JOURNAL_OVERFLOW = 'O'; // Events were lost
+static const char JOURNAL_SYNC = 'S'; // Token of a Begin, changes made before the Begin are recorded before it
+static const char JOURNAL_BASE = 'B'; // Offset of the next record, records before it were compacted
+
+/// Milliseconds Begin waits for the watcher to record its token
+static const unsigned int SYNC_TIMEOUT = 10000;
+static const unsigned int SYNC_POLL = 10;
+/// Records older than the state offset are dropped when there are more of them than of the newer ones, and at least this size
+static const unsigned long long COMPACT_MIN = 64*1024;
+
+/// Changes of entries of watched directories (modified content, params, created, deleted and moved ones)
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO
+    | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+// Hide data from .hpp file using PIMP idiom
+class ChangeJournal::ChangeJournalData {
+  public:
+    ~ChangeJournalData();
+
+    // Reading by the scan (offsets of records don't change by compaction)
+    bool ready = false; // Begin read the journal of a running watcher, which watched everything
+    std::string session; // Also of the watcher
+    unsigned long long end = 0; // End of the last complete record read by Begin
+    std::unordered_set<std::string> dirty;
+
+    // Watching
+    int journal_fd = -1;
+    int inotify_fd = -1;
+    std::string path; // Watched filesystem path
+    std::unordered_map<int, std::string> watches; // Watch descriptor -> tree path
+    std::unordered_set<std::string> written; // Directories recorded since the last scan began
+    int state_wd = -1; // Watch of the data directory, Begin and End rewrite the state in it
+    struct stat state_info = {};
+    std::string records; // Not yet written
+    unsigned long long journal_size = 0; // Size of the journal file
+    unsigned long long records_begin = 0; // End of the header in the journal file, records after it can be compacted
+    long long shift = 0; // Offset of a record minus its position in the journal file
+
+    void Record(char type, const std::string& text = "");
+    void Flush();
+    /**
+     * Directories recorded before the last Begin have to be recorded again (Begin rewrites the state),
+     * token of the Begin is recorded and records older than the state offset are compacted.
+     */
+    void CheckState();
+    /// Replace the journal by the header and records from the offset (when most of the journal is older)
+    void Compact(unsigned long long offset);
+    /// Watch the directory and all its subdirectories
+    void AddWatches(const std::string& tree_path, bool record);
+    void RemoveWatches(const std::string& tree_path);
+    void HandleEvents(const char* buffer, ssize_t length);
+
+    static bool ReadState(std::string& session, unsigned long long& offset, std::string& tree_name, std::string& token);
+    static void WriteState(const std::string& session, unsigned long long offset, const std::string& tree_name, const std::string& token = "");
+    /// Read the whole journal, return false when no watcher is running (it holds the lock)
+    static bool ReadJournal(std::string& content);
+};
+
+ChangeJournal::ChangeJournalData::~ChangeJournalData() {
+    if (inotify_fd >= 0) close(inotify_fd);
+    // The lock is released, so scans don't use the journal anymore
+    if (journal_fd >= 0) close(journal_fd);
+}
+
+void ChangeJournal::ChangeJournalData::Record(char type, const std::string& text) {
+    if (type == JOURNAL_CHANGED && !written.insert(text).second) return;
+    records += type;
+    records += text;
+    records += '\0';
+}
+
+void ChangeJournal::ChangeJournalData::Flush() {
+    for (size_t position = 0; position < records.size();) {
+        ssize_t count = write(journal_fd, records.data() + position, records.size() - position);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) throw AdapterException("Cannot write the change journal '"+Config::GetJournalFilename()+"': "+strerror(errno)+"\n");
+        position += count;
+        journal_size += count;
+    }
+    records.clear();
+}
+
+void ChangeJournal::ChangeJournalData::CheckState() {
+    struct stat info = {};
+    if (stat(Config::GetJournalStateFilename().c_str(), &info) != 0) memset(&info, 0, sizeof(info));
+    if (info.st_ino == state_info.st_ino && info.st_mtim == state_info.st_mtim) return;
+    written.clear();
+    state_info = info;
+
+    std::string state_session, tree_name, token;
+    unsigned long long offset;
+    if (!ReadState(state_session, offset, tree_name, token)) return;
+    // Events are read in order, so everything changed before the Begin is recorded already
+    if (!token.empty()) Record(JOURNAL_SYNC, token);
+    if (state_session == session) Compact(offset);
+}
+
+void ChangeJournal::ChangeJournalData::Compact(unsigned long long offset) {
+    Flush();
+    if ((long long)offset < (long long)records_begin + shift) return;
+    unsigned long long position = offset - shift;
+    if (position > journal_size || position - records_begin < COMPACT_MIN || position - records_begin < journal_size - position) return;
+
+    // 1. Header, ready and base records, then records from the offset
+    std::string content;
+    content += JOURNAL_HEADER + session + '\0';
+    content += JOURNAL_READY;
+    content += '\0';
+    content += JOURNAL_BASE + std::to_string(offset) + '\0';
+    size_t header_size = content.size();
+    content.resize(header_size + journal_size - position);
+    for (size_t done = header_size; done < content.size();) {
+        ssize_t count = pread(journal_fd, &content[done], content.size() - done, position + done - header_size);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return;
+        done += count;
+    }
+
+    // 2. New journal is locked before it replaces the old one, the old one is kept on failure
+    std::string filename = Config::GetJournalFilename();
+    std::string temp_name = filename + ".tmp";
+    int fd = open(temp_name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    bool ok = (flock(fd, LOCK_EX | LOCK_NB) == 0);
+    for (size_t done = 0; ok && done < content.size();) {
+        ssize_t count = write(fd, content.data() + done, content.size() - done);
+        if (count < 0 && errno == EINTR) continue;
+        ok = (count > 0);
+        if (ok) done += count;
+    }
+    if (!ok || rename(temp_name.c_str(), filename.c_str()) != 0) {
+        close(fd);
+        unlink(temp_name.c_str());
+        return;
+    }
+    close(journal_fd);
+    journal_fd = fd;
+    journal_size = content.size();
+    records_begin = header_size;
+    shift = (long long)offset - (long long)header_size;
+}
+
+void ChangeJournal::ChangeJournalData::AddWatches(const std::string& tree_path, bool record) {
+    std::string fs_path = (tree_path == "." ? path : path + "/" + tree_path.substr(2));
+    int wd = inotify_add_watch(inotify_fd, fs_path.c_str(), WATCH_MASK);
+    if (wd < 0) {
+        // Removed meanwhile, its parent is recorded
+        if (errno == ENOENT || errno == ENOTDIR) return;
+        Record(JOURNAL_OVERFLOW);
+        Flush();
+        throw AdapterException("Cannot watch '"+fs_path+"': "+strerror(errno)+" (see fs.inotify.max_user_watches)\n");
+    }
+    watches[wd] = tree_path;
+    // Entries could change before the watch was added
+    if (record) Record(JOURNAL_CHANGED, tree_path);
+
+    ::DIR* dir = opendir(fs_path.c_str());
+    if (dir == nullptr) return;
+    std::vector<std::string> subdirs;
+    while (auto item = readdir(dir)) {
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) continue;
+        bool is_dir = (item->d_type == DT_DIR);
+        if (item->d_type == DT_UNKNOWN) {
+            struct stat info;
+            is_dir = (fstatat(dirfd(dir), item->d_name, &info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode));
+        }
+        if (is_dir) subdirs.push_back(item->d_name);
+    }
+    closedir(dir);
+    for (auto& name: subdirs) AddWatches(tree_path + "/" + name, record);
+}
+
+void ChangeJournal::ChangeJournalData::RemoveWatches(const std::string& tree_path) {
+    std::string prefix = tree_path + "/";
+    for (auto watch = watches.begin(); watch != watches.end();) {
+        if (watch->second == tree_path || watch->second.compare(0, prefix.size(), prefix) == 0) {
+            inotify_rm_watch(inotify_fd, watch->first);
+            watch = watches.erase(watch);
+        } else ++watch;
+    }
+}
+
+void ChangeJournal::ChangeJournalData::HandleEvents(const char* buffer, ssize_t length) {
+    for (const char* position = buffer; position < buffer + length;) {
+        auto event = (const struct inotify_event*)position;
+        position += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            // Lost events could create directories, the whole tree is watched again (scans started
+            // before the second record are not complete)
+            Record(JOURNAL_OVERFLOW);
+            Flush();
+            AddWatches(".", false);
+            Record(JOURNAL_OVERFLOW);
+            CheckState();
+            continue;
+        }
+        if (event->wd == state_wd && event->len > 0 && Config::GetJournalStateFilename() == Config::GetDataDir() + "/" + event->name) CheckState();
+        auto watch = watches.find(event->wd);
+        if (watch == watches.end()) continue;
+        if (event->mask & IN_IGNORED) {
+            watches.erase(watch);
+            continue;
+        }
+        std::string tree_path = watch->second;
+        Record(JOURNAL_CHANGED, tree_path);
+
+        // Moved directories are watched under their new path
+        if (event->len == 0 || !(event->mask & IN_ISDIR)) continue;
+        std::string child = tree_path + "/" + event->name;
+        if (event->mask & IN_MOVED_FROM) RemoveWatches(child);
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) AddWatches(child, true);
+    }
+}
+
+bool ChangeJournal::ChangeJournalData::ReadState(std::string& session, unsigned long long& offset, std::string& tree_name, std::string& token) {
+    std::ifstream is(Config::GetJournalStateFilename());
+    std::string offset_text;
+    if (!std::getline(is, session) || !std::getline(is, offset_text) || !std::getline(is, tree_name)) return false;
+    offset = strtoull(offset_text.c_str(), nullptr, 10);
+    if (!std::getline(is, token)) token.clear();
+    return true;
+}
+
+void ChangeJournal::ChangeJournalData::WriteState(const std::string& session, unsigned long long offset, const std::string& tree_name, const std::string& token) {
+    std::string temp_name = Config::GetJournalStateFilename()+".tmp";
+    std::ofstream os(temp_name);
+    os << session << "\n" << offset << "\n" << tree_name << "\n" << token << "\n";
+    os.close();
+    if (!os.good()) throw AdapterException("Cannot write the change journal state '"+temp_name+"'\n");
+    rename(temp_name.c_str(), Config::GetJournalStateFilename().c_str());
+}
+
+bool ChangeJournal::ChangeJournalData::ReadJournal(std::string& content) {
+    std::string filename = Config::GetJournalFilename();
+    while (true) {
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+            // Unlocked journal was replaced by the compacted one meanwhile
+            struct stat opened, current;
+            bool replaced = (fstat(fd, &opened) == 0 && stat(filename.c_str(), &current) == 0 && opened.st_ino != current.st_ino);
+            close(fd);
+            if (replaced) continue;
+            return false;
+        }
+        content.clear();
+        char buffer[64*1024];
+        ssize_t count;
+        while ((count = read(fd, buffer, sizeof(buffer))) > 0) content.append(buffer, count);
+        close(fd);
+        return true;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ChangeJournal::ChangeJournal(): data{new ChangeJournalData()} {}
+ChangeJournal::~ChangeJournal() {}
+
+void ChangeJournal::Watch(const std::string& path, const std::function<bool()>& stopped) {
+    data->path = (path.size() > 1 && path.back() == '/' ? path.substr(0, path.size() - 1) : path);
+
+    // 1. Start a new session in the journal (journals of older versions were kept in the tree directory)
+    unlink((Config::GetTreeDir() + "/" + Config::GetConfig().journalFilename).c_str());
+    unlink((Config::GetTreeDir() + "/" + Config::GetConfig().journalStateFilename).c_str());
+    auto filename = Config::GetJournalFilename();
+    data->journal_fd = open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (data->journal_fd < 0) throw AdapterException("Cannot open the change journal '"+filename+"': "+strerror(errno)+"\n");
+    if (flock(data->journal_fd, LOCK_EX | LOCK_NB) != 0) throw AdapterException("Change journal '"+filename+"' is used by another watcher\n");
+    if (ftruncate(data->journal_fd, 0) != 0) throw AdapterException("Cannot truncate the change journal '"+filename+"'\n");
+    data->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (data->inotify_fd < 0) throw AdapterException(std::string("Cannot initialize inotify: ")+strerror(errno)+"\n");
+    data->session = std::to_string(time(nullptr))+"."+std::to_string(getpid());
+    data->Record(JOURNAL_HEADER, data->session);
+    data->CheckState();
+
+    // 2. Watch everything (and the state for Begin and End), scans can use the journal from the next one
+    data->AddWatches(".", false);
+    data->state_wd = inotify_add_watch(data->inotify_fd, Config::GetDataDir().c_str(), IN_MOVED_TO | IN_ONLYDIR | IN_MASK_ADD);
+    if (data->state_wd < 0) throw AdapterException("Cannot watch '"+Config::GetDataDir()+"': "+strerror(errno)+"\n");
+    data->Record(JOURNAL_READY);
+    data->Flush();
+    data->records_begin = data->journal_size;
+
+    // 3. Record changes until stopped
+    std::vector<struct inotify_event> buffer(64*1024 / sizeof(struct inotify_event));
+    while (!stopped()) {
+        struct pollfd fds = {data->inotify_fd, POLLIN, 0};
+        if (poll(&fds, 1, 1000) <= 0) continue;
+        ssize_t length = read(data->inotify_fd, buffer.data(), buffer.size() * sizeof(struct inotify_event));
+        if (length <= 0) continue;
+        data->HandleEvents((const char*)buffer.data(), length);
+        data->Flush();
+    }
+}
+
+bool ChangeJournal::Begin(std::shared_ptr<FileTree> prev_tree) {
+    static std::atomic<unsigned int> counter(0);
+    data->ready = false;
+    data->dirty.clear();
+
+    // 1. The watcher records again directories recorded before this point, and records the token
+    // of this Begin after the changes made before it
+    std::string state_session, state_tree, token;
+    unsigned long long state_offset = 0;
+    bool has_state = ChangeJournalData::ReadState(state_session, state_offset, state_tree, token);
+    token = std::to_string(time(nullptr))+"."+std::to_string(getpid())+"."+std::to_string(counter++);
+    ChangeJournalData::WriteState(state_session, state_offset, state_tree, token);
+
+    // 2. Read journal of the running watcher, until it has the token (a watcher not ready yet does not record it)
+    std::string content;
+    std::string ready_record = std::string(1, '\0') + JOURNAL_READY + '\0';
+    std::string sync_record = std::string(1, '\0') + JOURNAL_SYNC + token + '\0';
+    for (unsigned int waited = 0;; waited += SYNC_POLL) {
+        if (!ChangeJournalData::ReadJournal(content) || content.find(ready_record) == std::string::npos) return false;
+        if (content.find(sync_record) != std::string::npos) break;
+        if (waited >= SYNC_TIMEOUT) return false;
+        usleep(SYNC_POLL * 1000);
+    }
+
+    // 3. Changed directories since the previous scan (its end of the journal)
+    bool same_session = false, overflow = false;
+    long long shift = 0; // Offset of a record minus its position in the content
+    size_t position = 0;
+    for (size_t zero; (zero = content.find('\0', position)) != std::string::npos; position = zero + 1) {
+        char type = content[position];
+        unsigned long long offset = position + shift;
+        if (position == 0) {
+            if (type != JOURNAL_HEADER) return false;
+            data->session = content.substr(1, zero - 1);
+            same_session = (has_state && state_session == data->session);
+        } else if (type == JOURNAL_BASE) shift = (long long)strtoull(content.c_str() + position + 1, nullptr, 10) - (long long)(zero + 1);
+        else if (same_session && offset >= state_offset && type == JOURNAL_CHANGED) data->dirty.insert(content.substr(position + 1, zero - position - 1));
+        else if (same_session && offset >= state_offset && type == JOURNAL_OVERFLOW) overflow = true;
+    }
+    data->ready = true;
+    data->end = position + shift;
+
+    // 4. Journal continues where the previous tree ended, and rules of the scan are the same
+    if (!same_session || prev_tree == nullptr || state_tree != prev_tree->GetTreeName() || state_offset > data->end || overflow) return false;
+    struct stat info;
+    if (stat(Config::GetConfig().configFilename.c_str(), &info) != 0 || info.st_mtime >= prev_tree->GetConstructTime()) return false;
+    return true;
+}
+
+const std::unordered_set<std::string>& ChangeJournal::GetDirty() { return data->dirty; }
+
+void ChangeJournal::End(std::shared_ptr<FileTree> tree) {
+    if (!data->ready) return;
+    ChangeJournalData::WriteState(data->session, data->end, tree->GetTreeName());
+}
+
+}
@@ -0,0 +1,211 @@
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstring>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "FenixExceptions.hpp"
+#include "adapters/DirectoryScanner.hpp"
+
+namespace FenixBackup {
+
+/// Buffer of one getdents64 call (thousands of entries at once)
+static const size_t DIRENT_BUFFER_SIZE = 1024*1024;
+
+static std::string JoinPath(const std::string& directory, const std::string& name) {
+    if (directory.empty() || directory.back() == '/') return directory + name;
+    return directory + "/" + name;
+}
+
+// Hide data from .hpp file using PIMP idiom
+class DirectoryScanner::DirectoryScannerData {
+  public:
+    struct work_queue {
+        std::deque<directory*> directories;
+        std::mutex lock;
+    };
+
+    std::function<bool(const std::string&, const file_params&)> filter;
+    unsigned int thread_count;
+    std::vector<std::unique_ptr<directory>> roots;
+    std::vector<std::unique_ptr<work_queue>> queues; // One for each thread
+    std::vector<std::thread> threads;
+
+    std::mutex lock; // Guards everything below and complete flags of directories
+    std::condition_variable changed;
+    size_t queued = 0; // Directories waiting in queues
+    bool stop = false; // Threads wait for more scans until the scanner is destroyed
+    std::exception_ptr error;
+
+    void Work(size_t index);
+    /// Take the newest directory of own queue, or steal the oldest one from another queue
+    directory* Take(size_t index);
+    void Push(size_t index, directory* dir);
+    /// Read entries of the directory and queue its subdirectories
+    void Read(directory& dir, size_t index, std::vector<char>& buffer);
+};
+
+void DirectoryScanner::DirectoryScannerData::Work(size_t index) {
+    std::vector<char> buffer(DIRENT_BUFFER_SIZE);
+    while (true) {
+        directory* dir = Take(index);
+        if (dir == nullptr) {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [this]() { return stop || queued > 0; });
+            if (stop) return;
+            continue;
+        }
+        try {
+            Read(*dir, index, buffer);
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!error) error = std::current_exception();
+            stop = true;
+            changed.notify_all();
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        dir->complete = true;
+        changed.notify_all();
+    }
+}
+
+DirectoryScanner::directory* DirectoryScanner::DirectoryScannerData::Take(size_t index) {
+    directory* dir = nullptr;
+    {
+        auto& own = *queues[index];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.directories.empty()) {
+            dir = own.directories.back();
+            own.directories.pop_back();
+        }
+    }
+    for (size_t i = 1; dir == nullptr && i < queues.size(); i++) {
+        auto& other = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(other.lock);
+        if (!other.directories.empty()) {
+            dir = other.directories.front();
+            other.directories.pop_front();
+        }
+    }
+    if (dir != nullptr) {
+        std::lock_guard<std::mutex> guard(lock);
+        queued--;
+    }
+    return dir;
+}
+
+void DirectoryScanner::DirectoryScannerData::Push(size_t index, directory* dir) {
+    {
+        auto& own = *queues[index];
+        std::lock_guard<std::mutex> guard(own.lock);
+        own.directories.push_back(dir);
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    queued++;
+    changed.notify_all();
+}
+
+void DirectoryScanner::DirectoryScannerData::Read(directory& dir, size_t index, std::vector<char>& buffer) {
+    // Unreadable directory stays empty (as with boost::filesystem::directory_iterator)
+    int fd = open(dir.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    long count;
+    while ((count = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0) {
+        for (long position = 0; position < count;) {
+            auto item = (struct dirent64*)(buffer.data() + position);
+            position += item->d_reclen;
+            const char* name = item->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+            // The only stat of the entry, except symlinks (their target decides the type)
+            struct stat info;
+            if (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) continue; // Deleted after listing
+            entry result;
+            result.name = name;
+            result.params = GetParams(info);
+            struct stat target;
+            if (S_ISDIR(info.st_mode)) result.type = DIR;
+            else if (S_ISREG(info.st_mode)) result.type = FILE;
+            else if (S_ISLNK(info.st_mode)) {
+                bool followed = (fstatat(fd, name, &target, 0) == 0);
+                result.type = (followed && S_ISDIR(target.st_mode) ? DIR : followed && S_ISREG(target.st_mode) ? FILE : SYMLINK);
+            } else {
+                close(fd);
+                throw AdapterException("Unknown type of the file '"+JoinPath(dir.path, name)+"'\n");
+            }
+
+            if (result.type == DIR && filter(JoinPath(dir.tree_path, name), result.params)) {
+                result.subdir.reset(new directory());
+                result.subdir->path = JoinPath(dir.path, name);
+                result.subdir->tree_path = JoinPath(dir.tree_path, name);
+            }
+            dir.entries.push_back(std::move(result));
+        }
+    }
+    close(fd);
+
+    // Queued in reverse order, so the first subdirectory is read first (it is needed first by the tree)
+    for (auto item = dir.entries.rbegin(); item != dir.entries.rend(); ++item)
+        if (item->subdir != nullptr) Push(index, item->subdir.get());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+DirectoryScanner::DirectoryScanner(unsigned int threads, const std::function<bool(const std::string&, const file_params&)>& filter):
+    data{new DirectoryScannerData()} {
+    data->filter = filter;
+    data->thread_count = (threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads);
+}
+
+DirectoryScanner::~DirectoryScanner() {
+    {
+        std::lock_guard<std::mutex> guard(data->lock);
+        data->stop = true;
+    }
+    data->changed.notify_all();
+    for (auto& thread: data->threads) thread.join();
+}
+
+DirectoryScanner::directory& DirectoryScanner::Scan(const std::string& path, const std::string& tree_path) {
+    data->roots.emplace_back(new directory());
+    auto& root = *data->roots.back();
+    root.path = path;
+    root.tree_path = tree_path;
+
+    // Threads are started by the first scan
+    if (data->threads.empty()) {
+        for (unsigned int i = 0; i < data->thread_count; i++) data->queues.emplace_back(new DirectoryScannerData::work_queue());
+        for (unsigned int i = 0; i < data->thread_count; i++) data->threads.emplace_back(&DirectoryScannerData::Work, data.get(), i);
+    }
+    data->Push(0, &root);
+    return root;
+}
+
+void DirectoryScanner::Wait(directory& dir) {
+    std::unique_lock<std::mutex> guard(data->lock);
+    data->changed.wait(guard, [this, &dir]() { return dir.complete || data->error; });
+    if (data->error) std::rethrow_exception(data->error);
+}
+
+file_params DirectoryScanner::GetParams(const struct stat& info) {
+    file_params params;
+    params.device = info.st_dev;
+    params.inode = info.st_ino;
+    params.permissions = info.st_mode;
+    params.uid = info.st_uid;
+    params.gid = info.st_gid;
+    params.modification_time = info.st_mtim;
+    params.file_size = info.st_size;
+    params.link_count = info.st_nlink;
+    return params;
+}
+
+}
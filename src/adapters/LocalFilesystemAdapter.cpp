@@ -1,4 +1,5 @@
 #include <fstream>
+#include <cstring>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
@@ -6,24 +7,51 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <mutex>
 #include <boost/filesystem.hpp>
 
 #include "FenixExceptions.hpp"
 #include "adapters/LocalFilesystemAdapter.hpp"
+#include "adapters/SourceReader.hpp"
+#include "adapters/BatchReader.hpp"
+#include "adapters/DirectoryScanner.hpp"
+#include "adapters/ChangeJournal.hpp"
+#include "FileChunk.hpp"
 
 namespace FenixBackup {
 
 class LocalFilesystemAdapter::LocalFilesystemAdapterData {
 public:
-    void ScanFile(std::shared_ptr<FileInfo> parent, boost::filesystem::path& path);
     file_params GetParams(boost::filesystem::path& path);
-    void ScanFilesInDirectory(std::shared_ptr<FileInfo> directory, boost::filesystem::path& directory_path);
+    /// Add scanned entries into the directory (nullptr = only wait for the scanned subtree), in the order of the scan,
+    /// prev is the same directory in the previous tree (its unchanged subdirectories are not read)
+    void AddScanned(std::shared_ptr<FileInfo> directory, DirectoryScanner::directory& scanned, DirectoryScanner& scanner,
+        std::shared_ptr<FileInfo> prev);
+    /// Copy entries of the unchanged directory from the previous tree, only changed subdirectories are read
+    void AddPrevious(std::shared_ptr<FileInfo> directory, std::shared_ptr<FileInfo> prev, const std::string& directory_path,
+        DirectoryScanner& scanner);
+    /// Decide if the scanner reads the directory (called by more threads)
+    bool IsRead(const std::string& tree_path, const file_params& params);
+    std::string GetFilename(std::shared_ptr<FileInfo> file);
+    /// Batch reader for one thread, return it by ReleaseBatchReader
+    std::unique_ptr<BatchReader> AcquireBatchReader();
+    void ReleaseBatchReader(std::unique_ptr<BatchReader> reader);
 
     std::string path;
     std::shared_ptr<FileTree> tree;
+    std::vector<std::unique_ptr<BatchReader>> batch_readers; // Unused readers (each one has its own ring)
+    std::mutex batch_readers_lock;
 
-    std::unordered_map<std::shared_ptr<FileInfo>, boost::filesystem::path> path_cache;
+    std::unordered_map<unsigned int, boost::filesystem::path> path_cache; // By ids of files of the tree
+    std::map<std::pair<FileTree*, unsigned int>, boost::filesystem::path> restored_links; // Restored hard linked inodes (first link id)
+
+    const std::unordered_set<std::string>* dirty = nullptr; // Directories changed since the previous tree, nullptr = read all
+    std::unordered_set<std::string> followed; // Directories behind symlinks, they are not watched and always read
+    std::mutex followed_lock;
 };
 
 file_params LocalFilesystemAdapter::LocalFilesystemAdapterData
@@ -32,50 +60,101 @@ file_params LocalFilesystemAdapter::LocalFilesystemAdapterData
 
     struct stat info;
     lstat(path.c_str(), &info);
-
-    params.device = info.st_dev;
-    params.inode = info.st_ino;
-    params.permissions = info.st_mode;
-    params.uid = info.st_uid;
-    params.gid = info.st_gid;
-    params.modification_time = info.st_mtim;
-    params.file_size = info.st_size;
+    params = DirectoryScanner::GetParams(info);
 
     return params;
 }
 
 void LocalFilesystemAdapter::LocalFilesystemAdapterData
-::ScanFile(std::shared_ptr<FileInfo> parent, boost::filesystem::path& path) {
-    auto params = GetParams(path);
-
-    if (boost::filesystem::is_directory(path)) {
-        auto dir = tree->AddDirectory(parent, path.filename().string(), params);
-        if (dir != nullptr) ScanFilesInDirectory(dir, path);
-    } else if (boost::filesystem::is_regular_file(path)) {
-        auto file = tree->AddFile(parent, path.filename().string(), params);
-        if (file != nullptr) path_cache.insert(std::make_pair(file, path));
-    } else if (boost::filesystem::is_symlink(path)) {
-        auto file = tree->AddSymlink(parent, path.filename().string(), params);
-        if (file != nullptr) path_cache.insert(std::make_pair(file, path));
-    } else {
-        throw AdapterException("Unknown type of the file '"+path.string()+"'\n");
+::AddScanned(std::shared_ptr<FileInfo> directory, DirectoryScanner::directory& scanned, DirectoryScanner& scanner,
+    std::shared_ptr<FileInfo> prev) {
+    scanner.Wait(scanned);
+    for (auto& item: scanned.entries) {
+        if (item.type == DIR) {
+            auto dir = (directory != nullptr ? tree->AddDirectory(directory, item.name, item.params) : nullptr);
+            auto prev_dir = (prev != nullptr ? prev->GetChild(item.name) : nullptr);
+            if (prev_dir != nullptr && prev_dir->GetType() != DIR) prev_dir = nullptr;
+            // Subtree is freed below, so it must be read completely even when it is not added
+            if (item.subdir != nullptr) AddScanned(dir, *item.subdir, scanner, prev_dir);
+            else if (dir != nullptr && dirty != nullptr) {
+                // Unchanged directory, or one created after the journal was read (it is read now)
+                auto dir_path = (boost::filesystem::path(scanned.path) / item.name).string();
+                if (prev_dir != nullptr) AddPrevious(dir, prev_dir, dir_path, scanner);
+                else AddScanned(dir, scanner.Scan(dir_path, dir->GetPath()), scanner, nullptr);
+            }
+        } else if (directory != nullptr) {
+            auto file = (item.type == FILE ? tree->AddFile(directory, item.name, item.params) : tree->AddSymlink(directory, item.name, item.params));
+            if (file != nullptr) path_cache.insert(std::make_pair(file->GetId(), boost::filesystem::path(scanned.path) / item.name));
+        }
     }
+    // Added entries are not needed anymore
+    std::vector<DirectoryScanner::entry>().swap(scanned.entries);
 }
 
 void LocalFilesystemAdapter::LocalFilesystemAdapterData
-::ScanFilesInDirectory(std::shared_ptr<FileInfo> directory, boost::filesystem::path& directory_path) {
-    try {
-        if (boost::filesystem::exists(directory_path) && boost::filesystem::is_directory(directory_path)) {
-            for (boost::filesystem::directory_iterator file(directory_path); file != boost::filesystem::directory_iterator(); ++file) {
-                auto path = file->path();
-                ScanFile(directory, path);
-            }
+::AddPrevious(std::shared_ptr<FileInfo> directory, std::shared_ptr<FileInfo> prev, const std::string& directory_path,
+    DirectoryScanner& scanner) {
+    // Same order as in the previous tree
+    auto entries = prev->GetChilds();
+    std::sort(entries.begin(), entries.end(), [](const std::shared_ptr<FileInfo>& a, const std::shared_ptr<FileInfo>& b) {
+        return a->GetId() < b->GetId();
+    });
+
+    for (auto& entry: entries) {
+        auto entry_path = boost::filesystem::path(directory_path) / entry->GetName();
+        if (entry->GetType() == DIR) {
+            // Changed directory has new params too (at least mtime), its parent is not read
+            auto params = entry->GetParams();
+            bool read = IsRead(directory->GetPath() + "/" + entry->GetName(), params);
+            struct stat info;
+            if (read && lstat(entry_path.c_str(), &info) != 0) continue;
+            if (read) params = DirectoryScanner::GetParams(info);
+
+            auto dir = tree->AddDirectory(directory, entry->GetName(), params);
+            if (dir == nullptr) continue;
+            if (read) AddScanned(dir, scanner.Scan(entry_path.string(), dir->GetPath()), scanner, entry);
+            else AddPrevious(dir, entry, entry_path.string(), scanner);
+        } else {
+            auto file = (entry->GetType() == FILE ? tree->AddFile(directory, entry->GetName(), entry->GetParams())
+                : tree->AddSymlink(directory, entry->GetName(), entry->GetParams()));
+            if (file != nullptr) path_cache.insert(std::make_pair(file->GetId(), entry_path));
         }
-    } catch (const boost::filesystem::filesystem_error& ex) {
-        // TODO: What to do when reading from filesystem failed? Exit or log to logfile and continue?
     }
 }
 
+bool LocalFilesystemAdapter::LocalFilesystemAdapterData::IsRead(const std::string& tree_path, const file_params& params) {
+    if (!Config::GetRules(tree_path, params).scan) return false;
+    if (dirty == nullptr || dirty->count(tree_path)) return true;
+    std::lock_guard<std::mutex> guard(followed_lock);
+    if (!S_ISLNK(params.permissions) && !followed.count(tree_path.substr(0, tree_path.rfind('/')))) return false;
+    followed.insert(tree_path);
+    return true;
+}
+
+std::string LocalFilesystemAdapter::LocalFilesystemAdapterData::GetFilename(std::shared_ptr<FileInfo> file) {
+    auto i = (file->GetTree() == tree ? path_cache.find(file->GetId()) : path_cache.end());
+    if (i == path_cache.end()) return path + file->GetPath();
+    return (i->second).string();
+}
+
+std::unique_ptr<BatchReader> LocalFilesystemAdapter::LocalFilesystemAdapterData::AcquireBatchReader() {
+    {
+        std::lock_guard<std::mutex> guard(batch_readers_lock);
+        if (!batch_readers.empty()) {
+            auto reader = std::move(batch_readers.back());
+            batch_readers.pop_back();
+            return reader;
+        }
+    }
+    auto& config = Config::GetConfig();
+    return std::unique_ptr<BatchReader>(new BatchReader(config.adapterBatchSize, config.adapterIoUring));
+}
+
+void LocalFilesystemAdapter::LocalFilesystemAdapterData::ReleaseBatchReader(std::unique_ptr<BatchReader> reader) {
+    std::lock_guard<std::mutex> guard(batch_readers_lock);
+    batch_readers.push_back(std::move(reader));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 
@@ -91,28 +170,46 @@ void LocalFilesystemAdapter::SetTree(std::shared_ptr<FileTree> tree) { data->tre
 
 std::shared_ptr<FileTree> LocalFilesystemAdapter::Scan() {
     data->tree = FileTree::CreateNewTree();
+    auto& config = Config::GetConfig();
+
+    // When the journal has all changes since the previous tree, only changed directories are read
+    // and the others are copied from the previous tree
+    ChangeJournal journal;
+    auto prev_tree = data->tree->GetPrevTree();
+    data->dirty = (config.adapterJournal && journal.Begin(prev_tree) ? &journal.GetDirty() : nullptr);
+    data->followed.clear();
 
-    // Scan all files in given path in filesystem and save them into tree
+    // Scan all files in given path in filesystem and save them into tree, directories are read
+    // by more threads, but entries are added by this one in the same order as by a serial scan
     auto path = boost::filesystem::path(data->path);
     data->tree->GetRoot()->SetParams(data->GetParams(path));
-    data->ScanFilesInDirectory(data->tree->GetRoot(), path);
+    DirectoryScanner scanner(config.adapterScanThreads, [this](const std::string& tree_path, const file_params& params) {
+        return data->IsRead(tree_path, params);
+    });
+    auto prev_root = (prev_tree != nullptr ? prev_tree->GetRoot() : nullptr);
+    if (data->dirty == nullptr || data->dirty->count(".")) data->AddScanned(data->tree->GetRoot(), scanner.Scan(data->path), scanner, prev_root);
+    else data->AddPrevious(data->tree->GetRoot(), prev_root, data->path, scanner);
+    data->dirty = nullptr;
 
     data->tree->SaveTree();
+    journal.End(data->tree);
     return data->tree;
 }
 
 void LocalFilesystemAdapter::GetAndProcess(std::shared_ptr<FileInfo> file) {
     // 1. Get filename
-	std::string filename;
-	auto i = data->path_cache.find(file);
-	if (i == data->path_cache.end()) filename = data->path + file->GetPath();
-	else filename = (i->second).string();
+	std::string filename = data->GetFilename(file);
 
     // 2. Get content
-    if (file->GetType() == FILE) {
+    if (file->GetType() == FILE && Config::GetConfig().adapterReadMode == READ_STREAM) {
         std::ifstream is(filename, std::ifstream::binary);
         if (!is.good()) throw AdapterException("Cannot read from file '"+filename+"'");
         file->ProcessFileContent(is, data->tree);
+    } else if (file->GetType() == FILE) {
+        auto& config = Config::GetConfig();
+        SourceReader reader(filename, config.adapterReadMode, config.adapterReadBuffer, config.adapterDropCache);
+        std::istream is(&reader);
+        file->ProcessFileContent(is, data->tree);
     } else if (file->GetType() == SYMLINK) {
         char buf[1024];
         int count = readlink(filename.c_str(), buf, sizeof(buf));
@@ -124,6 +221,41 @@ void LocalFilesystemAdapter::GetAndProcess(std::shared_ptr<FileInfo> file) {
     }
 }
 
+void LocalFilesystemAdapter::GetAndProcessBatch(const std::vector<std::shared_ptr<FileInfo>>& files) {
+    auto& config = Config::GetConfig();
+
+    // 1. Read small files together, others are processed as usual
+    std::vector<std::shared_ptr<FileInfo>> small_files;
+    std::vector<BatchReader::item> items;
+    for (auto& file: files) {
+        if (file->GetType() == FILE && file->GetParams().file_size <= config.adapterBatchFileSize) {
+            small_files.push_back(file);
+            items.push_back(BatchReader::item());
+            items.back().filename = data->GetFilename(file);
+            items.back().size = file->GetParams().file_size;
+        } else GetAndProcess(file);
+    }
+    if (!items.empty()) {
+        auto reader = data->AcquireBatchReader();
+        reader->Read(items);
+        data->ReleaseBatchReader(std::move(reader));
+    }
+
+    // 2. Process their content, new small content is saved together in containers
+    FileChunk::Container container;
+    for (size_t i = 0; i < small_files.size(); i++) {
+        if (items[i].error != 0) throw AdapterException("Cannot read from file '"+items[i].filename+"': "+strerror(items[i].error)+"\n");
+        // File grew after the scan, it is read again whole
+        if (!items[i].complete) GetAndProcess(small_files[i]);
+        else {
+            std::istringstream is(items[i].content);
+            small_files[i]->ProcessFileContent(is, data->tree, &container);
+        }
+        std::string().swap(items[i].content);
+    }
+    container.Save();
+}
+
 // In this case remote is equal to local
 void LocalFilesystemAdapter::RestoreFile(std::shared_ptr<FileInfo> file, restore_mode mode, restore_tactic tactic) {
     RestoreFileToLocalPath(file, data->path, mode, tactic);
@@ -173,9 +305,22 @@ void LocalFilesystemAdapter::RestoreFileToLocalPath(std::shared_ptr<FileInfo> fi
         } else {
             // First remove, beware of outer hardlinks
             boost::filesystem::remove(final_path);
-            std::ofstream os(final_path.string());
-            file->GetFileContent(os);
-            os.close();
+            // Hard links of an already restored inode are linked to it, the content is written once
+            auto inode = std::make_pair(file->GetTree().get(), file->GetHardLinkId() != 0 ? file->GetHardLinkId() : file->GetId());
+            bool hard_link = (file->GetHardLinkId() != 0 || file->GetParams().link_count > 1);
+            auto restored = (hard_link ? data->restored_links.find(inode) : data->restored_links.end());
+            if (restored == data->restored_links.end() || link(restored->second.c_str(), final_path.c_str()) != 0) {
+                int fd = open(final_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (fd < 0) throw AdapterException("Cannot create file '"+final_path.string()+"'");
+                try {
+                    file->GetFileContent(fd);
+                } catch (...) {
+                    close(fd);
+                    throw;
+                }
+                if (close(fd) != 0) throw AdapterException("Cannot write file '"+final_path.string()+"'");
+                if (hard_link) data->restored_links[inode] = final_path;
+            }
         }
     }
 
@@ -0,0 +1,282 @@
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FenixExceptions.hpp"
+#include "adapters/SourceReader.hpp"
+
+namespace FenixBackup {
+
+/// Alignment of O_DIRECT reads (offset, length and memory)
+static const size_t DIRECT_ALIGNMENT = 4096;
+/// Page cache residency is checked by pieces of this size (mincore needs one byte per page)
+static const size_t RESIDENCY_PIECE = 64*1024*1024;
+
+static size_t GetPageSize() {
+    static size_t page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+/// Find pages of the file which are in the page cache, return false when it cannot be found out
+static bool GetResidency(int fd, size_t file_size, const char* map, std::vector<bool>& resident) {
+    size_t page_size = GetPageSize();
+    resident.assign((file_size + page_size - 1) / page_size, false);
+    if (file_size == 0) return true;
+
+    bool own_map = (map == nullptr);
+    if (own_map) {
+        void* address = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) return false;
+        map = (const char*)address;
+    }
+    bool ok = true;
+    std::vector<unsigned char> pages(RESIDENCY_PIECE / page_size);
+    for (size_t offset = 0; ok && offset < file_size; offset += RESIDENCY_PIECE) {
+        size_t length = std::min(RESIDENCY_PIECE, file_size - offset);
+        if (mincore((void*)(map + offset), length, pages.data()) != 0) ok = false;
+        for (size_t i = 0; ok && i < (length + page_size - 1) / page_size; i++) resident[offset / page_size + i] = pages[i] & 1;
+    }
+    if (own_map) munmap((void*)map, file_size);
+    return ok;
+}
+
+// Hide data from .hpp file using PIMP idiom
+class SourceReader::SourceReaderData {
+  public:
+    std::string filename;
+    source_read_mode mode;
+    size_t buffer_size;
+    bool drop_cache;
+
+    int fd = -1;
+    size_t file_size = 0;
+    char* buffer = nullptr; // READ_PREAD and READ_DIRECT (aligned)
+    char* map = nullptr; // READ_MMAP
+    std::vector<bool> resident; // Pages cached before the file was opened (empty = not known, nothing is dropped)
+
+    // Window of the file in the get area
+    size_t window_offset = 0;
+    size_t window_end = 0;
+
+    /// Read from the offset until length bytes or the end of the file, return number of read bytes
+    size_t Read(char* target, size_t length, size_t offset);
+    /// Drop pages of the file which were not cached before it was opened from the page cache
+    void Release();
+};
+
+size_t SourceReader::SourceReaderData::Read(char* target, size_t length, size_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t count = pread(fd, target + done, length - done, offset + done);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            throw AdapterException("Cannot read from file '"+filename+"': "+strerror(errno)+"\n");
+        }
+        if (count == 0) break;
+        done += count;
+        // Short O_DIRECT read is the end of the file (next offset would not be aligned)
+        if (mode == READ_DIRECT && done % DIRECT_ALIGNMENT != 0) break;
+    }
+    return done;
+}
+
+void SourceReader::SourceReaderData::Release() {
+    if (!drop_cache || resident.empty()) return;
+    size_t page_size = GetPageSize();
+
+    // Our own mapping would keep the pages in the memory
+    if (mode == READ_MMAP && map != nullptr) madvise(map, file_size, MADV_DONTNEED);
+    for (size_t i = 0; i < resident.size(); ) {
+        if (resident[i]) {
+            i++;
+            continue;
+        }
+        size_t run = i;
+        while (run < resident.size() && !resident[run]) run++;
+        posix_fadvise(fd, i * page_size, (run - i) * page_size, POSIX_FADV_DONTNEED);
+        i = run;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+SourceReader::SourceReader(const std::string& filename, source_read_mode mode, size_t buffer_size, bool drop_cache): data{new SourceReaderData()} {
+    if (mode == READ_STREAM) throw AdapterException("SourceReader cannot read in the stream mode\n");
+    size_t page_size = GetPageSize();
+    data->filename = filename;
+    data->mode = mode;
+    data->buffer_size = std::max(page_size, (buffer_size + page_size - 1) / page_size * page_size);
+    data->drop_cache = (drop_cache && mode != READ_DIRECT);
+
+    if (mode == READ_DIRECT) {
+        data->fd = open(filename.c_str(), O_RDONLY | O_DIRECT);
+        // Filesystem without O_DIRECT (e.g. tmpfs)
+        if (data->fd < 0 && errno == EINVAL) data->mode = READ_PREAD;
+    }
+    if (data->fd < 0) data->fd = open(filename.c_str(), O_RDONLY);
+    if (data->fd < 0) throw AdapterException("Cannot read from file '"+filename+"': "+strerror(errno)+"\n");
+
+    struct stat info;
+    if (fstat(data->fd, &info) != 0) {
+        close(data->fd);
+        throw AdapterException("Cannot read from file '"+filename+"': "+strerror(errno)+"\n");
+    }
+    data->file_size = info.st_size;
+
+    if (data->mode == READ_MMAP && data->file_size > 0) {
+        void* address = mmap(nullptr, data->file_size, PROT_READ, MAP_SHARED, data->fd, 0);
+        if (address == MAP_FAILED) data->mode = READ_PREAD;
+        else {
+            data->map = (char*)address;
+            madvise(data->map, data->file_size, MADV_SEQUENTIAL);
+        }
+    }
+    if (data->mode == READ_DIRECT) {
+        void* address;
+        if (posix_memalign(&address, DIRECT_ALIGNMENT, data->buffer_size) != 0) {
+            close(data->fd);
+            throw AdapterException("Cannot allocate buffer for file '"+filename+"'\n");
+        }
+        data->buffer = (char*)address;
+    } else if (data->mode == READ_PREAD) {
+        data->buffer = (char*)malloc(data->buffer_size);
+        if (data->buffer == nullptr) {
+            if (data->map != nullptr) munmap(data->map, data->file_size);
+            close(data->fd);
+            throw AdapterException("Cannot allocate buffer for file '"+filename+"'\n");
+        }
+        posix_fadvise(data->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (data->drop_cache && !GetResidency(data->fd, data->file_size, data->map, data->resident)) data->resident.clear();
+}
+
+SourceReader::~SourceReader() {
+    // Pages are dropped only now, the file may be read several times (hashed and encoded)
+    data->Release();
+    if (data->map != nullptr) munmap(data->map, data->file_size);
+    free(data->buffer);
+    close(data->fd);
+}
+
+size_t SourceReader::GetPosition() {
+    if (eback() == nullptr) return data->window_end;
+    return data->window_offset + (gptr() - eback());
+}
+
+void SourceReader::Reset(size_t offset) {
+    setg(nullptr, nullptr, nullptr);
+    data->window_offset = data->window_end = offset;
+}
+
+bool SourceReader::Fill(size_t offset) {
+    Reset(offset);
+    char* begin;
+    size_t skip = 0, length;
+    if (data->mode == READ_MMAP) {
+        if (offset >= data->file_size) return false;
+        begin = data->map + offset;
+        length = std::min(data->buffer_size, data->file_size - offset);
+    } else {
+        // O_DIRECT reads start at an aligned offset, the part before the requested offset is skipped
+        if (data->mode == READ_DIRECT) skip = offset % DIRECT_ALIGNMENT;
+        length = data->Read(data->buffer, data->buffer_size, offset - skip);
+        if (length <= skip) return false;
+        begin = data->buffer;
+        data->window_offset = offset - skip;
+    }
+    setg(begin, begin + skip, begin + length);
+    data->window_end = data->window_offset + length;
+    return true;
+}
+
+SourceReader::int_type SourceReader::underflow() {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    if (!Fill(GetPosition())) return traits_type::eof();
+    return traits_type::to_int_type(*gptr());
+}
+
+std::streamsize SourceReader::xsgetn(char* buffer, std::streamsize count) {
+    std::streamsize done = 0;
+    while (done < count) {
+        std::streamsize available = egptr() - gptr();
+        if (available > 0) {
+            std::streamsize length = std::min(available, count - done);
+            memcpy(buffer + done, gptr(), length);
+            gbump((int)length);
+            done += length;
+        } else if (data->mode == READ_PREAD && (size_t)(count - done) >= data->buffer_size) {
+            // Big reads go directly into the caller's memory
+            size_t offset = GetPosition();
+            Reset(offset);
+            size_t length = data->Read(buffer + done, count - done, offset);
+            data->window_offset = data->window_end = offset + length;
+            if (length == 0) break;
+            done += length;
+        } else if (traits_type::eq_int_type(underflow(), traits_type::eof())) break;
+    }
+    return done;
+}
+
+SourceReader::pos_type SourceReader::seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+    off_type base = 0;
+    if (direction == std::ios_base::cur) base = GetPosition();
+    else if (direction == std::ios_base::end) base = data->file_size;
+    off_type target = base + offset;
+    if (target < 0) return pos_type(off_type(-1));
+
+    // Inside of the window only the pointer moves
+    if (eback() != nullptr && (size_t)target >= data->window_offset && (size_t)target <= data->window_end)
+        setg(eback(), eback() + (target - data->window_offset), egptr());
+    else if ((size_t)target != GetPosition()) Reset(target);
+    return pos_type(target);
+}
+
+SourceReader::pos_type SourceReader::seekpos(pos_type position, std::ios_base::openmode which) {
+    return seekoff(off_type(position), std::ios_base::beg, which);
+}
+
+source_read_mode SourceReader::GetMode(const std::string& name) {
+    if (name == "stream") return READ_STREAM;
+    if (name == "mmap") return READ_MMAP;
+    if (name == "pread") return READ_PREAD;
+    if (name == "direct") return READ_DIRECT;
+    throw ConfigException("Unknown read mode '"+name+"'\n");
+}
+
+std::string SourceReader::GetModeName(source_read_mode mode) {
+    switch (mode) {
+        case READ_STREAM: return "stream";
+        case READ_MMAP: return "mmap";
+        case READ_PREAD: return "pread";
+        case READ_DIRECT: return "direct";
+    }
+    return "";
+}
+
+size_t SourceReader::GetCachedBytes(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw AdapterException("Cannot read from file '"+filename+"': "+strerror(errno)+"\n");
+    struct stat info;
+    std::vector<bool> resident;
+    bool ok = (fstat(fd, &info) == 0 && GetResidency(fd, info.st_size, nullptr, resident));
+    close(fd);
+    if (!ok) throw AdapterException("Cannot get page cache residency of file '"+filename+"'\n");
+    return std::count(resident.begin(), resident.end(), true) * GetPageSize();
+}
+
+void SourceReader::DropCache(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw AdapterException("Cannot read from file '"+filename+"': "+strerror(errno)+"\n");
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+}
@@ -0,0 +1,407 @@
+// //////////////////////////////////////////////////////////
+// blake3.cpp
+// Portable BLAKE3 (hash mode) following the reference implementation,
+// big inputs are split into subtrees hashed by several threads
+//
+
+#include "blake3.h"
+
+#include <cstring>
+#include <thread>
+
+
+namespace
+{
+  // chunk and parent node flags
+  enum
+  {
+    ChunkStart = 1 << 0,
+    ChunkEnd   = 1 << 1,
+    Parent     = 1 << 2,
+    Root       = 1 << 3
+  };
+
+  /// subtrees smaller than this are not split between threads
+  const size_t ParallelMinSize = 64 * 1024;
+
+  const uint32_t IV[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  const uint8_t MessagePermutation[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+
+  inline uint32_t rotate(uint32_t a, uint32_t c)
+  {
+    return (a >> c) | (a << (32 - c));
+  }
+
+  inline uint32_t load32(const uint8_t* data)
+  {
+    return  (uint32_t) data[0]        | ((uint32_t) data[1] <<  8) |
+           ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+  }
+
+  inline void mix(uint32_t state[16], int a, int b, int c, int d, uint32_t x, uint32_t y)
+  {
+    state[a] = state[a] + state[b] + x; state[d] = rotate(state[d] ^ state[a], 16);
+    state[c] = state[c] + state[d];     state[b] = rotate(state[b] ^ state[c], 12);
+    state[a] = state[a] + state[b] + y; state[d] = rotate(state[d] ^ state[a],  8);
+    state[c] = state[c] + state[d];     state[b] = rotate(state[b] ^ state[c],  7);
+  }
+
+  /// compression function, result has 16 words (the first 8 are the new chaining value)
+  void compress(const uint32_t cv[8], const uint8_t block[64], uint64_t counter, uint32_t blockLen, uint32_t flags, uint32_t result[16])
+  {
+    uint32_t m[16], permuted[16];
+    for (int i = 0; i < 16; i++)
+      m[i] = load32(block + 4 * i);
+
+    uint32_t state[16] =
+    {
+      cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+      IV[0], IV[1], IV[2], IV[3],
+      (uint32_t) counter, (uint32_t) (counter >> 32), blockLen, flags
+    };
+
+    for (int round = 0; round < 7; round++)
+    {
+      // columns
+      mix(state, 0, 4,  8, 12, m[ 0], m[ 1]);
+      mix(state, 1, 5,  9, 13, m[ 2], m[ 3]);
+      mix(state, 2, 6, 10, 14, m[ 4], m[ 5]);
+      mix(state, 3, 7, 11, 15, m[ 6], m[ 7]);
+      // diagonals
+      mix(state, 0, 5, 10, 15, m[ 8], m[ 9]);
+      mix(state, 1, 6, 11, 12, m[10], m[11]);
+      mix(state, 2, 7,  8, 13, m[12], m[13]);
+      mix(state, 3, 4,  9, 14, m[14], m[15]);
+
+      for (int i = 0; i < 16; i++)
+        permuted[i] = m[MessagePermutation[i]];
+      memcpy(m, permuted, sizeof(m));
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+      result[i]     = state[i] ^ state[i + 8];
+      result[i + 8] = state[i + 8] ^ cv[i];
+    }
+  }
+
+  inline int popcount(uint64_t x)
+  {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    int count = 0;
+    for (; x != 0; x &= x - 1)
+      count++;
+    return count;
+#endif
+  }
+
+  inline size_t roundDownToPowerOf2(size_t x)
+  {
+    size_t result = 1;
+    while (result <= x / 2)
+      result *= 2;
+    return result;
+  }
+}
+
+
+/// chaining value of the node
+void BLAKE3::Output::chainingValue(uint32_t result[8]) const
+{
+  uint32_t words[16];
+  compress(cv, block, counter, blockLen, flags, words);
+  memcpy(result, words, 8 * sizeof(uint32_t));
+}
+
+
+/// hash of the root node (the first 32 bytes of the output)
+void BLAKE3::Output::rootBytes(unsigned char result[HashBytes]) const
+{
+  uint32_t words[16];
+  compress(cv, block, 0, blockLen, flags | Root, words);
+  for (int i = 0; i < 8; i++)
+    for (int j = 0; j < 4; j++)
+      result[4 * i + j] = (unsigned char) (words[i] >> (8 * j));
+}
+
+
+void BLAKE3::ChunkState::init(uint64_t chunkCounter)
+{
+  memcpy(cv, IV, sizeof(cv));
+  counter          = chunkCounter;
+  memset(block, 0, sizeof(block));
+  blockLen         = 0;
+  blocksCompressed = 0;
+}
+
+
+size_t BLAKE3::ChunkState::length() const
+{
+  return BlockSize * blocksCompressed + blockLen;
+}
+
+
+void BLAKE3::ChunkState::update(const uint8_t* data, size_t numBytes)
+{
+  while (numBytes > 0)
+  {
+    // full block is compressed only when more input comes (the last one is compressed by output())
+    if (blockLen == BlockSize)
+    {
+      uint32_t words[16];
+      compress(cv, block, counter, BlockSize, blocksCompressed == 0 ? ChunkStart : 0, words);
+      memcpy(cv, words, sizeof(cv));
+      blocksCompressed++;
+      memset(block, 0, sizeof(block));
+      blockLen = 0;
+    }
+
+    size_t take = BlockSize - blockLen;
+    if (take > numBytes)
+      take = numBytes;
+    memcpy(block + blockLen, data, take);
+    blockLen += take;
+    data     += take;
+    numBytes -= take;
+  }
+}
+
+
+BLAKE3::Output BLAKE3::ChunkState::output() const
+{
+  Output result;
+  memcpy(result.cv, cv, sizeof(cv));
+  memcpy(result.block, block, sizeof(block));
+  result.counter  = counter;
+  result.blockLen = (uint32_t) blockLen;
+  result.flags    = (blocksCompressed == 0 ? ChunkStart : 0) | ChunkEnd;
+  return result;
+}
+
+
+BLAKE3::Output BLAKE3::parentOutput(const uint32_t left[8], const uint32_t right[8])
+{
+  Output result;
+  memcpy(result.cv, IV, sizeof(IV));
+  for (int i = 0; i < 8; i++)
+    for (int j = 0; j < 4; j++)
+    {
+      result.block[     4 * i + j] = (uint8_t) (left[i]  >> (8 * j));
+      result.block[32 + 4 * i + j] = (uint8_t) (right[i] >> (8 * j));
+    }
+  result.counter  = 0;
+  result.blockLen = BlockSize;
+  result.flags    = Parent;
+  return result;
+}
+
+
+/// chaining values of both halves of a power-of-2 subtree of whole chunks
+void BLAKE3::subtreeChildren(const uint8_t* data, size_t numBytes, uint64_t chunkCounter, uint32_t left[8], uint32_t right[8], unsigned int threads)
+{
+  size_t half = numBytes / 2;
+  uint64_t rightCounter = chunkCounter + half / ChunkSize;
+  if (threads > 1 && half >= ParallelMinSize)
+  {
+    unsigned int leftThreads = threads / 2;
+    std::thread worker([=]() { subtreeChainingValue(data, half, chunkCounter, left, leftThreads); });
+    subtreeChainingValue(data + half, half, rightCounter, right, threads - leftThreads);
+    worker.join();
+  }
+  else
+  {
+    subtreeChainingValue(data,        half, chunkCounter, left,  1);
+    subtreeChainingValue(data + half, half, rightCounter, right, 1);
+  }
+}
+
+
+/// chaining value of a power-of-2 subtree of whole chunks (not the root)
+void BLAKE3::subtreeChainingValue(const uint8_t* data, size_t numBytes, uint64_t chunkCounter, uint32_t cv[8], unsigned int threads)
+{
+  if (numBytes <= ChunkSize)
+  {
+    ChunkState chunk;
+    chunk.init(chunkCounter);
+    chunk.update(data, numBytes);
+    chunk.output().chainingValue(cv);
+    return;
+  }
+
+  uint32_t left[8], right[8];
+  subtreeChildren(data, numBytes, chunkCounter, left, right, threads);
+  parentOutput(left, right).chainingValue(cv);
+}
+
+
+/// same as reset()
+BLAKE3::BLAKE3(unsigned int threads)
+: m_threads(threads > 0 ? threads : 1)
+{
+  reset();
+}
+
+
+/// restart
+void BLAKE3::reset()
+{
+  m_chunk.init(0);
+  m_stackLen = 0;
+}
+
+
+/// merge completed subtrees, so the stack has one entry per set bit of totalChunks
+void BLAKE3::mergeStack(uint64_t totalChunks)
+{
+  size_t postMergeLen = popcount(totalChunks);
+  while (m_stackLen > postMergeLen)
+  {
+    parentOutput(m_stack[m_stackLen - 2], m_stack[m_stackLen - 1]).chainingValue(m_stack[m_stackLen - 2]);
+    m_stackLen--;
+  }
+}
+
+
+void BLAKE3::pushChainingValue(const uint32_t cv[8], uint64_t chunkCounter)
+{
+  mergeStack(chunkCounter);
+  memcpy(m_stack[m_stackLen++], cv, 8 * sizeof(uint32_t));
+}
+
+
+/// add arbitrary number of bytes
+void BLAKE3::add(const void* data, size_t numBytes)
+{
+  const uint8_t* current = (const uint8_t*) data;
+  if (numBytes == 0)
+    return;
+
+  // finish partial chunk first
+  if (m_chunk.length() > 0)
+  {
+    size_t take = ChunkSize - m_chunk.length();
+    if (take > numBytes)
+      take = numBytes;
+    m_chunk.update(current, take);
+    current  += take;
+    numBytes -= take;
+    // full chunk with more input coming is not the root
+    if (numBytes == 0)
+      return;
+    uint32_t cv[8];
+    m_chunk.output().chainingValue(cv);
+    pushChainingValue(cv, m_chunk.counter);
+    m_chunk.init(m_chunk.counter + 1);
+  }
+
+  // hash the biggest power-of-2 subtrees which fit into the input and evenly divide the chunks so far,
+  // at least one byte is kept in the chunk state (the last chunk may be the root)
+  while (numBytes > ChunkSize)
+  {
+    size_t subtreeLen = roundDownToPowerOf2(numBytes);
+    uint64_t countSoFar = m_chunk.counter * ChunkSize;
+    while (((uint64_t) (subtreeLen - 1) & countSoFar) != 0)
+      subtreeLen /= 2;
+    uint64_t subtreeChunks = subtreeLen / ChunkSize;
+
+    if (subtreeLen <= ChunkSize)
+    {
+      uint32_t cv[8];
+      subtreeChainingValue(current, subtreeLen, m_chunk.counter, cv, 1);
+      pushChainingValue(cv, m_chunk.counter);
+    }
+    else
+    {
+      // both children are pushed, the parent may be the root
+      uint32_t left[8], right[8];
+      subtreeChildren(current, subtreeLen, m_chunk.counter, left, right, m_threads);
+      pushChainingValue(left,  m_chunk.counter);
+      pushChainingValue(right, m_chunk.counter + subtreeChunks / 2);
+    }
+    m_chunk.counter += subtreeChunks;
+    current  += subtreeLen;
+    numBytes -= subtreeLen;
+  }
+
+  if (numBytes > 0)
+  {
+    m_chunk.update(current, numBytes);
+    mergeStack(m_chunk.counter);
+  }
+}
+
+
+/// return latest hash as bytes
+void BLAKE3::getHash(unsigned char buffer[BLAKE3::HashBytes])
+{
+  if (m_stackLen == 0)
+  {
+    m_chunk.output().rootBytes(buffer);
+    return;
+  }
+
+  // merge everything from the right edge, the last merge is the root
+  Output output;
+  size_t remaining;
+  if (m_chunk.length() > 0)
+  {
+    remaining = m_stackLen;
+    output    = m_chunk.output();
+  }
+  else
+  {
+    // the top of the stack is a pair of subtrees
+    remaining = m_stackLen - 2;
+    output    = parentOutput(m_stack[remaining], m_stack[remaining + 1]);
+  }
+  while (remaining > 0)
+  {
+    remaining--;
+    uint32_t cv[8];
+    output.chainingValue(cv);
+    output = parentOutput(m_stack[remaining], cv);
+  }
+  output.rootBytes(buffer);
+}
+
+
+/// return latest hash as 64 hex characters
+std::string BLAKE3::getHash()
+{
+  unsigned char rawHash[HashBytes];
+  getHash(rawHash);
+
+  std::string result;
+  result.reserve(2 * HashBytes);
+  for (int i = 0; i < HashBytes; i++)
+  {
+    static const char dec2hex[16+1] = "0123456789abcdef";
+    result += dec2hex[(rawHash[i] >> 4) & 15];
+    result += dec2hex[ rawHash[i]       & 15];
+  }
+  return result;
+}
+
+
+/// compute BLAKE3 of a memory block
+std::string BLAKE3::operator()(const void* data, size_t numBytes)
+{
+  reset();
+  add(data, numBytes);
+  return getHash();
+}
+
+
+/// compute BLAKE3 of a string, excluding final zero
+std::string BLAKE3::operator()(const std::string& text)
+{
+  reset();
+  add(text.c_str(), text.size());
+  return getHash();
+}
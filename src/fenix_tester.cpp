@@ -1,10 +1,18 @@
 #include <iostream>
 #include <fstream>
+#include <random>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
 #include "adapters/LocalFilesystemAdapter.hpp"
 #include "FileTree.hpp"
 #include "FileChunk.hpp"
 #include "FenixExceptions.hpp"
 #include "BackupCleaner.hpp"
+#include "VCDiffMerger.hpp"
+
+#include <google/vcdecoder.h>
+#include <google/vcencoder.h>
 
 #include <cereal/types/memory.hpp>
 #include <cereal/types/polymorphic.hpp>
@@ -63,3 +71,241 @@ int tester() {
 
 	return(EXIT_SUCCESS);
 }
+
+/// VCDIFF delta (RFC 3284) written instruction by instruction, target is the expected decoded file
+class DeltaWriter {
+  public:
+    std::string delta;
+    std::string target;
+
+    DeltaWriter(const std::string& source): source(source) { delta.assign("\xD6\xC3\xC4\x00\x00", 5); }
+
+    /// Window copying from source[source_pos, source_pos + source_len)
+    void StartWindow(uint64_t source_pos, uint64_t source_len) {
+        segment_pos = source_pos;
+        segment_len = source_len;
+        window.clear();
+        data.clear();
+        inst.clear();
+        addr.clear();
+    }
+    void Add(const std::string& bytes) {
+        inst.push_back(1);
+        WriteVarint(inst, bytes.size());
+        data += bytes;
+        window += bytes;
+    }
+    void Run(char byte, uint64_t size) {
+        inst.push_back(0);
+        WriteVarint(inst, size);
+        data.push_back(byte);
+        window.append(size, byte);
+    }
+    /// Address in the source segment followed by the window, VCD_HERE mode encodes it relative to the current position
+    void Copy(uint64_t address, uint64_t size, bool here_mode = false) {
+        uint64_t here = segment_len + window.size();
+        inst.push_back(here_mode ? 35 : 19);
+        WriteVarint(inst, size);
+        WriteVarint(addr, here_mode ? here - address : address);
+        // Byte by byte, the copy may overlap with its own output
+        for (uint64_t i = address; i < address + size; i++)
+            window.push_back(i < segment_len ? source[segment_pos + i] : window[i - segment_len]);
+    }
+    void EndWindow() {
+        std::string encoding;
+        WriteVarint(encoding, window.size());
+        encoding.push_back(0);
+        WriteVarint(encoding, data.size());
+        WriteVarint(encoding, inst.size());
+        WriteVarint(encoding, addr.size());
+        encoding += data + inst + addr;
+        delta.push_back(segment_len > 0 ? 1 : 0);
+        if (segment_len > 0) {
+            WriteVarint(delta, segment_len);
+            WriteVarint(delta, segment_pos);
+        }
+        WriteVarint(delta, encoding.size());
+        delta += encoding;
+        target += window;
+    }
+    uint64_t GetSegmentLength() { return segment_len; }
+    uint64_t GetWindowSize() { return window.size(); }
+
+  private:
+    const std::string& source;
+    uint64_t segment_pos = 0, segment_len = 0;
+    std::string window, data, inst, addr;
+
+    static void WriteVarint(std::string& out, uint64_t value) {
+        std::string bytes(1, value & 0x7F);
+        while (value >>= 7) bytes.insert(bytes.begin(), (char)((value & 0x7F) | 0x80));
+        out += bytes;
+    }
+};
+
+/// Random delta of the source with several windows and all kinds of instructions
+static DeltaWriter random_delta(const std::string& source, std::minstd_rand& random) {
+    DeltaWriter writer(source);
+    int windows = 1 + random() % 3;
+    for (int w = 0; w < windows; w++) {
+        uint64_t position = source.empty() ? 0 : random() % source.size();
+        writer.StartWindow(position, source.empty() ? 0 : 1 + random() % (source.size() - position));
+        int instructions = 1 + random() % 20;
+        for (int i = 0; i < instructions; i++) {
+            uint64_t here = writer.GetSegmentLength() + writer.GetWindowSize();
+            uint64_t size = 1 + random() % 100;
+            switch (random() % 4) {
+              case 0: {
+                std::string bytes(size, 0);
+                for (auto& c: bytes) c = 'a' + random() % 26;
+                writer.Add(bytes);
+                break;
+              }
+              case 1:
+                writer.Run('A' + random() % 26, size);
+                break;
+              default:
+                // Copy from the segment or from the target window, it may overlap with itself
+                if (here > 0) writer.Copy(random() % here, size, random() % 2);
+            }
+        }
+        writer.EndWindow();
+    }
+    return writer;
+}
+
+/// Check decode(merge(A->B, B->C)) == C, return false when it differs
+static bool check_merge(const std::string& a, const std::string& first, const std::string& first_target,
+    const std::string& second, const std::string& second_target, const std::string& name) {
+    std::string b, c, merged;
+    open_vcdiff::VCDiffDecoder decoder;
+    if (!decoder.Decode(a.data(), a.size(), first, &b) || b != first_target
+    || !decoder.Decode(b.data(), b.size(), second, &c) || c != second_target) {
+        std::cout << name << ": test delta is wrong" << std::endl;
+        return false;
+    }
+    c.clear();
+    if (!FenixBackup::VCDiffMerger::Merge(first, second, merged)) {
+        std::cout << name << ": merge failed" << std::endl;
+        return false;
+    }
+    if (!decoder.Decode(a.data(), a.size(), merged, &c) || c != second_target) {
+        std::cout << name << ": merged delta does not decode to C" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool check_merge(const std::string& a, const DeltaWriter& first, const DeltaWriter& second, const std::string& name) {
+    return check_merge(a, first.delta, first.target, second.delta, second.target, name);
+}
+
+/// Text-like content (words of a small vocabulary, repeated lines), so deltas copy from the target too
+static std::string random_text(size_t size, std::minstd_rand& random) {
+    std::string text;
+    std::vector<std::string> lines;
+    while (text.size() < size) {
+        if (!lines.empty() && random() % 4 == 0) text += lines[random() % lines.size()];
+        else {
+            std::string line;
+            for (int words = 1 + random() % 12; words > 0; words--) line += "word" + std::to_string(random() % 50) + " ";
+            line.back() = '\n';
+            lines.push_back(line);
+            text += line;
+        }
+    }
+    text.resize(size);
+    return text;
+}
+
+/// Next version of the content, a few parts are rewritten, inserted, deleted or copied elsewhere
+static std::string random_edit(const std::string& content, std::minstd_rand& random) {
+    std::string edited = content;
+    for (int edits = 1 + random() % 8; edits > 0 && !edited.empty(); edits--) {
+        size_t position = random() % edited.size(), length = std::min<size_t>(1 + random() % 200, edited.size() - position);
+        switch (random() % 4) {
+          case 0: edited.replace(position, length, random_text(length, random)); break;
+          case 1: edited.insert(position, random_text(1 + random() % 300, random)); break;
+          case 2: edited.erase(position, length); break;
+          default: edited.insert(random() % edited.size(), edited.substr(position, length));
+        }
+    }
+    return edited;
+}
+
+/// Delta of open-vcdiff as FileChunk saves it, at once (one window) or by the streaming encoder (window per chunk)
+static std::string encode_delta(const std::string& source, const std::string& target, size_t window) {
+    std::string delta;
+    if (window == 0) {
+        open_vcdiff::VCDiffEncoder encoder(source.data(), source.size());
+        encoder.Encode(target.data(), target.size(), &delta);
+        return delta;
+    }
+    open_vcdiff::HashedDictionary dictionary(source.data(), source.size());
+    dictionary.Init();
+    open_vcdiff::VCDiffStreamingEncoder encoder(&dictionary, open_vcdiff::VCD_STANDARD_FORMAT, true);
+    encoder.StartEncoding(&delta);
+    for (size_t position = 0; position < target.size(); position += window)
+        encoder.EncodeChunk(target.data() + position, std::min(window, target.size() - position), &delta);
+    encoder.FinishEncoding(&delta);
+    return delta;
+}
+
+/// Round trip of VCDiffMerger, return number of failed checks
+int merger_tester(int runs) {
+    int failed = 0;
+    std::string a;
+    for (int i = 0; i < 1000; i++) a += (char)('0' + i % 75);
+
+    // 1. B from pieces of A, the window of the second delta starts inside B
+    DeltaWriter first(a);
+    first.StartWindow(100, 500);
+    first.Copy(0, 50);                      // A[100, 150)
+    first.Add("literal bytes");
+    first.Run('r', 7);
+    first.Copy(200, 30, true);              // A[300, 330)
+    first.Copy(500 + 10, 25);               // from B itself, overlapping
+    first.EndWindow();
+    first.StartWindow(0, 1000);
+    first.Copy(900, 100);
+    first.Copy(1000 + 95, 12);              // overlapping copy of the target window
+    first.EndWindow();
+
+    // 2. C copies ranges spanning several instructions of B and from its own window
+    DeltaWriter second(first.target);
+    second.StartWindow(20, first.target.size() - 20);
+    second.Copy(10, 120);                   // copy, add, run, copy and self copy of B
+    second.Add("new");
+    second.Copy(second.GetSegmentLength() + 5, 40);  // from C itself
+    second.Copy(second.GetSegmentLength() + second.GetWindowSize() - 3, 20, true); // overlapping
+    second.Copy(0, second.GetSegmentLength());
+    second.EndWindow();
+    second.StartWindow(0, 0);
+    second.Add("no source");
+    second.Copy(2, 30);
+    second.EndWindow();
+    if (!check_merge(a, first, second, "spanning copies")) failed++;
+
+    // 3. Random deltas
+    for (int run = 0; run < runs; run++) {
+        std::minstd_rand random(run + 1);
+        std::string source(random() % 2000, 0);
+        for (auto& c: source) c = 'a' + random() % 4;
+        DeltaWriter first = random_delta(source, random);
+        DeltaWriter second = random_delta(first.target, random);
+        if (!check_merge(source, first, second, "random " + std::to_string(run))) failed++;
+    }
+
+    // 4. Deltas of open-vcdiff (standard format, target matches, windows of the streaming encoder)
+    int encoded_runs = std::min(runs, 100);
+    for (int run = 0; run < encoded_runs; run++) {
+        std::minstd_rand random(run + 1);
+        std::string a = random_text(random() % 200000, random);
+        std::string b = random_edit(a, random), c = random_edit(b, random);
+        // Windows of 16 kB or whole files, in both deltas or only in one of them
+        size_t first_window = (run % 3 == 0 ? 0 : 16*1024), second_window = (run % 3 == 1 ? 0 : 16*1024);
+        if (!check_merge(a, encode_delta(a, b, first_window), b, encode_delta(b, c, second_window), c, "encoded " + std::to_string(run))) failed++;
+    }
+    std::cout << "Merger: " << runs + 1 + encoded_runs - failed << " of " << runs + 1 + encoded_runs << " merges ok" << std::endl;
+    return failed;
+}
@@ -11,6 +11,15 @@
 #include <endian.h>
 #endif
 
+#include <cstring>
+
+// SHA-NI and AVX2 kernels, chosen at runtime by CPUID
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_X86
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
 
 /// same as reset()
 SHA256::SHA256()
@@ -73,6 +82,227 @@ namespace
     uint32_t term2 = ((a | b) & c) | (a & b); //(a & (b ^ c)) ^ (b & c);
     return term1 + term2;
   }
+
+  // round constants (same as in processBlock), used by the SIMD kernels
+  const uint32_t K[64] =
+  {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+
+  const uint32_t InitialHash[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  enum Kernel { KernelScalar, KernelAvx2, KernelShaNi };
+
+  bool forceScalarKernel = false;
+
+  Kernel detectKernel()
+  {
+#ifdef SHA256_X86
+    unsigned int eax, ebx, ecx, edx;
+    // leaf 7: EBX bit 29 = SHA extensions, bit 5 = AVX2
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+      if ((ebx & (1u << 29)) && __builtin_cpu_supports("sse4.1"))
+        return KernelShaNi;
+      if (__builtin_cpu_supports("avx2"))
+        return KernelAvx2;
+    }
+#endif
+    return KernelScalar;
+  }
+
+  Kernel kernel()
+  {
+    static const Kernel detected = detectKernel();
+    return forceScalarKernel ? KernelScalar : detected;
+  }
+
+#ifdef SHA256_X86
+  /// process blocks with Intel SHA extensions (one message)
+  __attribute__((target("sha,sse4.1")))
+  void processBlocksShaNi(uint32_t hash[8], const uint8_t* data, size_t numBlocks)
+  {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // state is kept as ABEF and CDGH
+    __m128i tmp    = _mm_loadu_si128((const __m128i*) &hash[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i*) &hash[4]);
+    tmp    = _mm_shuffle_epi32(tmp,    0xB1);   // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);   // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);    // ABEF
+    state1         = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+    for (; numBlocks > 0; numBlocks--, data += SHA256::BlockSize)
+    {
+      __m128i saveAbef = state0;
+      __m128i saveCdgh = state1;
+
+      // 16 words of the message schedule in 4 registers, extended in place
+      __m128i words[4];
+      for (int i = 0; i < 4; i++)
+        words[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16 * i)), byteSwap);
+
+      // 4 rounds per step
+#pragma GCC unroll 16
+      for (int step = 0; step < 16; step++)
+      {
+        __m128i& current = words[ step      & 3];
+        __m128i& next    = words[(step + 1) & 3];
+        __m128i& prev    = words[(step + 3) & 3];
+
+        __m128i msg = _mm_add_epi32(current, _mm_loadu_si128((const __m128i*) &K[4 * step]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        if (step >= 3 && step <= 14)
+        {
+          next = _mm_add_epi32(next, _mm_alignr_epi8(current, prev, 4));
+          next = _mm_sha256msg2_epu32(next, current);
+        }
+        msg    = _mm_shuffle_epi32(msg, 0x0E);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        if (step >= 1 && step <= 12)
+          prev = _mm_sha256msg1_epu32(prev, current);
+      }
+
+      state0 = _mm_add_epi32(state0, saveAbef);
+      state1 = _mm_add_epi32(state1, saveCdgh);
+    }
+
+    tmp    = _mm_shuffle_epi32(state0, 0x1B);   // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);   // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);    // HGFE
+    _mm_storeu_si128((__m128i*) &hash[0], state0);
+    _mm_storeu_si128((__m128i*) &hash[4], state1);
+  }
+
+#define SHA256_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+  /// process one block of 8 messages at once, lanes with zero mask keep their hash
+  __attribute__((target("avx2")))
+  void processLanesAvx2(__m256i hash[8], const uint32_t words[16][SHA256::Lanes], __m256i mask)
+  {
+    __m256i w[16];
+    for (int i = 0; i < 16; i++)
+      w[i] = _mm256_loadu_si256((const __m256i*) words[i]);
+
+    __m256i a = hash[0], b = hash[1], c = hash[2], d = hash[3];
+    __m256i e = hash[4], f = hash[5], g = hash[6], h = hash[7];
+
+    for (int i = 0; i < 64; i++)
+    {
+      if (i >= 16)
+      {
+        __m256i w15 = w[(i + 1) & 15], w2 = w[(i + 14) & 15];
+        __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(SHA256_ROTR(w15,  7), SHA256_ROTR(w15, 18)), _mm256_srli_epi32(w15,  3));
+        __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_ROTR(w2,  17), SHA256_ROTR(w2,  19)), _mm256_srli_epi32(w2,  10));
+        w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i + 9) & 15], s1));
+      }
+
+      __m256i sum1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_ROTR(e, 6), SHA256_ROTR(e, 11)), SHA256_ROTR(e, 25));
+      __m256i ch   = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+      __m256i x    = _mm256_add_epi32(_mm256_add_epi32(h, sum1), _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32(K[i]), w[i & 15])));
+      __m256i sum0 = _mm256_xor_si256(_mm256_xor_si256(SHA256_ROTR(a, 2), SHA256_ROTR(a, 13)), SHA256_ROTR(a, 22));
+      __m256i maj  = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+      __m256i y    = _mm256_add_epi32(sum0, maj);
+
+      h = g; g = f; f = e;
+      e = _mm256_add_epi32(d, x);
+      d = c; c = b; b = a;
+      a = _mm256_add_epi32(x, y);
+    }
+
+    __m256i result[8] = { a, b, c, d, e, f, g, h };
+    for (int i = 0; i < 8; i++)
+      hash[i] = _mm256_blendv_epi8(hash[i], _mm256_add_epi32(hash[i], result[i]), mask);
+  }
+
+#undef SHA256_ROTR
+
+  /// hash up to 8 messages in parallel, write hex digests
+  __attribute__((target("avx2")))
+  void hashLanesAvx2(const std::string* const* texts, size_t count, std::string* results)
+  {
+    // the last one or two blocks of each message (rest of data + padding + length)
+    uint8_t tails[SHA256::Lanes][2 * SHA256::BlockSize];
+    size_t fullBlocks[SHA256::Lanes], totalBlocks[SHA256::Lanes];
+    size_t maxBlocks = 0;
+    for (size_t lane = 0; lane < SHA256::Lanes; lane++)
+    {
+      fullBlocks[lane] = totalBlocks[lane] = 0;
+      if (lane >= count)
+        continue;
+      size_t numBytes = texts[lane]->size();
+      size_t rest     = numBytes % SHA256::BlockSize;
+      size_t tailSize = (rest + 9 <= SHA256::BlockSize ? 1 : 2) * SHA256::BlockSize;
+      memset(tails[lane], 0, sizeof(tails[lane]));
+      memcpy(tails[lane], texts[lane]->data() + numBytes - rest, rest);
+      tails[lane][rest] = 128;
+      uint64_t msgBits = 8 * (uint64_t) numBytes;
+      for (int i = 0; i < 8; i++)
+        tails[lane][tailSize - 1 - i] = (uint8_t) (msgBits >> (8 * i));
+
+      fullBlocks[lane]  = numBytes / SHA256::BlockSize;
+      totalBlocks[lane] = fullBlocks[lane] + tailSize / SHA256::BlockSize;
+      if (totalBlocks[lane] > maxBlocks)
+        maxBlocks = totalBlocks[lane];
+    }
+
+    __m256i hash[8];
+    for (int i = 0; i < 8; i++)
+      hash[i] = _mm256_set1_epi32(InitialHash[i]);
+
+    // transposed message words: words[i][lane]
+    alignas(32) uint32_t words[16][SHA256::Lanes];
+    alignas(32) uint32_t active[SHA256::Lanes];
+    for (size_t block = 0; block < maxBlocks; block++)
+    {
+      for (size_t lane = 0; lane < SHA256::Lanes; lane++)
+      {
+        active[lane] = (block < totalBlocks[lane] ? 0xFFFFFFFF : 0);
+        if (!active[lane])
+        {
+          for (int i = 0; i < 16; i++)
+            words[i][lane] = 0;
+          continue;
+        }
+        const uint8_t* current = (block < fullBlocks[lane])
+          ? (const uint8_t*) texts[lane]->data() + block * SHA256::BlockSize
+          : tails[lane] + (block - fullBlocks[lane]) * SHA256::BlockSize;
+        for (int i = 0; i < 16; i++)
+        {
+          uint32_t word;
+          memcpy(&word, current + 4 * i, sizeof(word));
+          words[i][lane] = swap(word);
+        }
+      }
+      processLanesAvx2(hash, words, _mm256_load_si256((const __m256i*) active));
+    }
+
+    alignas(32) uint32_t values[8][SHA256::Lanes];
+    for (int i = 0; i < 8; i++)
+      _mm256_store_si256((__m256i*) values[i], hash[i]);
+    for (size_t lane = 0; lane < count; lane++)
+    {
+      static const char dec2hex[16+1] = "0123456789abcdef";
+      std::string& result = results[lane];
+      result.clear();
+      result.reserve(2 * SHA256::HashBytes);
+      for (int i = 0; i < 8; i++)
+        for (int shift = 28; shift >= 0; shift -= 4)
+          result += dec2hex[(values[i][lane] >> shift) & 15];
+    }
+  }
+#endif
 }
 
 
@@ -237,6 +467,22 @@ void SHA256::processBlock(const void* data)
 }
 
 
+/// process numBlocks * 64 bytes with the fastest available function
+void SHA256::processBlocks(const void* data, size_t numBlocks)
+{
+#ifdef SHA256_X86
+  if (kernel() == KernelShaNi)
+  {
+    processBlocksShaNi(m_hash, (const uint8_t*) data, numBlocks);
+    return;
+  }
+#endif
+  const uint8_t* current = (const uint8_t*) data;
+  for (; numBlocks > 0; numBlocks--, current += BlockSize)
+    processBlock(current);
+}
+
+
 /// add arbitrary number of bytes
 void SHA256::add(const void* data, size_t numBytes)
 {
@@ -254,7 +500,7 @@ void SHA256::add(const void* data, size_t numBytes)
   // full buffer
   if (m_bufferSize == BlockSize)
   {
-    processBlock(m_buffer);
+    processBlocks(m_buffer, 1);
     m_numBytes  += BlockSize;
     m_bufferSize = 0;
   }
@@ -264,12 +510,13 @@ void SHA256::add(const void* data, size_t numBytes)
     return;
 
   // process full blocks
-  while (numBytes >= BlockSize)
+  if (numBytes >= BlockSize)
   {
-    processBlock(current);
-    current    += BlockSize;
-    m_numBytes += BlockSize;
-    numBytes   -= BlockSize;
+    size_t numBlocks = numBytes / BlockSize;
+    processBlocks(current, numBlocks);
+    current    += numBlocks * BlockSize;
+    m_numBytes += numBlocks * BlockSize;
+    numBytes   -= numBlocks * BlockSize;
   }
 
   // keep remaining bytes in buffer
@@ -340,10 +587,10 @@ void SHA256::processBuffer()
   *addLength   = (unsigned char)( msgBits        & 0xFF);
 
   // process blocks
-  processBlock(m_buffer);
+  processBlocks(m_buffer, 1);
   // flowed over into a second block ?
   if (paddedLength > BlockSize)
-    processBlock(extra);
+    processBlocks(extra, 1);
 }
 
 
@@ -409,3 +656,48 @@ std::string SHA256::operator()(const std::string& text)
   add(text.c_str(), text.size());
   return getHash();
 }
+
+
+/// compute SHA256 of several independent messages, short messages are hashed in parallel SIMD lanes
+std::vector<std::string> SHA256::hashMany(const std::vector<std::string>& texts)
+{
+  std::vector<std::string> results(texts.size());
+  size_t next = 0;
+#ifdef SHA256_X86
+  // SHA-NI is faster for a single message than 8 AVX2 lanes, so multi-buffer is used only without it
+  if (kernel() == KernelAvx2)
+  {
+    const std::string* group[Lanes];
+    for (; next + 1 < texts.size(); next += Lanes)
+    {
+      size_t count = (texts.size() - next < Lanes) ? texts.size() - next : Lanes;
+      for (size_t lane = 0; lane < count; lane++)
+        group[lane] = &texts[next + lane];
+      hashLanesAvx2(group, count, &results[next]);
+    }
+  }
+#endif
+  SHA256 sha256;
+  for (; next < texts.size(); next++)
+    results[next] = sha256(texts[next]);
+  return results;
+}
+
+
+/// name of the block function chosen for this CPU
+const char* SHA256::implementation()
+{
+  switch (kernel())
+  {
+    case KernelShaNi: return "sha-ni";
+    case KernelAvx2:  return "avx2";
+    default:          return "scalar";
+  }
+}
+
+
+/// use only the portable code (for benchmarks)
+void SHA256::forceScalar(bool scalar)
+{
+  forceScalarKernel = scalar;
+}
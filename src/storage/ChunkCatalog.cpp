@@ -0,0 +1,436 @@
+#include <fstream>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FenixExceptions.hpp"
+#include "Config.hpp"
+#include "storage/ChunkCatalog.hpp"
+
+namespace FenixBackup {
+
+static const char CATALOG_MAGIC[8] = {'F', 'X', 'C', 'A', 'T', 'L', 'O', 'G'};
+static const char JOURNAL_MAGIC[8] = {'F', 'X', 'C', 'A', 'T', 'J', 'R', 'N'};
+static const uint32_t CATALOG_VERSION = 3; // Version 1 records have no hash algorithm (SHA256_HASH), version 2 no container
+/// Journal records are written when the buffer reaches this size (or on Flush)
+static const size_t JOURNAL_BUFFER_SIZE = 1024*1024;
+/// Journal is compacted into a new snapshot when it has more records than this and than half of the snapshot
+static const size_t COMPACT_MIN_RECORDS = 64*1024;
+
+/// Snapshot file: header, hash index (slots) and records
+struct catalog_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t slot_count; // Power of two
+    uint64_t record_count;
+    uint64_t records_offset;
+};
+
+struct catalog_slot {
+    uint64_t hash;   // 0 = empty slot
+    uint64_t offset; // Offset of the record in the file
+};
+
+static uint64_t HashName(const std::string& name) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c: name) hash = (hash ^ c) * 0x100000001b3ULL;
+    return hash == 0 ? 1 : hash;
+}
+
+template <typename T>
+static void AppendValue(std::string& output, const T& value) { output.append((const char*)&value, sizeof(value)); }
+static void AppendString(std::string& output, const std::string& value) {
+    AppendValue(output, (uint32_t)value.size());
+    output.append(value);
+}
+
+/// Reading of records from the memory with bounds checking
+class RecordReader {
+  public:
+    RecordReader(const char* position, const char* end): position{position}, end{end} {}
+
+    template <typename T>
+    bool Read(T& value) {
+        if ((size_t)(end - position) < sizeof(value)) return false;
+        memcpy(&value, position, sizeof(value));
+        position += sizeof(value);
+        return true;
+    }
+    bool ReadString(std::string& value) {
+        uint32_t size;
+        if (!Read(size) || (size_t)(end - position) < size) return false;
+        value.assign(position, size);
+        position += size;
+        return true;
+    }
+    const char* GetPosition() { return position; }
+
+  private:
+    const char* position;
+    const char* end;
+};
+
+static void EncodeInfo(std::string& output, const chunk_info& info) {
+    AppendString(output, info.chunk_name);
+    AppendString(output, info.ancestor_chunk_name);
+    AppendValue(output, (int32_t)info.depth);
+    AppendValue(output, (uint64_t)info.chunk_size);
+    AppendValue(output, (uint8_t)info.type);
+    AppendValue(output, (uint32_t)info.references);
+    AppendValue(output, (uint8_t)info.codec);
+    AppendValue(output, (uint8_t)info.hash);
+    AppendString(output, info.container_name);
+    AppendValue(output, info.offset);
+    AppendValue(output, info.length);
+    AppendValue(output, (uint32_t)info.derived_chunks.size());
+    for (auto& name: info.derived_chunks) AppendString(output, name);
+}
+
+static bool DecodeInfo(RecordReader& reader, chunk_info& info, uint32_t version) {
+    int32_t depth;
+    uint64_t size;
+    uint8_t type, codec, hash = SHA256_HASH;
+    uint32_t references, derived_count;
+    if (!reader.ReadString(info.chunk_name) || !reader.ReadString(info.ancestor_chunk_name) || !reader.Read(depth) || !reader.Read(size)
+        || !reader.Read(type) || !reader.Read(references) || !reader.Read(codec)) return false;
+    if (version >= 2 && !reader.Read(hash)) return false;
+    if (version >= 3 && (!reader.ReadString(info.container_name) || !reader.Read(info.offset) || !reader.Read(info.length))) return false;
+    if (!reader.Read(derived_count)) return false;
+    info.depth = depth;
+    info.chunk_size = size;
+    info.type = (chunk_type)type;
+    info.references = references;
+    info.codec = (chunk_codec)codec;
+    info.hash = (hash_algorithm)hash;
+    info.derived_chunks.resize(derived_count);
+    for (auto& name: info.derived_chunks)
+        if (!reader.ReadString(name)) return false;
+    return true;
+}
+
+class ChunkCatalog::ChunkCatalogData {
+  public:
+    enum record_type : uint8_t { PUT = 1, REMOVE = 2 };
+
+    struct change {
+        bool removed;
+        chunk_info info;
+    };
+
+    bool opened = false;
+
+    // Snapshot (read only, mapped into the memory)
+    const char* snapshot = nullptr;
+    size_t snapshot_size = 0;
+    catalog_header header = {};
+    const catalog_slot* slots = nullptr;
+
+    // Changes made after the snapshot
+    std::unordered_map<std::string, change> changes;
+    std::string journal_buffer;
+    size_t journal_records = 0;
+    uint32_t journal_version = CATALOG_VERSION;
+    int journal_fd = -1;
+
+    void MapSnapshot();
+    void UnmapSnapshot();
+    /// Return pointer to the record of the chunk in the snapshot, nullptr if there is none
+    const char* FindInSnapshot(const std::string& name);
+    /// Call function for each record of the snapshot
+    template <typename F>
+    void ForEachInSnapshot(F function);
+
+    void ReplayJournal();
+    void OpenJournal(bool truncate);
+    void Append(record_type type, const std::string& name, const chunk_info* info);
+    void Flush();
+    void Compact();
+};
+
+void ChunkCatalog::ChunkCatalogData::MapSnapshot() {
+    std::string filename = Config::GetCatalogFilename();
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return;
+        throw ChunkStorageException("Cannot open chunk catalog '"+filename+"': "+strerror(errno)+"\n");
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(catalog_header)) {
+        close(fd);
+        throw ChunkStorageException("File '"+filename+"' is not a chunk catalog\n");
+    }
+    void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) throw ChunkStorageException("Cannot map chunk catalog '"+filename+"': "+strerror(errno)+"\n");
+
+    snapshot = (const char*)address;
+    snapshot_size = info.st_size;
+    memcpy(&header, snapshot, sizeof(header));
+    if (!std::equal(header.magic, header.magic + sizeof(header.magic), CATALOG_MAGIC)) throw ChunkStorageException("File '"+filename+"' is not a chunk catalog\n");
+    if (header.version == 0 || header.version > CATALOG_VERSION) throw ChunkStorageException("Unknown version "+std::to_string(header.version)+" of the chunk catalog\n");
+    if (header.slot_count == 0 || (header.slot_count & (header.slot_count - 1))
+        || header.records_offset != sizeof(catalog_header) + header.slot_count * sizeof(catalog_slot) || header.records_offset > snapshot_size)
+        throw ChunkStorageException("Corrupted chunk catalog '"+filename+"'\n");
+    slots = (const catalog_slot*)(snapshot + sizeof(catalog_header));
+}
+
+void ChunkCatalog::ChunkCatalogData::UnmapSnapshot() {
+    if (snapshot != nullptr) munmap((void*)snapshot, snapshot_size);
+    snapshot = nullptr;
+    snapshot_size = 0;
+    slots = nullptr;
+    header = catalog_header();
+}
+
+const char* ChunkCatalog::ChunkCatalogData::FindInSnapshot(const std::string& name) {
+    if (snapshot == nullptr) return nullptr;
+    uint64_t hash = HashName(name);
+    uint64_t mask = header.slot_count - 1;
+    for (uint64_t i = hash & mask; slots[i].hash != 0; i = (i + 1) & mask) {
+        if (slots[i].hash != hash) continue;
+        if (slots[i].offset >= snapshot_size) throw ChunkStorageException("Corrupted chunk catalog\n");
+        RecordReader reader(snapshot + slots[i].offset, snapshot + snapshot_size);
+        uint32_t size;
+        if (!reader.Read(size) || snapshot_size - slots[i].offset - sizeof(size) < size) throw ChunkStorageException("Corrupted chunk catalog\n");
+        if (size == name.size() && memcmp(reader.GetPosition(), name.data(), size) == 0) return snapshot + slots[i].offset;
+    }
+    return nullptr;
+}
+
+template <typename F>
+void ChunkCatalog::ChunkCatalogData::ForEachInSnapshot(F function) {
+    if (snapshot == nullptr) return;
+    RecordReader reader(snapshot + header.records_offset, snapshot + snapshot_size);
+    for (uint64_t i = 0; i < header.record_count; i++) {
+        chunk_info info;
+        if (!DecodeInfo(reader, info, header.version)) throw ChunkStorageException("Corrupted chunk catalog\n");
+        function(info);
+    }
+}
+
+void ChunkCatalog::ChunkCatalogData::ReplayJournal() {
+    std::string filename = Config::GetCatalogJournalFilename();
+    std::ifstream is(filename, std::ios::binary);
+    if (!is.good()) return;
+    std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    is.close();
+
+    RecordReader reader(content.data(), content.data() + content.size());
+    char magic[sizeof(JOURNAL_MAGIC)];
+    if (content.size() < sizeof(magic) || !std::equal(content.data(), content.data() + sizeof(magic), JOURNAL_MAGIC))
+        throw ChunkStorageException("File '"+filename+"' is not a chunk catalog journal\n");
+    reader.Read(magic);
+    if (!reader.Read(journal_version) || journal_version == 0 || journal_version > CATALOG_VERSION)
+        throw ChunkStorageException("Unknown version of the chunk catalog journal\n");
+
+    size_t valid_size = reader.GetPosition() - content.data();
+    while (true) {
+        uint8_t type;
+        chunk_info info;
+        if (!reader.Read(type)) break;
+        if (type == PUT) {
+            if (!DecodeInfo(reader, info, journal_version)) break;
+            changes[info.chunk_name] = change{false, info};
+        } else if (type == REMOVE) {
+            if (!reader.ReadString(info.chunk_name)) break;
+            changes[info.chunk_name] = change{true, chunk_info()};
+        } else break;
+        journal_records++;
+        valid_size = reader.GetPosition() - content.data();
+    }
+    // Drop incomplete record at the end (interrupted write)
+    if (valid_size != content.size() && truncate(filename.c_str(), valid_size) != 0)
+        throw ChunkStorageException("Cannot repair chunk catalog journal '"+filename+"'\n");
+}
+
+void ChunkCatalog::ChunkCatalogData::OpenJournal(bool truncate) {
+    if (journal_fd >= 0 && !truncate) return;
+    if (journal_fd >= 0) close(journal_fd);
+    std::string filename = Config::GetCatalogJournalFilename();
+    journal_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0666);
+    if (journal_fd < 0) throw ChunkStorageException("Cannot open chunk catalog journal '"+filename+"': "+strerror(errno)+"\n");
+
+    struct stat info;
+    if (fstat(journal_fd, &info) == 0 && info.st_size == 0) {
+        std::string journal_header(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        AppendValue(journal_header, CATALOG_VERSION);
+        // Header goes before any buffered record
+        journal_buffer.insert(0, journal_header);
+    }
+}
+
+void ChunkCatalog::ChunkCatalogData::Append(record_type type, const std::string& name, const chunk_info* info) {
+    AppendValue(journal_buffer, (uint8_t)type);
+    if (type == PUT) EncodeInfo(journal_buffer, *info);
+    else AppendString(journal_buffer, name);
+    journal_records++;
+
+    if (journal_buffer.size() >= JOURNAL_BUFFER_SIZE) Flush();
+    if (journal_records >= std::max<size_t>(COMPACT_MIN_RECORDS, header.record_count / 2)) Compact();
+}
+
+void ChunkCatalog::ChunkCatalogData::Flush() {
+    if (journal_buffer.empty()) return;
+    OpenJournal(false);
+    const char* position = journal_buffer.data();
+    size_t length = journal_buffer.size();
+    while (length > 0) {
+        ssize_t written = write(journal_fd, position, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw ChunkStorageException("Cannot write chunk catalog journal: "+std::string(strerror(errno))+"\n");
+        }
+        position += written;
+        length -= written;
+    }
+    journal_buffer.clear();
+    // Records are on the disk before data they describe are rewritten or removed
+    if (fdatasync(journal_fd) != 0) throw ChunkStorageException("Cannot sync chunk catalog journal: "+std::string(strerror(errno))+"\n");
+}
+
+void ChunkCatalog::ChunkCatalogData::Compact() {
+    // 1. Collect all live records
+    std::vector<chunk_info> chunks;
+    ForEachInSnapshot([this, &chunks](const chunk_info& info) {
+        if (changes.find(info.chunk_name) == changes.end()) chunks.push_back(info);
+    });
+    for (auto& item: changes)
+        if (!item.second.removed) chunks.push_back(item.second.info);
+
+    // 2. Build the hash index (linear probing, at most half full) and records
+    catalog_header new_header = {};
+    std::copy(CATALOG_MAGIC, CATALOG_MAGIC + sizeof(CATALOG_MAGIC), new_header.magic);
+    new_header.version = CATALOG_VERSION;
+    new_header.slot_count = 16;
+    while (new_header.slot_count < chunks.size() * 2) new_header.slot_count *= 2;
+    new_header.record_count = chunks.size();
+    new_header.records_offset = sizeof(catalog_header) + new_header.slot_count * sizeof(catalog_slot);
+
+    std::vector<catalog_slot> new_slots(new_header.slot_count, catalog_slot{0, 0});
+    std::string records;
+    uint64_t mask = new_header.slot_count - 1;
+    for (auto& info: chunks) {
+        uint64_t hash = HashName(info.chunk_name);
+        uint64_t i = hash & mask;
+        while (new_slots[i].hash != 0) i = (i + 1) & mask;
+        new_slots[i] = catalog_slot{hash, new_header.records_offset + records.size()};
+        EncodeInfo(records, info);
+    }
+
+    // 3. Replace the snapshot
+    std::string filename = Config::GetCatalogFilename();
+    std::string temp_name = filename + ".tmp";
+    {
+        std::ofstream os(temp_name, std::ios::binary);
+        os.write((const char*)&new_header, sizeof(new_header));
+        os.write((const char*)new_slots.data(), new_slots.size() * sizeof(catalog_slot));
+        os.write(records.data(), records.size());
+        os.close();
+        if (os.fail()) throw ChunkStorageException("Cannot write chunk catalog '"+temp_name+"'\n");
+    }
+    // Snapshot is complete on the disk before it replaces the journal
+    int fd = open(temp_name.c_str(), O_RDONLY);
+    bool synced = (fd >= 0 && fdatasync(fd) == 0);
+    if (fd >= 0) close(fd);
+    if (!synced) throw ChunkStorageException("Cannot sync chunk catalog '"+temp_name+"'\n");
+    UnmapSnapshot();
+    if (rename(temp_name.c_str(), filename.c_str()) != 0) throw ChunkStorageException("Cannot replace chunk catalog '"+filename+"'\n");
+    MapSnapshot();
+
+    // 4. All changes are in the snapshot now (replaying the old journal again would not change anything)
+    changes.clear();
+    journal_buffer.clear();
+    journal_records = 0;
+    journal_version = CATALOG_VERSION;
+    OpenJournal(true);
+    Flush();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ChunkCatalog::ChunkCatalog(): data{new ChunkCatalogData()} {}
+
+ChunkCatalog::~ChunkCatalog() {
+    try {
+        data->Flush();
+    } catch (const FenixException& ex) {
+        // Destructor cannot throw, the journal ends with the last complete record
+    }
+    data->UnmapSnapshot();
+    if (data->journal_fd >= 0) close(data->journal_fd);
+}
+
+void ChunkCatalog::Open(ChunkStorage& storage) {
+    if (data->opened) return;
+    data->opened = true;
+    bool exists = (access(Config::GetCatalogFilename().c_str(), F_OK) == 0 || access(Config::GetCatalogJournalFilename().c_str(), F_OK) == 0);
+    data->MapSnapshot();
+    data->ReplayJournal();
+    if (!exists) ImportLegacy(storage);
+    // Records are appended only in the current version, older files are rewritten first
+    else if ((data->snapshot != nullptr && data->header.version < CATALOG_VERSION) || data->journal_version < CATALOG_VERSION) data->Compact();
+}
+
+bool ChunkCatalog::Exists(const std::string& name) {
+    auto it = data->changes.find(name);
+    if (it != data->changes.end()) return !it->second.removed;
+    return data->FindInSnapshot(name) != nullptr;
+}
+
+bool ChunkCatalog::Load(chunk_info& info) {
+    auto it = data->changes.find(info.chunk_name);
+    if (it != data->changes.end()) {
+        if (it->second.removed) return false;
+        info = it->second.info;
+        return true;
+    }
+    const char* record = data->FindInSnapshot(info.chunk_name);
+    if (record == nullptr) return false;
+    RecordReader reader(record, data->snapshot + data->snapshot_size);
+    if (!DecodeInfo(reader, info, data->header.version)) throw ChunkStorageException("Corrupted chunk catalog\n");
+    return true;
+}
+
+void ChunkCatalog::Save(const chunk_info& info) {
+    data->changes[info.chunk_name] = ChunkCatalogData::change{false, info};
+    data->Append(ChunkCatalogData::PUT, info.chunk_name, &info);
+}
+
+void ChunkCatalog::Remove(const std::string& name) {
+    if (!Exists(name)) return;
+    data->changes[name] = ChunkCatalogData::change{true, chunk_info()};
+    data->Append(ChunkCatalogData::REMOVE, name, nullptr);
+}
+
+std::vector<std::string> ChunkCatalog::GetChunkList() {
+    std::vector<std::string> chunks;
+    data->ForEachInSnapshot([this, &chunks](const chunk_info& info) {
+        if (data->changes.find(info.chunk_name) == data->changes.end()) chunks.push_back(info.chunk_name);
+    });
+    for (auto& item: data->changes)
+        if (!item.second.removed) chunks.push_back(item.first);
+    return chunks;
+}
+
+void ChunkCatalog::Flush() { data->Flush(); }
+void ChunkCatalog::Compact() { data->Compact(); }
+
+void ChunkCatalog::ImportLegacy(ChunkStorage& storage) {
+    auto chunks = storage.LoadLegacyInfo();
+    if (chunks.empty()) return;
+    for (auto& info: chunks)
+        if (!Exists(info.chunk_name)) data->changes[info.chunk_name] = ChunkCatalogData::change{false, info};
+    // Legacy info is dropped only after the new snapshot is safely written
+    data->Compact();
+    storage.DropLegacyInfo();
+}
+
+}
@@ -0,0 +1,288 @@
+#include <vector>
+#include <algorithm>
+
+#include <zstd.h>
+#include <lz4frame.h>
+
+#include "FenixExceptions.hpp"
+#include "Config.hpp"
+#include "storage/ChunkCompression.hpp"
+
+namespace FenixBackup {
+
+/// Size of data used to decide if the chunk is compressed
+static const size_t PROBE_SIZE = 64*1024;
+/// Compression is used only if it saves at least this part of the probe (in percents)
+static const size_t MIN_SAVING_PERCENT = 5;
+/// Size of compressed data read from the source at once
+static const size_t INPUT_SIZE = 64*1024;
+
+class ChunkCompression::Encoder {
+  public:
+    virtual ~Encoder() {}
+    /// Append compressed data to output, finish the frame when finish is true
+    virtual void Encode(const char* input, size_t length, bool finish, std::string& output) = 0;
+};
+
+class ChunkCompression::Decoder {
+  public:
+    virtual ~Decoder() {}
+    /// Decode part of the input into output, return size of decoded data and set number of consumed bytes
+    virtual size_t Decode(const char* input, size_t length, char* output, size_t output_length, size_t& consumed) = 0;
+    /// True when the end of the compressed frame was reached (calls without any progress do not change it)
+    bool finished = false;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// zstd
+
+class ChunkCompression::ZstdEncoder: public ChunkCompression::Encoder {
+  public:
+    ZstdEncoder(int level): context{ZSTD_createCCtx()} {
+        if (context == nullptr) throw ChunkStorageException("Cannot create zstd context\n");
+        ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, level > 0 ? level : ZSTD_CLEVEL_DEFAULT);
+    }
+    virtual ~ZstdEncoder() { ZSTD_freeCCtx(context); }
+
+    virtual void Encode(const char* input, size_t length, bool finish, std::string& output) {
+        ZSTD_inBuffer in = { input, length, 0 };
+        std::vector<char> buffer(ZSTD_CStreamOutSize());
+        size_t remaining;
+        do {
+            ZSTD_outBuffer out = { buffer.data(), buffer.size(), 0 };
+            remaining = ZSTD_compressStream2(context, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(remaining)) throw ChunkStorageException("zstd compression failed: "+std::string(ZSTD_getErrorName(remaining))+"\n");
+            output.append(buffer.data(), out.pos);
+        } while (finish ? remaining != 0 : in.pos < in.size);
+    }
+
+  private:
+    ZSTD_CCtx* context;
+};
+
+class ChunkCompression::ZstdDecoder: public ChunkCompression::Decoder {
+  public:
+    ZstdDecoder(): context{ZSTD_createDCtx()} {
+        if (context == nullptr) throw ChunkStorageException("Cannot create zstd context\n");
+    }
+    virtual ~ZstdDecoder() { ZSTD_freeDCtx(context); }
+
+    virtual size_t Decode(const char* input, size_t length, char* output, size_t output_length, size_t& consumed) {
+        ZSTD_inBuffer in = { input, length, 0 };
+        ZSTD_outBuffer out = { output, output_length, 0 };
+        size_t result = ZSTD_decompressStream(context, &out, &in);
+        if (ZSTD_isError(result)) throw ChunkStorageException("zstd decompression failed: "+std::string(ZSTD_getErrorName(result))+"\n");
+        consumed = in.pos;
+        if (consumed > 0 || out.pos > 0) finished = (result == 0);
+        return out.pos;
+    }
+
+  private:
+    ZSTD_DCtx* context;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// LZ4 (frame format)
+
+class ChunkCompression::LZ4Encoder: public ChunkCompression::Encoder {
+  public:
+    LZ4Encoder(int level) {
+        if (LZ4F_isError(LZ4F_createCompressionContext(&context, LZ4F_VERSION))) throw ChunkStorageException("Cannot create LZ4 context\n");
+        preferences = LZ4F_preferences_t();
+        preferences.compressionLevel = level;
+    }
+    virtual ~LZ4Encoder() { LZ4F_freeCompressionContext(context); }
+
+    virtual void Encode(const char* input, size_t length, bool finish, std::string& output) {
+        std::vector<char> buffer(std::max<size_t>(LZ4F_compressBound(length, &preferences), LZ4F_HEADER_SIZE_MAX));
+        size_t result;
+        if (!started) {
+            result = LZ4F_compressBegin(context, buffer.data(), buffer.size(), &preferences);
+            Check(result);
+            output.append(buffer.data(), result);
+            started = true;
+        }
+        if (length > 0) {
+            result = LZ4F_compressUpdate(context, buffer.data(), buffer.size(), input, length, nullptr);
+            Check(result);
+            output.append(buffer.data(), result);
+        }
+        if (finish) {
+            buffer.resize(LZ4F_compressBound(0, &preferences));
+            result = LZ4F_compressEnd(context, buffer.data(), buffer.size(), nullptr);
+            Check(result);
+            output.append(buffer.data(), result);
+        }
+    }
+
+  private:
+    LZ4F_cctx* context;
+    LZ4F_preferences_t preferences;
+    bool started = false;
+
+    static void Check(size_t result) {
+        if (LZ4F_isError(result)) throw ChunkStorageException("LZ4 compression failed: "+std::string(LZ4F_getErrorName(result))+"\n");
+    }
+};
+
+class ChunkCompression::LZ4Decoder: public ChunkCompression::Decoder {
+  public:
+    LZ4Decoder() {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&context, LZ4F_VERSION))) throw ChunkStorageException("Cannot create LZ4 context\n");
+    }
+    virtual ~LZ4Decoder() { LZ4F_freeDecompressionContext(context); }
+
+    virtual size_t Decode(const char* input, size_t length, char* output, size_t output_length, size_t& consumed) {
+        size_t output_size = output_length;
+        consumed = length;
+        size_t result = LZ4F_decompress(context, output, &output_size, input, &consumed, nullptr);
+        if (LZ4F_isError(result)) throw ChunkStorageException("LZ4 decompression failed: "+std::string(LZ4F_getErrorName(result))+"\n");
+        if (consumed > 0 || output_size > 0) finished = (result == 0);
+        return output_size;
+    }
+
+  private:
+    LZ4F_dctx* context;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+class ChunkCompression::Writer::WriterData {
+  public:
+    std::unique_ptr<ChunkStorage::Writer> target;
+    chunk_codec codec;
+    std::unique_ptr<Encoder> encoder;
+    bool decided = false;
+    std::string probe;
+    std::string output;
+
+    /// Choose codec by the probe and write the probe
+    void Decide();
+    void Forward(const char* buffer, size_t length, bool finish);
+};
+
+void ChunkCompression::Writer::WriterData::Decide() {
+    decided = true;
+    if (codec != RAW && !IsCompressible(probe.data(), probe.size(), codec)) codec = RAW;
+    if (codec != RAW) encoder = CreateEncoder(codec);
+    Forward(probe.data(), probe.size(), false);
+    probe.clear();
+    probe.shrink_to_fit();
+}
+
+void ChunkCompression::Writer::WriterData::Forward(const char* buffer, size_t length, bool finish) {
+    if (encoder == nullptr) {
+        target->Write(buffer, length);
+        return;
+    }
+    encoder->Encode(buffer, length, finish, output);
+    target->Write(output.data(), output.size());
+    output.clear();
+}
+
+ChunkCompression::Writer::Writer(std::unique_ptr<ChunkStorage::Writer> target, chunk_codec codec): data{new WriterData()} {
+    data->target = std::move(target);
+    data->codec = codec;
+    // Nothing to decide without compression
+    if (codec == RAW) data->decided = true;
+}
+ChunkCompression::Writer::~Writer() {}
+
+void ChunkCompression::Writer::Write(const char* buffer, size_t length) {
+    if (data->decided) return data->Forward(buffer, length, false);
+    data->probe.append(buffer, length);
+    if (data->probe.size() >= PROBE_SIZE) data->Decide();
+}
+
+size_t ChunkCompression::Writer::Close() {
+    if (!data->decided) data->Decide();
+    if (data->encoder != nullptr) data->Forward(nullptr, 0, true);
+    return data->target->Close();
+}
+
+chunk_codec ChunkCompression::Writer::GetCodec() { return data->codec; }
+
+////////
+
+class ChunkCompression::Reader: public ChunkStorage::Reader {
+  public:
+    Reader(std::unique_ptr<ChunkStorage::Reader> source, std::unique_ptr<Decoder> decoder):
+        source{std::move(source)}, decoder{std::move(decoder)}, input(INPUT_SIZE) {}
+
+    virtual size_t Read(char* buffer, size_t length) {
+        while (true) {
+            if (position == available && !source_end) {
+                available = source->Read(input.data(), input.size());
+                position = 0;
+                source_end = (available == 0);
+            }
+            size_t consumed;
+            size_t decoded = decoder->Decode(input.data() + position, available - position, buffer, length, consumed);
+            position += consumed;
+            if (decoded > 0) return decoded;
+            // Decoder may keep data inside, so the end is when nothing is decoded from empty input
+            if (source_end && consumed == 0) {
+                if (!decoder->finished) throw ChunkStorageException("Truncated compressed chunk data\n");
+                return 0;
+            }
+        }
+    }
+
+  private:
+    std::unique_ptr<ChunkStorage::Reader> source;
+    std::unique_ptr<Decoder> decoder;
+    std::vector<char> input;
+    size_t position = 0;
+    size_t available = 0;
+    bool source_end = false;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::unique_ptr<ChunkCompression::Encoder> ChunkCompression::CreateEncoder(chunk_codec codec) {
+    int level = Config::GetConfig().compressionLevel;
+    if (codec == ZSTD) return std::unique_ptr<Encoder>(new ZstdEncoder(level));
+    if (codec == LZ4) return std::unique_ptr<Encoder>(new LZ4Encoder(level));
+    throw ChunkStorageException("Unknown codec "+std::to_string(codec)+"\n");
+}
+
+std::unique_ptr<ChunkCompression::Decoder> ChunkCompression::CreateDecoder(chunk_codec codec) {
+    if (codec == ZSTD) return std::unique_ptr<Decoder>(new ZstdDecoder());
+    if (codec == LZ4) return std::unique_ptr<Decoder>(new LZ4Decoder());
+    throw ChunkStorageException("Unknown codec "+std::to_string(codec)+"\n");
+}
+
+std::unique_ptr<ChunkCompression::Writer> ChunkCompression::CreateWriter(std::unique_ptr<ChunkStorage::Writer> target, chunk_codec codec) {
+    return std::unique_ptr<Writer>(new Writer(std::move(target), codec));
+}
+
+std::unique_ptr<ChunkStorage::Reader> ChunkCompression::CreateReader(std::unique_ptr<ChunkStorage::Reader> source, chunk_codec codec) {
+    if (codec == RAW) return source;
+    return std::unique_ptr<ChunkStorage::Reader>(new Reader(std::move(source), CreateDecoder(codec)));
+}
+
+chunk_codec ChunkCompression::GetCodec(const std::string& name) {
+    if (name == "none") return RAW;
+    if (name == "zstd") return ZSTD;
+    if (name == "lz4") return LZ4;
+    throw ConfigException("Unknown compression '"+name+"'\n");
+}
+
+bool ChunkCompression::IsCompressible(const char* sample, size_t length, chunk_codec codec) {
+    if (length == 0) return false;
+    // Probe uses the fastest settings, the real compression is usually better
+    size_t compressed;
+    std::vector<char> output;
+    if (codec == LZ4) {
+        output.resize(LZ4F_compressFrameBound(length, nullptr));
+        compressed = LZ4F_compressFrame(output.data(), output.size(), sample, length, nullptr);
+        if (LZ4F_isError(compressed)) return false;
+    } else {
+        output.resize(ZSTD_compressBound(length));
+        compressed = ZSTD_compress(output.data(), output.size(), sample, length, 1);
+        if (ZSTD_isError(compressed)) return false;
+    }
+    return compressed * 100 <= length * (100 - MIN_SAVING_PERCENT);
+}
+
+}
@@ -0,0 +1,44 @@
+#include <vector>
+
+#include "storage/ChunkStorage.hpp"
+
+namespace FenixBackup {
+
+ChunkStorage::ChunkStorage() {}
+ChunkStorage::~ChunkStorage() {}
+
+void ChunkStorage::Compact() {}
+std::vector<chunk_info> ChunkStorage::LoadLegacyInfo() { return std::vector<chunk_info>(); }
+void ChunkStorage::DropLegacyInfo() {}
+
+std::string ChunkStorage::LoadData(const std::string& name) {
+    auto reader = OpenData(name);
+    std::string content;
+    char buffer[64*1024];
+    size_t count;
+    while ((count = reader->Read(buffer, sizeof(buffer))) > 0) content.append(buffer, count);
+    return content;
+}
+
+size_t ChunkStorage::SaveData(const std::string& name, const std::string& content) {
+    auto writer = CreateData(name);
+    writer->Write(content.data(), content.size());
+    return writer->Close();
+}
+
+void ChunkStorage::Import(ChunkStorage& source, const std::vector<std::string>& chunks, bool remove_source) {
+    std::vector<char> buffer(1024*1024);
+    for (auto& name: chunks) {
+        // Copy data without loading them whole into the memory
+        auto reader = source.OpenData(name);
+        auto writer = CreateData(name);
+        size_t count;
+        while ((count = reader->Read(buffer.data(), buffer.size())) > 0) writer->Write(buffer.data(), count);
+        writer->Close();
+
+        reader.reset();
+        if (remove_source) source.Remove(name);
+    }
+}
+
+}
@@ -0,0 +1,116 @@
+#include <fstream>
+#include <cstdio>
+#include <boost/filesystem.hpp>
+
+#include <cereal/archives/binary.hpp>
+
+#include "FenixExceptions.hpp"
+#include "Config.hpp"
+#include "storage/FileChunkStorage.hpp"
+
+namespace FenixBackup {
+
+class FileChunkStorage::FileReader: public ChunkStorage::Reader {
+  public:
+    FileReader(const std::string& filename): stream(filename, std::ios::binary) {
+        if (!stream.good()) throw ChunkStorageException("Cannot read data file '"+filename+"'\n");
+    }
+    virtual size_t Read(char* buffer, size_t length) {
+        stream.read(buffer, length);
+        return stream.gcount();
+    }
+  private:
+    std::ifstream stream;
+};
+
+class FileChunkStorage::FileWriter: public ChunkStorage::Writer {
+  public:
+    FileWriter(const std::string& filename): filename{filename}, stream(filename, std::ios::binary) {
+        if (!stream.good()) throw ChunkStorageException("Cannot write data file '"+filename+"'\n");
+    }
+    virtual void Write(const char* buffer, size_t length) {
+        stream.write(buffer, length);
+        size += length;
+    }
+    virtual size_t Close() {
+        stream.close();
+        if (stream.fail()) throw ChunkStorageException("Cannot write data file '"+filename+"'\n");
+        return size;
+    }
+  private:
+    std::string filename;
+    std::ofstream stream;
+    size_t size = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+FileChunkStorage::FileChunkStorage() {}
+FileChunkStorage::~FileChunkStorage() {}
+
+std::unique_ptr<ChunkStorage::Reader> FileChunkStorage::OpenData(const std::string& name) {
+    return std::unique_ptr<Reader>(new FileReader(Config::GetChunkFilename(name, true)));
+}
+
+std::unique_ptr<ChunkStorage::Writer> FileChunkStorage::CreateData(const std::string& name) {
+    return std::unique_ptr<Writer>(new FileWriter(Config::GetChunkFilename(name, true)));
+}
+
+std::unique_ptr<ChunkStorage::Writer> FileChunkStorage::CreateTempData(const std::string& temp_name) {
+    boost::system::error_code error;
+    boost::filesystem::create_directories(Config::GetTempDir(), error);
+    return std::unique_ptr<Writer>(new FileWriter(GetTempFilename(temp_name)));
+}
+
+void FileChunkStorage::CommitData(const std::string& temp_name, const std::string& name) {
+    // Temp directory is in the same repository, so rename is atomic
+    if (rename(GetTempFilename(temp_name).c_str(), Config::GetChunkFilename(name, true).c_str()) != 0)
+        throw ChunkStorageException("Cannot move temporary data '"+GetTempFilename(temp_name)+"' into the data directory\n");
+}
+
+void FileChunkStorage::DiscardData(const std::string& temp_name) {
+    remove(GetTempFilename(temp_name).c_str());
+}
+
+std::string FileChunkStorage::GetTempFilename(const std::string& temp_name) {
+    return Config::GetTempDir() + "/" + temp_name + Config::GetConfig().chunkDataExtension;
+}
+
+void FileChunkStorage::Remove(const std::string& name) {
+    remove(Config::GetChunkFilename(name, true).c_str());
+}
+
+std::vector<std::string> FileChunkStorage::GetLegacyMetaFiles() {
+    std::vector<std::string> files;
+    boost::filesystem::path dir(Config::GetDataDir());
+    try {
+        for (boost::filesystem::directory_iterator file(dir); file != boost::filesystem::directory_iterator(); ++file) {
+            if (boost::filesystem::is_regular_file(file->path())
+            && boost::filesystem::extension(file->path()) == Config::GetConfig().chunkMetaExtension) {
+                files.push_back(file->path().string());
+            }
+        }
+    } catch (const boost::filesystem::filesystem_error& ex) {
+        throw ChunkStorageException("Problem when parsing data directory '"+Config::GetDataDir()+"'\n");
+    }
+    return files;
+}
+
+std::vector<chunk_info> FileChunkStorage::LoadLegacyInfo() {
+    std::vector<chunk_info> chunks;
+    for (auto& filename: GetLegacyMetaFiles()) {
+        std::ifstream is(filename, std::ios::binary);
+        if (!is.good()) throw ChunkStorageException("Couldn't load meta file '"+filename+"'\n");
+        cereal::BinaryInputArchive archive(is);
+        chunk_info info;
+        archive(info);
+        chunks.push_back(info);
+    }
+    return chunks;
+}
+
+void FileChunkStorage::DropLegacyInfo() {
+    for (auto& filename: GetLegacyMetaFiles()) remove(filename.c_str());
+}
+
+}
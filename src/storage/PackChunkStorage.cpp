@@ -0,0 +1,434 @@
+#include <fstream>
+#include <map>
+#include <set>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <boost/filesystem.hpp>
+
+#include "FenixExceptions.hpp"
+#include "Config.hpp"
+#include "storage/PackChunkStorage.hpp"
+
+namespace FenixBackup {
+
+static const char PACK_INDEX_MAGIC[8] = {'F', 'X', 'P', 'A', 'C', 'K', 'I', 'X'};
+static const uint32_t PACK_INDEX_VERSION = 4;
+// Versions 1-3 stored also meta info of chunks, since version 4 it is in the ChunkCatalog
+/// Temporary data are stored under names with this prefix until they are committed
+static const std::string TEMP_PREFIX = "~";
+
+class PackChunkStorage::PackChunkStorageData {
+  public:
+    enum record_type : uint8_t { PUT = 1, REMOVE = 2 };
+
+    struct pack_location {
+        uint32_t pack = 0;
+        uint64_t offset = 0;
+        uint64_t length = 0;
+    };
+
+    std::unordered_map<std::string, pack_location> entries;
+    std::unordered_map<std::string, chunk_info> legacy; // Meta info from the index of older version
+    std::map<uint32_t, uint64_t> pack_sizes;
+    std::map<uint32_t, uint64_t> pack_garbage; // Bytes of each pack not used by live chunks
+    uint32_t active_pack = 0;
+    std::set<uint32_t> writing; // Packs with an open writer, concurrent writers append into different packs
+    std::recursive_mutex lock;
+
+    bool loaded = false;
+    uint32_t index_version = PACK_INDEX_VERSION;
+    std::ofstream index;
+
+    void Load();
+    void OpenIndex();
+    /// Replace the index with a new one containing only live chunks
+    void WriteIndex();
+    uint32_t GetActivePack();
+    /// Return a pack for a new writer (the active one, unless it is being written), ReleasePack when it is closed
+    uint32_t AcquirePack();
+    void ReleasePack(uint32_t pack);
+
+    void Put(const std::string& name, const pack_location& location);
+    void Remove(const std::string& name);
+    void AppendRecord(std::ostream& os, record_type type, const std::string& name, const pack_location* location);
+    bool ReadRecord(std::istream& is, record_type& type, std::string& name, pack_location& location, chunk_info& info);
+
+    class PackReader;
+    class PackWriter;
+};
+
+template <typename T>
+static void WriteValue(std::ostream& os, const T& value) { os.write((const char*)&value, sizeof(value)); }
+static void WriteString(std::ostream& os, const std::string& value) {
+    WriteValue(os, (uint32_t)value.size());
+    os.write(value.data(), value.size());
+}
+template <typename T>
+static bool ReadValue(std::istream& is, T& value) { return (bool)is.read((char*)&value, sizeof(value)); }
+static bool ReadString(std::istream& is, std::string& value) {
+    uint32_t size;
+    if (!ReadValue(is, size)) return false;
+    value.resize(size);
+    return size == 0 || (bool)is.read(&value[0], size);
+}
+
+class PackChunkStorage::PackChunkStorageData::PackReader: public ChunkStorage::Reader {
+  public:
+    PackReader(const pack_location& location): remaining{location.length}, stream(Config::GetPackFilename(location.pack), std::ios::binary) {
+        if (!stream.good()) throw ChunkStorageException("Cannot read pack file '"+Config::GetPackFilename(location.pack)+"'\n");
+        stream.seekg(location.offset);
+    }
+    virtual size_t Read(char* buffer, size_t length) {
+        length = std::min<uint64_t>(length, remaining);
+        if (length == 0) return 0;
+        stream.read(buffer, length);
+        if ((size_t)stream.gcount() != length) throw ChunkStorageException("Truncated pack file\n");
+        remaining -= length;
+        return length;
+    }
+  private:
+    uint64_t remaining;
+    std::ifstream stream;
+};
+
+class PackChunkStorage::PackChunkStorageData::PackWriter: public ChunkStorage::Writer {
+  public:
+    PackWriter(PackChunkStorageData& storage, const std::string& name): storage(storage), name{name} {
+        std::lock_guard<std::recursive_mutex> guard(storage.lock);
+        location.pack = storage.AcquirePack();
+        stream.open(Config::GetPackFilename(location.pack), std::ios::binary | std::ios::app);
+        // Record starts at the real end of the pack (it can differ from pack_sizes after a failed write)
+        if (stream.good()) stream.seekp(0, std::ios::end);
+        std::streamoff end = (stream.good() ? (std::streamoff)stream.tellp() : -1);
+        if (end < 0) {
+            storage.ReleasePack(location.pack);
+            throw ChunkStorageException("Cannot write pack file '"+Config::GetPackFilename(location.pack)+"'\n");
+        }
+        location.offset = end;
+        storage.pack_sizes[location.pack] = end;
+    }
+    virtual ~PackWriter() {
+        if (closed) return;
+        // Data of an unfinished write are garbage, but the next writer has to append after them
+        stream.close();
+        std::lock_guard<std::recursive_mutex> guard(storage.lock);
+        storage.pack_garbage[location.pack] += Written();
+        storage.ReleasePack(location.pack);
+    }
+    virtual void Write(const char* buffer, size_t length) {
+        stream.write(buffer, length);
+        location.length += length;
+    }
+    virtual size_t Close() {
+        stream.close();
+        std::lock_guard<std::recursive_mutex> guard(storage.lock);
+        closed = true;
+        uint64_t written = Written();
+        storage.ReleasePack(location.pack);
+        if (stream.fail() || written != location.length) {
+            storage.pack_garbage[location.pack] += written;
+            throw ChunkStorageException("Cannot write pack file '"+Config::GetPackFilename(location.pack)+"'\n");
+        }
+
+        // Data are valid since the index record is written
+        storage.OpenIndex();
+        storage.AppendRecord(storage.index, PUT, name, &location);
+        storage.index.flush();
+        storage.Put(name, location);
+        return location.length;
+    }
+  private:
+    PackChunkStorageData& storage;
+    std::string name;
+    pack_location location;
+    std::ofstream stream;
+    bool closed = false;
+
+    /// Update the pack size from the pack file after the stream is closed, return bytes written by this writer
+    uint64_t Written() {
+        boost::system::error_code error;
+        uint64_t size = boost::filesystem::file_size(Config::GetPackFilename(location.pack), error);
+        if (error || size < location.offset) return 0;
+        storage.pack_sizes[location.pack] = size;
+        return size - location.offset;
+    }
+};
+
+void PackChunkStorage::PackChunkStorageData::AppendRecord(std::ostream& os, record_type type, const std::string& name, const pack_location* location) {
+    WriteValue(os, (uint8_t)type);
+    WriteString(os, name);
+    if (type == PUT) {
+        WriteValue(os, location->pack);
+        WriteValue(os, location->offset);
+        WriteValue(os, location->length);
+    }
+}
+
+bool PackChunkStorage::PackChunkStorageData::ReadRecord(std::istream& is, record_type& type, std::string& name, pack_location& location, chunk_info& info) {
+    uint8_t raw_type;
+    if (!ReadValue(is, raw_type) || !ReadString(is, name)) return false;
+    type = (record_type)raw_type;
+    if (type == PUT) {
+        if (index_version >= 4) return ReadValue(is, location.pack) && ReadValue(is, location.offset) && ReadValue(is, location.length);
+
+        // Older versions with meta info
+        info = chunk_info();
+        info.chunk_name = name;
+        int32_t depth;
+        uint8_t chunk_type_value = DELTA, codec_value = RAW;
+        uint32_t references = 0;
+        bool ok = ReadString(is, info.ancestor_chunk_name) && ReadValue(is, depth)
+            && ReadValue(is, location.pack) && ReadValue(is, location.offset) && ReadValue(is, location.length)
+            && (index_version < 2 || (ReadValue(is, chunk_type_value) && ReadValue(is, references)))
+            && (index_version < 3 || ReadValue(is, codec_value));
+        info.depth = depth;
+        info.chunk_size = location.length;
+        info.type = (chunk_type)chunk_type_value;
+        info.references = references;
+        info.codec = (chunk_codec)codec_value;
+        return ok;
+    }
+    return type == REMOVE;
+}
+
+void PackChunkStorage::PackChunkStorageData::Put(const std::string& name, const pack_location& location) {
+    auto it = entries.find(name);
+    // Old data of the chunk are garbage now
+    if (it != entries.end() && (it->second.pack != location.pack || it->second.offset != location.offset))
+        pack_garbage[it->second.pack] += it->second.length;
+    entries[name] = location;
+}
+
+void PackChunkStorage::PackChunkStorageData::Remove(const std::string& name) {
+    auto it = entries.find(name);
+    if (it == entries.end()) return;
+    pack_garbage[it->second.pack] += it->second.length;
+    entries.erase(it);
+}
+
+void PackChunkStorage::PackChunkStorageData::Load() {
+    if (loaded) return;
+    loaded = true;
+
+    // 1. Existing packs
+    boost::filesystem::path dir(Config::GetDataDir());
+    try {
+        for (boost::filesystem::directory_iterator file(dir); file != boost::filesystem::directory_iterator(); ++file) {
+            auto path = file->path();
+            if (boost::filesystem::is_regular_file(path) && boost::filesystem::extension(path) == Config::GetConfig().packExtension) {
+                uint32_t pack = std::stoul(boost::filesystem::basename(path));
+                pack_sizes[pack] = boost::filesystem::file_size(path);
+            }
+        }
+    } catch (const boost::filesystem::filesystem_error& ex) {
+        throw ChunkStorageException("Problem when parsing data directory '"+Config::GetDataDir()+"'\n");
+    } catch (const std::logic_error& ex) {
+        throw ChunkStorageException("Unexpected pack file in the data directory '"+Config::GetDataDir()+"'\n");
+    }
+
+    // 2. Replay the index
+    std::string filename = Config::GetPackIndexFilename();
+    std::ifstream is(filename, std::ios::binary);
+    if (is.good()) {
+        char magic[sizeof(PACK_INDEX_MAGIC)];
+        if (!is.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), PACK_INDEX_MAGIC) || !ReadValue(is, index_version))
+            throw ChunkStorageException("File '"+filename+"' is not a pack index\n");
+        if (index_version < 1 || index_version > PACK_INDEX_VERSION) throw ChunkStorageException("Unknown version "+std::to_string(index_version)+" of the pack index\n");
+
+        std::streamoff valid_size = is.tellg();
+        record_type type;
+        std::string name;
+        pack_location location;
+        chunk_info info;
+        while (ReadRecord(is, type, name, location, info)) {
+            if (type == PUT) Put(name, location);
+            else Remove(name);
+            if (index_version < 4) {
+                if (type == PUT) legacy[name] = info;
+                else legacy.erase(name);
+            }
+            valid_size = is.tellg();
+        }
+        is.close();
+        // Drop incomplete record at the end (interrupted write), new records are appended after the last valid one
+        if ((uintmax_t)valid_size != boost::filesystem::file_size(filename)) boost::filesystem::resize_file(filename, valid_size);
+    }
+
+    // 3. Temporary data never committed (interrupted backup) are garbage
+    std::vector<std::string> temporary;
+    for (auto& item: entries)
+        if (item.first.compare(0, TEMP_PREFIX.size(), TEMP_PREFIX) == 0) temporary.push_back(item.first);
+    for (auto& name: temporary) Remove(name);
+
+    // 4. Garbage is all data of a pack not used by live chunks, REMOVE records of chunks
+    // are not kept when the index is rewritten and unfinished writes have no records at all
+    pack_garbage.clear();
+    for (auto& pack: pack_sizes) pack_garbage[pack.first] = pack.second;
+    for (auto& entry: entries) {
+        auto garbage = pack_garbage.find(entry.second.pack);
+        if (garbage != pack_garbage.end()) garbage->second -= std::min(garbage->second, entry.second.length);
+    }
+}
+
+void PackChunkStorage::PackChunkStorageData::OpenIndex() {
+    if (index.is_open()) return;
+    // Records of older versions cannot be mixed with the new ones
+    if (index_version != PACK_INDEX_VERSION) WriteIndex();
+
+    std::string filename = Config::GetPackIndexFilename();
+    bool exists = boost::filesystem::exists(filename);
+    index.open(filename, std::ios::binary | std::ios::app);
+    if (!index.good()) throw ChunkStorageException("Cannot write pack index '"+filename+"'\n");
+    if (!exists) {
+        index.write(PACK_INDEX_MAGIC, sizeof(PACK_INDEX_MAGIC));
+        WriteValue(index, PACK_INDEX_VERSION);
+    }
+}
+
+void PackChunkStorage::PackChunkStorageData::WriteIndex() {
+    index.close();
+    std::string filename = Config::GetPackIndexFilename();
+    std::string temp_name = filename + ".tmp";
+    {
+        std::ofstream os(temp_name, std::ios::binary);
+        os.write(PACK_INDEX_MAGIC, sizeof(PACK_INDEX_MAGIC));
+        WriteValue(os, PACK_INDEX_VERSION);
+        for (auto& entry: entries) AppendRecord(os, PUT, entry.first, &entry.second);
+        os.close();
+        if (os.fail()) throw ChunkStorageException("Cannot write pack index '"+temp_name+"'\n");
+    }
+    rename(temp_name.c_str(), filename.c_str());
+    index_version = PACK_INDEX_VERSION;
+}
+
+uint32_t PackChunkStorage::PackChunkStorageData::GetActivePack() {
+    if (active_pack == 0) active_pack = pack_sizes.empty() ? 1 : pack_sizes.rbegin()->first;
+    if (pack_sizes[active_pack] >= Config::GetConfig().packSize) active_pack++;
+    return active_pack;
+}
+
+uint32_t PackChunkStorage::PackChunkStorageData::AcquirePack() {
+    uint32_t pack = GetActivePack();
+    while (writing.find(pack) != writing.end() || pack_sizes[pack] >= Config::GetConfig().packSize) pack++;
+    writing.insert(pack);
+    return pack;
+}
+
+void PackChunkStorage::PackChunkStorageData::ReleasePack(uint32_t pack) { writing.erase(pack); }
+
+////////////////////////////////////////////////////////////////////////////////
+
+PackChunkStorage::PackChunkStorage(): data{new PackChunkStorageData()} {}
+PackChunkStorage::~PackChunkStorage() {}
+
+std::unique_ptr<ChunkStorage::Reader> PackChunkStorage::OpenData(const std::string& name) {
+    std::lock_guard<std::recursive_mutex> guard(data->lock);
+    data->Load();
+    auto it = data->entries.find(name);
+    if (it == data->entries.end()) throw ChunkStorageException("No chunk '"+name+"' in the pack index\n");
+    return std::unique_ptr<Reader>(new PackChunkStorageData::PackReader(it->second));
+}
+
+std::unique_ptr<ChunkStorage::Writer> PackChunkStorage::CreateData(const std::string& name) {
+    std::lock_guard<std::recursive_mutex> guard(data->lock);
+    data->Load();
+    return std::unique_ptr<Writer>(new PackChunkStorageData::PackWriter(*data, name));
+}
+
+std::unique_ptr<ChunkStorage::Writer> PackChunkStorage::CreateTempData(const std::string& temp_name) {
+    return CreateData(TEMP_PREFIX + temp_name);
+}
+
+void PackChunkStorage::CommitData(const std::string& temp_name, const std::string& name) {
+    std::lock_guard<std::recursive_mutex> guard(data->lock);
+    data->Load();
+    auto it = data->entries.find(TEMP_PREFIX + temp_name);
+    if (it == data->entries.end()) throw ChunkStorageException("No temporary data '"+temp_name+"' to commit\n");
+    auto location = it->second;
+    // Data stay in place, only the index record changes (the PUT record is atomic)
+    data->OpenIndex();
+    data->AppendRecord(data->index, PackChunkStorageData::PUT, name, &location);
+    data->AppendRecord(data->index, PackChunkStorageData::REMOVE, it->first, nullptr);
+    data->index.flush();
+    data->entries.erase(it);
+    data->Put(name, location);
+}
+
+void PackChunkStorage::DiscardData(const std::string& temp_name) {
+    Remove(TEMP_PREFIX + temp_name);
+}
+
+void PackChunkStorage::Remove(const std::string& name) {
+    std::lock_guard<std::recursive_mutex> guard(data->lock);
+    data->Load();
+    if (data->entries.find(name) == data->entries.end()) return;
+    data->OpenIndex();
+    data->AppendRecord(data->index, PackChunkStorageData::REMOVE, name, nullptr);
+    data->index.flush();
+    data->Remove(name);
+}
+
+std::vector<chunk_info> PackChunkStorage::LoadLegacyInfo() {
+    std::lock_guard<std::recursive_mutex> guard(data->lock);
+    data->Load();
+    // Derived chunks were not stored, they are computed from ancestors
+    std::unordered_map<std::string, std::vector<std::string>> derived;
+    for (auto& item: data->legacy)
+        if (!item.second.ancestor_chunk_name.empty()) derived[item.second.ancestor_chunk_name].push_back(item.first);
+
+    std::vector<chunk_info> chunks;
+    for (auto& item: data->legacy) {
+        chunks.push_back(item.second);
+        auto it = derived.find(item.first);
+        if (it != derived.end()) chunks.back().derived_chunks = it->second;
+    }
+    return chunks;
+}
+
+void PackChunkStorage::DropLegacyInfo() {
+    std::lock_guard<std::recursive_mutex> guard(data->lock);
+    data->Load();
+    data->legacy.clear();
+    if (data->index_version != PACK_INDEX_VERSION) data->WriteIndex();
+}
+
+void PackChunkStorage::Compact() {
+    std::lock_guard<std::recursive_mutex> guard(data->lock);
+    data->Load();
+
+    // 1. Find packs where at least half of the space is unused
+    std::vector<uint32_t> packs;
+    for (auto& pack: data->pack_sizes)
+        if (data->pack_garbage[pack.first] * 2 >= pack.second && pack.second > 0) packs.push_back(pack.first);
+
+    // 2. Move live chunks from these packs into a new pack
+    if (!packs.empty()) {
+        data->active_pack = data->pack_sizes.rbegin()->first + 1;
+        std::vector<std::pair<std::string, PackChunkStorageData::pack_location>> moved;
+        for (auto& entry: data->entries)
+            if (std::find(packs.begin(), packs.end(), entry.second.pack) != packs.end()) moved.push_back(entry);
+        for (auto& entry: moved) {
+            PackChunkStorageData::PackReader reader(entry.second);
+            PackChunkStorageData::PackWriter writer(*data, entry.first);
+            char buffer[64*1024];
+            size_t count;
+            while ((count = reader.Read(buffer, sizeof(buffer))) > 0) writer.Write(buffer, count);
+            writer.Close();
+        }
+    }
+
+    // 3. Write new index with only live chunks and replace the old one
+    data->WriteIndex();
+
+    // 4. Old packs are not referenced anymore
+    for (auto pack: packs) {
+        remove(Config::GetPackFilename(pack).c_str());
+        data->pack_sizes.erase(pack);
+        data->pack_garbage.erase(pack);
+    }
+}
+
+}